@@ -52,6 +52,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <basalt/imu/imu_types.h>
 #include <basalt/optical_flow/optical_flow.h>
+#include <basalt/utils/object_pool.h>
+#include <basalt/utils/spsc_queue.h>
 #include <basalt/calibration/calibration.hpp>
 
 namespace basalt {
@@ -90,9 +92,8 @@ class RsT265Device {
   std::shared_ptr<basalt::Calibration<double>> exportCalibration();
 
   OpticalFlowInput::Ptr last_img_data;
-  tbb::concurrent_bounded_queue<OpticalFlowInput::Ptr>* image_data_queue =
-      nullptr;
-  tbb::concurrent_bounded_queue<ImuData<double>::Ptr>* imu_data_queue = nullptr;
+  SpscQueue<OpticalFlowInput::Ptr>* image_data_queue = nullptr;
+  SpscQueue<ImuData<double>::Ptr>* imu_data_queue = nullptr;
   tbb::concurrent_bounded_queue<RsPoseData>* pose_data_queue = nullptr;
 
  private:
@@ -103,6 +104,7 @@ class RsT265Device {
   int frame_counter = 0;
 
   Eigen::aligned_deque<RsIMUData> gyro_data_queue;
+  ObjectPool<ImuData<double>> imu_data_pool{1024};
   std::shared_ptr<RsIMUData> prev_accel_data;
 
   std::shared_ptr<basalt::Calibration<double>> calib;
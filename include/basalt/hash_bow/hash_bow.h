@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <bitset>
+#include <cmath>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
@@ -10,6 +12,7 @@
 
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 
 namespace basalt {
 
@@ -66,31 +69,196 @@ class HashBow {
     }
   }
 
+  /// Move all entries added so far into the compact index: posting lists
+  /// sorted by word and stored contiguously, frames mapped to dense ids in
+  /// time order and weights quantized to 16 bit. Only the new postings are
+  /// sorted, the existing lists are merged with them in one linear pass.
+  /// Entries added afterwards go to the dynamic index again until the next
+  /// call. Must not run concurrently with add_to_database or
+  /// querry_database.
+  void freeze() {
+    if (inverted_index.empty()) return;
+
+    struct Posting {
+      uint32_t word;
+      uint32_t frame;
+      uint16_t weight;
+    };
+
+    auto equal = [](const TimeCamId& a, const TimeCamId& b) {
+      return !(a < b) && !(b < a);
+    };
+
+    std::vector<TimeCamId> new_frames;
+    for (const auto& kv : inverted_index) {
+      for (const auto& v : kv.second) new_frames.emplace_back(v.first);
+    }
+    std::sort(new_frames.begin(), new_frames.end());
+    new_frames.erase(std::unique(new_frames.begin(), new_frames.end(), equal),
+                     new_frames.end());
+
+    // Dense frame ids sorted by (frame_id, cam_id), so frames before a
+    // given time form a prefix. The old frames keep their order, so their
+    // posting lists stay sorted after the ids are shifted.
+    std::vector<TimeCamId> frames;
+    frames.reserve(compact_frames.size() + new_frames.size());
+    std::vector<uint32_t> old_to_new(compact_frames.size());
+    for (size_t i = 0, j = 0;
+         i < compact_frames.size() || j < new_frames.size();) {
+      if (j == new_frames.size() ||
+          (i < compact_frames.size() && !(new_frames[j] < compact_frames[i]))) {
+        if (j < new_frames.size() && equal(compact_frames[i], new_frames[j])) {
+          j++;
+        }
+        old_to_new[i++] = frames.size();
+        frames.emplace_back(compact_frames[i - 1]);
+      } else {
+        frames.emplace_back(new_frames[j++]);
+      }
+    }
+
+    std::vector<Posting> postings;
+    for (const auto& kv : inverted_index) {
+      const uint32_t word = kv.first.to_ulong();
+      for (const auto& v : kv.second) {
+        const uint32_t frame =
+            std::lower_bound(frames.begin(), frames.end(), v.first) -
+            frames.begin();
+        postings.push_back({word, frame, quantize(v.second)});
+      }
+    }
+
+    std::sort(postings.begin(), postings.end(),
+              [](const Posting& a, const Posting& b) {
+                if (a.word == b.word) return a.frame < b.frame;
+                return a.word < b.word;
+              });
+
+    const size_t num_postings = compact_posting_frames.size() + postings.size();
+
+    std::vector<uint32_t> words;
+    std::vector<size_t> posting_start;
+    std::vector<uint32_t> posting_frames;
+    std::vector<uint16_t> posting_weights;
+    posting_frames.reserve(num_postings);
+    posting_weights.reserve(num_postings);
+
+    // Both sides are sorted by word and then by frame
+    size_t w = 0, n = 0;
+    while (w < compact_words.size() || n < postings.size()) {
+      const bool old_first =
+          n == postings.size() ||
+          (w < compact_words.size() && compact_words[w] <= postings[n].word);
+      const uint32_t word = old_first ? compact_words[w] : postings[n].word;
+
+      words.emplace_back(word);
+      posting_start.emplace_back(posting_frames.size());
+
+      size_t k = 0, k_end = 0;
+      if (w < compact_words.size() && compact_words[w] == word) {
+        k = compact_posting_start[w];
+        k_end = compact_posting_start[w + 1];
+        w++;
+      }
+
+      while (k < k_end || (n < postings.size() && postings[n].word == word)) {
+        if (k < k_end &&
+            (n == postings.size() || postings[n].word != word ||
+             old_to_new[compact_posting_frames[k]] <= postings[n].frame)) {
+          posting_frames.emplace_back(old_to_new[compact_posting_frames[k]]);
+          posting_weights.emplace_back(compact_posting_weights[k]);
+          k++;
+        } else {
+          posting_frames.emplace_back(postings[n].frame);
+          posting_weights.emplace_back(postings[n].weight);
+          n++;
+        }
+      }
+    }
+    posting_start.emplace_back(posting_frames.size());
+
+    compact_frames.swap(frames);
+    compact_words.swap(words);
+    compact_posting_start.swap(posting_start);
+    compact_posting_frames.swap(posting_frames);
+    compact_posting_weights.swap(posting_weights);
+
+    inverted_index.clear();
+    query_scratch.clear();
+  }
+
   inline void querry_database(
       const HashBowVector& bow_vector, size_t num_results,
       std::vector<std::pair<TimeCamId, double>>& results,
       const int64_t* max_t_ns = nullptr) const {
     results.clear();
 
-    std::unordered_map<TimeCamId, double> scores;
+    if (!compact_frames.empty()) {
+      // Frames with dense id below this have frame_id < max_t_ns
+      const uint32_t max_dense_id =
+          max_t_ns ? std::lower_bound(compact_frames.begin(),
+                                      compact_frames.end(),
+                                      TimeCamId(*max_t_ns, 0)) -
+                         compact_frames.begin()
+                   : compact_frames.size();
 
-    for (const auto& kv : bow_vector) {
-      const auto range_it = inverted_index.find(kv.first);
-
-      if (range_it != inverted_index.end())
-        for (const auto& v : range_it->second) {
-          // if there is a maximum query time select only the frames that have
-          // timestamp below max_t_ns
-          if (!max_t_ns || v.first.frame_id < (*max_t_ns))
-            scores[v.first] += std::abs(kv.second - v.second) -
-                               std::abs(kv.second) - std::abs(v.second);
+      QueryScratch& scratch = query_scratch.local();
+      if (scratch.scores.size() != compact_frames.size()) {
+        scratch.scores.assign(compact_frames.size(), 0);
+      }
+
+      for (const auto& kv : bow_vector) {
+        const uint32_t word = kv.first.to_ulong();
+        const auto word_it =
+            std::lower_bound(compact_words.begin(), compact_words.end(), word);
+        if (word_it == compact_words.end() || *word_it != word) continue;
+
+        const size_t w = word_it - compact_words.begin();
+        for (size_t k = compact_posting_start[w];
+             k < compact_posting_start[w + 1]; k++) {
+          const uint32_t f = compact_posting_frames[k];
+          // posting lists are sorted by frame, the rest is too recent
+          if (f >= max_dense_id) break;
+
+          const double weight = compact_posting_weights[k] / WEIGHT_SCALE;
+
+          // All weights are positive, so a touched frame has a negative
+          // score
+          double& score = scratch.scores[f];
+          if (score == 0) scratch.touched.emplace_back(f);
+          score += std::abs(kv.second - weight) - std::abs(kv.second) -
+                   std::abs(weight);
         }
+      }
+
+      results.reserve(scratch.touched.size());
+      for (uint32_t f : scratch.touched) {
+        results.emplace_back(compact_frames[f], -scratch.scores[f] / 2.0);
+        scratch.scores[f] = 0;
+      }
+      scratch.touched.clear();
     }
 
-    results.reserve(scores.size());
+    // Entries added after the last freeze()
+    if (!inverted_index.empty()) {
+      std::unordered_map<TimeCamId, double> scores;
+
+      for (const auto& kv : bow_vector) {
+        const auto range_it = inverted_index.find(kv.first);
+
+        if (range_it != inverted_index.end())
+          for (const auto& v : range_it->second) {
+            // if there is a maximum query time select only the frames that
+            // have timestamp below max_t_ns
+            if (!max_t_ns || v.first.frame_id < (*max_t_ns))
+              scores[v.first] += std::abs(kv.second - v.second) -
+                                 std::abs(kv.second) - std::abs(v.second);
+          }
+      }
 
-    for (const auto& kv : scores)
-      results.emplace_back(kv.first, -kv.second / 2.0);
+      for (const auto& kv : scores)
+        results.emplace_back(kv.first, -kv.second / 2.0);
+    }
 
     if (results.size() > num_results) {
       std::partial_sort(
@@ -162,6 +330,29 @@ class HashBow {
       FeatureHash, tbb::concurrent_vector<std::pair<TimeCamId, double>>,
       std::hash<FeatureHash>>
       inverted_index;
+
+  // Weights are L1 normalized, so they are in (0, 1]. Non-zero weights never
+  // quantize to 0.
+  constexpr static double WEIGHT_SCALE = 65535.0;
+
+  static uint16_t quantize(double weight) {
+    const long q = std::lround(std::min(std::abs(weight), 1.0) * WEIGHT_SCALE);
+    return uint16_t(std::max(q, 1l));
+  }
+
+  struct QueryScratch {
+    std::vector<double> scores;
+    std::vector<uint32_t> touched;
+  };
+
+  // Compact index built by freeze()
+  std::vector<TimeCamId> compact_frames;
+  std::vector<uint32_t> compact_words;
+  std::vector<size_t> compact_posting_start;
+  std::vector<uint32_t> compact_posting_frames;
+  std::vector<uint16_t> compact_posting_weights;
+
+  mutable tbb::enumerable_thread_specific<QueryScratch> query_scratch;
 };
 
 }  // namespace basalt
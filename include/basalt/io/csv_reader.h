@@ -0,0 +1,211 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <tbb/parallel_for.h>
+
+#include <basalt/utils/mapped_file.h>
+
+namespace basalt {
+
+/// Fields of a single line of a text table. Fields are separated by commas
+/// and/or whitespace, so the same reader handles EuRoC csv files as well as
+/// TUM/UZH and KITTI style text files.
+class CsvLine {
+ public:
+  CsvLine(std::string_view line, const std::string& path)
+      : pos(line.data()), end(line.data() + line.size()), path(path) {}
+
+  template <class T>
+  CsvLine& operator>>(T& value) {
+    next_field();
+    if constexpr (std::is_floating_point_v<T>) {
+      parse_floating_point(value);
+    } else {
+      const auto res = std::from_chars(pos, end, value);
+      if (res.ec != std::errc()) error();
+      pos = res.ptr;
+    }
+    return *this;
+  }
+
+  /// Reads a non-numeric field, e.g. an image file name. The returned view
+  /// points into the mapped file and is only valid while the reader exists.
+  CsvLine& operator>>(std::string_view& value) {
+    next_field();
+    const char* begin = pos;
+    while (pos != end && !is_separator(*pos)) pos++;
+    if (pos == begin) error();
+    value = std::string_view(begin, pos - begin);
+    return *this;
+  }
+
+ private:
+  static bool is_separator(char c) {
+    return c == ',' || c == ' ' || c == '\t' || c == '\r';
+  }
+
+  void next_field() {
+    while (pos != end && is_separator(*pos)) pos++;
+  }
+
+  // std::from_chars for floating point needs GCC 11, so strtod is used. It
+  // needs a terminated string, which the mapped file does not have at its
+  // end, so the field is copied first.
+  template <class T>
+  void parse_floating_point(T& value) {
+    const char* field_end = pos;
+    while (field_end != end && !is_separator(*field_end)) field_end++;
+
+    char buf[64];
+    const size_t len = field_end - pos;
+    if (len == 0 || len >= sizeof(buf)) error();
+    std::copy(pos, field_end, buf);
+    buf[len] = '\0';
+
+    char* parse_end;
+    const double d = std::strtod(buf, &parse_end);
+    if (parse_end == buf) error();
+
+    value = T(d);
+    pos += parse_end - buf;
+  }
+
+  void error() const {
+    std::cerr << "Could not parse field '"
+              << std::string_view(pos, std::min<size_t>(end - pos, 32))
+              << "' in " << path << std::endl;
+    std::abort();
+  }
+
+  const char* pos;
+  const char* end;
+  const std::string& path;
+};
+
+/// Memory mapped text table. The file is split into chunks at line
+/// boundaries, and the data lines of every chunk are counted in parallel on
+/// construction. Blank lines, also with only whitespace, and lines starting
+/// with '#' are skipped, so data lines can be indexed densely and written
+/// directly to preallocated storage from parallel_for_each.
+class CsvReader {
+ public:
+  explicit CsvReader(const std::string& path,
+                     size_t chunk_size = 1024 * 1024)
+      : path(path), file(path) {
+    const char* data = reinterpret_cast<const char*>(file.data());
+    const char* end = data + file.size();
+
+    const char* begin = data;
+    while (begin != end) {
+      const char* chunk_end =
+          begin + std::min<size_t>(chunk_size, end - begin);
+      chunk_end = std::find(chunk_end, end, '\n');
+      if (chunk_end != end) chunk_end++;
+
+      chunks.emplace_back(Chunk{begin, chunk_end, 0});
+      begin = chunk_end;
+    }
+
+    tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+      size_t count = 0;
+      for_each_line(chunks[i], [&](std::string_view) { count++; });
+      chunks[i].first_line = count;
+    });
+
+    // Turn counts into the index of the first line of every chunk
+    num_lines = 0;
+    for (Chunk& c : chunks) {
+      const size_t count = c.first_line;
+      c.first_line = num_lines;
+      num_lines += count;
+    }
+  }
+
+  /// Number of data lines
+  size_t size() const { return num_lines; }
+
+  /// Calls func(i, line) for every data line, where i is the index of the
+  /// line. Chunks are processed in parallel, so func must only write to
+  /// storage owned by line i.
+  template <class Func>
+  void parallel_for_each(const Func& func) const {
+    tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+      size_t line_idx = chunks[i].first_line;
+      for_each_line(chunks[i], [&](std::string_view line) {
+        CsvLine fields(line, path);
+        func(line_idx++, fields);
+      });
+    });
+  }
+
+ private:
+  struct Chunk {
+    const char* begin;
+    const char* end;
+    size_t first_line;
+  };
+
+  template <class Func>
+  static void for_each_line(const Chunk& c, const Func& func) {
+    const char* pos = c.begin;
+    while (pos != c.end) {
+      const char* line_end = std::find(pos, c.end, '\n');
+      std::string_view line(pos, line_end - pos);
+      if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+      const size_t first = line.find_first_not_of(" \t\r");
+      if (first != std::string_view::npos && line[first] != '#') func(line);
+      pos = line_end == c.end ? line_end : line_end + 1;
+    }
+  }
+
+  std::string path;
+  MappedFile file;
+  std::vector<Chunk> chunks;
+  size_t num_lines;
+};
+
+}  // namespace basalt
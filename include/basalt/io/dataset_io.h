@@ -60,6 +60,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <basalt/image/image.h>
 #include <basalt/utils/assert.h>
+#include <basalt/utils/image_pool.h>
 
 #include <basalt/camera/generic_camera.hpp>
 #include <basalt/camera/stereographic_param.hpp>
@@ -126,7 +127,21 @@ class VioDataset {
   virtual int64_t get_mocap_to_imu_offset_ns() const = 0;
   virtual std::vector<ImageData> get_image_data(int64_t t_ns) = 0;
 
+  /// Buffers for the images returned by get_image_data. Without a pool every
+  /// image is a new allocation.
+  virtual void set_image_pool(const ImagePool<uint16_t>::Ptr &pool) {
+    image_pool = pool;
+  }
+
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+ protected:
+  ManagedImage<uint16_t>::Ptr allocate_image(size_t w, size_t h) const {
+    if (image_pool) return image_pool->get(w, h);
+    return std::make_shared<ManagedImage<uint16_t>>(w, h);
+  }
+
+  ImagePool<uint16_t>::Ptr image_pool;
 };
 
 typedef std::shared_ptr<VioDataset> VioDatasetPtr;
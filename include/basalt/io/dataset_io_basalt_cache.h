@@ -0,0 +1,434 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <cstring>
+#include <limits>
+
+#include <lz4.h>
+
+#include <basalt/io/dataset_io.h>
+#include <basalt/utils/filesystem.h>
+#include <basalt/utils/mapped_file.h>
+
+namespace basalt {
+
+// Binary dataset cache written by basalt_convert_dataset_cache. The folder
+// contains two files with little-endian data:
+//  - sequence.bin: BasaltCacheHeader followed by the image timestamps, accel
+//    and gyro samples, ground truth timestamps and poses, exposures and
+//    BasaltCacheImageEntry for every image as contiguous arrays.
+//  - images.bin: 16 bit images, raw or LZ4 compressed, each starting at a
+//    multiple of BASALT_CACHE_ALIGNMENT bytes.
+
+constexpr char BASALT_CACHE_MAGIC[8] = {'B', 'A', 'S', 'A', 'L', 'T', 'C', 'D'};
+constexpr uint32_t BASALT_CACHE_VERSION = 1;
+constexpr size_t BASALT_CACHE_ALIGNMENT = 64;
+
+struct BasaltCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_cams;
+  uint64_t num_frames;
+  uint64_t num_accel;
+  uint64_t num_gyro;
+  uint64_t num_gt;
+  int64_t mocap_to_imu_offset_ns;
+};
+
+struct BasaltCacheImuSample {
+  int64_t timestamp_ns;
+  double data[3];
+};
+
+struct BasaltCacheImageEntry {
+  enum Compression : uint32_t { RAW = 0, LZ4 = 1 };
+
+  uint64_t offset;  // in images.bin
+  uint64_t size;    // in bytes, 0 for missing images
+  uint32_t w;
+  uint32_t h;
+  uint32_t compression;
+  uint32_t reserved;
+};
+
+class BasaltCacheVioDataset : public VioDataset {
+  size_t num_cams;
+
+  std::vector<int64_t> image_timestamps;
+  std::unordered_map<int64_t, size_t> frame_index;
+
+  // num_cams entries and exposures for every frame
+  std::vector<BasaltCacheImageEntry> image_entries;
+  std::vector<double> exposures;
+
+  MappedFile::Ptr images;
+
+  Eigen::aligned_vector<AccelData> accel_data;
+  Eigen::aligned_vector<GyroData> gyro_data;
+
+  std::vector<int64_t> gt_timestamps;  // ordered gt timestamps
+  Eigen::aligned_vector<Sophus::SE3d> gt_pose_data;
+
+  int64_t mocap_to_imu_offset_ns = 0;
+
+ public:
+  ~BasaltCacheVioDataset(){};
+
+  size_t get_num_cams() const { return num_cams; }
+
+  std::vector<int64_t> &get_image_timestamps() { return image_timestamps; }
+
+  const Eigen::aligned_vector<AccelData> &get_accel_data() const {
+    return accel_data;
+  }
+  const Eigen::aligned_vector<GyroData> &get_gyro_data() const {
+    return gyro_data;
+  }
+  const std::vector<int64_t> &get_gt_timestamps() const {
+    return gt_timestamps;
+  }
+  const Eigen::aligned_vector<Sophus::SE3d> &get_gt_pose_data() const {
+    return gt_pose_data;
+  }
+
+  int64_t get_mocap_to_imu_offset_ns() const { return mocap_to_imu_offset_ns; }
+
+  std::vector<ImageData> get_image_data(int64_t t_ns) {
+    std::vector<ImageData> res(num_cams);
+
+    auto it = frame_index.find(t_ns);
+    if (it == frame_index.end()) return res;
+
+    for (size_t i = 0; i < num_cams; i++) {
+      const size_t idx = it->second * num_cams + i;
+      const BasaltCacheImageEntry &e = image_entries[idx];
+      if (e.size == 0) continue;
+
+      const uint8_t *src = images->data() + e.offset;
+
+      if (e.compression == BasaltCacheImageEntry::RAW) {
+        // The mapping is read-only, so the pixels are copied once into a
+        // pooled image, which the optical flow uses as pyramid level 0.
+        res[i].img = allocate_image(e.w, e.h);
+        ManagedImage<uint16_t> &img = *res[i].img;
+
+        const size_t row_bytes = e.w * sizeof(uint16_t);
+        for (size_t y = 0; y < e.h; y++) {
+          std::memcpy(img.RowPtr(y), src + y * row_bytes, row_bytes);
+        }
+      } else {
+        res[i].img = allocate_image(e.w, e.h);
+        ManagedImage<uint16_t> &img = *res[i].img;
+
+        // Pooled images with padded rows are filled from a temporary buffer
+        const size_t row_bytes = e.w * sizeof(uint16_t);
+        const bool contiguous = img.pitch == row_bytes;
+
+        thread_local std::vector<char> buffer;
+        if (!contiguous) buffer.resize(row_bytes * e.h);
+
+        char *dst =
+            contiguous ? reinterpret_cast<char *>(img.ptr) : buffer.data();
+
+        const int num_bytes = row_bytes * e.h;
+        const int decompressed = LZ4_decompress_safe(
+            reinterpret_cast<const char *>(src), dst, e.size, num_bytes);
+
+        if (decompressed != num_bytes) {
+          std::cerr << "Corrupted image " << i << " at " << t_ns
+                    << " in the dataset cache" << std::endl;
+          std::abort();
+        }
+
+        if (!contiguous) {
+          for (size_t y = 0; y < e.h; y++) {
+            std::memcpy(img.RowPtr(y), buffer.data() + y * row_bytes,
+                        row_bytes);
+          }
+        }
+      }
+
+      res[i].exposure = exposures[idx];
+    }
+
+    return res;
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  friend class BasaltCacheIO;
+};
+
+class BasaltCacheIO : public DatasetIoInterface {
+ public:
+  BasaltCacheIO() {}
+
+  void read(const std::string &path) {
+    if (!fs::exists(path + "/sequence.bin")) {
+      std::cerr << "No dataset cache found in " << path << std::endl;
+      std::abort();
+    }
+
+    data.reset(new BasaltCacheVioDataset);
+
+    std::ifstream is(path + "/sequence.bin", std::ios::binary);
+
+    BasaltCacheHeader header;
+    read_array(is, &header, 1);
+
+    if (std::memcmp(header.magic, BASALT_CACHE_MAGIC, 8) != 0 ||
+        header.version != BASALT_CACHE_VERSION) {
+      std::cerr << "Unsupported dataset cache version in " << path
+                << std::endl;
+      std::abort();
+    }
+
+    data->num_cams = header.num_cams;
+    data->mocap_to_imu_offset_ns = header.mocap_to_imu_offset_ns;
+
+    data->image_timestamps.resize(header.num_frames);
+    read_array(is, data->image_timestamps.data(), header.num_frames);
+
+    std::vector<BasaltCacheImuSample> imu(header.num_accel);
+    read_array(is, imu.data(), header.num_accel);
+    data->accel_data.resize(imu.size());
+    for (size_t i = 0; i < imu.size(); i++) {
+      data->accel_data[i].timestamp_ns = imu[i].timestamp_ns;
+      data->accel_data[i].data = Eigen::Map<const Eigen::Vector3d>(imu[i].data);
+    }
+
+    imu.resize(header.num_gyro);
+    read_array(is, imu.data(), header.num_gyro);
+    data->gyro_data.resize(imu.size());
+    for (size_t i = 0; i < imu.size(); i++) {
+      data->gyro_data[i].timestamp_ns = imu[i].timestamp_ns;
+      data->gyro_data[i].data = Eigen::Map<const Eigen::Vector3d>(imu[i].data);
+    }
+
+    data->gt_timestamps.resize(header.num_gt);
+    read_array(is, data->gt_timestamps.data(), header.num_gt);
+
+    // Quaternion (x, y, z, w) and translation
+    std::vector<double> gt_poses(7 * header.num_gt);
+    read_array(is, gt_poses.data(), gt_poses.size());
+    data->gt_pose_data.resize(header.num_gt);
+    for (size_t i = 0; i < header.num_gt; i++) {
+      data->gt_pose_data[i] =
+          Eigen::Map<const Sophus::SE3d>(gt_poses.data() + 7 * i);
+    }
+
+    const size_t num_images = header.num_frames * header.num_cams;
+
+    data->exposures.resize(num_images);
+    read_array(is, data->exposures.data(), num_images);
+
+    data->image_entries.resize(num_images);
+    read_array(is, data->image_entries.data(), num_images);
+
+    if (!is) {
+      std::cerr << "Truncated dataset cache in " << path << std::endl;
+      std::abort();
+    }
+
+    for (size_t i = 0; i < data->image_timestamps.size(); i++) {
+      data->frame_index[data->image_timestamps[i]] = i;
+    }
+
+    data->images.reset(new MappedFile(path + "/images.bin"));
+
+    // Every image has to be inside of the mapping
+    for (size_t i = 0; i < num_images; i++) {
+      const BasaltCacheImageEntry &e = data->image_entries[i];
+      if (e.size == 0) continue;
+
+      const uint64_t num_bytes = uint64_t(e.w) * e.h * sizeof(uint16_t);
+
+      bool valid = e.offset <= data->images->size() &&
+                   e.size <= data->images->size() - e.offset &&
+                   num_bytes > 0 &&
+                   num_bytes <= uint64_t(std::numeric_limits<int>::max());
+
+      if (e.compression == BasaltCacheImageEntry::RAW) {
+        valid = valid && e.size == num_bytes;
+      } else if (e.compression == BasaltCacheImageEntry::LZ4) {
+        valid = valid && e.size <= uint64_t(std::numeric_limits<int>::max());
+      } else {
+        valid = false;
+      }
+
+      if (!valid) {
+        std::cerr << "Invalid entry of image " << i % header.num_cams
+                  << " at " << data->image_timestamps[i / header.num_cams]
+                  << " in the dataset cache " << path << std::endl;
+        std::abort();
+      }
+    }
+
+    std::cout << "Loaded " << data->image_timestamps.size() << " frames, "
+              << data->gyro_data.size() << " imu msgs and "
+              << data->gt_timestamps.size() << " gt poses from the cache."
+              << std::endl;
+  }
+
+  void reset() { data.reset(); }
+
+  VioDatasetPtr get_data() { return data; }
+
+  /// Writes all data of a dataset to a cache folder. The images are
+  /// optionally LZ4 compressed, which makes the cache smaller, but they have
+  /// to be decompressed on every access.
+  static void save(const VioDatasetPtr &dataset, const std::string &path,
+                   bool compress) {
+    fs::create_directories(path);
+
+    const size_t num_cams = dataset->get_num_cams();
+    const std::vector<int64_t> &timestamps = dataset->get_image_timestamps();
+
+    std::vector<double> exposures(timestamps.size() * num_cams, 0);
+    std::vector<BasaltCacheImageEntry> image_entries(timestamps.size() *
+                                                     num_cams);
+
+    {
+      std::ofstream os(path + "/images.bin", std::ios::binary);
+
+      std::vector<char> buffer;
+      uint64_t offset = 0;
+
+      for (size_t f = 0; f < timestamps.size(); f++) {
+        const std::vector<ImageData> img_data =
+            dataset->get_image_data(timestamps[f]);
+
+        for (size_t i = 0; i < num_cams && i < img_data.size(); i++) {
+          const size_t idx = f * num_cams + i;
+          BasaltCacheImageEntry &e = image_entries[idx];
+          e = BasaltCacheImageEntry();
+
+          exposures[idx] = img_data[i].exposure;
+
+          const ManagedImage<uint16_t>::Ptr &img = img_data[i].img;
+          if (!img) continue;
+
+          // Contiguous rows
+          const size_t row_bytes = img->w * sizeof(uint16_t);
+          const size_t num_bytes = row_bytes * img->h;
+          buffer.resize(num_bytes);
+          for (size_t y = 0; y < img->h; y++) {
+            std::memcpy(buffer.data() + y * row_bytes, img->RowPtr(y),
+                        row_bytes);
+          }
+
+          e.offset = offset;
+          e.w = img->w;
+          e.h = img->h;
+
+          if (compress) {
+            std::vector<char> compressed(LZ4_compressBound(num_bytes));
+            e.size = LZ4_compress_default(buffer.data(), compressed.data(),
+                                          num_bytes, compressed.size());
+            e.compression = BasaltCacheImageEntry::LZ4;
+            os.write(compressed.data(), e.size);
+          } else {
+            e.size = num_bytes;
+            e.compression = BasaltCacheImageEntry::RAW;
+            os.write(buffer.data(), e.size);
+          }
+
+          // Keep the next image aligned
+          const size_t padding =
+              (BASALT_CACHE_ALIGNMENT - e.size % BASALT_CACHE_ALIGNMENT) %
+              BASALT_CACHE_ALIGNMENT;
+          const char zeros[BASALT_CACHE_ALIGNMENT] = {};
+          os.write(zeros, padding);
+
+          offset += e.size + padding;
+        }
+      }
+    }
+
+    BasaltCacheHeader header;
+    std::memcpy(header.magic, BASALT_CACHE_MAGIC, 8);
+    header.version = BASALT_CACHE_VERSION;
+    header.num_cams = num_cams;
+    header.num_frames = timestamps.size();
+    header.num_accel = dataset->get_accel_data().size();
+    header.num_gyro = dataset->get_gyro_data().size();
+    header.num_gt = dataset->get_gt_timestamps().size();
+    header.mocap_to_imu_offset_ns = dataset->get_mocap_to_imu_offset_ns();
+
+    std::ofstream os(path + "/sequence.bin", std::ios::binary);
+    write_array(os, &header, 1);
+    write_array(os, timestamps.data(), timestamps.size());
+
+    std::vector<BasaltCacheImuSample> imu;
+    for (const AccelData &d : dataset->get_accel_data()) {
+      imu.push_back({d.timestamp_ns, {d.data[0], d.data[1], d.data[2]}});
+    }
+    write_array(os, imu.data(), imu.size());
+
+    imu.clear();
+    for (const GyroData &d : dataset->get_gyro_data()) {
+      imu.push_back({d.timestamp_ns, {d.data[0], d.data[1], d.data[2]}});
+    }
+    write_array(os, imu.data(), imu.size());
+
+    write_array(os, dataset->get_gt_timestamps().data(), header.num_gt);
+
+    std::vector<double> gt_poses(7 * header.num_gt);
+    for (size_t i = 0; i < header.num_gt; i++) {
+      Eigen::Map<Sophus::SE3d>(gt_poses.data() + 7 * i) =
+          dataset->get_gt_pose_data()[i];
+    }
+    write_array(os, gt_poses.data(), gt_poses.size());
+
+    write_array(os, exposures.data(), exposures.size());
+    write_array(os, image_entries.data(), image_entries.size());
+  }
+
+ private:
+  template <class T>
+  static void read_array(std::ifstream &is, T *ptr, size_t size) {
+    is.read(reinterpret_cast<char *>(ptr), size * sizeof(T));
+  }
+
+  template <class T>
+  static void write_array(std::ofstream &os, const T *ptr, size_t size) {
+    os.write(reinterpret_cast<const char *>(ptr), size * sizeof(T));
+  }
+
+  std::shared_ptr<BasaltCacheVioDataset> data;
+};
+
+}  // namespace basalt
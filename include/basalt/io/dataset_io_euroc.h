@@ -35,6 +35,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef DATASET_IO_EUROC_H
 #define DATASET_IO_EUROC_H
 
+#include <basalt/io/csv_reader.h>
 #include <basalt/io/dataset_io.h>
 #include <basalt/utils/filesystem.h>
 
@@ -95,39 +96,45 @@ class EurocVioDataset : public VioDataset {
 
     for (size_t i = 0; i < num_cams; i++) {
       std::string full_image_path =
-          path + folder[i] + "data/" + image_path[t_ns];
+          path + folder[i] + "data/" + image_path.at(t_ns);
 
       if (fs::exists(full_image_path)) {
         cv::Mat img = cv::imread(full_image_path, cv::IMREAD_UNCHANGED);
 
         if (img.type() == CV_8UC1) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
-
-          const uint8_t *data_in = img.ptr();
-          uint16_t *data_out = res[i].img->ptr;
-
-          size_t full_size = img.cols * img.rows;
-          for (size_t i = 0; i < full_size; i++) {
-            int val = data_in[i];
-            val = val << 8;
-            data_out[i] = val;
+          res[i].img = allocate_image(img.cols, img.rows);
+
+          // The rows of pooled images can be padded
+          for (int y = 0; y < img.rows; y++) {
+            const uint8_t *data_in = img.ptr(y);
+            uint16_t *data_out = res[i].img->RowPtr(y);
+
+            for (int x = 0; x < img.cols; x++) {
+              int val = data_in[x];
+              val = val << 8;
+              data_out[x] = val;
+            }
           }
         } else if (img.type() == CV_8UC3) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
+          res[i].img = allocate_image(img.cols, img.rows);
 
-          const uint8_t *data_in = img.ptr();
-          uint16_t *data_out = res[i].img->ptr;
+          for (int y = 0; y < img.rows; y++) {
+            const uint8_t *data_in = img.ptr(y);
+            uint16_t *data_out = res[i].img->RowPtr(y);
 
-          size_t full_size = img.cols * img.rows;
-          for (size_t i = 0; i < full_size; i++) {
-            int val = data_in[i * 3];
-            val = val << 8;
-            data_out[i] = val;
+            for (int x = 0; x < img.cols; x++) {
+              int val = data_in[x * 3];
+              val = val << 8;
+              data_out[x] = val;
+            }
           }
         } else if (img.type() == CV_16UC1) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
-          std::memcpy(res[i].img->ptr, img.ptr(),
-                      img.cols * img.rows * sizeof(uint16_t));
+          res[i].img = allocate_image(img.cols, img.rows);
+
+          for (int y = 0; y < img.rows; y++) {
+            std::memcpy(res[i].img->RowPtr(y), img.ptr(y),
+                        img.cols * sizeof(uint16_t));
+          }
 
         } else {
           std::cerr << "img.fmt.bpp " << img.type() << std::endl;
@@ -195,116 +202,63 @@ class EurocIO : public DatasetIoInterface {
                      std::unordered_map<int64_t, double> &exposure_data) {
     exposure_data.clear();
 
-    std::ifstream f(path + "exposure.csv");
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
-
-      char tmp;
-      int64_t timestamp, exposure_int;
-      Eigen::Vector3d gyro, accel;
-
-      ss >> timestamp >> tmp >> exposure_int;
+    CsvReader csv(path + "exposure.csv");
+    std::vector<std::pair<int64_t, int64_t>> exposure(csv.size());
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      line >> exposure[i].first >> exposure[i].second;
+    });
 
-      exposure_data[timestamp] = exposure_int * 1e-9;
-    }
+    for (const auto &e : exposure) exposure_data[e.first] = e.second * 1e-9;
   }
 
   void read_image_timestamps(const std::string &path) {
-    std::ifstream f(path + "data.csv");
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-      std::stringstream ss(line);
-      char tmp;
-      int64_t t_ns;
-      std::string path;
-      ss >> t_ns >> tmp >> path;
-
-      data->image_timestamps.emplace_back(t_ns);
-      data->image_path[t_ns] = path;
+    CsvReader csv(path + "data.csv");
+    std::vector<int64_t> timestamps(csv.size());
+    std::vector<std::string_view> paths(csv.size());
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      line >> timestamps[i] >> paths[i];
+    });
+
+    for (size_t i = 0; i < timestamps.size(); i++) {
+      data->image_timestamps.emplace_back(timestamps[i]);
+      data->image_path[timestamps[i]] = paths[i];
     }
   }
 
   void read_imu_data(const std::string &path) {
-    data->accel_data.clear();
-    data->gyro_data.clear();
-
-    std::ifstream f(path + "data.csv");
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
-
-      char tmp;
-      uint64_t timestamp;
-      Eigen::Vector3d gyro, accel;
-
-      ss >> timestamp >> tmp >> gyro[0] >> tmp >> gyro[1] >> tmp >> gyro[2] >>
-          tmp >> accel[0] >> tmp >> accel[1] >> tmp >> accel[2];
-
-      data->accel_data.emplace_back();
-      data->accel_data.back().timestamp_ns = timestamp;
-      data->accel_data.back().data = accel;
-
-      data->gyro_data.emplace_back();
-      data->gyro_data.back().timestamp_ns = timestamp;
-      data->gyro_data.back().data = gyro;
-    }
+    CsvReader csv(path + "data.csv");
+    data->accel_data.resize(csv.size());
+    data->gyro_data.resize(csv.size());
+
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      AccelData &accel = data->accel_data[i];
+      GyroData &gyro = data->gyro_data[i];
+
+      line >> gyro.timestamp_ns >> gyro.data[0] >> gyro.data[1] >>
+          gyro.data[2] >> accel.data[0] >> accel.data[1] >> accel.data[2];
+      accel.timestamp_ns = gyro.timestamp_ns;
+    });
   }
 
   void read_gt_data_state(const std::string &path) {
-    data->gt_timestamps.clear();
-    data->gt_pose_data.clear();
-
-    std::ifstream f(path + "data.csv");
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
-
-      char tmp;
-      uint64_t timestamp;
-      Eigen::Quaterniond q;
-      Eigen::Vector3d pos, vel, accel_bias, gyro_bias;
-
-      ss >> timestamp >> tmp >> pos[0] >> tmp >> pos[1] >> tmp >> pos[2] >>
-          tmp >> q.w() >> tmp >> q.x() >> tmp >> q.y() >> tmp >> q.z() >> tmp >>
-          vel[0] >> tmp >> vel[1] >> tmp >> vel[2] >> tmp >> accel_bias[0] >>
-          tmp >> accel_bias[1] >> tmp >> accel_bias[2] >> tmp >> gyro_bias[0] >>
-          tmp >> gyro_bias[1] >> tmp >> gyro_bias[2];
-
-      data->gt_timestamps.emplace_back(timestamp);
-      data->gt_pose_data.emplace_back(q, pos);
-    }
+    // Velocity and biases follow the pose, but are not used
+    read_gt_data_pose(path);
   }
 
   void read_gt_data_pose(const std::string &path) {
-    data->gt_timestamps.clear();
-    data->gt_pose_data.clear();
+    CsvReader csv(path + "data.csv");
+    data->gt_timestamps.resize(csv.size());
+    data->gt_pose_data.resize(csv.size());
 
-    std::ifstream f(path + "data.csv");
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
-
-      char tmp;
-      uint64_t timestamp;
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
       Eigen::Quaterniond q;
       Eigen::Vector3d pos;
 
-      ss >> timestamp >> tmp >> pos[0] >> tmp >> pos[1] >> tmp >> pos[2] >>
-          tmp >> q.w() >> tmp >> q.x() >> tmp >> q.y() >> tmp >> q.z();
+      line >> data->gt_timestamps[i] >> pos[0] >> pos[1] >> pos[2] >> q.w() >>
+          q.x() >> q.y() >> q.z();
 
-      data->gt_timestamps.emplace_back(timestamp);
-      data->gt_pose_data.emplace_back(q, pos);
-    }
+      data->gt_pose_data[i] = Sophus::SE3d(q, pos);
+    });
   }
 
   std::shared_ptr<EurocVioDataset> data;
@@ -35,6 +35,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <basalt/io/csv_reader.h>
 #include <basalt/io/dataset_io.h>
 #include <basalt/utils/filesystem.h>
 
@@ -91,22 +92,24 @@ class KittiVioDataset : public VioDataset {
     const std::vector<std::string> folder = {"/image_0/", "/image_1/"};
 
     for (size_t i = 0; i < num_cams; i++) {
-      std::string full_image_path = path + folder[i] + image_path[t_ns];
+      std::string full_image_path = path + folder[i] + image_path.at(t_ns);
 
       if (fs::exists(full_image_path)) {
         cv::Mat img = cv::imread(full_image_path, cv::IMREAD_UNCHANGED);
 
         if (img.type() == CV_8UC1) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
-
-          const uint8_t *data_in = img.ptr();
-          uint16_t *data_out = res[i].img->ptr;
-
-          size_t full_size = img.cols * img.rows;
-          for (size_t i = 0; i < full_size; i++) {
-            int val = data_in[i];
-            val = val << 8;
-            data_out[i] = val;
+          res[i].img = allocate_image(img.cols, img.rows);
+
+          // The rows of pooled images can be padded
+          for (int y = 0; y < img.rows; y++) {
+            const uint8_t *data_in = img.ptr(y);
+            uint16_t *data_out = res[i].img->RowPtr(y);
+
+            for (int x = 0; x < img.cols; x++) {
+              int val = data_in[x];
+              val = val << 8;
+              data_out[x] = val;
+            }
           }
         } else {
           std::cerr << "img.fmt.bpp " << img.type() << std::endl;
@@ -149,17 +152,15 @@ class KittiIO : public DatasetIoInterface {
 
  private:
   void read_image_timestamps(const std::string &path) {
-    std::ifstream f(path);
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-      std::stringstream ss(line);
-
+    CsvReader csv(path);
+    std::vector<int64_t> timestamps(csv.size());
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
       double t_s;
-      ss >> t_s;
-
-      int64_t t_ns = t_s * 1e9;
+      line >> t_s;
+      timestamps[i] = t_s * 1e9;
+    });
 
+    for (int64_t t_ns : timestamps) {
       std::stringstream ss1;
       ss1 << std::setfill('0') << std::setw(6) << data->image_timestamps.size()
           << ".png";
@@ -170,29 +171,23 @@ class KittiIO : public DatasetIoInterface {
   }
 
   void read_gt_data_pose(const std::string &path) {
-    data->gt_timestamps.clear();
-    data->gt_pose_data.clear();
+    CsvReader csv(path);
+    BASALT_ASSERT(csv.size() <= data->image_timestamps.size());
 
-    int i = 0;
-
-    std::ifstream f(path);
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
+    data->gt_timestamps.assign(data->image_timestamps.begin(),
+                               data->image_timestamps.begin() + csv.size());
+    data->gt_pose_data.resize(csv.size());
 
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
       Eigen::Matrix3d rot;
       Eigen::Vector3d pos;
 
-      ss >> rot(0, 0) >> rot(0, 1) >> rot(0, 2) >> pos[0] >> rot(1, 0) >>
+      line >> rot(0, 0) >> rot(0, 1) >> rot(0, 2) >> pos[0] >> rot(1, 0) >>
           rot(1, 1) >> rot(1, 2) >> pos[1] >> rot(2, 0) >> rot(2, 1) >>
           rot(2, 2) >> pos[2];
 
-      data->gt_timestamps.emplace_back(data->image_timestamps[i]);
-      data->gt_pose_data.emplace_back(Eigen::Quaterniond(rot), pos);
-      i++;
-    }
+      data->gt_pose_data[i] = Sophus::SE3d(Eigen::Quaterniond(rot), pos);
+    });
   }
 
   std::shared_ptr<KittiVioDataset> data;
@@ -0,0 +1,123 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <basalt/io/dataset_io.h>
+
+namespace basalt {
+
+/// Decorator that decodes the images of the next frames on a pool of threads
+/// while the current frame is processed. Works with every VioDataset whose
+/// get_image_data can be called concurrently. Frames requested in timestamp
+/// order are served from the look-ahead window, any other request falls back
+/// to decoding on the calling thread. The image buffers are recycled through
+/// an ImagePool, with mipmap_rows they have room for the optical flow
+/// pyramid.
+class PrefetchVioDataset : public VioDataset {
+ public:
+  PrefetchVioDataset(const VioDatasetPtr &dataset, size_t window_size,
+                     size_t num_threads, bool mipmap_rows = false);
+  ~PrefetchVioDataset();
+
+  size_t get_num_cams() const { return dataset->get_num_cams(); }
+
+  std::vector<int64_t> &get_image_timestamps() {
+    return dataset->get_image_timestamps();
+  }
+
+  const Eigen::aligned_vector<AccelData> &get_accel_data() const {
+    return dataset->get_accel_data();
+  }
+  const Eigen::aligned_vector<GyroData> &get_gyro_data() const {
+    return dataset->get_gyro_data();
+  }
+  const std::vector<int64_t> &get_gt_timestamps() const {
+    return dataset->get_gt_timestamps();
+  }
+  const Eigen::aligned_vector<Sophus::SE3d> &get_gt_pose_data() const {
+    return dataset->get_gt_pose_data();
+  }
+
+  int64_t get_mocap_to_imu_offset_ns() const {
+    return dataset->get_mocap_to_imu_offset_ns();
+  }
+
+  std::vector<ImageData> get_image_data(int64_t t_ns);
+
+  void set_image_pool(const ImagePool<uint16_t>::Ptr &pool) {
+    dataset->set_image_pool(pool);
+  }
+
+ private:
+  struct Slot {
+    int64_t t_ns = -1;
+    bool ready = false;
+    std::vector<ImageData> data;
+  };
+
+  // Schedules frames until the window after next_idx is full. Requires the
+  // lock.
+  void fill_window();
+
+  void decode_func();
+
+  VioDatasetPtr dataset;
+
+  std::mutex m;
+  std::condition_variable cv_job, cv_ready;
+
+  // Slot of frame i is slots[i % slots.size()]
+  std::vector<Slot> slots;
+
+  // Frame index and timestamp of the frames to decode
+  std::deque<std::pair<size_t, int64_t>> jobs;
+
+  // Next frame in timestamp order and next frame to schedule
+  size_t next_idx, next_job;
+
+  // Index of the last request outside of the window, reset by every hit
+  size_t last_miss;
+
+  bool stop;
+  std::vector<std::thread> decode_threads;
+};
+
+}  // namespace basalt
@@ -35,9 +35,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef DATASET_IO_ROSBAG_H
 #define DATASET_IO_ROSBAG_H
 
-#include <mutex>
 #include <optional>
 
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
 #include <basalt/io/dataset_io.h>
 
 // Hack to access private functions
@@ -51,14 +53,22 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <geometry_msgs/TransformStamped.h>
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/Imu.h>
+#include <std_msgs/Header.h>
 
 #include <basalt/utils/filesystem.h>
 
 namespace basalt {
 
 class RosbagVioDataset : public VioDataset {
+  std::string path;
+
+  // Bag with the parsed index, shared by all readers
   std::shared_ptr<rosbag::Bag> bag;
-  std::mutex m;
+
+  // Reading a message modifies the chunk buffers of the bag, so every thread
+  // lazily opens its own handle. The handles only open the file and copy the
+  // connections of the shared bag instead of parsing the index again.
+  tbb::enumerable_thread_specific<std::shared_ptr<rosbag::Bag>> readers;
 
   size_t num_cams;
 
@@ -80,6 +90,22 @@ class RosbagVioDataset : public VioDataset {
   int64_t mocap_to_imu_offset_ns;
 
  public:
+  RosbagVioDataset()
+      : readers([this]() {
+          std::shared_ptr<rosbag::Bag> reader(new rosbag::Bag);
+          reader->file_.openRead(path);
+          reader->mode_ = rosbag::bagmode::Read;
+          reader->version_ = bag->version_;
+
+          // The bag deletes its connections when closed
+          for (const auto &kv : bag->connections_) {
+            reader->connections_[kv.first] =
+                new rosbag::ConnectionInfo(*kv.second);
+          }
+
+          return reader;
+        }) {}
+
   ~RosbagVioDataset() {}
 
   size_t get_num_cams() const { return num_cams; }
@@ -112,17 +138,15 @@ class RosbagVioDataset : public VioDataset {
 
         if (!it->second[i].has_value()) continue;
 
-        m.lock();
         sensor_msgs::ImageConstPtr img_msg =
-            bag->instantiateBuffer<sensor_msgs::Image>(*it->second[i]);
-        m.unlock();
+            readers.local()->instantiateBuffer<sensor_msgs::Image>(
+                *it->second[i]);
 
         //        std::cerr << "img_msg->width " << img_msg->width << "
         //        img_msg->height "
         //                  << img_msg->height << std::endl;
 
-        id.img.reset(
-            new ManagedImage<uint16_t>(img_msg->width, img_msg->height));
+        id.img = allocate_image(img_msg->width, img_msg->height);
 
         if (!img_msg->header.frame_id.empty() &&
             std::isdigit(img_msg->header.frame_id[0])) {
@@ -131,18 +155,25 @@ class RosbagVioDataset : public VioDataset {
           id.exposure = -1;
         }
 
+        // The rows of pooled images can be padded
         if (img_msg->encoding == "mono8") {
-          const uint8_t *data_in = img_msg->data.data();
-          uint16_t *data_out = id.img->ptr;
-
-          for (size_t i = 0; i < img_msg->data.size(); i++) {
-            int val = data_in[i];
-            val = val << 8;
-            data_out[i] = val;
+          for (size_t y = 0; y < img_msg->height; y++) {
+            const uint8_t *data_in = img_msg->data.data() + y * img_msg->step;
+            uint16_t *data_out = id.img->RowPtr(y);
+
+            for (size_t x = 0; x < img_msg->width; x++) {
+              int val = data_in[x];
+              val = val << 8;
+              data_out[x] = val;
+            }
           }
 
         } else if (img_msg->encoding == "mono16") {
-          std::memcpy(id.img->ptr, img_msg->data.data(), img_msg->data.size());
+          for (size_t y = 0; y < img_msg->height; y++) {
+            std::memcpy(id.img->RowPtr(y),
+                        img_msg->data.data() + y * img_msg->step,
+                        img_msg->width * sizeof(uint16_t));
+          }
         } else {
           std::cerr << "Encoding " << img_msg->encoding << " is not supported."
                     << std::endl;
@@ -167,11 +198,14 @@ class RosbagIO : public DatasetIoInterface {
       std::cerr << "No dataset found in " << path << std::endl;
 
     data.reset(new RosbagVioDataset);
+    data->path = path;
 
+    // Opening the bag loads the index of all messages
     data->bag.reset(new rosbag::Bag);
     data->bag->open(path, rosbag::bagmode::Read);
+    const std::shared_ptr<rosbag::Bag> &bag = data->bag;
 
-    rosbag::View view(*data->bag);
+    rosbag::View view(*bag);
 
     // get topics
     std::vector<const rosbag::ConnectionInfo *> connection_infos =
@@ -181,6 +215,7 @@ class RosbagIO : public DatasetIoInterface {
     std::string imu_topic;
     std::string mocap_topic;
     std::string point_topic;
+    bool mocap_is_pose = false;
 
     for (const rosbag::ConnectionInfo *info : connection_infos) {
       //      if (info->topic.substr(0, 4) == std::string("/cam")) {
@@ -201,6 +236,8 @@ class RosbagIO : public DatasetIoInterface {
                      std::string("geometry_msgs/TransformStamped") ||
                  info->datatype == std::string("geometry_msgs/PoseStamped")) {
         mocap_topic = info->topic;
+        mocap_is_pose =
+            info->datatype == std::string("geometry_msgs/PoseStamped");
       } else if (info->datatype == std::string("geometry_msgs/PointStamped")) {
         point_topic = info->topic;
       }
@@ -221,106 +258,190 @@ class RosbagIO : public DatasetIoInterface {
 
     data->num_cams = cam_topics.size();
 
-    int num_msgs = 0;
-
-    int64_t min_time = std::numeric_limits<int64_t>::max();
-    int64_t max_time = std::numeric_limits<int64_t>::min();
+    // Index entries of the required messages in time order for every topic.
+    // Camera i uses msg_entries[i], followed by IMU, mocap and point entries.
+    const int imu_id = data->num_cams;
+    const int mocap_id = imu_id + 1;
+    const int point_id = imu_id + 2;
 
-    std::vector<geometry_msgs::TransformStampedConstPtr> mocap_msgs;
-    std::vector<geometry_msgs::PointStampedConstPtr> point_msgs;
+    std::vector<std::vector<rosbag::IndexEntry>> msg_entries(point_id + 1);
 
-    std::vector<int64_t>
-        system_to_imu_offset_vec;  // t_imu = t_system + system_to_imu_offset
-    std::vector<int64_t> system_to_mocap_offset_vec;  // t_mocap = t_system +
-                                                      // system_to_mocap_offset
+    size_t num_msgs = 0;
 
-    std::set<int64_t> image_timestamps;
+    for (const auto &conn_index : bag->connection_indexes_) {
+      num_msgs += conn_index.second.size();
 
-    for (const rosbag::MessageInstance &m : view) {
-      const std::string &topic = m.getTopic();
+      const std::string &topic = bag->connections_.at(conn_index.first)->topic;
 
+      int id = -1;
       if (cam_topics.find(topic) != cam_topics.end()) {
-        sensor_msgs::ImageConstPtr img_msg =
-            m.instantiate<sensor_msgs::Image>();
-        int64_t timestamp_ns = img_msg->header.stamp.toNSec();
+        id = topic_to_id.at(topic);
+      } else if (imu_topic == topic) {
+        id = imu_id;
+      } else if (mocap_topic == topic) {
+        id = mocap_id;
+      } else if (point_topic == topic) {
+        id = point_id;
+      }
 
-        auto &img_vec = data->image_data_idx[timestamp_ns];
-        if (img_vec.size() == 0) img_vec.resize(data->num_cams);
+      if (id >= 0) {
+        msg_entries[id].insert(msg_entries[id].end(), conn_index.second.begin(),
+                               conn_index.second.end());
+      }
+    }
 
-        img_vec[topic_to_id.at(topic)] = m.index_entry_;
-        image_timestamps.insert(timestamp_ns);
+    // A topic can have several connections
+    for (auto &entries : msg_entries) {
+      std::stable_sort(entries.begin(), entries.end());
+    }
 
-        min_time = std::min(min_time, timestamp_ns);
-        max_time = std::max(max_time, timestamp_ns);
+    // Parse the messages in parallel, one chunk per task, so every chunk is
+    // read and decompressed only once.
+    struct Job {
+      uint64_t chunk_pos;
+      uint32_t offset;
+      int id;
+      size_t i;
+    };
+
+    std::vector<Job> jobs;
+    for (size_t id = 0; id < msg_entries.size(); id++) {
+      for (size_t i = 0; i < msg_entries[id].size(); i++) {
+        const rosbag::IndexEntry &e = msg_entries[id][i];
+        jobs.push_back({e.chunk_pos, e.offset, int(id), i});
       }
+    }
 
-      if (imu_topic == topic) {
-        sensor_msgs::ImuConstPtr imu_msg = m.instantiate<sensor_msgs::Imu>();
-        int64_t time = imu_msg->header.stamp.toNSec();
-
-        data->accel_data.emplace_back();
-        data->accel_data.back().timestamp_ns = time;
-        data->accel_data.back().data = Eigen::Vector3d(
-            imu_msg->linear_acceleration.x, imu_msg->linear_acceleration.y,
-            imu_msg->linear_acceleration.z);
+    std::sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) {
+      return std::make_pair(a.chunk_pos, a.offset) <
+             std::make_pair(b.chunk_pos, b.offset);
+    });
 
-        data->gyro_data.emplace_back();
-        data->gyro_data.back().timestamp_ns = time;
-        data->gyro_data.back().data = Eigen::Vector3d(
-            imu_msg->angular_velocity.x, imu_msg->angular_velocity.y,
-            imu_msg->angular_velocity.z);
+    std::vector<size_t> chunk_begin;
+    for (size_t k = 0; k < jobs.size(); k++) {
+      if (k == 0 || jobs[k].chunk_pos != jobs[k - 1].chunk_pos) {
+        chunk_begin.push_back(k);
+      }
+    }
+    chunk_begin.push_back(jobs.size());
 
-        min_time = std::min(min_time, time);
-        max_time = std::max(max_time, time);
+    std::vector<std::vector<int64_t>> cam_timestamps(data->num_cams);
+    for (size_t c = 0; c < data->num_cams; c++) {
+      cam_timestamps[c].resize(msg_entries[c].size());
+    }
 
-        int64_t msg_arrival_time = m.getTime().toNSec();
-        system_to_imu_offset_vec.push_back(time - msg_arrival_time);
+    data->accel_data.resize(msg_entries[imu_id].size());
+    data->gyro_data.resize(msg_entries[imu_id].size());
+
+    std::vector<geometry_msgs::TransformStampedConstPtr> mocap_msgs(
+        msg_entries[mocap_id].size());
+    std::vector<geometry_msgs::PointStampedConstPtr> point_msgs(
+        msg_entries[point_id].size());
+
+    auto parse_chunks = [&](const tbb::blocked_range<size_t> &range) {
+      rosbag::Bag &local_bag = *data->readers.local();
+
+      for (size_t r = range.begin(); r != range.end(); r++) {
+        for (size_t k = chunk_begin[r]; k < chunk_begin[r + 1]; k++) {
+          const Job &job = jobs[k];
+          const rosbag::IndexEntry &e = msg_entries[job.id][job.i];
+
+          if (job.id < imu_id) {
+            // Only the header of the image is needed
+            std_msgs::HeaderConstPtr header =
+                local_bag.instantiateBuffer<std_msgs::Header>(e);
+            cam_timestamps[job.id][job.i] = header->stamp.toNSec();
+          } else if (job.id == imu_id) {
+            sensor_msgs::ImuConstPtr imu_msg =
+                local_bag.instantiateBuffer<sensor_msgs::Imu>(e);
+            int64_t time = imu_msg->header.stamp.toNSec();
+
+            data->accel_data[job.i].timestamp_ns = time;
+            data->accel_data[job.i].data = Eigen::Vector3d(
+                imu_msg->linear_acceleration.x, imu_msg->linear_acceleration.y,
+                imu_msg->linear_acceleration.z);
+
+            data->gyro_data[job.i].timestamp_ns = time;
+            data->gyro_data[job.i].data = Eigen::Vector3d(
+                imu_msg->angular_velocity.x, imu_msg->angular_velocity.y,
+                imu_msg->angular_velocity.z);
+          } else if (job.id == mocap_id && mocap_is_pose) {
+            geometry_msgs::PoseStampedConstPtr mocap_pose_msg =
+                local_bag.instantiateBuffer<geometry_msgs::PoseStamped>(e);
+
+            geometry_msgs::TransformStampedPtr mocap_new_msg(
+                new geometry_msgs::TransformStamped);
+            mocap_new_msg->header = mocap_pose_msg->header;
+            mocap_new_msg->transform.rotation =
+                mocap_pose_msg->pose.orientation;
+            mocap_new_msg->transform.translation.x =
+                mocap_pose_msg->pose.position.x;
+            mocap_new_msg->transform.translation.y =
+                mocap_pose_msg->pose.position.y;
+            mocap_new_msg->transform.translation.z =
+                mocap_pose_msg->pose.position.z;
+
+            mocap_msgs[job.i] = mocap_new_msg;
+          } else if (job.id == mocap_id) {
+            mocap_msgs[job.i] =
+                local_bag.instantiateBuffer<geometry_msgs::TransformStamped>(
+                    e);
+          } else {
+            point_msgs[job.i] =
+                local_bag.instantiateBuffer<geometry_msgs::PointStamped>(e);
+          }
+        }
       }
+    };
 
-      if (mocap_topic == topic) {
-        geometry_msgs::TransformStampedConstPtr mocap_msg =
-            m.instantiate<geometry_msgs::TransformStamped>();
-
-        // Try different message type if instantiate did not work
-        if (!mocap_msg) {
-          geometry_msgs::PoseStampedConstPtr mocap_pose_msg =
-              m.instantiate<geometry_msgs::PoseStamped>();
-
-          geometry_msgs::TransformStampedPtr mocap_new_msg(
-              new geometry_msgs::TransformStamped);
-          mocap_new_msg->header = mocap_pose_msg->header;
-          mocap_new_msg->transform.rotation = mocap_pose_msg->pose.orientation;
-          mocap_new_msg->transform.translation.x =
-              mocap_pose_msg->pose.position.x;
-          mocap_new_msg->transform.translation.y =
-              mocap_pose_msg->pose.position.y;
-          mocap_new_msg->transform.translation.z =
-              mocap_pose_msg->pose.position.z;
-
-          mocap_msg = mocap_new_msg;
-        }
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, chunk_begin.size() - 1),
+                      parse_chunks);
 
-        int64_t time = mocap_msg->header.stamp.toNSec();
+    int64_t min_time = std::numeric_limits<int64_t>::max();
+    int64_t max_time = std::numeric_limits<int64_t>::min();
 
-        mocap_msgs.push_back(mocap_msg);
+    std::vector<int64_t>
+        system_to_imu_offset_vec;  // t_imu = t_system + system_to_imu_offset
+    std::vector<int64_t> system_to_mocap_offset_vec;  // t_mocap = t_system +
+                                                      // system_to_mocap_offset
 
-        int64_t msg_arrival_time = m.getTime().toNSec();
-        system_to_mocap_offset_vec.push_back(time - msg_arrival_time);
-      }
+    std::set<int64_t> image_timestamps;
 
-      if (point_topic == topic) {
-        geometry_msgs::PointStampedConstPtr mocap_msg =
-            m.instantiate<geometry_msgs::PointStamped>();
+    for (size_t c = 0; c < data->num_cams; c++) {
+      for (size_t i = 0; i < msg_entries[c].size(); i++) {
+        int64_t timestamp_ns = cam_timestamps[c][i];
 
-        int64_t time = mocap_msg->header.stamp.toNSec();
+        auto &img_vec = data->image_data_idx[timestamp_ns];
+        if (img_vec.size() == 0) img_vec.resize(data->num_cams);
 
-        point_msgs.push_back(mocap_msg);
+        img_vec[c] = msg_entries[c][i];
+        image_timestamps.insert(timestamp_ns);
 
-        int64_t msg_arrival_time = m.getTime().toNSec();
-        system_to_mocap_offset_vec.push_back(time - msg_arrival_time);
+        min_time = std::min(min_time, timestamp_ns);
+        max_time = std::max(max_time, timestamp_ns);
       }
+    }
+
+    for (size_t i = 0; i < data->gyro_data.size(); i++) {
+      int64_t time = data->gyro_data[i].timestamp_ns;
+
+      min_time = std::min(min_time, time);
+      max_time = std::max(max_time, time);
+
+      int64_t msg_arrival_time = msg_entries[imu_id][i].time.toNSec();
+      system_to_imu_offset_vec.push_back(time - msg_arrival_time);
+    }
+
+    for (size_t i = 0; i < mocap_msgs.size(); i++) {
+      int64_t time = mocap_msgs[i]->header.stamp.toNSec();
+      int64_t msg_arrival_time = msg_entries[mocap_id][i].time.toNSec();
+      system_to_mocap_offset_vec.push_back(time - msg_arrival_time);
+    }
 
-      num_msgs++;
+    for (size_t i = 0; i < point_msgs.size(); i++) {
+      int64_t time = point_msgs[i]->header.stamp.toNSec();
+      int64_t msg_arrival_time = msg_entries[point_id][i].time.toNSec();
+      system_to_mocap_offset_vec.push_back(time - msg_arrival_time);
     }
 
     data->image_timestamps.clear();
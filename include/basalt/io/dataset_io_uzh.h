@@ -35,6 +35,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <basalt/io/csv_reader.h>
 #include <basalt/io/dataset_io.h>
 #include <basalt/utils/filesystem.h>
 
@@ -101,33 +102,39 @@ class UzhVioDataset : public VioDataset {
         cv::Mat img = cv::imread(full_image_path, cv::IMREAD_UNCHANGED);
 
         if (img.type() == CV_8UC1) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
-
-          const uint8_t *data_in = img.ptr();
-          uint16_t *data_out = res[i].img->ptr;
-
-          size_t full_size = img.cols * img.rows;
-          for (size_t i = 0; i < full_size; i++) {
-            int val = data_in[i];
-            val = val << 8;
-            data_out[i] = val;
+          res[i].img = allocate_image(img.cols, img.rows);
+
+          // The rows of pooled images can be padded
+          for (int y = 0; y < img.rows; y++) {
+            const uint8_t *data_in = img.ptr(y);
+            uint16_t *data_out = res[i].img->RowPtr(y);
+
+            for (int x = 0; x < img.cols; x++) {
+              int val = data_in[x];
+              val = val << 8;
+              data_out[x] = val;
+            }
           }
         } else if (img.type() == CV_8UC3) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
+          res[i].img = allocate_image(img.cols, img.rows);
 
-          const uint8_t *data_in = img.ptr();
-          uint16_t *data_out = res[i].img->ptr;
+          for (int y = 0; y < img.rows; y++) {
+            const uint8_t *data_in = img.ptr(y);
+            uint16_t *data_out = res[i].img->RowPtr(y);
 
-          size_t full_size = img.cols * img.rows;
-          for (size_t i = 0; i < full_size; i++) {
-            int val = data_in[i * 3];
-            val = val << 8;
-            data_out[i] = val;
+            for (int x = 0; x < img.cols; x++) {
+              int val = data_in[x * 3];
+              val = val << 8;
+              data_out[x] = val;
+            }
           }
         } else if (img.type() == CV_16UC1) {
-          res[i].img.reset(new ManagedImage<uint16_t>(img.cols, img.rows));
-          std::memcpy(res[i].img->ptr, img.ptr(),
-                      img.cols * img.rows * sizeof(uint16_t));
+          res[i].img = allocate_image(img.cols, img.rows);
+
+          for (int y = 0; y < img.rows; y++) {
+            std::memcpy(res[i].img->RowPtr(y), img.ptr(y),
+                        img.cols * sizeof(uint16_t));
+          }
 
         } else {
           std::cerr << "img.fmt.bpp " << img.type() << std::endl;
@@ -196,114 +203,85 @@ class UzhIO : public DatasetIoInterface {
                      std::unordered_map<int64_t, double> &exposure_data) {
     exposure_data.clear();
 
-    std::ifstream f(path + "exposure.csv");
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
-
-      char tmp;
-      int64_t timestamp, exposure_int;
-      Eigen::Vector3d gyro, accel;
+    CsvReader csv(path + "exposure.csv");
+    std::vector<std::pair<int64_t, int64_t>> exposure(csv.size());
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      line >> exposure[i].first >> exposure[i].second;
+    });
 
-      ss >> timestamp >> tmp >> exposure_int;
+    for (const auto &e : exposure) exposure_data[e.first] = e.second * 1e-9;
+  }
 
-      exposure_data[timestamp] = exposure_int * 1e-9;
-    }
+  void read_image_list(const std::string &path,
+                       std::vector<int64_t> &timestamps,
+                       std::vector<std::string> &paths) {
+    CsvReader csv(path);
+    timestamps.resize(csv.size());
+    paths.resize(csv.size());
+
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      int id;
+      double t_s;
+      std::string_view image_path;
+      line >> id >> t_s >> image_path;
+
+      timestamps[i] = t_s * 1e9;
+      paths[i] = image_path;
+    });
   }
 
   void read_image_timestamps(const std::string &path) {
-    {
-      std::ifstream f(path + "/left_images.txt");
-      std::string line;
-      while (std::getline(f, line)) {
-        if (line[0] == '#') continue;
-        std::stringstream ss(line);
-        int tmp;
-        double t_s;
-        std::string path;
-        ss >> tmp >> t_s >> path;
-
-        int64_t t_ns = t_s * 1e9;
-
-        data->image_timestamps.emplace_back(t_ns);
-        data->left_image_path[t_ns] = path;
-      }
-    }
-
-    {
-      std::ifstream f(path + "/right_images.txt");
-      std::string line;
-      while (std::getline(f, line)) {
-        if (line[0] == '#') continue;
-        std::stringstream ss(line);
-        int tmp;
-        double t_s;
-        std::string path;
-        ss >> tmp >> t_s >> path;
+    std::vector<int64_t> timestamps;
+    std::vector<std::string> paths;
 
-        int64_t t_ns = t_s * 1e9;
+    read_image_list(path + "/left_images.txt", timestamps, paths);
+    for (size_t i = 0; i < timestamps.size(); i++) {
+      data->image_timestamps.emplace_back(timestamps[i]);
+      data->left_image_path[timestamps[i]] = paths[i];
+    }
 
-        data->right_image_path[t_ns] = path;
-      }
+    read_image_list(path + "/right_images.txt", timestamps, paths);
+    for (size_t i = 0; i < timestamps.size(); i++) {
+      data->right_image_path[timestamps[i]] = paths[i];
     }
   }
 
   void read_imu_data(const std::string &path) {
-    data->accel_data.clear();
-    data->gyro_data.clear();
-
-    std::ifstream f(path);
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
+    CsvReader csv(path);
+    data->accel_data.resize(csv.size());
+    data->gyro_data.resize(csv.size());
 
-      std::stringstream ss(line);
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      AccelData &accel = data->accel_data[i];
+      GyroData &gyro = data->gyro_data[i];
 
-      int tmp;
+      int id;
       double timestamp;
-      Eigen::Vector3d gyro, accel;
-
-      ss >> tmp >> timestamp >> gyro[0] >> gyro[1] >> gyro[2] >> accel[0] >>
-          accel[1] >> accel[2];
-
-      int64_t t_ns = timestamp * 1e9;
-
-      data->accel_data.emplace_back();
-      data->accel_data.back().timestamp_ns = t_ns;
-      data->accel_data.back().data = accel;
+      line >> id >> timestamp >> gyro.data[0] >> gyro.data[1] >>
+          gyro.data[2] >> accel.data[0] >> accel.data[1] >> accel.data[2];
 
-      data->gyro_data.emplace_back();
-      data->gyro_data.back().timestamp_ns = t_ns;
-      data->gyro_data.back().data = gyro;
-    }
+      gyro.timestamp_ns = timestamp * 1e9;
+      accel.timestamp_ns = gyro.timestamp_ns;
+    });
   }
 
   void read_gt_data_pose(const std::string &path) {
-    data->gt_timestamps.clear();
-    data->gt_pose_data.clear();
-
-    std::ifstream f(path);
-    std::string line;
-    while (std::getline(f, line)) {
-      if (line[0] == '#') continue;
-
-      std::stringstream ss(line);
+    CsvReader csv(path);
+    data->gt_timestamps.resize(csv.size());
+    data->gt_pose_data.resize(csv.size());
 
-      int tmp;
+    csv.parallel_for_each([&](size_t i, CsvLine &line) {
+      int id;
       double timestamp;
       Eigen::Quaterniond q;
       Eigen::Vector3d pos;
 
-      ss >> tmp >> timestamp >> pos[0] >> pos[1] >> pos[2] >> q.x() >> q.y() >>
-          q.z() >> q.w();
+      line >> id >> timestamp >> pos[0] >> pos[1] >> pos[2] >> q.x() >>
+          q.y() >> q.z() >> q.w();
 
-      int64_t t_ns = timestamp * 1e9;
-
-      data->gt_timestamps.emplace_back(t_ns);
-      data->gt_pose_data.emplace_back(q, pos);
-    }
+      data->gt_timestamps[i] = timestamp * 1e9;
+      data->gt_pose_data[i] = Sophus::SE3d(q, pos);
+    });
   }
 
   std::shared_ptr<UzhVioDataset> data;
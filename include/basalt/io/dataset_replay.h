@@ -0,0 +1,131 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <basalt/imu/imu_types.h>
+#include <basalt/io/dataset_io.h>
+#include <basalt/optical_flow/optical_flow.h>
+#include <basalt/utils/spsc_queue.h>
+
+namespace basalt {
+
+/// Plays a dataset back like a live sensor: every image and IMU sample is
+/// pushed when the wall clock reaches its recorded timestamp, scaled by the
+/// speed multiplier. Like a camera driver, a frame is dropped if the image
+/// queue is still full at that time; IMU samples are never dropped. For
+/// every frame whose state reaches record_output the end-to-end latency
+/// from the scheduled sensor time is recorded. Playback ends early when
+/// stop() is called, e.g. when the window is closed.
+class VioDatasetReplay {
+ public:
+  using Ptr = std::shared_ptr<VioDatasetReplay>;
+  using Clock = std::chrono::steady_clock;
+
+  /// speed > 1 replays faster than recorded
+  VioDatasetReplay(const VioDatasetPtr &dataset, double speed);
+  ~VioDatasetReplay();
+
+  /// Starts the image and the IMU thread, both queues must be set.
+  void start();
+
+  /// Stops the playback and wakes both threads. The end of the streams is
+  /// still signaled, so the consumers must keep draining the queues until
+  /// they receive the nullptr. Safe to call repeatedly and from any thread.
+  void stop();
+
+  /// Like stop(), but gives up on signaling the end of the streams. Call
+  /// once the consumers no longer read the queues, e.g. after the estimator
+  /// has finished.
+  void cancel();
+
+  /// Call when the state for the frame t_ns is published, from a single
+  /// thread.
+  void record_output(int64_t t_ns);
+
+  void print_stats() const;
+
+  /// Writes "timestamp [ns],latency [ms]" for every frame, the latency of
+  /// frames without output is -1.
+  void save_latencies(const std::string &path) const;
+
+  SpscQueue<OpticalFlowInput::Ptr> *out_image_queue = nullptr;
+  SpscQueue<ImuData<double>::Ptr> *out_imu_queue = nullptr;
+
+ private:
+  void imageLoop();
+  void imuLoop();
+
+  Clock::time_point sensor_time(int64_t t_ns) const;
+
+  /// Sleeps until t or until stop() is called, returns false if stopped.
+  bool wait_until(Clock::time_point t);
+
+  /// Pushes like a blocking push, but returns false once abort is set.
+  template <class T>
+  bool push_until(SpscQueue<T> &queue, T &&value,
+                  const std::atomic<bool> &abort);
+
+  VioDatasetPtr dataset;
+  double speed;
+
+  int64_t start_t_ns;
+  Clock::time_point start_time;
+
+  std::unordered_map<int64_t, size_t> frame_idx;
+  std::vector<double> frame_latency_ms;
+
+  std::atomic<size_t> num_dropped_input;
+  std::atomic<size_t> num_outputs;
+
+  std::atomic<bool> stop_requested;
+  std::atomic<bool> cancel_requested;
+  std::mutex stop_mutex;
+  std::condition_variable stop_cv;
+
+  std::shared_ptr<std::thread> image_thread;
+  std::shared_ptr<std::thread> imu_thread;
+};
+
+}  // namespace basalt
@@ -34,18 +34,104 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #pragma once
 
+#include <fstream>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <basalt/utils/imu_types.h>
+#include <basalt/utils/mapped_file.h>
+#include <basalt/utils/vio_config.h>
 
 namespace basalt {
 
+template <size_t N>
+class HashBow;
+
+/// Append-only log with all marginalization data of a session. Every
+/// MargData and OpticalFlowResult is a cereal serialized record. Images are
+/// stored in separate LZ4 compressed records and identical images only once.
+/// The index of all records is appended when the log is closed.
+class MargDataLogWriter {
+ public:
+  using Ptr = std::shared_ptr<MargDataLogWriter>;
+
+  explicit MargDataLogWriter(const std::string& path);
+  ~MargDataLogWriter();
+
+  /// Thread safe, only the keyframe states are stored, not opt_flow_res
+  void write(const MargData& data);
+
+  /// Thread safe, stores the observations and the input images
+  void write(const OpticalFlowResult& data);
+
+  struct IndexEntry {
+    uint32_t type;
+    uint32_t reserved;
+    int64_t key;
+    uint64_t offset;
+  };
+
+ private:
+  uint64_t write_image(const ManagedImage<uint16_t>& img);
+
+  /// Compares raw (size and pixels) with the image record at record_offset
+  bool is_same_image(uint64_t record_offset, const std::string& raw);
+
+  void append(uint32_t type, int64_t key, const std::string& payload);
+
+  std::mutex m;
+  std::string path;
+  std::ofstream os;
+  uint64_t offset;
+  std::vector<IndexEntry> index;
+
+  // Image id to the offset of its record
+  std::unordered_map<uint64_t, uint64_t> written_images;
+};
+
+/// Random access to the records of a log written by MargDataLogWriter. The
+/// file is memory mapped, so the records can be read from several threads.
+/// Logs that were not closed are indexed by scanning the records.
+class MargDataLogReader {
+ public:
+  using Ptr = std::shared_ptr<MargDataLogReader>;
+
+  explicit MargDataLogReader(const std::string& path);
+
+  /// Keys of the MargData records, the first marginalized keyframe, sorted
+  const std::vector<int64_t>& get_marg_data_keys() const {
+    return marg_data_keys;
+  }
+
+  MargData::Ptr read_marg_data(int64_t key) const;
+
+  /// Returns nullptr if there is no record for t_ns
+  OpticalFlowResult::Ptr read_opt_flow_result(int64_t t_ns) const;
+
+ private:
+  const uint8_t* record(uint32_t type, int64_t key, uint64_t& size) const;
+
+  ManagedImage<uint16_t>::Ptr read_image(uint64_t image_id) const;
+
+  MappedFile::Ptr file;
+
+  std::vector<int64_t> marg_data_keys;
+
+  // Offsets of the records for every type
+  std::vector<std::unordered_map<int64_t, uint64_t>> offsets;
+};
+
 class MargDataSaver {
  public:
   using Ptr = std::shared_ptr<MargDataSaver>;
 
-  MargDataSaver(const std::string& path);
+  /// With config.vio_marg_data_features the mapping features of every frame
+  /// are computed on the saving thread and stored instead of the images.
+  MargDataSaver(const std::string& path,
+                const VioConfig& config = VioConfig());
   ~MargDataSaver() {
     saving_thread->join();
     saving_img_thread->join();
@@ -53,6 +139,14 @@ class MargDataSaver {
   tbb::concurrent_bounded_queue<MargData::Ptr> in_marg_queue;
 
  private:
+  OpticalFlowResult::Ptr extract_features(
+      const OpticalFlowResult::Ptr& data) const;
+
+  VioConfig config;
+  std::shared_ptr<HashBow<256>> hash_bow;
+
+  MargDataLogWriter::Ptr log;
+
   std::shared_ptr<std::thread> saving_thread;
   std::shared_ptr<std::thread> saving_img_thread;
 
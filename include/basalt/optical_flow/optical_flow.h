@@ -43,7 +43,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <basalt/io/dataset_io.h>
 #include <basalt/calibration/calibration.hpp>
 #include <basalt/camera/stereographic_param.hpp>
+#include <basalt/utils/common_types.h>
 #include <basalt/utils/sophus_utils.hpp>
+#include <basalt/utils/spsc_queue.h>
 
 #include <tbb/concurrent_queue.h>
 
@@ -56,6 +58,11 @@ struct OpticalFlowInput {
 
   int64_t t_ns;
   std::vector<ImageData> img_data;
+
+  /// Mapping keypoints, descriptors and BoW vectors of every camera. Only set
+  /// in marg. data that stores them instead of the images
+  /// (config.vio_marg_data_features).
+  std::vector<KeypointsData> keypoints;
 };
 
 struct OpticalFlowResult {
@@ -72,8 +79,8 @@ class OpticalFlowBase {
  public:
   using Ptr = std::shared_ptr<OpticalFlowBase>;
 
-  tbb::concurrent_bounded_queue<OpticalFlowInput::Ptr> input_queue;
-  tbb::concurrent_bounded_queue<OpticalFlowResult::Ptr>* output_queue = nullptr;
+  SpscQueue<OpticalFlowInput::Ptr> input_queue;
+  SpscQueue<OpticalFlowResult::Ptr>* output_queue = nullptr;
 
   Eigen::MatrixXf patch_coord;
 };
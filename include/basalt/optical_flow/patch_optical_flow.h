@@ -119,7 +119,7 @@ class PatchOpticalFlow : public OpticalFlowBase {
       pyramid.reset(new std::vector<basalt::ManagedImagePyr<uint16_t>>);
       pyramid->resize(calib.intrinsics.size());
       for (size_t i = 0; i < calib.intrinsics.size(); i++) {
-        pyramid->at(i).setFromImage(*new_img_vec->img_data[i].img,
+        pyramid->at(i).setFromImage(new_img_vec->img_data[i].img,
                                     config.optical_flow_levels);
       }
 
@@ -136,7 +136,7 @@ class PatchOpticalFlow : public OpticalFlowBase {
       pyramid.reset(new std::vector<basalt::ManagedImagePyr<uint16_t>>);
       pyramid->resize(calib.intrinsics.size());
       for (size_t i = 0; i < calib.intrinsics.size(); i++) {
-        pyramid->at(i).setFromImage(*new_img_vec->img_data[i].img,
+        pyramid->at(i).setFromImage(new_img_vec->img_data[i].img,
                                     config.optical_flow_levels);
       }
 
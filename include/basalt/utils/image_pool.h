@@ -0,0 +1,103 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include <tbb/concurrent_queue.h>
+
+#include <basalt/image/image.h>
+
+namespace basalt {
+
+/// Recycles image buffers, so decoding a sequence does not allocate and
+/// page-fault a new buffer for every frame. get() may be called from many
+/// threads. The returned images give their buffer back to the pool when the
+/// last owner releases them and keep the pool alive until then. Recycled
+/// buffers contain the pixels of their previous use. Must be owned by a
+/// shared_ptr.
+///
+/// With mipmap_rows every row has room for the upper pyramid levels, so
+/// ManagedImagePyr can use the image as level 0 without copying it. Such
+/// images are not contiguous, their pitch is (w + w / 2) * sizeof(T).
+template <class T>
+class ImagePool : public std::enable_shared_from_this<ImagePool<T>> {
+ public:
+  using Ptr = std::shared_ptr<ImagePool<T>>;
+  using ImagePtr = typename ManagedImage<T>::Ptr;
+
+  /// Keeps at most max_free unused buffers
+  explicit ImagePool(size_t max_free, bool mipmap_rows = false)
+      : max_free(max_free), mipmap_rows(mipmap_rows), num_free(0) {}
+
+  ~ImagePool() {
+    ManagedImage<T>* img = nullptr;
+    while (free_images.try_pop(img)) delete img;
+  }
+
+  ImagePtr get(size_t w, size_t h) {
+    const size_t pitch = (mipmap_rows ? w + w / 2 : w) * sizeof(T);
+
+    ManagedImage<T>* img = nullptr;
+    if (free_images.try_pop(img)) {
+      num_free--;
+      img->Reinitialise(w, h, pitch);
+    } else {
+      img = new ManagedImage<T>(w, h, pitch);
+    }
+
+    Ptr self = this->shared_from_this();
+    return ImagePtr(img, [self](ManagedImage<T>* img) { self->release(img); });
+  }
+
+ private:
+  void release(ManagedImage<T>* img) {
+    if (num_free++ < max_free) {
+      free_images.push(img);
+    } else {
+      num_free--;
+      delete img;
+    }
+  }
+
+  const size_t max_free;
+  const bool mipmap_rows;
+
+  tbb::concurrent_queue<ManagedImage<T>*> free_images;
+  std::atomic<size_t> num_free;
+};
+
+}  // namespace basalt
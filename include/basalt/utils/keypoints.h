@@ -70,6 +70,21 @@ void matchDescriptors(const std::vector<std::bitset<256>>& corner_descriptors_1,
                       std::vector<std::pair<int, int>>& matches, int threshold,
                       double dist_2_best);
 
+/// Match descriptors when the relative pose T_1_2 of the two cameras is
+/// known. Only corners of kd2 in a band around the epipolar curve of a kd1
+/// corner (for depths >= min_depth) that also pass the epipolar check are
+/// compared. Ratio and mutual consistency tests are the same as in
+/// matchDescriptors. The epipolar geometry is degenerate without
+/// translation, so for a baseline below min_baseline all corners are matched
+/// like in matchDescriptors.
+void matchDescriptorsGuided(const KeypointsData& kd1, const KeypointsData& kd2,
+                            const GenericCamera<double>& cam2,
+                            const Sophus::SE3d& T_1_2,
+                            std::vector<std::pair<int, int>>& matches,
+                            int threshold, double dist_2_best,
+                            double epipolar_error_threshold, double cell_size,
+                            double min_depth = 0.1, double min_baseline = 0.01);
+
 inline void computeEssential(const Sophus::SE3d& T_0_1, Eigen::Matrix4d& E) {
   E.setZero();
   const Eigen::Vector3d t_0_1 = T_0_1.translation();
@@ -101,4 +116,13 @@ void findInliersRansac(const KeypointsData& kd1, const KeypointsData& kd2,
                        const double ransac_thresh, const int ransac_min_inliers,
                        MatchData& md);
 
+/// Estimates the pose T_w_c of a camera from 3D points in world coordinates
+/// and the unit bearing vectors of their observations. Returns the indices of
+/// the inliers.
+void findAbsolutePoseRansac(
+    const Eigen::aligned_vector<Eigen::Vector3d>& points_w,
+    const Eigen::aligned_vector<Eigen::Vector3d>& bearings,
+    const double ransac_thresh, Sophus::SE3d& T_w_c,
+    std::vector<size_t>& inliers);
+
 }  // namespace basalt
@@ -0,0 +1,95 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+namespace basalt {
+
+/// Read-only memory mapping of a whole file. The pages are loaded by the
+/// kernel on first access and shared with the page cache, so nothing is
+/// copied. Writing to the mapped memory crashes.
+class MappedFile {
+ public:
+  using Ptr = std::shared_ptr<MappedFile>;
+
+  explicit MappedFile(const std::string& path) : ptr(nullptr), num_bytes(0) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "Could not open " << path << std::endl;
+      std::abort();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) num_bytes = st.st_size;
+
+    if (num_bytes > 0) {
+      void* addr = mmap(nullptr, num_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        std::cerr << "Could not map " << path << std::endl;
+        std::abort();
+      }
+      ptr = static_cast<const uint8_t*>(addr);
+    }
+
+    // The mapping stays valid after closing the descriptor
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (ptr) munmap(const_cast<uint8_t*>(ptr), num_bytes);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* data() const { return ptr; }
+  size_t size() const { return num_bytes; }
+
+ private:
+  const uint8_t* ptr;
+  size_t num_bytes;
+};
+
+}  // namespace basalt
@@ -0,0 +1,84 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace basalt {
+
+/// Recycles the shared objects that are passed between the processing stages
+/// to avoid a heap allocation per IMU sample or frame. The pool keeps a ring
+/// of preallocated objects and hands out the next one as soon as all other
+/// owners have released it. If it is still in use, a new object takes its
+/// place in the ring. Returned objects keep the values of their previous use,
+/// so the caller has to set all fields. Only one thread may call get().
+template <class T>
+class ObjectPool {
+ public:
+  using Ptr = std::shared_ptr<T>;
+
+  explicit ObjectPool(size_t size) : objects(size), next(0) {
+    for (auto& obj : objects) obj = allocate();
+  }
+
+  Ptr get() {
+    Ptr& obj = objects[next];
+    next = (next + 1) % objects.size();
+
+    if (obj.use_count() == 1) {
+      // Synchronize with the release of the last other owner before the
+      // object is written again.
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } else {
+      obj = allocate();
+    }
+
+    return obj;
+  }
+
+ private:
+  static Ptr allocate() {
+    return std::allocate_shared<T>(Eigen::aligned_allocator<T>());
+  }
+
+  std::vector<Ptr> objects;
+  size_t next;
+};
+
+}  // namespace basalt
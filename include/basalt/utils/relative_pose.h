@@ -0,0 +1,67 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <sophus/se3.hpp>
+
+#include <basalt/utils/eigen_utils.hpp>
+
+namespace basalt {
+
+/// Minimal solver for the essential matrix from 5 bearing vector
+/// correspondences (Stewenius et al.). Every solution satisfies
+/// f1^T E f2 = 0, E = [t_1_2]_x R_1_2. Returns the number of real solutions
+/// written to E.
+int fivePointEssential(const Eigen::Matrix<double, 3, 5>& f1,
+                       const Eigen::Matrix<double, 3, 5>& f2,
+                       std::array<Eigen::Matrix3d, 10>& E);
+
+/// Relative pose of two cameras from bearing vectors f1[i] <-> f2[i] with
+/// PROSAC. Correspondences have to be sorted by quality, best first.
+/// Sampling stops early once the inlier ratio gives 99% confidence.
+/// threshold has the same unit as in opengv (1 - cos of the reprojection
+/// angle, summed over both views). T_1_2 has unit length translation,
+/// inliers are sorted indices into f1 and f2. Uses thread local scratch
+/// memory and does not allocate after warm-up.
+bool findRelativePoseRansac(const Eigen::aligned_vector<Eigen::Vector3d>& f1,
+                            const Eigen::aligned_vector<Eigen::Vector3d>& f2,
+                            double threshold, int max_iterations,
+                            Sophus::SE3d& T_1_2, std::vector<int>& inliers);
+
+}  // namespace basalt
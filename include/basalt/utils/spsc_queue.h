@@ -0,0 +1,241 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace basalt {
+
+/// Bounded single-producer/single-consumer ring buffer used for the hand-offs
+/// between the processing stages. The ring is preallocated by set_capacity(),
+/// so push() and pop() never allocate and move the elements in and out
+/// without touching their reference counts. Exactly one thread may push and
+/// exactly one thread may pop. push() blocks while the queue is full and
+/// pop() blocks while it is empty; both spin briefly before going to sleep.
+/// The end of a stream is signaled by pushing a nullptr, like with the tbb
+/// queues used before.
+template <class T>
+class SpscQueue {
+ public:
+  static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+  SpscQueue(size_t capacity = DEFAULT_CAPACITY) { set_capacity(capacity); }
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  /// Must not be called while the queue is in use. Drops queued elements.
+  void set_capacity(size_t capacity) {
+    size_t buffer_size = 1;
+    while (buffer_size < capacity) buffer_size <<= 1;
+
+    buffer.clear();
+    buffer.resize(buffer_size);
+    mask = buffer_size - 1;
+    capacity_ = capacity;
+
+    head = 0;
+    tail = 0;
+    head_cache = 0;
+    tail_cache = 0;
+    max_depth = 0;
+    num_pushed = 0;
+  }
+
+  void push(const T& value) {
+    T tmp = value;
+    push(std::move(tmp));
+  }
+
+  void push(T&& value) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+
+    if (t - head_cache >= capacity_) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache >= capacity_) {
+        wait([&] {
+          head_cache = head.load(std::memory_order_acquire);
+          return t - head_cache < capacity_;
+        });
+      }
+    }
+
+    publish(t, std::move(value));
+  }
+
+  template <typename... Args>
+  void emplace(Args&&... args) {
+    push(T(std::forward<Args>(args)...));
+  }
+
+  bool try_push(const T& value) {
+    T tmp = value;
+    return try_push(std::move(tmp));
+  }
+
+  bool try_push(T&& value) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+
+    if (t - head_cache >= capacity_) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache >= capacity_) return false;
+    }
+
+    publish(t, std::move(value));
+    return true;
+  }
+
+  void pop(T& value) {
+    const size_t h = head.load(std::memory_order_relaxed);
+
+    if (h == tail_cache) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h == tail_cache) {
+        wait([&] {
+          tail_cache = tail.load(std::memory_order_acquire);
+          return h != tail_cache;
+        });
+      }
+    }
+
+    consume(h, value);
+  }
+
+  bool try_pop(T& value) {
+    const size_t h = head.load(std::memory_order_relaxed);
+
+    if (h == tail_cache) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h == tail_cache) return false;
+    }
+
+    consume(h, value);
+    return true;
+  }
+
+  /// Number of queued elements. Exact only when called from the producer or
+  /// the consumer thread.
+  size_t size() const {
+    const size_t h = head.load(std::memory_order_acquire);
+    const size_t t = tail.load(std::memory_order_acquire);
+    return t - h;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  size_t capacity() const { return capacity_; }
+
+  /// Largest depth observed by the producer since set_capacity().
+  size_t max_size() const { return max_depth.load(std::memory_order_relaxed); }
+
+  /// Number of elements pushed since set_capacity().
+  size_t total_pushed() const {
+    return num_pushed.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr int NUM_SPINS = 64;
+
+  void publish(size_t t, T&& value) {
+    buffer[t & mask] = std::move(value);
+    tail.store(t + 1, std::memory_order_release);
+
+    const size_t depth = t + 1 - head_cache;
+    if (depth > max_depth.load(std::memory_order_relaxed))
+      max_depth.store(depth, std::memory_order_relaxed);
+    num_pushed.store(num_pushed.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+
+    notify();
+  }
+
+  void consume(size_t h, T& value) {
+    value = std::move(buffer[h & mask]);
+    // Release the slot so pooled objects are not kept alive by the ring.
+    buffer[h & mask] = T();
+    head.store(h + 1, std::memory_order_release);
+
+    notify();
+  }
+
+  template <class Pred>
+  void wait(Pred ready) {
+    for (int i = 0; i < NUM_SPINS; i++) {
+      if (ready()) return;
+      std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    num_waiting.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    cv.wait(lock, ready);
+    num_waiting.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void notify() {
+    // Pairs with the increment of num_waiting in wait(): either the waiting
+    // thread sees the new index or we see that it is waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiting.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      cv.notify_all();
+    }
+  }
+
+  std::vector<T> buffer;
+  size_t mask;
+  size_t capacity_;
+
+  // Consumer side
+  alignas(64) std::atomic<size_t> head;
+  size_t tail_cache;
+
+  // Producer side
+  alignas(64) std::atomic<size_t> tail;
+  size_t head_cache;
+  std::atomic<size_t> max_depth;
+  std::atomic<size_t> num_pushed;
+
+  alignas(64) std::atomic<int> num_waiting{0};
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+}  // namespace basalt
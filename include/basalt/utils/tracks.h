@@ -33,6 +33,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <functional>
@@ -44,6 +45,12 @@
 #include <utility>
 #include <vector>
 
+#include <tbb/blocked_range.h>
+#include <tbb/concurrent_unordered_map.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+#include <basalt/utils/assert.h>
 #include <basalt/utils/common_types.h>
 #include <basalt/utils/union_find.h>
 
@@ -51,108 +58,242 @@ namespace basalt {
 
 /// TrackBuild class creates feature tracks from matches
 struct TrackBuilder {
-  std::map<ImageFeaturePair, TrackId> map_node_to_index;
-  UnionFind uf_tree;
+  using NodeIndex = ConcurrentUnionFind::ValueType;
+
+  struct ImageFeaturePairHash {
+    size_t operator()(const ImageFeaturePair& x) const {
+      size_t seed = 0;
+      hash_combine(seed, x.first.frame_id);
+      hash_combine(seed, x.first.cam_id);
+      hash_combine(seed, x.second);
+      return seed;
+    }
+  };
+
+  /// {track index, node index} pairs used to group the nodes by track
+  using NodeEntries = std::vector<std::pair<NodeIndex, NodeIndex>>;
+
+  tbb::concurrent_unordered_map<ImageFeaturePair, NodeIndex,
+                                ImageFeaturePairHash>
+      map_node_to_index;
+  std::vector<ImageFeaturePair> nodes;
+  ConcurrentUnionFind uf_tree;
+
+  /// Nodes of every track, stored at its root. Empty for the other nodes.
+  std::vector<std::vector<NodeIndex>> track_nodes;
+
+  /// Tracks rejected by Filter, by their root. The union-find is never
+  /// changed by filtering, so Build can still extend a rejected track.
+  std::vector<uint8_t> rejected;
 
-  /// Build tracks for a given series of pairWise matches
+  /// Roots of the tracks that the last call to Build created or extended,
+  /// and the former roots of the tracks it merged into another one.
+  std::vector<NodeIndex> changed_tracks;
+  std::vector<NodeIndex> merged_tracks;
+
+  /// Build tracks for a given series of pairWise matches. Calling it again
+  /// with further matches extends the existing tracks. Only the tracks that
+  /// the matches touch are regrouped, and they have to be filtered again
+  /// before they are exported.
   void Build(const Matches& map_pair_wise_matches) {
-    // 1. We need to know how much single set we will have.
-    //   i.e each set is made of a tuple : (imageIndex, featureIndex)
-    std::set<ImageFeaturePair> allFeatures;
-    // For each couple of images list the used features
+    // 1. Flatten the image pairs, so they can be processed in parallel.
+    //  offsets[i] is the index of the first inlier of the i-th pair.
+    std::vector<const Matches::value_type*> image_pairs;
+    std::vector<size_t> offsets(1, 0);
     for (const auto& iter : map_pair_wise_matches) {
-      const auto I = iter.first.first;
-      const auto J = iter.first.second;
-      const MatchData& matchData = iter.second;
-
-      // Retrieve all shared features and add them to a set
-      for (const auto& match : matchData.inliers) {
-        allFeatures.emplace(I, match.first);
-        allFeatures.emplace(J, match.second);
-      }
+      image_pairs.emplace_back(&iter);
+      offsets.emplace_back(offsets.back() + iter.second.inliers.size());
+    }
+
+    // 2. We need to know how much single set we will have.
+    //   i.e each set is made of a tuple : (imageIndex, featureIndex)
+    std::vector<ImageFeaturePair> all_features(2 * offsets.back());
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, image_pairs.size()),
+        [&](const tbb::blocked_range<size_t>& r) {
+          for (size_t i = r.begin(); i != r.end(); ++i) {
+            const auto I = image_pairs[i]->first.first;
+            const auto J = image_pairs[i]->first.second;
+
+            size_t k = 2 * offsets[i];
+            for (const auto& match : image_pairs[i]->second.inliers) {
+              all_features[k++] = ImageFeaturePair(I, match.first);
+              all_features[k++] = ImageFeaturePair(J, match.second);
+            }
+          }
+        });
+
+    tbb::parallel_sort(all_features.begin(), all_features.end());
+    all_features.erase(std::unique(all_features.begin(), all_features.end()),
+                       all_features.end());
+
+    // 3. Build the 'flat' representation where a tuple (the node)
+    //  is attached to a unique index. Nodes of previous calls keep their
+    //  index, new nodes are numbered in sorted order.
+    std::vector<uint8_t> is_new(all_features.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, all_features.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                          is_new[i] = map_node_to_index.find(all_features[i]) ==
+                                      map_node_to_index.end();
+                        }
+                      });
+
+    const size_t old_num_nodes = nodes.size();
+    for (size_t i = 0; i < all_features.size(); i++) {
+      if (is_new[i]) nodes.emplace_back(all_features[i]);
     }
 
-    // 2. Build the 'flat' representation where a tuple (the node)
-    //  is attached to a unique index.
-    TrackId cpt = 0;
-    for (const auto& feat : allFeatures) {
-      map_node_to_index.emplace(feat, cpt);
-      ++cpt;
+    BASALT_ASSERT(nodes.size() < ConcurrentUnionFind::InvalidIndex());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(old_num_nodes, nodes.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                          map_node_to_index.insert(
+                              std::make_pair(nodes[i], NodeIndex(i)));
+                        }
+                      });
+
+    // 4. Add the node and the pairwise correpondences in the UF tree.
+    uf_tree.ExtendSets(nodes.size());
+    track_nodes.resize(nodes.size());
+    rejected.resize(nodes.size(), 0);
+    for (size_t i = old_num_nodes; i < nodes.size(); i++) {
+      track_nodes[i].assign(1, NodeIndex(i));
     }
+
+    // Tracks touched by the matches, before they are merged
+    std::vector<NodeIndex> old_roots(all_features.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, all_features.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                          old_roots[i] = uf_tree.Find(
+                              map_node_to_index.find(all_features[i])->second);
+                        }
+                      });
+    tbb::parallel_sort(old_roots.begin(), old_roots.end());
+    old_roots.erase(std::unique(old_roots.begin(), old_roots.end()),
+                    old_roots.end());
+
     // Clean some memory
-    allFeatures.clear();
+    all_features.clear();
+    all_features.shrink_to_fit();
 
-    // 3. Add the node and the pairwise correpondences in the UF tree.
-    uf_tree.InitSets(map_node_to_index.size());
+    // 5. Union of the matched features corresponding UF tree sets
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, image_pairs.size()),
+        [&](const tbb::blocked_range<size_t>& r) {
+          for (size_t i = r.begin(); i != r.end(); ++i) {
+            const auto I = image_pairs[i]->first.first;
+            const auto J = image_pairs[i]->first.second;
 
-    // 4. Union of the matched features corresponding UF tree sets
-    for (const auto& iter : map_pair_wise_matches) {
-      const auto I = iter.first.first;
-      const auto J = iter.first.second;
-      const MatchData& matchData = iter.second;
-      for (const auto& match : matchData.inliers) {
-        const ImageFeaturePair pairI(I, match.first);
-        const ImageFeaturePair pairJ(J, match.second);
-        // Link feature correspondences to the corresponding containing sets.
-        uf_tree.Union(map_node_to_index[pairI], map_node_to_index[pairJ]);
+            for (const auto& match : image_pairs[i]->second.inliers) {
+              const ImageFeaturePair pairI(I, match.first);
+              const ImageFeaturePair pairJ(J, match.second);
+              // Link feature correspondences to the corresponding containing
+              // sets.
+              uf_tree.Union(map_node_to_index.find(pairI)->second,
+                            map_node_to_index.find(pairJ)->second);
+            }
+          }
+        });
+
+    // 6. Regroup the nodes of the touched tracks by their new root
+    std::vector<size_t> node_offsets(1, 0);
+    for (NodeIndex root : old_roots) {
+      node_offsets.emplace_back(node_offsets.back() + track_nodes[root].size());
+    }
+
+    NodeEntries entries(node_offsets.back());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, old_roots.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                          size_t k = node_offsets[i];
+                          for (NodeIndex n : track_nodes[old_roots[i]]) {
+                            entries[k++] =
+                                std::make_pair(uf_tree.Find(n), n);
+                          }
+                          std::vector<NodeIndex>().swap(
+                              track_nodes[old_roots[i]]);
+                        }
+                      });
+    tbb::parallel_sort(entries.begin(), entries.end());
+
+    changed_tracks.clear();
+    std::vector<size_t> track_starts;
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (i == 0 || entries[i].first != entries[i - 1].first) {
+        changed_tracks.emplace_back(entries[i].first);
+        track_starts.emplace_back(i);
+      }
+    }
+    track_starts.emplace_back(entries.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, changed_tracks.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t t = r.begin(); t != r.end(); ++t) {
+                          std::vector<NodeIndex>& track =
+                              track_nodes[changed_tracks[t]];
+                          for (size_t i = track_starts[t];
+                               i < track_starts[t + 1]; i++) {
+                            track.emplace_back(entries[i].second);
+                          }
+                        }
+                      });
+
+    merged_tracks.clear();
+    for (NodeIndex root : old_roots) {
+      if (root < old_num_nodes && uf_tree.Parent(root) != root) {
+        merged_tracks.emplace_back(root);
       }
     }
   }
 
   /// Remove bad tracks (too short or track with ids collision)
   bool Filter(size_t minimumTrackLength = 2) {
+    Filter(Roots(), minimumTrackLength);
+    return false;
+  }
+
+  /// Filter only the given tracks, e.g. changed_tracks after Build. The
+  /// others keep their state.
+  void Filter(const std::vector<NodeIndex>& track_roots,
+              size_t minimumTrackLength) {
     // Remove bad tracks:
     // - track that are too short,
     // - track with id conflicts:
     //    i.e. tracks that have many times the same image index
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, track_roots.size()),
+        [&](const tbb::blocked_range<size_t>& r) {
+          std::vector<TimeCamId> images;
+          for (size_t t = r.begin(); t != r.end(); ++t) {
+            const NodeIndex root = track_roots[t];
 
-    // From the UF tree, create tracks of the image indexes.
-    //  If an image index appears twice the track must disappear
-    //  If a track is too short it has to be removed.
-    std::map<TrackId, std::set<TimeCamId>> tracks;
-
-    std::set<TrackId> problematic_track_id;
-    // Build tracks from the UF tree, track problematic ids.
-    for (const auto& iter : map_node_to_index) {
-      const TrackId track_id = uf_tree.Find(iter.second);
-      if (problematic_track_id.count(track_id) != 0) {
-        continue;  // Track already marked
-      }
-
-      const ImageFeaturePair& feat = iter.first;
+            images.clear();
+            for (NodeIndex n : track_nodes[root]) {
+              images.emplace_back(nodes[n].first);
+            }
+            std::sort(images.begin(), images.end());
 
-      if (tracks[track_id].count(feat.first)) {
-        problematic_track_id.insert(track_id);
-      } else {
-        tracks[track_id].insert(feat.first);
-      }
-    }
-
-    // - track that are too short,
-    for (const auto& val : tracks) {
-      if (val.second.size() < minimumTrackLength) {
-        problematic_track_id.insert(val.first);
-      }
-    }
+            bool valid = images.size() >= minimumTrackLength;
+            for (size_t i = 1; valid && i < images.size(); i++) {
+              if (!(images[i - 1] < images[i])) valid = false;
+            }
 
-    for (uint32_t& root_index : uf_tree.m_cc_parent) {
-      if (problematic_track_id.count(root_index) > 0) {
-        // reset selected root
-        uf_tree.m_cc_size[root_index] = 1;
-        root_index = UnionFind::InvalidIndex();
-      }
-    }
-    return false;
+            rejected[root] = !valid;
+          }
+        });
   }
 
   /// Return the number of connected set in the UnionFind structure (tree
-  /// forest)
+  /// forest) that were not rejected
   size_t TrackCount() const {
-    std::set<TrackId> parent_id(uf_tree.m_cc_parent.begin(),
-                                uf_tree.m_cc_parent.end());
-    // Erase the "special marker" that depicted rejected tracks
-    parent_id.erase(UnionFind::InvalidIndex());
-    return parent_id.size();
+    size_t num_tracks = 0;
+    for (size_t i = 0; i < uf_tree.GetNumNodes(); i++) {
+      if (uf_tree.Parent(i) == i && !rejected[i]) num_tracks++;
+    }
+    return num_tracks;
   }
 
   /// Export tracks as a map (each entry is a map of imageId and
@@ -160,21 +301,52 @@ struct TrackBuilder {
   ///  {TrackIndex => {imageIndex => featureIndex}}
   void Export(FeatureTracks& tracks) {
     tracks.clear();
-    for (const auto& iter : map_node_to_index) {
-      const TrackId track_id = uf_tree.Find(iter.second);
-      const ImageFeaturePair& feat = iter.first;
-      // ensure never add rejected elements (track marked as invalid)
-      if (track_id != UnionFind::InvalidIndex()) {
-        tracks[track_id].emplace(feat);
+    Export(Roots(), tracks);
+  }
+
+  /// Export only the given tracks, e.g. changed_tracks after Build and
+  /// Filter. Rejected ones are removed from tracks, the other entries of
+  /// tracks are not changed.
+  void Export(const std::vector<NodeIndex>& track_roots,
+              FeatureTracks& tracks) {
+    std::vector<FeatureTrack> track_features(track_roots.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, track_roots.size()),
+                      [&](const tbb::blocked_range<size_t>& r) {
+                        for (size_t t = r.begin(); t != r.end(); ++t) {
+                          const NodeIndex root = track_roots[t];
+                          if (rejected[root]) continue;
+
+                          for (NodeIndex n : track_nodes[root]) {
+                            track_features[t].emplace(nodes[n]);
+                          }
+                        }
+                      });
+
+    tracks.reserve(tracks.size() + track_roots.size());
+    for (size_t t = 0; t < track_roots.size(); t++) {
+      if (rejected[track_roots[t]]) {
+        tracks.erase(track_roots[t]);
+      } else {
+        tracks[track_roots[t]] = std::move(track_features[t]);
       }
     }
   }
+
+  /// Roots of all tracks
+  std::vector<NodeIndex> Roots() const {
+    std::vector<NodeIndex> roots;
+    for (size_t i = 0; i < uf_tree.GetNumNodes(); i++) {
+      if (uf_tree.Parent(i) == i) roots.emplace_back(i);
+    }
+    return roots;
+  }
 };
 
 /// Find common tracks between images.
-bool GetTracksInImages(const std::set<TimeCamId>& image_ids,
-                       const FeatureTracks& all_tracks,
-                       std::vector<TrackId>& shared_track_ids) {
+inline bool GetTracksInImages(const std::set<TimeCamId>& image_ids,
+                              const FeatureTracks& all_tracks,
+                              std::vector<TrackId>& shared_track_ids) {
   shared_track_ids.clear();
 
   // Go along the tracks
@@ -197,18 +369,19 @@ bool GetTracksInImages(const std::set<TimeCamId>& image_ids,
 }
 
 /// Find all tracks in an image.
-bool GetTracksInImage(const TimeCamId& image_id,
-                      const FeatureTracks& all_tracks,
-                      std::vector<TrackId>& track_ids) {
+inline bool GetTracksInImage(const TimeCamId& image_id,
+                             const FeatureTracks& all_tracks,
+                             std::vector<TrackId>& track_ids) {
   std::set<TimeCamId> image_set;
   image_set.insert(image_id);
   return GetTracksInImages(image_set, all_tracks, track_ids);
 }
 
 /// Find shared tracks between map and image
-bool GetSharedTracks(const TimeCamId& image_id, const FeatureTracks& all_tracks,
-                     const Landmarks& landmarks,
-                     std::vector<TrackId>& track_ids) {
+inline bool GetSharedTracks(const TimeCamId& image_id,
+                            const FeatureTracks& all_tracks,
+                            const Landmarks& landmarks,
+                            std::vector<TrackId>& track_ids) {
   track_ids.clear();
   for (const auto& kv : landmarks) {
     const TrackId trackId = kv.first;
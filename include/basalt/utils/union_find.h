@@ -12,9 +12,11 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <limits>
 #include <numeric>
+#include <utility>
 #include <vector>
 
 // Union-Find/Disjoint-Set data structure
@@ -59,6 +61,17 @@ struct UnionFind {
     m_cc_rank.resize(num_cc, 0);
   }
 
+  // Grow the UF structure to num_cc nodes, keeping the existing sets
+  void ExtendSets(const ValueType num_cc) {
+    const ValueType old_num_cc = m_cc_parent.size();
+    if (num_cc <= old_num_cc) return;
+
+    m_cc_size.resize(num_cc, 1);
+    m_cc_parent.resize(num_cc);
+    std::iota(m_cc_parent.begin() + old_num_cc, m_cc_parent.end(), old_num_cc);
+    m_cc_rank.resize(num_cc, 0);
+  }
+
   // Return the number of nodes that have been initialized in the UF tree
   std::size_t GetNumNodes() const { return m_cc_size.size(); }
 
@@ -92,3 +105,91 @@ struct UnionFind {
     }
   }
 };
+
+// Concurrent variant of the Union-Find structure
+//--
+// Find and Union can be called from multiple threads at the same time. Union
+// is lock-free: the root with the larger index is linked below the root with
+// the smaller one by a compare-and-swap on its parent. Find uses path halving,
+// a failed compression step is simply skipped.
+// Linking by index instead of by rank makes the result independent of the
+// thread schedule: the representative of a set is always its smallest node.
+//--
+struct ConcurrentUnionFind {
+  using ValueType = uint32_t;
+
+  // Special Value for invalid parent index
+  static ValueType InvalidIndex() {
+    return std::numeric_limits<ValueType>::max();
+  }
+
+  // Atomic parent that can be stored in a std::vector. Copying is not
+  // synchronized and must not overlap with modifications.
+  struct Node {
+    std::atomic<ValueType> parent;
+
+    Node() : parent(0) {}
+    Node(const Node& other)
+        : parent(other.parent.load(std::memory_order_relaxed)) {}
+    Node& operator=(const Node& other) {
+      parent.store(other.parent.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+      return *this;
+    }
+  };
+
+  // Parent 'pointer tree' where each node holds a reference to its parent
+  std::vector<Node> m_cc_parent;
+
+  // Grow the UF structure to num_cc nodes, keeping the existing sets. Not
+  // thread-safe.
+  void ExtendSets(const ValueType num_cc) {
+    const ValueType old_num_cc = m_cc_parent.size();
+    if (num_cc <= old_num_cc) return;
+
+    m_cc_parent.resize(num_cc);
+    for (ValueType i = old_num_cc; i < num_cc; i++) {
+      m_cc_parent[i].parent.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Return the number of nodes that have been initialized in the UF tree
+  std::size_t GetNumNodes() const { return m_cc_parent.size(); }
+
+  ValueType Parent(ValueType i) const {
+    return m_cc_parent[i].parent.load(std::memory_order_relaxed);
+  }
+
+  // Return the representative set id of I nth component
+  ValueType Find(ValueType i) {
+    while (true) {
+      ValueType p = Parent(i);
+      if (p == i) return p;
+
+      const ValueType gp = Parent(p);
+      if (gp == p) return gp;
+
+      // Path halving
+      m_cc_parent[i].parent.compare_exchange_weak(p, gp,
+                                                  std::memory_order_relaxed);
+      i = gp;
+    }
+  }
+
+  // Replace sets containing I and J with their union
+  void Union(ValueType i, ValueType j) {
+    while (true) {
+      i = Find(i);
+      j = Find(j);
+      // Already in the same set. Nothing to do
+      if (i == j) return;
+
+      if (i < j) std::swap(i, j);
+
+      // i is the larger root. Fails if i got linked by another thread in the
+      // meantime, then retry with the new roots.
+      ValueType expected = i;
+      if (m_cc_parent[i].parent.compare_exchange_strong(expected, j)) return;
+    }
+  }
+};
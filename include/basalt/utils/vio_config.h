@@ -76,6 +76,11 @@ struct VioConfig {
   double vio_init_ba_weight;
   double vio_init_bg_weight;
 
+  double vio_reintegrate_bg_thresh;
+  double vio_reintegrate_ba_thresh;
+
+  bool vio_marg_data_features;
+
   double mapper_obs_std_dev;
   double mapper_obs_huber_thresh;
   int mapper_detection_num_points;
@@ -86,6 +91,12 @@ struct VioConfig {
   double mapper_min_track_length;
   double mapper_max_hamming_distance;
   double mapper_second_best_test_ratio;
+  bool mapper_guided_matching;
+  double mapper_guided_epipolar_error;
+  double mapper_guided_cell_size;
+  double mapper_guided_min_depth;
+  double mapper_guided_max_time_diff;
+  double mapper_guided_min_baseline;
   int mapper_bow_num_bits;
   double mapper_min_triangulation_dist;
   bool mapper_no_factor_weights;
@@ -94,5 +105,22 @@ struct VioConfig {
   bool mapper_use_lm;
   double mapper_lm_lambda_min;
   double mapper_lm_lambda_max;
+  double mapper_local_window;
+  bool mapper_pose_graph_init;
+  double mapper_loop_min_time_diff;
+  double mapper_loop_pos_std_dev;
+  double mapper_loop_rot_std_dev;
+  double mapper_session_align_pos_thresh;
+  double mapper_session_align_rot_thresh;
+  int mapper_session_align_min_inliers;
+  bool mapper_partitioned;
+  double mapper_submap_size;
+  double mapper_submap_overlap;
+  int mapper_submap_iterations;
+
+  double loop_exclusion_window;
+  double loop_latency_budget;
+  double loop_min_score;
+  int loop_num_candidates;
 };
 }  // namespace basalt
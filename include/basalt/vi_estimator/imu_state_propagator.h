@@ -0,0 +1,99 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <memory>
+#include <thread>
+
+#include <Eigen/Dense>
+#include <sophus/se3.hpp>
+
+#include <basalt/imu/preintegration.h>
+#include <basalt/utils/imu_types.h>
+#include <basalt/utils/object_pool.h>
+#include <basalt/utils/spsc_queue.h>
+#include <basalt/calibration/calibration.hpp>
+
+namespace basalt {
+
+/// Propagates the latest optimized VIO state with every incoming IMU sample
+/// and publishes the result at IMU rate. The propagator sits in front of the
+/// estimator: samples are consumed from imu_data_queue, forwarded unchanged
+/// to out_imu_queue and integrated on top of the most recent state received
+/// through state_queue. Whenever a new optimized state arrives the
+/// propagation is re-anchored to it and the buffered samples newer than the
+/// state are re-integrated.
+class ImuStatePropagator {
+ public:
+  typedef std::shared_ptr<ImuStatePropagator> Ptr;
+
+  ImuStatePropagator(const Eigen::Vector3d& g,
+                     const basalt::Calibration<double>& calib);
+
+  ~ImuStatePropagator() { processing_thread->join(); }
+
+  SpscQueue<ImuData<double>::Ptr> imu_data_queue;
+  SpscQueue<PoseVelBiasState<double>::Ptr> state_queue;
+
+  SpscQueue<ImuData<double>::Ptr>* out_imu_queue = nullptr;
+  SpscQueue<PoseVelBiasState<double>::Ptr>* out_state_queue = nullptr;
+
+ private:
+  void processingLoop();
+
+  // Integrate a single bias- and gravity-corrected sample into curr_state.
+  void propagate(const ImuData<double>& data);
+
+  // Restart the propagation from anchor and replay the buffered samples.
+  void reanchor(const PoseVelBiasState<double>& anchor);
+
+  static constexpr size_t MAX_BUFFERED_SAMPLES = 2000;
+
+  Eigen::Vector3d g;
+  basalt::Calibration<double> calib;
+
+  // Calibrated samples that are newer than the current anchor.
+  Eigen::aligned_deque<ImuData<double>> imu_buffer;
+
+  bool anchored;
+  PoseVelBiasState<double> anchor_state;
+  PoseVelState<double> curr_state;
+
+  ObjectPool<PoseVelBiasState<double>> state_pool;
+
+  std::shared_ptr<std::thread> processing_thread;
+};
+
+}  // namespace basalt
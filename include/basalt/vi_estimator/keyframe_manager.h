@@ -0,0 +1,94 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include <basalt/utils/eigen_utils.hpp>
+
+namespace basalt {
+
+/// Keeps the positions of the keyframes in the optimization window and
+/// caches the pairwise terms 1 / (|p_i - p_j| + 1e-5) of the keyframe
+/// marginalization score. Only the terms of keyframes whose position changed
+/// are recomputed, so selecting the keyframe to marginalize costs O(K)
+/// instead of O(K^2) pose lookups and norms. Used by KeypointVioEstimator
+/// and KeypointVoEstimator.
+class KeyframeManager {
+ public:
+  KeyframeManager() : sums_dirty(false) {}
+
+  /// Add a keyframe or update its position.
+  void setPosition(int64_t kf_id, const Eigen::Vector3d& pos);
+
+  /// Remove a keyframe.
+  void erase(int64_t kf_id);
+
+  /// Remove all keyframes that are not in kf_ids.
+  void retain(const std::set<int64_t>& kf_ids);
+
+  size_t size() const { return slots.size(); }
+
+  /// Keyframe with the lowest score among all but the two newest keyframes.
+  /// The score of keyframe i is sqrt(|p_i - p_last|) * sum_j 1 / (|p_i - p_j|
+  /// + 1e-5), where j runs over the same set of keyframes and p_last is the
+  /// position of the newest keyframe. Returns -1 if there are less than
+  /// three keyframes.
+  int64_t selectKeyframeToMarg();
+
+ private:
+  void updateDistances();
+
+  static constexpr double DIST_EPS = 1e-5;
+
+  // Keyframe id to slot in the cached matrices, ordered by id.
+  std::map<int64_t, size_t> slots;
+  std::vector<size_t> free_slots;
+
+  Eigen::aligned_vector<Eigen::Vector3d> positions;
+  std::vector<char> changed;
+
+  // Pairwise terms and their row sums, indexed by slot. Rows and columns of
+  // unused slots are zero.
+  Eigen::MatrixXd inv_dist;
+  Eigen::VectorXd row_sum;
+  bool sums_dirty;
+};
+
+}  // namespace basalt
@@ -49,6 +49,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <basalt/utils/sophus_utils.hpp>
 
 #include <basalt/vi_estimator/ba_base.h>
+#include <basalt/vi_estimator/keyframe_manager.h>
 #include <basalt/vi_estimator/vio_estimator.h>
 
 namespace basalt {
@@ -110,6 +111,21 @@ class KeypointVioEstimator : public VioEstimatorBase,
 
   void optimize();
 
+  // Re-integrate the IMU measurements whose bias drifted past the threshold.
+  void reintegrateImuMeasurements();
+
+  // Re-integrates every measurement in imu_meas from its samples in
+  // imu_meas_data when the bias of its start state moved by at least
+  // bg_thresh or ba_thresh. Returns the number of re-integrated measurements.
+  static int reintegrateImuMeasurements(
+      const Eigen::aligned_map<int64_t, PoseVelBiasStateWithLin<double>>&
+          states,
+      Eigen::aligned_map<int64_t, IntegratedImuMeasurement<double>>& imu_meas,
+      const Eigen::aligned_map<int64_t, Eigen::aligned_vector<ImuData<double>>>&
+          imu_meas_data,
+      const Eigen::Vector3d& accel_cov, const Eigen::Vector3d& gyro_cov,
+      double bg_thresh, double ba_thresh);
+
   void checkMargNullspace() const;
 
   int64_t get_t_ns() const {
@@ -191,11 +207,19 @@ class KeypointVioEstimator : public VioEstimatorBase,
   bool take_kf;
   int frames_after_kf;
   std::set<int64_t> kf_ids;                                                   //滑窗内的kf_ids
+  KeyframeManager kf_manager;
 
   int64_t last_state_t_ns;
   
   Eigen::aligned_map<int64_t, IntegratedImuMeasurement<double>> imu_meas;     //保存所有的IMU 测量值
 
+  // Calibrated IMU samples of every measurement in imu_meas. Used to
+  // re-integrate when the bias estimate drifts too far from the bias the
+  // measurement was integrated with. The samples of every interval in the
+  // window are kept in memory until the measurement is marginalized.
+  Eigen::aligned_map<int64_t, Eigen::aligned_vector<ImuData<double>>>
+      imu_meas_data;
+
   const Eigen::Vector3d g;
 
   // Input
@@ -49,6 +49,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <basalt/utils/sophus_utils.hpp>
 
 #include <basalt/vi_estimator/ba_base.h>
+#include <basalt/vi_estimator/keyframe_manager.h>
 #include <basalt/vi_estimator/vio_estimator.h>
 
 namespace basalt {
@@ -167,6 +168,7 @@ class KeypointVoEstimator : public VioEstimatorBase,
   bool take_kf;
   int frames_after_kf;
   std::set<int64_t> kf_ids;
+  KeyframeManager kf_manager;
 
   int64_t last_state_t_ns;
 
@@ -35,7 +35,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include <memory>
+#include <set>
 #include <thread>
+#include <unordered_set>
 
 #include <Eigen/Dense>
 #include <sophus/se3.hpp>
@@ -54,6 +56,8 @@ namespace basalt {
 template <size_t N>
 class HashBow;
 
+struct TrackBuilder;
+
 class NfrMapper : public BundleAdjustmentBase {
  public:
   using Ptr = std::shared_ptr<NfrMapper>;
@@ -158,15 +162,85 @@ class NfrMapper : public BundleAdjustmentBase {
     const Eigen::aligned_map<int64_t, PoseStateWithLin<double>>* frame_poses;
   };
 
+  /// Subset of the problem that is optimized with the poses of
+  /// active_frames. Contains the landmarks observed in the active frames and
+  /// all poses observing them, the poses that are not active are fixed.
+  struct LocalProblem {
+    std::set<int64_t> active_frames;
+    std::set<int64_t> frames;
+    std::unordered_set<int> landmarks;
+
+    AbsOrderMap aom;
+    Eigen::aligned_map<
+        TimeCamId, Eigen::aligned_map<
+                       TimeCamId, Eigen::aligned_vector<KeypointObservation>>>
+        obs;
+    Eigen::aligned_vector<RollPitchFactor> roll_pitch_factors;
+    Eigen::aligned_vector<RelPoseFactor> rel_pose_factors;
+    std::vector<int> fixed_idx;
+  };
+
   NfrMapper(const basalt::Calibration<double>& calib, const VioConfig& config);
 
   void addMargData(basalt::MargData::Ptr& data);
 
+  /// Adds a recording to a multi-session map and returns its index. Frames
+  /// of all sessions have session-qualified ids: the session index above
+  /// SESSION_ID_SHIFT and the time since start_t_ns below. Without sessions,
+  /// frame ids are timestamps.
+  size_t addSession(int64_t start_t_ns);
+
+  int64_t sessionFrameId(size_t session, int64_t t_ns) const;
+
+  /// Session index and timestamp of a frame id
+  std::pair<size_t, int64_t> splitFrameId(int64_t frame_id) const;
+
+  /// Replaces the timestamps in m by the frame ids of the session. Must be
+  /// called before addMargData.
+  void toSessionFrameIds(basalt::MargData& m, size_t session) const;
+
+  /// Moves the poses of every session to the world frame of session 0 with
+  /// the loop closure factors between sessions. Has to run before the
+  /// landmarks are triangulated, since every session starts in its own world
+  /// frame. With IMU only yaw and translation are changed, so the roll-pitch
+  /// factors remain valid. Every loop closure to an aligned session proposes
+  /// a transformation; the one that agrees with most other closures wins and
+  /// is refined over them, so single false matches are ignored. A session is
+  /// only aligned once config.mapper_session_align_min_inliers closures agree,
+  /// otherwise it is deferred to a later call. Sessions aligned by an earlier
+  /// call are not moved again.
+  void alignSessions();
+
   void processMargData(basalt::MargData& m);
 
   bool extractNonlinearFactors(basalt::MargData& m);
 
-  void optimize(int num_iterations = 10);
+  /// Optimize all poses and landmarks. If active_frames is given, only the
+  /// landmarks observed in these frames and the poses of these frames are
+  /// optimized, all other poses are kept fixed.
+  void optimize(int num_iterations = 10,
+                const std::set<int64_t>* active_frames = nullptr);
+
+  void setupLocalProblem(const std::set<int64_t>& active_frames,
+                         LocalProblem& lp) const;
+
+  /// Levenberg-Marquardt on a local problem. Writes only the active poses
+  /// and the landmarks of the problem, so problems that do not share them
+  /// can be optimized in parallel.
+  void optimizeLocalProblem(LocalProblem& lp, int num_iterations);
+
+  /// Alternative to optimize() for large maps. The map is split into
+  /// consecutive submaps of config.mapper_submap_size seconds. Submaps that
+  /// share no landmark are optimized in parallel, followed by a solve over
+  /// the frames within config.mapper_submap_overlap seconds of a submap
+  /// boundary. Each sweep is one pass of block Gauss-Seidel; the global
+  /// system is never built.
+  void optimizePartitioned(int num_sweeps = 3);
+
+  /// Optimize only the poses over the roll-pitch, relative pose and loop
+  /// closure factors. Much cheaper than optimize() and can be used to
+  /// initialize the poses before the landmarks are triangulated.
+  void optimizePoseGraph(int num_iterations = 20);
 
   Eigen::aligned_map<int64_t, PoseStateWithLin<double>>& getFramePoses();
 
@@ -174,21 +248,59 @@ class NfrMapper : public BundleAdjustmentBase {
 
   void computeRollPitch(double& roll_pitch_error);
 
+  void computeLoopClosure(double& loop_error);
+
   void detect_keypoints();
 
+  void detect_keypoints(const std::vector<int64_t>& frame_ids);
+
   // Feature matching and inlier filtering for stereo pairs with known pose
   void match_stereo();
 
+  void match_stereo(const std::vector<int64_t>& frame_ids);
+
   void match_all();
 
+  // Match the given images against older images from the BoW database
+  void match_all(const std::vector<TimeCamId>& query_ids);
+
+  // Metric relative poses between matched frames that are far apart in
+  // time. Points are triangulated from the stereo matches of one frame and
+  // the pose of the other frame is estimated with PnP.
+  void compute_loop_closure_factors();
+
+  // Replaces only the loop closures of the given frames, from the matches
+  // that involve them
+  void compute_loop_closure_factors(const std::vector<int64_t>& frame_ids);
+
   void build_tracks();
 
   void setup_opt();
 
+  // Triangulate the landmark of a track and add it with all observations.
+  // warm_start is used instead if it has the same host.
+  bool add_track_landmark(TrackId track_id, const FeatureTrack& track,
+                          const KeypointPosition* warm_start = nullptr);
+
+  /// Incremental alternative to running detect_keypoints, match_stereo,
+  /// match_all, build_tracks, setup_opt and optimize again after adding
+  /// MargData. Features are detected and matched only for the new frames,
+  /// the existing tracks are extended, and only the new frames, a local
+  /// window of config.mapper_local_window seconds before them and the
+  /// frames connected to them by loop closures are optimized. Sessions are
+  /// aligned with alignSessions before new landmarks are added. Only the
+  /// tracks touched by new matches are filtered, exported and triangulated
+  /// again. The tracks and landmarks are the same as after the batch run;
+  /// the poses differ only because frames outside the optimized window keep
+  /// the estimate of earlier updates, and optimize() over all frames
+  /// converges to the batch result.
+  void update(int num_iterations = 10);
+
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
   Eigen::aligned_vector<RollPitchFactor> roll_pitch_factors;
   Eigen::aligned_vector<RelPoseFactor> rel_pose_factors;
+  Eigen::aligned_vector<RelPoseFactor> loop_closure_factors;
 
   std::unordered_map<int64_t, OpticalFlowInput::Ptr> img_data;
 
@@ -199,6 +311,26 @@ class NfrMapper : public BundleAdjustmentBase {
   FeatureTracks feature_tracks;
 
   std::shared_ptr<HashBow<256>> hash_bow_database;
+  size_t num_frozen_frames = 0;
+  size_t num_dynamic_frames = 0;
+
+  // Frames for which keypoints were detected
+  std::set<int64_t> processed_frames;
+
+  // All tracks including the rejected ones, extended by update()
+  std::shared_ptr<TrackBuilder> track_builder;
+
+  // Damping that keeps poses outside a local optimization fixed
+  static constexpr double FIXED_POSE_DAMPING = 1e12;
+
+  // Start time of every session, empty for a single recording
+  std::vector<int64_t> session_start_t_ns;
+
+  // Sessions that are in the world frame of session 0
+  std::vector<bool> session_aligned;
+
+  // Sessions are 2^56 ns (2.3 years) apart in the frame ids
+  static constexpr int SESSION_ID_SHIFT = 56;
 
   VioConfig config;
 
@@ -0,0 +1,124 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include <tbb/concurrent_queue.h>
+
+#include <basalt/utils/common_types.h>
+#include <basalt/utils/imu_types.h>
+#include <basalt/utils/vio_config.h>
+
+namespace basalt {
+
+template <size_t N>
+class HashBow;
+
+struct LoopClosureCandidate {
+  using Ptr = std::shared_ptr<LoopClosureCandidate>;
+
+  TimeCamId query;  // image of the newly marginalized keyframe
+  TimeCamId match;  // older image that looks similar
+  double score;
+};
+
+/// Online place recognition while VIO is running. Consumes the MargData
+/// produced by the estimator and forwards it unchanged to out_marg_queue.
+/// The images of every marginalized keyframe are added to a HashBow
+/// database and queried against keyframes older than
+/// config.loop_exclusion_window. Matches with a score above
+/// config.loop_min_score are published to out_loop_queue. Keyframes that
+/// waited longer than config.loop_latency_budget before processing starts
+/// are not queried, so the candidates never lag behind the estimator. They
+/// are still added to the database and can be matched by later keyframes.
+class PlaceRecognizer {
+ public:
+  using Ptr = std::shared_ptr<PlaceRecognizer>;
+
+  PlaceRecognizer(const VioConfig& config);
+  ~PlaceRecognizer();
+
+  tbb::concurrent_bounded_queue<MargData::Ptr> in_marg_queue;
+
+  tbb::concurrent_bounded_queue<MargData::Ptr>* out_marg_queue = nullptr;
+  tbb::concurrent_bounded_queue<LoopClosureCandidate::Ptr>* out_loop_queue =
+      nullptr;
+
+  /// Keyframes that were queried and added to the database
+  size_t num_processed() const { return num_processed_keyframes; }
+  /// Keyframes only added to the database because they were late, or lost
+  /// entirely because the job queue was full
+  size_t num_dropped() const { return num_dropped_keyframes; }
+
+  /// Maximum time from receiving a keyframe to publishing its candidates.
+  double max_latency() const { return max_latency_s; }
+
+ private:
+  struct KeyframeJob {
+    int64_t t_ns;
+    OpticalFlowResult::Ptr opt_flow_res;
+    std::chrono::steady_clock::time_point received;
+  };
+
+  void forwardLoop();
+  void processingLoop();
+
+  void processKeyframe(const KeyframeJob& job, bool query);
+
+  // Minimal number of keyframes in the dynamic part of the database before
+  // it is merged into the compact index.
+  static constexpr size_t MIN_KEYFRAMES_TO_FREEZE = 100;
+
+  VioConfig config;
+
+  std::shared_ptr<HashBow<256>> hash_bow_database;
+  size_t num_frozen_keyframes;
+  size_t num_dynamic_keyframes;
+
+  tbb::concurrent_bounded_queue<std::shared_ptr<KeyframeJob>> job_queue;
+
+  std::atomic<size_t> num_processed_keyframes;
+  std::atomic<size_t> num_dropped_keyframes;
+  std::atomic<double> max_latency_s;
+
+  std::shared_ptr<std::thread> forward_thread;
+  std::shared_ptr<std::thread> processing_thread;
+};
+
+}  // namespace basalt
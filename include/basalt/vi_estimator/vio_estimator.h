@@ -38,6 +38,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <basalt/optical_flow/optical_flow.h>
 #include <basalt/utils/imu_types.h>
+#include <basalt/utils/object_pool.h>
+#include <basalt/utils/spsc_queue.h>
 
 namespace basalt {
 
@@ -66,7 +68,9 @@ class VioEstimatorBase {
   VioEstimatorBase()
       : out_state_queue(nullptr),
         out_marg_queue(nullptr),
-        out_vis_queue(nullptr) {
+        out_vis_queue(nullptr),
+        out_imu_propagator_queue(nullptr),
+        out_state_pool(64) {
     vision_data_queue.set_capacity(10);
     imu_data_queue.set_capacity(300);
     last_processed_t_ns = 0;
@@ -76,15 +80,21 @@ class VioEstimatorBase {
   std::atomic<int64_t> last_processed_t_ns;
   std::atomic<bool> finished;
 
-  tbb::concurrent_bounded_queue<OpticalFlowResult::Ptr> vision_data_queue;
-  tbb::concurrent_bounded_queue<ImuData<double>::Ptr> imu_data_queue;
+  SpscQueue<OpticalFlowResult::Ptr> vision_data_queue;
+  SpscQueue<ImuData<double>::Ptr> imu_data_queue;
 
-  tbb::concurrent_bounded_queue<PoseVelBiasState<double>::Ptr>*
-      out_state_queue = nullptr;
+  SpscQueue<PoseVelBiasState<double>::Ptr>* out_state_queue = nullptr;
   tbb::concurrent_bounded_queue<MargData::Ptr>* out_marg_queue = nullptr;
   tbb::concurrent_bounded_queue<VioVisualizationData::Ptr>* out_vis_queue =
       nullptr;
 
+  // Optimized states used to re-anchor the IMU-rate state propagation.
+  SpscQueue<PoseVelBiasState<double>::Ptr>* out_imu_propagator_queue =
+      nullptr;
+
+  // Recycled output states, only used by the processing thread.
+  ObjectPool<PoseVelBiasState<double>> out_state_pool;
+
   virtual void initialize(int64_t t_ns, const Sophus::SE3d& T_w_i,
                           const Eigen::Vector3d& vel_w_i,
                           const Eigen::Vector3d& bg,
@@ -0,0 +1,90 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <iostream>
+
+#include <CLI/CLI.hpp>
+
+#include <basalt/io/dataset_io.h>
+#include <basalt/io/dataset_io_basalt_cache.h>
+#include <basalt/io/dataset_io_prefetch.h>
+
+// Converts a dataset to the basalt_cache format, which can be replayed
+// without parsing and decoding images.
+int main(int argc, char** argv) {
+  std::string dataset_path;
+  std::string dataset_type;
+  std::string cache_path;
+  bool compress = false;
+  int num_threads = 4;
+
+  CLI::App app{"Convert a dataset to a basalt_cache dataset."};
+
+  app.add_option("--dataset-path", dataset_path, "Path to dataset.")
+      ->required();
+  app.add_option("--dataset-type", dataset_type,
+                 "Dataset type <euroc, bag, uzh, kitti>.")
+      ->required();
+  app.add_option("--cache-path", cache_path,
+                 "Path to the folder where the cache will be written.")
+      ->required();
+  app.add_option("--compress", compress, "LZ4 compress the images.");
+  app.add_option("--num-threads", num_threads,
+                 "Number of threads decoding the images.");
+
+  try {
+    app.parse(argc, argv);
+  } catch (const CLI::ParseError& e) {
+    return app.exit(e);
+  }
+
+  basalt::DatasetIoInterfacePtr dataset_io =
+      basalt::DatasetIoFactory::getDatasetIo(dataset_type);
+
+  dataset_io->read(dataset_path);
+
+  basalt::VioDatasetPtr vio_dataset = dataset_io->get_data();
+  if (num_threads > 0) {
+    vio_dataset = std::make_shared<basalt::PrefetchVioDataset>(
+        vio_dataset, 4 * num_threads, num_threads);
+  }
+
+  basalt::BasaltCacheIO::save(vio_dataset, cache_path, compress);
+
+  std::cout << "Saved " << vio_dataset->get_image_timestamps().size()
+            << " frames to " << cache_path << std::endl;
+
+  return 0;
+}
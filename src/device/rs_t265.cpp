@@ -135,13 +135,12 @@ void RsT265Device::start() {
             Eigen::Vector3d accel_interpolated =
                 w0 * prev_accel_data->data + w1 * d.data;
 
-            basalt::ImuData<double>::Ptr data;
-            data.reset(new basalt::ImuData<double>);
+            basalt::ImuData<double>::Ptr data = imu_data_pool.get();
             data->t_ns = gyro_data.timestamp * 1e6;
             data->accel = accel_interpolated;
             data->gyro = gyro_data.data;
 
-            if (imu_data_queue) imu_data_queue->push(data);
+            if (imu_data_queue) imu_data_queue->push(std::move(data));
           }
 
           prev_accel_data.reset(new RsIMUData(d));
@@ -204,6 +203,10 @@ void RsT265Device::start() {
 }
 
 void RsT265Device::stop() {
+  // The queues have a single producer. Stopping the pipeline waits for the
+  // running callbacks, only then this thread may push the terminators.
+  if (profile) pipe.stop();
+
   if (image_data_queue) image_data_queue->push(nullptr);
   if (imu_data_queue) imu_data_queue->push(nullptr);
 }
@@ -0,0 +1,171 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <basalt/io/dataset_io_prefetch.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace basalt {
+
+PrefetchVioDataset::PrefetchVioDataset(const VioDatasetPtr &dataset,
+                                       size_t window_size, size_t num_threads,
+                                       bool mipmap_rows)
+    : dataset(dataset),
+      slots(window_size),
+      next_idx(0),
+      next_job(0),
+      last_miss(std::numeric_limits<size_t>::max() - 1),
+      stop(false) {
+  BASALT_ASSERT(window_size > 0 && num_threads > 0);
+
+  // Buffers of the frames in the window and in the processing queues
+  dataset->set_image_pool(std::make_shared<ImagePool<uint16_t>>(
+      2 * window_size * dataset->get_num_cams(), mipmap_rows));
+
+  {
+    std::lock_guard<std::mutex> lk(m);
+    fill_window();
+  }
+
+  for (size_t i = 0; i < num_threads; i++) {
+    decode_threads.emplace_back(&PrefetchVioDataset::decode_func, this);
+  }
+}
+
+PrefetchVioDataset::~PrefetchVioDataset() {
+  {
+    std::lock_guard<std::mutex> lk(m);
+    stop = true;
+  }
+  cv_job.notify_all();
+
+  for (auto &t : decode_threads) t.join();
+}
+
+std::vector<ImageData> PrefetchVioDataset::get_image_data(int64_t t_ns) {
+  const std::vector<int64_t> &timestamps = dataset->get_image_timestamps();
+
+  std::unique_lock<std::mutex> lk(m);
+
+  auto it = std::lower_bound(timestamps.begin(), timestamps.end(), t_ns);
+  const bool found = it != timestamps.end() && *it == t_ns;
+  const size_t idx = it - timestamps.begin();
+
+  if (!found || idx < next_idx || idx >= next_job) {
+    // Two consecutive misses without a hit in between mean that the caller
+    // reads in order from a new position, so the window moves there.
+    if (found && idx == last_miss + 1) {
+      for (size_t i = next_idx; i < next_job; i++) {
+        slots[i % slots.size()] = Slot();
+      }
+      jobs.clear();
+      cv_ready.notify_all();
+
+      next_idx = next_job = idx + 1;
+      fill_window();
+    }
+    last_miss = idx;
+
+    lk.unlock();
+    return dataset->get_image_data(t_ns);
+  }
+
+  Slot &slot = slots[idx % slots.size()];
+  cv_ready.wait(lk, [&] { return slot.ready || slot.t_ns != t_ns; });
+
+  // The window was moved by another caller while waiting
+  if (slot.t_ns != t_ns) {
+    lk.unlock();
+    return dataset->get_image_data(t_ns);
+  }
+
+  std::vector<ImageData> res = std::move(slot.data);
+
+  // Reads of another caller, e.g. the GUI showing a frame behind the feeder,
+  // must not move the window.
+  last_miss = std::numeric_limits<size_t>::max() - 1;
+
+  // Release this frame and the skipped ones
+  for (size_t i = next_idx; i <= idx; i++) {
+    slots[i % slots.size()] = Slot();
+  }
+  while (!jobs.empty() && jobs.front().first <= idx) jobs.pop_front();
+
+  next_idx = idx + 1;
+  fill_window();
+
+  return res;
+}
+
+void PrefetchVioDataset::fill_window() {
+  const std::vector<int64_t> &timestamps = dataset->get_image_timestamps();
+
+  const size_t end = std::min(timestamps.size(), next_idx + slots.size());
+  for (; next_job < end; next_job++) {
+    Slot &slot = slots[next_job % slots.size()];
+    slot.t_ns = timestamps[next_job];
+    slot.ready = false;
+    slot.data.clear();
+
+    jobs.emplace_back(next_job, slot.t_ns);
+  }
+
+  cv_job.notify_all();
+}
+
+void PrefetchVioDataset::decode_func() {
+  while (true) {
+    std::unique_lock<std::mutex> lk(m);
+    cv_job.wait(lk, [&] { return stop || !jobs.empty(); });
+    if (stop) return;
+
+    const std::pair<size_t, int64_t> job = jobs.front();
+    jobs.pop_front();
+    lk.unlock();
+
+    std::vector<ImageData> data = dataset->get_image_data(job.second);
+
+    lk.lock();
+    Slot &slot = slots[job.first % slots.size()];
+    if (slot.t_ns == job.second && !slot.ready) {
+      slot.data = std::move(data);
+      slot.ready = true;
+      cv_ready.notify_all();
+    }
+  }
+}
+
+}  // namespace basalt
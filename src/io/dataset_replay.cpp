@@ -0,0 +1,222 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <basalt/io/dataset_replay.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <basalt/utils/assert.h>
+
+namespace basalt {
+
+VioDatasetReplay::VioDatasetReplay(const VioDatasetPtr &dataset, double speed)
+    : dataset(dataset),
+      speed(speed),
+      start_t_ns(0),
+      num_dropped_input(0),
+      num_outputs(0),
+      stop_requested(false),
+      cancel_requested(false) {
+  BASALT_ASSERT(speed > 0);
+
+  const std::vector<int64_t> &image_t_ns = dataset->get_image_timestamps();
+
+  for (size_t i = 0; i < image_t_ns.size(); i++) {
+    frame_idx[image_t_ns[i]] = i;
+  }
+  frame_latency_ms.resize(image_t_ns.size(), -1);
+
+  start_t_ns = image_t_ns.empty() ? 0 : image_t_ns.front();
+  if (!dataset->get_gyro_data().empty()) {
+    start_t_ns =
+        std::min(start_t_ns, dataset->get_gyro_data().front().timestamp_ns);
+  }
+}
+
+VioDatasetReplay::~VioDatasetReplay() {
+  // Nobody reads the queues anymore when the replay is destroyed
+  cancel();
+  if (image_thread) image_thread->join();
+  if (imu_thread) imu_thread->join();
+}
+
+void VioDatasetReplay::start() {
+  BASALT_ASSERT(out_image_queue && out_imu_queue);
+
+  start_time = Clock::now();
+
+  image_thread.reset(new std::thread(&VioDatasetReplay::imageLoop, this));
+  imu_thread.reset(new std::thread(&VioDatasetReplay::imuLoop, this));
+}
+
+void VioDatasetReplay::stop() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    stop_requested = true;
+  }
+  stop_cv.notify_all();
+}
+
+void VioDatasetReplay::cancel() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    stop_requested = true;
+    cancel_requested = true;
+  }
+  stop_cv.notify_all();
+}
+
+void VioDatasetReplay::record_output(int64_t t_ns) {
+  auto it = frame_idx.find(t_ns);
+  if (it == frame_idx.end()) return;
+
+  frame_latency_ms[it->second] =
+      std::chrono::duration<double, std::milli>(Clock::now() -
+                                                sensor_time(t_ns))
+          .count();
+  num_outputs++;
+}
+
+void VioDatasetReplay::print_stats() const {
+  std::vector<double> latencies;
+  for (double l : frame_latency_ms) {
+    if (l >= 0) latencies.emplace_back(l);
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  const size_t num_frames = frame_latency_ms.size();
+
+  std::cout << "Replay at " << speed << "x: " << num_frames << " frames, "
+            << num_dropped_input << " dropped at the input, "
+            << num_frames - num_dropped_input - latencies.size()
+            << " dropped by the estimator." << std::endl;
+
+  if (latencies.empty()) return;
+
+  double sum = 0;
+  for (double l : latencies) sum += l;
+
+  auto percentile = [&](double p) {
+    return latencies[std::min(latencies.size() - 1,
+                              size_t(p * latencies.size()))];
+  };
+
+  std::cout << "Latency [ms]: mean " << sum / latencies.size() << " median "
+            << percentile(0.5) << " p95 " << percentile(0.95) << " p99 "
+            << percentile(0.99) << " max " << latencies.back() << std::endl;
+}
+
+void VioDatasetReplay::save_latencies(const std::string &path) const {
+  const std::vector<int64_t> &image_t_ns = dataset->get_image_timestamps();
+
+  std::ofstream os(path);
+  os << "#timestamp [ns],latency [ms]" << std::endl;
+  for (size_t i = 0; i < image_t_ns.size(); i++) {
+    os << image_t_ns[i] << "," << frame_latency_ms[i] << std::endl;
+  }
+}
+
+bool VioDatasetReplay::wait_until(Clock::time_point t) {
+  std::unique_lock<std::mutex> lock(stop_mutex);
+  return !stop_cv.wait_until(lock, t, [&] { return bool(stop_requested); });
+}
+
+template <class T>
+bool VioDatasetReplay::push_until(SpscQueue<T> &queue, T &&value,
+                                  const std::atomic<bool> &abort) {
+  // The queue has no way to interrupt a blocking push, so retry in short
+  // slices.
+  while (!queue.try_push(std::move(value))) {
+    if (abort) return false;
+
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    stop_cv.wait_for(lock, std::chrono::milliseconds(1),
+                     [&] { return bool(abort); });
+  }
+  return true;
+}
+
+void VioDatasetReplay::imageLoop() {
+  const std::vector<int64_t> &image_t_ns = dataset->get_image_timestamps();
+
+  for (size_t i = 0; i < image_t_ns.size() && !stop_requested; i++) {
+    const int64_t t_ns = image_t_ns[i];
+
+    // Decode before the sensor time, the images of a live camera are
+    // available when they are published.
+    OpticalFlowInput::Ptr data(new OpticalFlowInput);
+    data->t_ns = t_ns;
+    data->img_data = dataset->get_image_data(t_ns);
+
+    if (!wait_until(sensor_time(t_ns))) break;
+
+    if (!out_image_queue->try_push(std::move(data))) num_dropped_input++;
+  }
+
+  // The consumers only terminate on the end marker, so it is delivered even
+  // after a stop.
+  push_until(*out_image_queue, OpticalFlowInput::Ptr(), cancel_requested);
+}
+
+void VioDatasetReplay::imuLoop() {
+  const auto &gyro_data = dataset->get_gyro_data();
+  const auto &accel_data = dataset->get_accel_data();
+
+  for (size_t i = 0; i < gyro_data.size(); i++) {
+    ImuData<double>::Ptr data(new ImuData<double>);
+    data->t_ns = gyro_data[i].timestamp_ns;
+    data->accel = accel_data[i].data;
+    data->gyro = gyro_data[i].data;
+
+    if (!wait_until(sensor_time(data->t_ns))) break;
+
+    // Blocks while the queue is full like a driver with a backlog, but gives
+    // up when the playback is stopped.
+    if (!push_until(*out_imu_queue, std::move(data), stop_requested)) break;
+  }
+
+  push_until(*out_imu_queue, ImuData<double>::Ptr(), cancel_requested);
+}
+
+VioDatasetReplay::Clock::time_point VioDatasetReplay::sensor_time(
+    int64_t t_ns) const {
+  return start_time + std::chrono::duration_cast<Clock::duration>(
+                          std::chrono::duration<double, std::nano>(
+                              (t_ns - start_t_ns) / speed));
+}
+
+}  // namespace basalt
@@ -35,23 +35,504 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <basalt/io/marg_data_io.h>
 
+#include <cstring>
+#include <functional>
+#include <list>
+#include <sstream>
+
+#include <lz4.h>
+
+#include <tbb/parallel_for.h>
+#include <tbb/pipeline.h>
+#include <tbb/task_arena.h>
+
+#include <cereal/types/bitset.hpp>
+#include <cereal/types/utility.hpp>
+
+#include <basalt/hash_bow/hash_bow.h>
 #include <basalt/serialization/headers_serialization.h>
 #include <basalt/utils/filesystem.h>
+#include <basalt/utils/keypoints.h>
+
+namespace cereal {
+
+template <class Archive, class T>
+void save(Archive& ar, const basalt::ManagedImage<T>& m) {
+  ar(m.w);
+  ar(m.h);
+  // Rows can be padded, e.g. for the pyramid
+  for (size_t y = 0; y < m.h; y++) {
+    ar(cereal::binary_data(m.RowPtr(y), sizeof(T) * m.w));
+  }
+}
+
+template <class Archive, class T>
+void load(Archive& ar, basalt::ManagedImage<T>& m) {
+  size_t w;
+  size_t h;
+  ar(w);
+  ar(h);
+  m.Reinitialise(w, h);
+  ar(cereal::binary_data(m.ptr, sizeof(T) * m.w * m.h));
+}
+
+template <class Archive>
+void serialize(Archive& ar, basalt::OpticalFlowResult& m) {
+  ar(m.t_ns);
+  ar(m.observations);
+  ar(m.input_images);
+}
+
+template <class Archive>
+void serialize(Archive& ar, basalt::OpticalFlowInput& m) {
+  ar(m.t_ns);
+  ar(m.img_data);
+}
+
+template <class Archive>
+void serialize(Archive& ar, basalt::ImageData& m) {
+  ar(m.exposure);
+  ar(m.img);
+}
+
+template <class Archive>
+static void serialize(Archive& ar, Eigen::AffineCompact2f& m) {
+  ar(m.matrix());
+}
+}  // namespace cereal
 
 namespace basalt {
 
-MargDataSaver::MargDataSaver(const std::string& path) {
+namespace {
+
+constexpr char MARG_LOG_MAGIC[] = "BMARGLOG";
+constexpr char MARG_LOG_INDEX_MAGIC[] = "BMARGIDX";
+// Version 2 added the mapping keypoints to OpticalFlowInput.
+constexpr uint32_t MARG_LOG_VERSION = 2;
+
+enum RecordType : uint32_t {
+  RECORD_MARG_DATA = 0,
+  RECORD_OPT_FLOW = 1,
+  RECORD_IMAGE = 2,
+  NUM_RECORD_TYPES = 3,
+  RECORD_INDEX = 4
+};
+
+struct LogHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct RecordHeader {
+  uint32_t type;
+  uint32_t reserved;
+  int64_t key;
+  uint64_t size;
+};
+
+// Last bytes of a closed log
+struct LogTrailer {
+  uint64_t index_offset;
+  char magic[8];
+};
+
+// Stream over a record of the mapped file, so records are deserialized
+// without copying them first.
+struct MemoryBuffer : public std::streambuf {
+  MemoryBuffer(const uint8_t* data, size_t size) {
+    char* p = const_cast<char*>(reinterpret_cast<const char*>(data));
+    setg(p, p, p + size);
+  }
+};
+
+// Consecutive keyframe windows share most of their frames, so only recently
+// used optical flow results are kept instead of the whole sequence.
+constexpr size_t OPT_FLOW_RESULT_CACHE_SIZE = 64;
+
+/// Thread-safe LRU cache of optical flow results
+class OptFlowResultCache {
+ public:
+  explicit OptFlowResultCache(size_t capacity) : capacity(capacity) {}
+
+  /// Returns the cached result or loads it, results that could not be loaded
+  /// (nullptr) are not cached
+  template <class Func>
+  OpticalFlowResult::Ptr get(int64_t t_ns, const Func& load) {
+    {
+      std::lock_guard<std::mutex> lk(m);
+      auto it = entries.find(t_ns);
+      if (it != entries.end()) {
+        lru.splice(lru.begin(), lru, it->second.second);
+        return it->second.first;
+      }
+    }
+
+    OpticalFlowResult::Ptr res = load(t_ns);
+    if (!res) return res;
+
+    std::lock_guard<std::mutex> lk(m);
+
+    // Loaded concurrently by another thread
+    auto it = entries.find(t_ns);
+    if (it != entries.end()) return it->second.first;
+
+    lru.push_front(t_ns);
+    entries.emplace(t_ns, std::make_pair(res, lru.begin()));
+
+    if (entries.size() > capacity) {
+      entries.erase(lru.back());
+      lru.pop_back();
+    }
+
+    return res;
+  }
+
+ private:
+  size_t capacity;
+
+  std::mutex m;
+  std::list<int64_t> lru;
+  std::unordered_map<int64_t, std::pair<OpticalFlowResult::Ptr,
+                                        std::list<int64_t>::iterator>>
+      entries;
+};
+
+}  // namespace
+
+MargDataLogWriter::MargDataLogWriter(const std::string& path)
+    : path(path), os(path, std::ios::binary), offset(0) {
+  LogHeader header;
+  std::memcpy(header.magic, MARG_LOG_MAGIC, 8);
+  header.version = MARG_LOG_VERSION;
+  header.reserved = 0;
+
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  offset = sizeof(header);
+}
+
+MargDataLogWriter::~MargDataLogWriter() {
+  std::lock_guard<std::mutex> lk(m);
+
+  const std::string payload(reinterpret_cast<const char*>(index.data()),
+                            index.size() * sizeof(IndexEntry));
+
+  LogTrailer trailer;
+  trailer.index_offset = offset;
+  std::memcpy(trailer.magic, MARG_LOG_INDEX_MAGIC, 8);
+
+  append(RECORD_INDEX, 0, payload);
+  os.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+}
+
+void MargDataLogWriter::write(const MargData& data) {
+  std::ostringstream ss;
+  {
+    cereal::BinaryOutputArchive archive(ss);
+    archive(data);
+  }
+
+  std::lock_guard<std::mutex> lk(m);
+  append(RECORD_MARG_DATA, *data.kfs_to_marg.begin(), ss.str());
+}
+
+void MargDataLogWriter::write(const OpticalFlowResult& data) {
+  // Image id 0 marks a missing image
+  std::vector<double> exposures;
+  std::vector<uint64_t> image_ids;
+
+  // The cereal serialization of KeypointsData does not include the BoW
+  // vectors
+  const std::vector<KeypointsData> no_keypoints;
+  const std::vector<KeypointsData>& keypoints =
+      data.input_images ? data.input_images->keypoints : no_keypoints;
+
+  std::vector<HashBowVector> bow_vectors;
+  for (const KeypointsData& kd : keypoints) {
+    bow_vectors.emplace_back(kd.bow_vector);
+  }
+
+  if (data.input_images) {
+    for (const ImageData& img_data : data.input_images->img_data) {
+      exposures.emplace_back(img_data.exposure);
+      image_ids.emplace_back(img_data.img ? write_image(*img_data.img) : 0);
+    }
+  }
+
+  std::ostringstream ss;
+  {
+    cereal::BinaryOutputArchive archive(ss);
+    archive(data.t_ns, data.observations, exposures, image_ids);
+    archive(keypoints, bow_vectors);
+  }
+
+  std::lock_guard<std::mutex> lk(m);
+  append(RECORD_OPT_FLOW, data.t_ns, ss.str());
+}
+
+uint64_t MargDataLogWriter::write_image(const ManagedImage<uint16_t>& img) {
+  // Size followed by the contiguous pixels
+  const uint32_t size[2] = {uint32_t(img.w), uint32_t(img.h)};
+  const size_t row_bytes = img.w * sizeof(uint16_t);
+  const size_t num_bytes = row_bytes * img.h;
+
+  std::string raw(sizeof(size) + num_bytes, 0);
+  std::memcpy(&raw[0], size, sizeof(size));
+  for (size_t y = 0; y < img.h; y++) {
+    std::memcpy(&raw[sizeof(size) + y * row_bytes], img.RowPtr(y), row_bytes);
+  }
+
+  uint64_t id = std::hash<std::string>{}(raw);
+  if (id == 0) id = 1;
+
+  std::lock_guard<std::mutex> lk(m);
+
+  // Equal hashes are only a candidate, a different image with the same hash
+  // gets the next free id.
+  for (auto it = written_images.find(id); it != written_images.end();
+       it = written_images.find(id)) {
+    if (is_same_image(it->second, raw)) return id;
+    id++;
+    if (id == 0) id = 1;
+  }
+
+  std::string payload(sizeof(size) + LZ4_compressBound(num_bytes), 0);
+  std::memcpy(&payload[0], size, sizeof(size));
+  const int compressed_bytes = LZ4_compress_default(
+      &raw[sizeof(size)], &payload[sizeof(size)], num_bytes,
+      payload.size() - sizeof(size));
+  payload.resize(sizeof(size) + compressed_bytes);
+
+  written_images.emplace(id, offset);
+  append(RECORD_IMAGE, int64_t(id), payload);
+
+  return id;
+}
+
+bool MargDataLogWriter::is_same_image(uint64_t record_offset,
+                                      const std::string& raw) {
+  // Only called for matching hashes, so the record is read back from disk
+  // instead of keeping the written images in memory.
+  os.flush();
+
+  std::ifstream is(path, std::ios::binary);
+  is.seekg(record_offset);
+
+  RecordHeader header;
+  is.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+  std::string payload(header.size, 0);
+  is.read(&payload[0], payload.size());
+
+  if (!is || payload.size() < 2 * sizeof(uint32_t) ||
+      std::memcmp(payload.data(), raw.data(), 2 * sizeof(uint32_t)) != 0) {
+    return false;
+  }
+
+  const size_t num_bytes = raw.size() - 2 * sizeof(uint32_t);
+  std::string pixels(num_bytes, 0);
+  const int decompressed_bytes = LZ4_decompress_safe(
+      &payload[2 * sizeof(uint32_t)], &pixels[0],
+      payload.size() - 2 * sizeof(uint32_t), num_bytes);
+
+  return decompressed_bytes == int(num_bytes) &&
+         std::memcmp(pixels.data(), &raw[2 * sizeof(uint32_t)], num_bytes) ==
+             0;
+}
+
+void MargDataLogWriter::append(uint32_t type, int64_t key,
+                               const std::string& payload) {
+  RecordHeader header;
+  header.type = type;
+  header.reserved = 0;
+  header.key = key;
+  header.size = payload.size();
+
+  index.push_back({type, 0, key, offset});
+
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  os.write(payload.data(), payload.size());
+  offset += sizeof(header) + payload.size();
+}
+
+MargDataLogReader::MargDataLogReader(const std::string& path)
+    : file(new MappedFile(path)), offsets(NUM_RECORD_TYPES) {
+  const uint8_t* data = file->data();
+  const size_t size = file->size();
+
+  LogHeader header;
+  if (size < sizeof(header)) {
+    std::cerr << "Invalid marg. data log " << path << std::endl;
+    std::abort();
+  }
+
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, MARG_LOG_MAGIC, 8) != 0 ||
+      header.version != MARG_LOG_VERSION) {
+    std::cerr << "Unsupported marg. data log " << path << std::endl;
+    std::abort();
+  }
+
+  bool indexed = false;
+
+  if (size >= sizeof(header) + sizeof(RecordHeader) + sizeof(LogTrailer)) {
+    LogTrailer trailer;
+    std::memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+
+    RecordHeader index_header;
+    if (std::memcmp(trailer.magic, MARG_LOG_INDEX_MAGIC, 8) == 0 &&
+        trailer.index_offset + sizeof(index_header) <= size) {
+      std::memcpy(&index_header, data + trailer.index_offset,
+                  sizeof(index_header));
+      indexed = index_header.type == RECORD_INDEX;
+    }
+
+    if (indexed) {
+      const uint8_t* index_data =
+          data + trailer.index_offset + sizeof(index_header);
+      using IndexEntry = MargDataLogWriter::IndexEntry;
+      const size_t num_entries = index_header.size / sizeof(IndexEntry);
+
+      for (size_t i = 0; i < num_entries; i++) {
+        IndexEntry e;
+        std::memcpy(&e, index_data + i * sizeof(e), sizeof(e));
+        if (e.type < NUM_RECORD_TYPES) offsets[e.type][e.key] = e.offset;
+      }
+    }
+  }
+
+  // The log was not closed, e.g. because the recording crashed
+  if (!indexed) {
+    uint64_t pos = sizeof(header);
+    while (pos + sizeof(RecordHeader) <= size) {
+      RecordHeader h;
+      std::memcpy(&h, data + pos, sizeof(h));
+      if (pos + sizeof(h) + h.size > size) break;
+
+      if (h.type < NUM_RECORD_TYPES) offsets[h.type][h.key] = pos;
+      pos += sizeof(h) + h.size;
+    }
+  }
+
+  for (const auto& kv : offsets[RECORD_MARG_DATA]) {
+    marg_data_keys.emplace_back(kv.first);
+  }
+  std::sort(marg_data_keys.begin(), marg_data_keys.end());
+}
+
+MargData::Ptr MargDataLogReader::read_marg_data(int64_t key) const {
+  uint64_t size;
+  const uint8_t* ptr = record(RECORD_MARG_DATA, key, size);
+  if (!ptr) return nullptr;
+
+  MargData::Ptr data(new MargData);
+
+  MemoryBuffer buffer(ptr, size);
+  std::istream is(&buffer);
+  {
+    cereal::BinaryInputArchive archive(is);
+    archive(*data);
+  }
+
+  return data;
+}
+
+OpticalFlowResult::Ptr MargDataLogReader::read_opt_flow_result(
+    int64_t t_ns) const {
+  uint64_t size;
+  const uint8_t* ptr = record(RECORD_OPT_FLOW, t_ns, size);
+  if (!ptr) return nullptr;
+
+  OpticalFlowResult::Ptr data(new OpticalFlowResult);
+  data->input_images.reset(new OpticalFlowInput);
+
+  std::vector<double> exposures;
+  std::vector<uint64_t> image_ids;
+  std::vector<HashBowVector> bow_vectors;
+
+  MemoryBuffer buffer(ptr, size);
+  std::istream is(&buffer);
+  {
+    cereal::BinaryInputArchive archive(is);
+    archive(data->t_ns, data->observations, exposures, image_ids);
+    archive(data->input_images->keypoints, bow_vectors);
+  }
+
+  for (size_t i = 0; i < bow_vectors.size(); i++) {
+    data->input_images->keypoints[i].bow_vector = std::move(bow_vectors[i]);
+  }
+
+  data->input_images->t_ns = data->t_ns;
+  data->input_images->img_data.resize(image_ids.size());
+
+  for (size_t i = 0; i < image_ids.size(); i++) {
+    ImageData& img_data = data->input_images->img_data[i];
+    img_data.exposure = exposures[i];
+    if (image_ids[i] != 0) img_data.img = read_image(image_ids[i]);
+  }
+
+  return data;
+}
+
+const uint8_t* MargDataLogReader::record(uint32_t type, int64_t key,
+                                         uint64_t& size) const {
+  auto it = offsets[type].find(key);
+  if (it == offsets[type].end()) return nullptr;
+
+  RecordHeader header;
+  std::memcpy(&header, file->data() + it->second, sizeof(header));
+  size = header.size;
+
+  return file->data() + it->second + sizeof(header);
+}
+
+ManagedImage<uint16_t>::Ptr MargDataLogReader::read_image(
+    uint64_t image_id) const {
+  uint64_t size;
+  const uint8_t* ptr = record(RECORD_IMAGE, int64_t(image_id), size);
+  if (!ptr) {
+    std::cerr << "Missing image " << image_id << " in the marg. data log"
+              << std::endl;
+    return nullptr;
+  }
+
+  uint32_t img_size[2];
+  std::memcpy(img_size, ptr, sizeof(img_size));
+
+  ManagedImage<uint16_t>::Ptr img(
+      new ManagedImage<uint16_t>(img_size[0], img_size[1]));
+
+  const int num_bytes = img->w * img->h * sizeof(uint16_t);
+  const int decompressed_bytes = LZ4_decompress_safe(
+      reinterpret_cast<const char*>(ptr + sizeof(img_size)),
+      reinterpret_cast<char*>(img->ptr), size - sizeof(img_size), num_bytes);
+
+  if (decompressed_bytes != num_bytes) {
+    std::cerr << "Corrupted image " << image_id << " in the marg. data log"
+              << std::endl;
+    std::abort();
+  }
+
+  return img;
+}
+
+MargDataSaver::MargDataSaver(const std::string& path,
+                             const VioConfig& config)
+    : config(config) {
+  if (config.vio_marg_data_features) {
+    hash_bow.reset(new HashBow<256>(config.mapper_bow_num_bits));
+  }
+
   fs::remove_all(path);
   fs::create_directory(path);
 
-  save_image_queue.set_capacity(300);
+  log.reset(new MargDataLogWriter(path + "/marg_data.log"));
 
-  std::string img_path = path + "/images/";
-  fs::create_directory(img_path);
+  save_image_queue.set_capacity(300);
 
   in_marg_queue.set_capacity(1000);
 
-  auto save_func = [&, path]() {
+  auto save_func = [&]() {
     basalt::MargData::Ptr data;
 
     std::unordered_set<int64_t> processed_opt_flow;
@@ -60,16 +541,7 @@ MargDataSaver::MargDataSaver(const std::string& path) {
       in_marg_queue.pop(data);
 
       if (data.get()) {
-        int64_t kf_id = *data->kfs_to_marg.begin();
-
-        std::string p = path + "/" + std::to_string(kf_id) + ".cereal";
-        std::ofstream os(p, std::ios::binary);
-
-        {
-          cereal::BinaryOutputArchive archive(os);
-          archive(*data);
-        }
-        os.close();
+        log->write(*data);
 
         for (const auto& d : data->opt_flow_res) {
           if (processed_opt_flow.count(d->t_ns) == 0) {
@@ -87,21 +559,15 @@ MargDataSaver::MargDataSaver(const std::string& path) {
     std::cout << "Finished MargDataSaver" << std::endl;
   };
 
-  auto save_image_func = [&, img_path]() {
+  auto save_image_func = [&]() {
     basalt::OpticalFlowResult::Ptr data;
 
     while (true) {
       save_image_queue.pop(data);
 
       if (data.get()) {
-        std::string p = img_path + "/" + std::to_string(data->t_ns) + ".cereal";
-        std::ofstream os(p, std::ios::binary);
-
-        {
-          cereal::BinaryOutputArchive archive(os);
-          archive(data);
-        }
-        os.close();
+        if (hash_bow) data = extract_features(data);
+        log->write(*data);
       } else {
         break;
       }
@@ -114,6 +580,41 @@ MargDataSaver::MargDataSaver(const std::string& path) {
   saving_img_thread.reset(new std::thread(save_image_func));
 }  // namespace basalt
 
+OpticalFlowResult::Ptr MargDataSaver::extract_features(
+    const OpticalFlowResult::Ptr& data) const {
+  if (!data->input_images) return data;
+
+  // The input is shared with the estimator and the visualization, so the
+  // features are stored in a copy without images.
+  const OpticalFlowInput& input = *data->input_images;
+
+  OpticalFlowResult::Ptr res(new OpticalFlowResult);
+  res->t_ns = data->t_ns;
+  res->observations = data->observations;
+  res->input_images.reset(new OpticalFlowInput);
+  res->input_images->t_ns = input.t_ns;
+  res->input_images->img_data.resize(input.img_data.size());
+  res->input_images->keypoints.resize(input.img_data.size());
+
+  tbb::parallel_for(size_t(0), input.img_data.size(), [&](size_t i) {
+    res->input_images->img_data[i].exposure = input.img_data[i].exposure;
+
+    if (!input.img_data[i].img.get()) return;
+
+    const Image<const uint16_t> img =
+        input.img_data[i].img->Reinterpret<const uint16_t>();
+
+    KeypointsData& kd = res->input_images->keypoints[i];
+    detectKeypointsMapping(img, kd, config.mapper_detection_num_points);
+    computeAngles(img, kd, true);
+    computeDescriptors(img, kd);
+
+    hash_bow->compute_bow(kd.corner_descriptors, kd.hashes, kd.bow_vector);
+  });
+
+  return res;
+}
+
 MargDataLoader::MargDataLoader() : out_marg_queue(nullptr) {}
 
 void MargDataLoader::start(const std::string& path) {
@@ -121,56 +622,113 @@ void MargDataLoader::start(const std::string& path) {
     std::cerr << "No marg. data found in " << path << std::endl;
 
   auto func = [&, path]() {
-    std::string img_path = path + "/images/";
+    std::vector<int64_t> keys;
+    std::function<MargData::Ptr(int64_t)> read_marg_data;
+    std::function<OpticalFlowResult::Ptr(int64_t)> read_opt_flow_result;
+
+    MargDataLogReader::Ptr reader;
+    std::map<int64_t, std::string> filenames;
+
+    const std::string log_path = path + "/marg_data.log";
+
+    if (fs::exists(log_path)) {
+      reader.reset(new MargDataLogReader(log_path));
+      keys = reader->get_marg_data_keys();
 
-    std::unordered_set<uint64_t> saved_images;
+      read_marg_data = [&](int64_t key) {
+        return reader->read_marg_data(key);
+      };
+      read_opt_flow_result = [&](int64_t t_ns) {
+        return reader->read_opt_flow_result(t_ns);
+      };
+    } else {
+      for (auto& p : fs::directory_iterator(path)) {
+        std::string filename = p.path().filename();
+        if (!std::isdigit(filename[0])) continue;
 
-    std::map<int64_t, OpticalFlowResult::Ptr> opt_flow_res;
+        size_t lastindex = filename.find_last_of(".");
+        std::string rawname = filename.substr(0, lastindex);
 
-    for (const auto& entry : fs::directory_iterator(img_path)) {
-      OpticalFlowResult::Ptr data;
-      // std::cout << entry.path() << std::endl;
-      std::ifstream is(entry.path(), std::ios::binary);
-      {
-        cereal::BinaryInputArchive archive(is);
-        archive(data);
+        int64_t t_ns = std::stol(rawname);
+
+        filenames.emplace(t_ns, filename);
+        keys.emplace_back(t_ns);
       }
-      is.close();
-      opt_flow_res[data->t_ns] = data;
-    }
 
-    std::map<int64_t, std::string> filenames;
+      // directory_iterator gives no order guarantee.
+      std::sort(keys.begin(), keys.end());
+
+      read_marg_data = [&](int64_t key) {
+        basalt::MargData::Ptr data(new basalt::MargData);
+
+        std::ifstream is(path + "/" + filenames.at(key), std::ios::binary);
+        {
+          cereal::BinaryInputArchive archive(is);
+          archive(*data);
+        }
 
-    for (auto& p : fs::directory_iterator(path)) {
-      std::string filename = p.path().filename();
-      if (!std::isdigit(filename[0])) continue;
+        return data;
+      };
+      read_opt_flow_result = [&](int64_t t_ns) {
+        OpticalFlowResult::Ptr data;
 
-      size_t lastindex = filename.find_last_of(".");
-      std::string rawname = filename.substr(0, lastindex);
+        std::string p = path + "/images/" + std::to_string(t_ns) + ".cereal";
+        if (!fs::exists(p)) return data;
 
-      int64_t t_ns = std::stol(rawname);
+        std::ifstream is(p, std::ios::binary);
+        {
+          cereal::BinaryInputArchive archive(is);
+          archive(data);
+        }
 
-      filenames.emplace(t_ns, filename);
+        return data;
+      };
     }
 
-    for (const auto& kv : filenames) {
-      basalt::MargData::Ptr data(new basalt::MargData);
+    OptFlowResultCache cache(OPT_FLOW_RESULT_CACHE_SIZE);
 
-      std::string p = path + "/" + kv.second;
-      std::ifstream is(p, std::ios::binary);
+    // Records are read and completed in parallel, but pushed in order. The
+    // number of tokens bounds the records in flight.
+    size_t next_key = 0;
 
-      {
-        cereal::BinaryInputArchive archive(is);
-        archive(*data);
+    auto read_keys = [&](tbb::flow_control& fc) -> int64_t {
+      if (next_key == keys.size()) {
+        fc.stop();
+        return 0;
       }
-      is.close();
+      return keys[next_key++];
+    };
+
+    auto read_record = [&](int64_t key) {
+      MargData::Ptr data = read_marg_data(key);
 
       for (const auto& d : data->kfs_all) {
-        data->opt_flow_res.emplace_back(opt_flow_res.at(d));
+        OpticalFlowResult::Ptr res = cache.get(d, read_opt_flow_result);
+
+        if (!res) {
+          std::cerr << "Missing optical flow result " << d << " in " << path
+                    << std::endl;
+          std::abort();
+        }
+
+        data->opt_flow_res.emplace_back(res);
       }
 
+      return data;
+    };
+
+    auto push_record = [&](const MargData::Ptr& data) {
       out_marg_queue->push(data);
-    }
+    };
+
+    tbb::parallel_pipeline(
+        2 * tbb::this_task_arena::max_concurrency(),
+        tbb::make_filter<void, int64_t>(tbb::filter::serial_in_order,
+                                        read_keys) &
+            tbb::make_filter<int64_t, MargData::Ptr>(tbb::filter::parallel,
+                                                     read_record) &
+            tbb::make_filter<MargData::Ptr, void>(
+                tbb::filter::serial_in_order, push_record));
 
     out_marg_queue->push(nullptr);
 
@@ -180,47 +738,3 @@ void MargDataLoader::start(const std::string& path) {
   processing_thread.reset(new std::thread(func));
 }
 }  // namespace basalt
-
-namespace cereal {
-
-template <class Archive, class T>
-void save(Archive& ar, const basalt::ManagedImage<T>& m) {
-  ar(m.w);
-  ar(m.h);
-  ar(cereal::binary_data(m.ptr, sizeof(T) * m.w * m.h));
-}
-
-template <class Archive, class T>
-void load(Archive& ar, basalt::ManagedImage<T>& m) {
-  size_t w;
-  size_t h;
-  ar(w);
-  ar(h);
-  m.Reinitialise(w, h);
-  ar(cereal::binary_data(m.ptr, sizeof(T) * m.w * m.h));
-}
-
-template <class Archive>
-void serialize(Archive& ar, basalt::OpticalFlowResult& m) {
-  ar(m.t_ns);
-  ar(m.observations);
-  ar(m.input_images);
-}
-
-template <class Archive>
-void serialize(Archive& ar, basalt::OpticalFlowInput& m) {
-  ar(m.t_ns);
-  ar(m.img_data);
-}
-
-template <class Archive>
-void serialize(Archive& ar, basalt::ImageData& m) {
-  ar(m.exposure);
-  ar(m.img);
-}
-
-template <class Archive>
-static void serialize(Archive& ar, Eigen::AffineCompact2f& m) {
-  ar(m.matrix());
-}
-}  // namespace cereal
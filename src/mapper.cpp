@@ -82,7 +82,7 @@ std::vector<int64_t> gt_frame_t_ns, image_t_ns;
 Eigen::aligned_vector<Eigen::Vector3d> mapper_points;
 std::vector<int> mapper_point_ids;
 
-std::map<int64_t, basalt::MargData::Ptr> marg_data;
+size_t num_marg_data = 0;
 
 Eigen::aligned_vector<Eigen::Vector3d> edges_vis;
 Eigen::aligned_vector<Eigen::Vector3d> roll_pitch_vis;
@@ -91,7 +91,7 @@ Eigen::aligned_vector<Eigen::Vector3d> rel_edges_vis;
 void draw_image_overlay(pangolin::View& v, size_t cam_id);
 void draw_scene();
 void load_data(const std::string& calib_path,
-               const std::string& marg_data_path);
+               const std::vector<std::string>& marg_data_paths);
 void processMargData(basalt::MargData& m);
 void extractNonlinearFactors(basalt::MargData& m);
 void computeEdgeVis();
@@ -104,6 +104,7 @@ void detect();
 void match();
 void tracks();
 void optimize();
+void pose_graph();
 void filter();
 void saveTrajectoryButton();
 
@@ -133,6 +134,7 @@ Button detect_btn("ui.detect", &detect);
 Button match_btn("ui.match", &match);
 Button tracks_btn("ui.tracks", &tracks);
 Button optimize_btn("ui.optimize", &optimize);
+Button pose_graph_btn("ui.pose_graph", &pose_graph);
 
 pangolin::Var<double> outlier_threshold("ui.outlier_threshold", 3.0, 0.01, 10);
 
@@ -145,7 +147,8 @@ Button save_traj_btn("ui.save_traj", &saveTrajectoryButton);
 
 pangolin::OpenGlRenderState camera;
 
-std::string marg_data_path;
+std::vector<std::string> marg_data_paths;
+bool incremental = false;
 
 
 
@@ -163,11 +166,17 @@ int main(int argc, char** argv) {
                  "Ground-truth camera calibration used for simulation.")
       ->required();
 
-  app.add_option("--marg-data", marg_data_path, "Path to cache folder.")
+  app.add_option("--marg-data", marg_data_paths,
+                 "Path to cache folder. Several folders are merged into one "
+                 "map, one session per folder.")
       ->required();
 
   app.add_option("--config-path", config_path, "Path to config file.");
 
+  app.add_option("--incremental", incremental,
+                 "Build the map with NfrMapper::update while the marg data is "
+                 "loaded instead of in one batch afterwards.");
+
   app.add_option("--result-path", result_path, "Path to config file.");
 
   try {
@@ -180,11 +189,7 @@ int main(int argc, char** argv) {
     vio_config.load(config_path);
   }
 
-  load_data(cam_calib_path, marg_data_path);
-
-  for (auto& kv : marg_data) {
-    nrf_mapper->addMargData(kv.second);
-  }
+  load_data(cam_calib_path, marg_data_paths);
 
   computeEdgeVis();
 
@@ -339,10 +344,14 @@ int main(int argc, char** argv) {
   } else {
     auto time_start = std::chrono::high_resolution_clock::now();
     // optimize();
-    detect();
-    match();
-    tracks();
-    optimize();
+    if (!incremental) {
+      detect();
+      match();
+      // Correct the drift before the landmarks are triangulated
+      if (vio_config.mapper_pose_graph_init) pose_graph();
+      tracks();
+      optimize();
+    }
     filter();
     optimize();
 
@@ -532,7 +541,8 @@ void draw_scene() {
   pangolin::glDrawAxis(Sophus::SE3d().matrix(), 1.0);
 }
 
-void load_data(const std::string& calib_path, const std::string& cache_path) {
+void load_data(const std::string& calib_path,
+               const std::vector<std::string>& cache_paths) {
   {
     std::ifstream os(calib_path, std::ios::binary);
 
@@ -549,45 +559,95 @@ void load_data(const std::string& calib_path, const std::string& cache_path) {
     }
   }
 
-  {
+  nrf_mapper.reset(new basalt::NfrMapper(calib, vio_config));
+
+  for (const std::string& cache_path : cache_paths) {
     // Load gt.
+    std::vector<int64_t> session_gt_t_ns;
+    Eigen::aligned_vector<Eigen::Vector3d> session_gt_t_w_i;
     {
       std::string p = cache_path + "/gt.cereal";
       std::ifstream is(p, std::ios::binary);
 
       {
         cereal::BinaryInputArchive archive(is);
-        archive(gt_frame_t_ns);
-        archive(gt_frame_t_w_i);
+        archive(session_gt_t_ns);
+        archive(session_gt_t_w_i);
       }
       is.close();
-      std::cout << "Loaded " << gt_frame_t_ns.size() << " timestamps and "
-                << gt_frame_t_w_i.size() << " poses" << std::endl;
+      std::cout << "Loaded " << session_gt_t_ns.size() << " timestamps and "
+                << session_gt_t_w_i.size() << " poses" << std::endl;
     }
-  }
 
-  nrf_mapper.reset(new basalt::NfrMapper(calib, vio_config));
+    basalt::MargDataLoader mdl;
+    tbb::concurrent_bounded_queue<basalt::MargData::Ptr> marg_queue;
+    marg_queue.set_capacity(100);
+    mdl.out_marg_queue = &marg_queue;
 
-  basalt::MargDataLoader mdl;
-  tbb::concurrent_bounded_queue<basalt::MargData::Ptr> marg_queue;
-  mdl.out_marg_queue = &marg_queue;
+    mdl.start(cache_path);
 
-  mdl.start(cache_path);
+    // Records arrive in time order and are handed to the mapper as they are
+    // popped, so only the records in flight are kept in memory.
+    bool has_session = false;
+    size_t session = 0;
 
-  while (true) {
-    basalt::MargData::Ptr data;
-    marg_queue.pop(data);
+    // Frame id of the last incremental update
+    bool has_update_t_ns = false;
+    int64_t update_t_ns = 0;
 
-    if (data.get()) {
-      int64_t t_ns = *data->kfs_to_marg.begin();
-      marg_data[t_ns] = data;
+    while (true) {
+      basalt::MargData::Ptr data;
+      marg_queue.pop(data);
 
-    } else {
-      break;
+      if (!data.get()) break;
+
+      // Session-qualified frame ids keep the timelines of the recordings apart
+      if (cache_paths.size() > 1) {
+        if (!has_session) {
+          session = nrf_mapper->addSession(*data->kfs_to_marg.begin());
+          has_session = true;
+        }
+        nrf_mapper->toSessionFrameIds(*data, session);
+      }
+
+      nrf_mapper->addMargData(data);
+      num_marg_data++;
+
+      // The map is extended once per local window, update() optimizes the
+      // new frames together with the window before them
+      if (incremental) {
+        const int64_t t_ns = *data->kfs_to_marg.begin();
+        if (!has_update_t_ns) {
+          update_t_ns = t_ns;
+          has_update_t_ns = true;
+        }
+
+        if ((t_ns - update_t_ns) * 1e-9 > vio_config.mapper_local_window) {
+          nrf_mapper->update(num_opt_iter);
+          update_t_ns = t_ns;
+        }
+      }
     }
+
+    if (incremental) nrf_mapper->update(num_opt_iter);
+
+    if (has_session) {
+      for (int64_t& t_ns : session_gt_t_ns) {
+        t_ns = nrf_mapper->sessionFrameId(session, t_ns);
+      }
+    }
+
+    gt_frame_t_ns.insert(gt_frame_t_ns.end(), session_gt_t_ns.begin(),
+                         session_gt_t_ns.end());
+    gt_frame_t_w_i.insert(gt_frame_t_w_i.end(), session_gt_t_w_i.begin(),
+                          session_gt_t_w_i.end());
   }
 
-  std::cout << "Loaded " << marg_data.size() << " marg data." << std::endl;
+  std::cout << "Loaded " << num_marg_data << " marg data." << std::endl;
+
+  if (incremental) {
+    nrf_mapper->get_current_points(mapper_points, mapper_point_ids);
+  }
 }
 
 void computeEdgeVis() {
@@ -634,7 +694,19 @@ void computeEdgeVis() {
 }
 
 void optimize() {
-  nrf_mapper->optimize(num_opt_iter);
+  if (vio_config.mapper_partitioned) {
+    nrf_mapper->optimizePartitioned(num_opt_iter);
+  } else {
+    nrf_mapper->optimize(num_opt_iter);
+  }
+  nrf_mapper->get_current_points(mapper_points, mapper_point_ids);
+
+  computeEdgeVis();
+}
+
+void pose_graph() {
+  nrf_mapper->compute_loop_closure_factors();
+  nrf_mapper->optimizePoseGraph();
   nrf_mapper->get_current_points(mapper_points, mapper_point_ids);
 
   computeEdgeVis();
@@ -663,6 +735,13 @@ void match() {
   nrf_mapper->feature_matches.clear();
   nrf_mapper->match_stereo();
   nrf_mapper->match_all();
+
+  // Sessions start in different world frames and are connected only by the
+  // matches between them
+  if (marg_data_paths.size() > 1) {
+    nrf_mapper->compute_loop_closure_factors();
+    nrf_mapper->alignSessions();
+  }
 }
 
 void tracks() {
@@ -688,7 +767,8 @@ void saveTrajectoryButton() {
 
     for (const auto& kv : nrf_mapper->getFramePoses()) {
       const Sophus::SE3d pose = kv.second.getPose();
-      os << std::scientific << std::setprecision(18) << kv.first * 1e-9 << " "
+      const int64_t t_ns = nrf_mapper->splitFrameId(kv.first).second;
+      os << std::scientific << std::setprecision(18) << t_ns * 1e-9 << " "
          << pose.translation().x() << " " << pose.translation().y() << " "
          << pose.translation().z() << " " << pose.unit_quaternion().x() << " "
          << pose.unit_quaternion().y() << " " << pose.unit_quaternion().z()
@@ -709,7 +789,8 @@ void saveTrajectoryButton() {
 
     for (const auto& kv : nrf_mapper->getFramePoses()) {
       const Sophus::SE3d pose = kv.second.getPose();
-      os << std::scientific << std::setprecision(18) << kv.first << ","
+      const int64_t t_ns = nrf_mapper->splitFrameId(kv.first).second;
+      os << std::scientific << std::setprecision(18) << t_ns << ","
          << pose.translation().x() << "," << pose.translation().y() << ","
          << pose.translation().z() << "," << pose.unit_quaternion().w() << ","
          << pose.unit_quaternion().x() << "," << pose.unit_quaternion().y()
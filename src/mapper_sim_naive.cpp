@@ -107,8 +107,7 @@ basalt::KeypointVioEstimator::Ptr vio;
 // Visualization vars
 std::unordered_map<int64_t, basalt::VioVisualizationData::Ptr> vis_map;
 tbb::concurrent_bounded_queue<basalt::VioVisualizationData::Ptr> out_vis_queue;
-tbb::concurrent_bounded_queue<basalt::PoseVelBiasState<double>::Ptr>
-    out_state_queue;
+basalt::SpscQueue<basalt::PoseVelBiasState<double>::Ptr> out_state_queue;
 
 std::vector<pangolin::TypedImage> images;
 
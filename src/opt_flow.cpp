@@ -85,8 +85,7 @@ basalt::OpticalFlowBase::Ptr opt_flow_ptr;
 tbb::concurrent_unordered_map<int64_t, basalt::OpticalFlowResult::Ptr,
                               std::hash<int64_t>>
     observations;
-tbb::concurrent_bounded_queue<basalt::OpticalFlowResult::Ptr>
-    observations_queue;
+basalt::SpscQueue<basalt::OpticalFlowResult::Ptr> observations_queue;
 
 basalt::Calibration<double> calib;
 
@@ -70,9 +70,9 @@ pangolin::Var<int> webp_quality("ui.webp_quality", 90, 0, 101);
 pangolin::Var<int> skip_frames("ui.skip_frames", 1, 1, 10);
 pangolin::Var<float> exposure("ui.exposure", 5.0, 1, 20);
 
-tbb::concurrent_bounded_queue<basalt::OpticalFlowInput::Ptr> image_data_queue,
-    image_data_queue2;
-tbb::concurrent_bounded_queue<basalt::ImuData<double>::Ptr> imu_data_queue;
+basalt::SpscQueue<basalt::OpticalFlowInput::Ptr> image_data_queue;
+tbb::concurrent_bounded_queue<basalt::OpticalFlowInput::Ptr> image_data_queue2;
+basalt::SpscQueue<basalt::ImuData<double>::Ptr> imu_data_queue;
 tbb::concurrent_bounded_queue<basalt::RsPoseData> pose_data_queue;
 
 std::atomic<bool> stop_workers;
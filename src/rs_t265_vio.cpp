@@ -58,6 +58,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <basalt/io/dataset_io.h>
 #include <basalt/io/marg_data_io.h>
 #include <basalt/spline/se3_spline.h>
+#include <basalt/vi_estimator/imu_state_propagator.h>
 #include <basalt/vi_estimator/vio_estimator.h>
 #include <basalt/calibration/calibration.hpp>
 
@@ -97,8 +98,8 @@ pangolin::Var<bool> follow("ui.follow", true, false, true);
 basalt::VioVisualizationData::Ptr curr_vis_data;
 
 tbb::concurrent_bounded_queue<basalt::VioVisualizationData::Ptr> out_vis_queue;
-tbb::concurrent_bounded_queue<basalt::PoseVelBiasState<double>::Ptr>
-    out_state_queue;
+basalt::SpscQueue<basalt::PoseVelBiasState<double>::Ptr> out_state_queue;
+basalt::SpscQueue<basalt::PoseVelBiasState<double>::Ptr> out_imu_state_queue;
 
 std::vector<int64_t> vio_t_ns;
 Eigen::aligned_vector<Eigen::Vector3d> vio_t_w_i;
@@ -115,6 +116,7 @@ basalt::Calibration<double> calib;
 basalt::VioConfig vio_config;
 basalt::OpticalFlowBase::Ptr opt_flow_ptr;
 basalt::VioEstimatorBase::Ptr vio;
+basalt::ImuStatePropagator::Ptr imu_propagator;
 
 int main(int argc, char** argv) {
   bool terminate = false;
@@ -123,6 +125,7 @@ int main(int argc, char** argv) {
   std::string cam_calib_path;
   std::string config_path;
   int num_threads = 0;
+  bool imu_propagation = false;
 
   CLI::App app{"RealSense T265 Live Vio"};
 
@@ -137,6 +140,9 @@ int main(int argc, char** argv) {
   app.add_option("--config-path", config_path, "Path to config file.");
   app.add_option("--num-threads", num_threads, "Number of threads.");
   app.add_option("--step-by-step", step_by_step, "Path to config file.");
+  app.add_option("--imu-propagation", imu_propagation,
+                 "Publish IMU-rate states propagated from the latest "
+                 "optimized state.");
 
   try {
     app.parse(argc, argv);
@@ -175,7 +181,17 @@ int main(int argc, char** argv) {
   vio = basalt::VioEstimatorFactory::getVioEstimator(
       vio_config, calib, basalt::constants::g, true);
   vio->initialize(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero());
-  t265_device->imu_data_queue = &vio->imu_data_queue;
+  if (imu_propagation) {
+    imu_propagator.reset(
+        new basalt::ImuStatePropagator(basalt::constants::g, calib));
+    imu_propagator->out_imu_queue = &vio->imu_data_queue;
+    imu_propagator->out_state_queue = &out_imu_state_queue;
+    out_imu_state_queue.set_capacity(1000);
+    vio->out_imu_propagator_queue = &imu_propagator->state_queue;
+    t265_device->imu_data_queue = &imu_propagator->imu_data_queue;
+  } else {
+    t265_device->imu_data_queue = &vio->imu_data_queue;
+  }
 
   opt_flow_ptr->output_queue = &vio->vision_data_queue;
   if (show_gui) vio->out_vis_queue = &out_vis_queue;
@@ -184,7 +200,8 @@ int main(int argc, char** argv) {
   basalt::MargDataSaver::Ptr marg_data_saver;
 
   if (!marg_data_path.empty()) {
-    marg_data_saver.reset(new basalt::MargDataSaver(marg_data_path));
+    marg_data_saver.reset(
+        new basalt::MargDataSaver(marg_data_path, vio_config));
     vio->out_marg_queue = &marg_data_saver->in_marg_queue;
   }
 
@@ -240,6 +257,21 @@ int main(int argc, char** argv) {
     std::cout << "Finished t4" << std::endl;
   });
 
+  std::shared_ptr<std::thread> t6;
+
+  if (imu_propagator)
+    t6.reset(new std::thread([&]() {
+      basalt::PoseVelBiasState<double>::Ptr data;
+
+      while (true) {
+        out_imu_state_queue.pop(data);
+
+        if (!data.get()) break;
+      }
+
+      std::cout << "Finished t6" << std::endl;
+    }));
+
   std::shared_ptr<std::thread> t5;
 
   if (print_queue) {
@@ -358,6 +390,7 @@ int main(int argc, char** argv) {
   if (t3.get()) t3->join();
   t4.join();
   if (t5.get()) t5->join();
+  if (t6.get()) t6->join();
 
   return 0;
 }
@@ -33,20 +33,23 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <algorithm>
+#include <limits>
 #include <unordered_set>
 
 #include <basalt/utils/keypoints.h>
+#include <basalt/utils/relative_pose.h>
 
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
-#include <opengv/relative_pose/CentralRelativeAdapter.hpp>
-#include <opengv/relative_pose/methods.hpp>
+#include <opengv/absolute_pose/CentralAbsoluteAdapter.hpp>
+#include <opengv/absolute_pose/methods.hpp>
 #include <opengv/sac/Ransac.hpp>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
-#include <opengv/sac_problems/relative_pose/CentralRelativePoseSacProblem.hpp>
+#include <opengv/sac_problems/absolute_pose/AbsolutePoseSacProblem.hpp>
 #pragma GCC diagnostic pop
 
 namespace basalt {
@@ -137,11 +140,14 @@ void detectKeypointsMapping(const basalt::Image<const uint16_t>& img_raw,
                             KeypointsData& kd, int num_features) {
   cv::Mat image(img_raw.h, img_raw.w, CV_8U);
 
-  uint8_t* dst = image.ptr();
-  const uint16_t* src = img_raw.ptr;
+  // The rows of the input can be padded, e.g. for the pyramid
+  for (size_t y = 0; y < img_raw.h; y++) {
+    uint8_t* dst = image.ptr(y);
+    const uint16_t* src = img_raw.RowPtr(y);
 
-  for (size_t i = 0; i < img_raw.size(); i++) {
-    dst[i] = (src[i] >> 8);
+    for (size_t x = 0; x < img_raw.w; x++) {
+      dst[x] = (src[x] >> 8);
+    }
   }
 
   std::vector<cv::Point2f> points;
@@ -310,52 +316,323 @@ void computeDescriptors(const basalt::Image<const uint16_t>& img_raw,
   }
 }
 
-void matchFastHelper(const std::vector<std::bitset<256>>& corner_descriptors_1,
-                     const std::vector<std::bitset<256>>& corner_descriptors_2,
-                     std::unordered_map<int, int>& matches, int threshold,
-                     double test_dist) {
-  matches.clear();
+namespace {
 
-  for (size_t i = 0; i < corner_descriptors_1.size(); i++) {
-    int best_idx = -1, best_dist = 500;
-    int best2_dist = 500;
+// Descriptor packed into 64 bit words for popcount based Hamming distances.
+struct PackedDescriptor {
+  uint64_t w[4];
+};
 
-    for (size_t j = 0; j < corner_descriptors_2.size(); j++) {
-      int dist = (corner_descriptors_1[i] ^ corner_descriptors_2[j]).count();
+void packDescriptors(const std::vector<std::bitset<256>>& descriptors,
+                     std::vector<PackedDescriptor>& packed) {
+  const std::bitset<256> mask(std::numeric_limits<uint64_t>::max());
 
-      if (dist <= best_dist) {
-        best2_dist = best_dist;
+  packed.resize(descriptors.size());
+  for (size_t i = 0; i < descriptors.size(); i++) {
+    for (int k = 0; k < 4; k++) {
+      packed[i].w[k] = ((descriptors[i] >> (64 * k)) & mask).to_ullong();
+    }
+  }
+}
 
-        best_dist = dist;
-        best_idx = j;
-      } else if (dist < best2_dist) {
-        best2_dist = dist;
-      }
+// Best and second best distance of one descriptor. Ties go to the later
+// candidate, as in a plain loop with "dist <= best_dist".
+struct BestMatch {
+  int best_idx = -1;
+  int best_dist = 500;
+  int best2_dist = 500;
+
+  inline void update(int idx, int dist) {
+    if (dist <= best_dist) {
+      best2_dist = best_dist;
+
+      best_dist = dist;
+      best_idx = idx;
+    } else if (dist < best2_dist) {
+      best2_dist = dist;
+    }
+  }
+
+  inline bool accept(int threshold, double test_dist) const {
+    return best_dist < threshold && best_dist * test_dist <= best2_dist;
+  }
+};
+
+// Hamming distance of two descriptors, or a value larger than max_dist if the
+// first half of the descriptor already exceeds it.
+inline int descriptorDistance(const PackedDescriptor& d1,
+                              const PackedDescriptor& d2, int max_dist) {
+  int dist = __builtin_popcountll(d1.w[0] ^ d2.w[0]) +
+             __builtin_popcountll(d1.w[1] ^ d2.w[1]);
+
+  if (dist > max_dist) return dist;
+
+  return dist + __builtin_popcountll(d1.w[2] ^ d2.w[2]) +
+         __builtin_popcountll(d1.w[3] ^ d2.w[3]);
+}
+
+void collectMutualMatches(const std::vector<BestMatch>& best_1,
+                          const std::vector<BestMatch>& best_2, int threshold,
+                          double dist_2_best,
+                          std::vector<std::pair<int, int>>& matches) {
+  for (size_t i = 0; i < best_1.size(); i++) {
+    const BestMatch& b1 = best_1[i];
+    if (!b1.accept(threshold, dist_2_best)) continue;
+
+    const BestMatch& b2 = best_2[b1.best_idx];
+    if (b2.accept(threshold, dist_2_best) && b2.best_idx == int(i)) {
+      matches.emplace_back(i, b1.best_idx);
     }
+  }
+}
 
-    if (best_dist < threshold && best_dist * test_dist <= best2_dist) {
-      matches.emplace(i, best_idx);
+// Clip the segment p0-p1 to the box [box_min, box_max] (Liang-Barsky).
+bool clipSegment(const Eigen::Vector2d& box_min, const Eigen::Vector2d& box_max,
+                 Eigen::Vector2d& p0, Eigen::Vector2d& p1) {
+  const Eigen::Vector2d d = p1 - p0;
+  double t0 = 0, t1 = 1;
+
+  for (int k = 0; k < 2; k++) {
+    const double q[2] = {p0[k] - box_min[k], box_max[k] - p0[k]};
+    const double p[2] = {-d[k], d[k]};
+
+    for (int m = 0; m < 2; m++) {
+      if (p[m] == 0) {
+        if (q[m] < 0) return false;
+      } else {
+        const double t = q[m] / p[m];
+        if (p[m] < 0) {
+          t0 = std::max(t0, t);
+        } else {
+          t1 = std::min(t1, t);
+        }
+      }
     }
   }
+
+  if (t0 > t1) return false;
+
+  const Eigen::Vector2d p_start = p0 + t0 * d;
+  p1 = p0 + t1 * d;
+  p0 = p_start;
+  return true;
 }
 
+// Number of descriptors of the second image processed together. 256
+// descriptors take 8KB and stay in L1 while all descriptors of the first
+// image are matched against them.
+constexpr size_t MATCH_TILE_SIZE = 256;
+
+}  // namespace
+
 void matchDescriptors(const std::vector<std::bitset<256>>& corner_descriptors_1,
                       const std::vector<std::bitset<256>>& corner_descriptors_2,
                       std::vector<std::pair<int, int>>& matches, int threshold,
                       double dist_2_best) {
   matches.clear();
 
-  std::unordered_map<int, int> matches_1_2, matches_2_1;
-  matchFastHelper(corner_descriptors_1, corner_descriptors_2, matches_1_2,
-                  threshold, dist_2_best);
-  matchFastHelper(corner_descriptors_2, corner_descriptors_1, matches_2_1,
-                  threshold, dist_2_best);
+  std::vector<PackedDescriptor> desc_1, desc_2;
+  packDescriptors(corner_descriptors_1, desc_1);
+  packDescriptors(corner_descriptors_2, desc_2);
+
+  // Both directions (1->2 and 2->1) are computed in one pass over the
+  // distance matrix. Rows and columns are visited in increasing order, so
+  // the result is the same as for two separate brute force searches.
+  std::vector<BestMatch> best_1(desc_1.size()), best_2(desc_2.size());
+
+  for (size_t j0 = 0; j0 < desc_2.size(); j0 += MATCH_TILE_SIZE) {
+    const size_t j1 = std::min(j0 + MATCH_TILE_SIZE, desc_2.size());
+
+    for (size_t i = 0; i < desc_1.size(); i++) {
+      const PackedDescriptor& d1 = desc_1[i];
+      BestMatch& b1 = best_1[i];
+
+      for (size_t j = j0; j < j1; j++) {
+        const PackedDescriptor& d2 = desc_2[j];
+        BestMatch& b2 = best_2[j];
+
+        // A distance larger than both second best distances changes neither
+        // the row nor the column.
+        const int max_dist = std::max(b1.best2_dist, b2.best2_dist);
+        const int dist = descriptorDistance(d1, d2, max_dist);
+        if (dist > max_dist) continue;
 
-  for (const auto& kv : matches_1_2) {
-    if (matches_2_1[kv.second] == kv.first) {
-      matches.emplace_back(kv.first, kv.second);
+        b1.update(j, dist);
+        b2.update(i, dist);
+      }
     }
   }
+
+  collectMutualMatches(best_1, best_2, threshold, dist_2_best, matches);
+}
+
+void matchDescriptorsGuided(const KeypointsData& kd1, const KeypointsData& kd2,
+                            const GenericCamera<double>& cam2,
+                            const Sophus::SE3d& T_1_2,
+                            std::vector<std::pair<int, int>>& matches,
+                            int threshold, double dist_2_best,
+                            double epipolar_error_threshold, double cell_size,
+                            double min_depth, double min_baseline) {
+  matches.clear();
+
+  if (kd1.corners.empty() || kd2.corners.empty()) return;
+
+  // The direction of a tiny translation is noise, every epipolar error would
+  // be close to zero or NaN.
+  if (!(T_1_2.translation().norm() >= min_baseline)) {
+    matchDescriptors(kd1.corner_descriptors, kd2.corner_descriptors, matches,
+                     threshold, dist_2_best);
+    return;
+  }
+
+  std::vector<PackedDescriptor> desc_1, desc_2;
+  packDescriptors(kd1.corner_descriptors, desc_1);
+  packDescriptors(kd2.corner_descriptors, desc_2);
+
+  // Grid over the bounding box of the corners in the second image. Points of
+  // a cell are stored contiguously.
+  Eigen::Vector2d box_min = kd2.corners[0], box_max = kd2.corners[0];
+  for (const auto& c : kd2.corners) {
+    box_min = box_min.cwiseMin(c);
+    box_max = box_max.cwiseMax(c);
+  }
+
+  const int grid_w = int((box_max[0] - box_min[0]) / cell_size) + 1;
+  const int grid_h = int((box_max[1] - box_min[1]) / cell_size) + 1;
+
+  auto cell_coords = [&](const Eigen::Vector2d& p, int& cx, int& cy) {
+    cx = int((p[0] - box_min[0]) / cell_size);
+    cy = int((p[1] - box_min[1]) / cell_size);
+  };
+
+  std::vector<int> cell_start(grid_w * grid_h + 1, 0);
+  std::vector<int> cell_points(kd2.corners.size());
+  {
+    std::vector<int> point_cell(kd2.corners.size());
+    for (size_t j = 0; j < kd2.corners.size(); j++) {
+      int cx, cy;
+      cell_coords(kd2.corners[j], cx, cy);
+      point_cell[j] = cy * grid_w + cx;
+      cell_start[point_cell[j] + 1]++;
+    }
+
+    for (size_t c = 1; c < cell_start.size(); c++) {
+      cell_start[c] += cell_start[c - 1];
+    }
+
+    std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+    for (size_t j = 0; j < kd2.corners.size(); j++) {
+      cell_points[fill[point_cell[j]]++] = j;
+    }
+  }
+
+  Eigen::Matrix4d E;
+  computeEssential(T_1_2, E);
+
+  const Sophus::SE3d T_2_1 = T_1_2.inverse();
+  const Eigen::Matrix3d R_2_1 = T_2_1.so3().matrix();
+  const Eigen::Vector3d t_2_1 = T_2_1.translation();
+
+  // Number of inverse depth samples in [0, 1 / min_depth] used to trace the
+  // epipolar curve. The curve is linear for pinhole cameras, the samples
+  // account for distortion.
+  constexpr int NUM_DEPTH_SAMPLES = 16;
+
+  std::vector<BestMatch> best_1(desc_1.size()), best_2(desc_2.size());
+
+  std::vector<int> cell_stamp(grid_w * grid_h, -1);
+  std::vector<int> cells, candidates;
+
+  for (size_t i = 0; i < desc_1.size(); i++) {
+    const Eigen::Vector4d& p1_3d = kd1.corners_3d[i];
+
+    cells.clear();
+
+    // Mark the cell of p and its neighbors, so the band covers at least one
+    // cell on each side of the curve. Points along the curve are at most one
+    // cell apart, so the marked neighborhoods overlap.
+    auto mark = [&](const Eigen::Vector2d& p) {
+      int cx, cy;
+      cell_coords(p, cx, cy);
+      for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, grid_h - 1);
+           y++) {
+        for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, grid_w - 1);
+             x++) {
+          const int c = y * grid_w + x;
+          if (cell_stamp[c] != int(i)) {
+            cell_stamp[c] = i;
+            cells.emplace_back(c);
+          }
+        }
+      }
+    };
+
+    Eigen::Vector2d prev_proj;
+    bool prev_valid = false;
+
+    for (int s = 0; s < NUM_DEPTH_SAMPLES; s++) {
+      const double inv_depth = s / (NUM_DEPTH_SAMPLES - 1.0) / min_depth;
+
+      Eigen::Vector4d p2_3d;
+      p2_3d.head<3>() = R_2_1 * p1_3d.head<3>() + inv_depth * t_2_1;
+      p2_3d[3] = inv_depth;
+
+      Eigen::Vector2d proj;
+      if (!cam2.project(p2_3d, proj)) {
+        prev_valid = false;
+        continue;
+      }
+
+      if (prev_valid) {
+        Eigen::Vector2d a = prev_proj, b = proj;
+        if (clipSegment(box_min, box_max, a, b)) {
+          const int steps = int((b - a).norm() / cell_size) + 1;
+          for (int k = 0; k <= steps; k++) {
+            mark(a + (b - a) * (double(k) / steps));
+          }
+        }
+      } else if ((proj.array() >= box_min.array()).all() &&
+                 (proj.array() <= box_max.array()).all()) {
+        mark(proj);
+      }
+
+      prev_proj = proj;
+      prev_valid = true;
+    }
+
+    // Epipolar plane normal, the error of p2_3d is |p1_3d^T * E * p2_3d|
+    const Eigen::Vector3d epipolar_normal =
+        E.topLeftCorner<3, 3>().transpose() * p1_3d.head<3>();
+
+    candidates.clear();
+    for (int c : cells) {
+      for (int k = cell_start[c]; k < cell_start[c + 1]; k++) {
+        const int j = cell_points[k];
+        const double epipolar_error =
+            std::abs(epipolar_normal.dot(kd2.corners_3d[j].head<3>()));
+        if (epipolar_error < epipolar_error_threshold) {
+          candidates.emplace_back(j);
+        }
+      }
+    }
+
+    // Same visiting order as the brute force matcher
+    std::sort(candidates.begin(), candidates.end());
+
+    BestMatch& b1 = best_1[i];
+    for (int j : candidates) {
+      BestMatch& b2 = best_2[j];
+
+      const int max_dist = std::max(b1.best2_dist, b2.best2_dist);
+      const int dist = descriptorDistance(desc_1[i], desc_2[j], max_dist);
+      if (dist > max_dist) continue;
+
+      b1.update(j, dist);
+      b2.update(i, dist);
+    }
+  }
+
+  collectMutualMatches(best_1, best_2, threshold, dist_2_best, matches);
 }
 
 void findInliersRansac(const KeypointsData& kd1, const KeypointsData& kd2,
@@ -363,65 +640,91 @@ void findInliersRansac(const KeypointsData& kd1, const KeypointsData& kd2,
                        MatchData& md) {
   md.inliers.clear();
 
-  opengv::bearingVectors_t bearingVectors1, bearingVectors2;
+  // Called from many threads for all image pairs, so the buffers are reused
+  thread_local std::vector<std::pair<int, int>> order;
+  thread_local Eigen::aligned_vector<Eigen::Vector3d> bearings1, bearings2;
+  thread_local std::vector<int> inliers;
+
+  // PROSAC samples the most distinctive matches first
+  const bool has_descriptors = !kd1.corner_descriptors.empty() &&
+                               !kd2.corner_descriptors.empty();
 
+  order.clear();
   for (size_t i = 0; i < md.matches.size(); i++) {
-    bearingVectors1.push_back(kd1.corners_3d[md.matches[i].first].head<3>());
-    bearingVectors2.push_back(kd2.corners_3d[md.matches[i].second].head<3>());
+    const auto& m = md.matches[i];
+    const int dist = has_descriptors
+                         ? (kd1.corner_descriptors[m.first] ^
+                            kd2.corner_descriptors[m.second])
+                               .count()
+                         : 0;
+    order.emplace_back(dist, i);
+  }
+  std::sort(order.begin(), order.end());
+
+  bearings1.clear();
+  bearings2.clear();
+  for (const auto& o : order) {
+    const auto& m = md.matches[o.second];
+    bearings1.emplace_back(kd1.corners_3d[m.first].head<3>());
+    bearings2.emplace_back(kd2.corners_3d[m.second].head<3>());
+  }
+
+  if (!findRelativePoseRansac(bearings1, bearings2, ransac_thresh, 100,
+                              md.T_i_j, inliers)) {
+    return;
   }
 
-  // create the central relative adapter
-  opengv::relative_pose::CentralRelativeAdapter adapter(bearingVectors1,
-                                                        bearingVectors2);
+  if ((long)inliers.size() >= ransac_min_inliers) {
+    // Keep the inliers in the order of the matches
+    for (int& i : inliers) i = order[i].second;
+    std::sort(inliers.begin(), inliers.end());
+
+    for (int i : inliers) md.inliers.emplace_back(md.matches[i]);
+  }
+}
+
+void findAbsolutePoseRansac(
+    const Eigen::aligned_vector<Eigen::Vector3d>& points_w,
+    const Eigen::aligned_vector<Eigen::Vector3d>& bearings,
+    const double ransac_thresh, Sophus::SE3d& T_w_c,
+    std::vector<size_t>& inliers) {
+  inliers.clear();
+
+  opengv::bearingVectors_t bearingVectors(bearings.begin(), bearings.end());
+  opengv::points_t points(points_w.begin(), points_w.end());
+
+  // create the central absolute adapter
+  opengv::absolute_pose::CentralAbsoluteAdapter adapter(bearingVectors,
+                                                        points);
   // create a RANSAC object
   opengv::sac::Ransac<
-      opengv::sac_problems::relative_pose::CentralRelativePoseSacProblem>
+      opengv::sac_problems::absolute_pose::AbsolutePoseSacProblem>
       ransac;
-  // create a CentralRelativePoseSacProblem
-  // (set algorithm to STEWENIUS, NISTER, SEVENPT, or EIGHTPT)
-  std::shared_ptr<
-      opengv::sac_problems::relative_pose::CentralRelativePoseSacProblem>
-      relposeproblem_ptr(
-          new opengv::sac_problems::relative_pose::
-              CentralRelativePoseSacProblem(
-                  adapter, opengv::sac_problems::relative_pose::
-                               CentralRelativePoseSacProblem::STEWENIUS));
+  std::shared_ptr<opengv::sac_problems::absolute_pose::AbsolutePoseSacProblem>
+      absposeproblem_ptr(
+          new opengv::sac_problems::absolute_pose::AbsolutePoseSacProblem(
+              adapter, opengv::sac_problems::absolute_pose::
+                           AbsolutePoseSacProblem::KNEIP));
   // run ransac
-  ransac.sac_model_ = relposeproblem_ptr;
+  ransac.sac_model_ = absposeproblem_ptr;
   ransac.threshold_ = ransac_thresh;
   ransac.max_iterations_ = 100;
-  ransac.computeModel();
+  if (!ransac.computeModel()) return;
 
   // do non-linear refinement and add more inliers
-  const size_t num_inliers_ransac = ransac.inliers_.size();
-
-  adapter.sett12(ransac.model_coefficients_.topRightCorner<3, 1>());
-  adapter.setR12(ransac.model_coefficients_.topLeftCorner<3, 3>());
+  adapter.sett(ransac.model_coefficients_.topRightCorner<3, 1>());
+  adapter.setR(ransac.model_coefficients_.topLeftCorner<3, 3>());
 
   const opengv::transformation_t nonlinear_transformation =
-      opengv::relative_pose::optimize_nonlinear(adapter, ransac.inliers_);
+      opengv::absolute_pose::optimize_nonlinear(adapter, ransac.inliers_);
 
   ransac.sac_model_->selectWithinDistance(nonlinear_transformation,
                                           ransac.threshold_, ransac.inliers_);
 
-  // Sanity check if the number of inliers decreased, but only warn if it is
-  // by 3 or more, since some small fluctuation is expected.
-  if (ransac.inliers_.size() + 2 < num_inliers_ransac) {
-    std::cout << "Warning: non-linear refinement reduced the relative pose "
-                 "ransac inlier count from "
-              << num_inliers_ransac << " to " << ransac.inliers_.size() << "."
-              << std::endl;
-  }
+  T_w_c = Sophus::SE3d(nonlinear_transformation.topLeftCorner<3, 3>(),
+                       nonlinear_transformation.topRightCorner<3, 1>());
 
-  // get the result (normalize translation)
-  md.T_i_j = Sophus::SE3d(
-      nonlinear_transformation.topLeftCorner<3, 3>(),
-      nonlinear_transformation.topRightCorner<3, 1>().normalized());
-
-  if ((long)ransac.inliers_.size() >= ransac_min_inliers) {
-    for (size_t i = 0; i < ransac.inliers_.size(); i++)
-      md.inliers.emplace_back(md.matches[ransac.inliers_[i]]);
-  }
+  inliers.assign(ransac.inliers_.begin(), ransac.inliers_.end());
 }
 
 }  // namespace basalt
@@ -0,0 +1,519 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <basalt/utils/relative_pose.h>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <random>
+
+#include <Eigen/Eigenvalues>
+
+namespace basalt {
+
+namespace {
+
+// Polynomials of degree up to 3 in the unknowns of
+// E = x * E1 + y * E2 + z * E3 + E4. The monomials are ordered
+// x^3, x^2y, x^2z, xy^2, xyz, xz^2, y^3, y^2z, yz^2, z^3,
+// x^2, xy, xz, y^2, yz, z^2, x, y, z, 1,
+// so the cubic monomials can be eliminated first. Linear polynomials only
+// use the last 4, quadratic polynomials the last 10 coefficients.
+using Poly = Eigen::Matrix<double, 20, 1>;
+
+constexpr int POLY_LINEAR_BEGIN = 16;
+constexpr int POLY_QUADRATIC_BEGIN = 10;
+
+constexpr int MONOMIAL_EXPONENTS[20][3] = {
+    {3, 0, 0}, {2, 1, 0}, {2, 0, 1}, {1, 2, 0}, {1, 1, 1},
+    {1, 0, 2}, {0, 3, 0}, {0, 2, 1}, {0, 1, 2}, {0, 0, 3},
+    {2, 0, 0}, {1, 1, 0}, {1, 0, 1}, {0, 2, 0}, {0, 1, 1},
+    {0, 0, 2}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1}, {0, 0, 0}};
+
+struct MonomialProducts {
+  // Index of the product of two monomials, -1 if the degree is above 3
+  int index[20][20];
+
+  MonomialProducts() {
+    int monomial_index[4][4][4];
+    for (int i = 0; i < 20; i++) {
+      const int* e = MONOMIAL_EXPONENTS[i];
+      monomial_index[e[0]][e[1]][e[2]] = i;
+    }
+
+    for (int i = 0; i < 20; i++) {
+      for (int j = 0; j < 20; j++) {
+        const int a = MONOMIAL_EXPONENTS[i][0] + MONOMIAL_EXPONENTS[j][0];
+        const int b = MONOMIAL_EXPONENTS[i][1] + MONOMIAL_EXPONENTS[j][1];
+        const int c = MONOMIAL_EXPONENTS[i][2] + MONOMIAL_EXPONENTS[j][2];
+        index[i][j] = a + b + c <= 3 ? monomial_index[a][b][c] : -1;
+      }
+    }
+  }
+};
+
+// Product of polynomials that are zero before a_begin and b_begin. The
+// degree of the result has to be at most 3.
+inline Poly multiply(const Poly& a, int a_begin, const Poly& b, int b_begin) {
+  static const MonomialProducts products;
+
+  Poly res = Poly::Zero();
+  for (int i = a_begin; i < 20; i++) {
+    for (int j = b_begin; j < 20; j++) {
+      res[products.index[i][j]] += a[i] * b[j];
+    }
+  }
+  return res;
+}
+
+inline Poly multiplyLinear(const Poly& a, const Poly& b) {
+  return multiply(a, POLY_LINEAR_BEGIN, b, POLY_LINEAR_BEGIN);
+}
+
+inline Poly multiplyQuadraticLinear(const Poly& a, const Poly& b) {
+  return multiply(a, POLY_QUADRATIC_BEGIN, b, POLY_LINEAR_BEGIN);
+}
+
+// Bearing vectors as structure of arrays, so the scoring loop vectorizes
+struct RansacScratch {
+  std::vector<double> f1x, f1y, f1z, f2x, f2y, f2z;
+  std::vector<double> residuals;
+
+  void set(const Eigen::aligned_vector<Eigen::Vector3d>& f1,
+           const Eigen::aligned_vector<Eigen::Vector3d>& f2) {
+    const size_t n = f1.size();
+    f1x.resize(n), f1y.resize(n), f1z.resize(n);
+    f2x.resize(n), f2y.resize(n), f2z.resize(n);
+    residuals.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+      f1x[i] = f1[i].x(), f1y[i] = f1[i].y(), f1z[i] = f1[i].z();
+      f2x[i] = f2[i].x(), f2y[i] = f2[i].y(), f2z[i] = f2[i].z();
+    }
+  }
+
+  Eigen::Vector3d bearing1(int i) const {
+    return Eigen::Vector3d(f1x[i], f1y[i], f1z[i]);
+  }
+
+  Eigen::Vector3d bearing2(int i) const {
+    return Eigen::Vector3d(f2x[i], f2y[i], f2z[i]);
+  }
+};
+
+// Sampson approximation of the opengv reprojection error
+// (1 - cos(a1)) + (1 - cos(a2)), where the epipolar error is split evenly
+// between both views. Returns the number of residuals below threshold.
+int computeResiduals(const Eigen::Matrix3d& E, RansacScratch& s,
+                     double threshold) {
+  const int n = s.residuals.size();
+
+  const double e00 = E(0, 0), e01 = E(0, 1), e02 = E(0, 2);
+  const double e10 = E(1, 0), e11 = E(1, 1), e12 = E(1, 2);
+  const double e20 = E(2, 0), e21 = E(2, 1), e22 = E(2, 2);
+
+  const double* f1x = s.f1x.data();
+  const double* f1y = s.f1y.data();
+  const double* f1z = s.f1z.data();
+  const double* f2x = s.f2x.data();
+  const double* f2y = s.f2y.data();
+  const double* f2z = s.f2z.data();
+  double* residuals = s.residuals.data();
+
+  for (int i = 0; i < n; i++) {
+    // E * f2
+    const double ax = e00 * f2x[i] + e01 * f2y[i] + e02 * f2z[i];
+    const double ay = e10 * f2x[i] + e11 * f2y[i] + e12 * f2z[i];
+    const double az = e20 * f2x[i] + e21 * f2y[i] + e22 * f2z[i];
+
+    // E^T * f1
+    const double bx = e00 * f1x[i] + e10 * f1y[i] + e20 * f1z[i];
+    const double by = e01 * f1x[i] + e11 * f1y[i] + e21 * f1z[i];
+    const double bz = e02 * f1x[i] + e12 * f1y[i] + e22 * f1z[i];
+
+    const double num = f1x[i] * ax + f1y[i] * ay + f1z[i] * az;
+    const double n1 = ax * ax + ay * ay + az * az;
+    const double n2 = bx * bx + by * by + bz * bz;
+
+    residuals[i] = 0.125 * num * num * (1.0 / n1 + 1.0 / n2);
+  }
+
+  int num_inliers = 0;
+  for (int i = 0; i < n; i++) num_inliers += residuals[i] < threshold;
+
+  return num_inliers;
+}
+
+// Checks if d1 * f1 = d2 * R * f2 + t has a solution with positive depths
+inline bool inFront(const Eigen::Vector3d& f1, const Eigen::Vector3d& Rf2,
+                    const Eigen::Vector3d& t) {
+  const double c = f1.dot(Rf2);
+  const double det = 1 - c * c;
+  if (det < 1e-12) return false;
+
+  const double a = f1.dot(t);
+  const double b = Rf2.dot(t);
+  const double d1 = (a - c * b) / det;
+  const double d2 = (c * a - b) / det;
+
+  return d1 > 0 && d2 > 0;
+}
+
+// Selects the decomposition E = [t]_x R with most inliers in front of both
+// cameras
+void decomposeEssential(const Eigen::Matrix3d& E, const RansacScratch& s,
+                        const std::vector<int>& inliers, Sophus::SO3d& R,
+                        Eigen::Vector3d& t) {
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(
+      E, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  Eigen::Matrix3d U = svd.matrixU();
+  Eigen::Matrix3d V = svd.matrixV();
+
+  // The last singular value is zero, so the sign of the last column does
+  // not change E
+  if (U.determinant() < 0) U.col(2) *= -1;
+  if (V.determinant() < 0) V.col(2) *= -1;
+
+  Eigen::Matrix3d W;
+  W << 0, -1, 0, 1, 0, 0, 0, 0, 1;
+
+  const Eigen::Matrix3d Rs[2] = {U * W * V.transpose(),
+                                 U * W.transpose() * V.transpose()};
+
+  int best_count = -1;
+  for (int k = 0; k < 4; k++) {
+    const Eigen::Matrix3d& Rk = Rs[k / 2];
+    const Eigen::Vector3d tk = k % 2 == 0 ? 1.0 * U.col(2) : -1.0 * U.col(2);
+
+    int count = 0;
+    for (int i : inliers) {
+      count += inFront(s.bearing1(i), Rk * s.bearing2(i), tk);
+    }
+
+    if (count > best_count) {
+      best_count = count;
+      R = Sophus::SO3d(Eigen::Quaterniond(Rk).normalized());
+      t = tk;
+    }
+  }
+}
+
+// Scale of the Cauchy loss relative to the inlier threshold. Outliers that
+// are just below the threshold would otherwise dominate the refinement.
+constexpr double ROBUST_SCALE = 0.01;
+
+// Gauss-Newton on the Sampson error of the inliers with a Cauchy loss. The
+// translation stays unit length.
+void refineRelativePose(const RansacScratch& s, const std::vector<int>& inliers,
+                        double threshold, Sophus::SO3d& R, Eigen::Vector3d& t) {
+  for (int iter = 0; iter < 5; iter++) {
+    // Basis of the tangent space of the unit sphere at t
+    const Eigen::Vector3d a = std::abs(t.x()) < 0.9 ? Eigen::Vector3d::UnitX()
+                                                    : Eigen::Vector3d::UnitY();
+    const Eigen::Vector3d b1 = t.cross(a).normalized();
+    const Eigen::Vector3d b2 = t.cross(b1);
+
+    const Eigen::Matrix3d Rm = R.matrix();
+
+    Eigen::Matrix<double, 5, 5> H;
+    Eigen::Matrix<double, 5, 1> g;
+    H.setZero();
+    g.setZero();
+
+    for (int i : inliers) {
+      const Eigen::Vector3d f1 = s.bearing1(i);
+      const Eigen::Vector3d f2 = s.bearing2(i);
+      const Eigen::Vector3d v = Rm * f2;
+
+      const double n1 = t.cross(v).squaredNorm();
+      const double n2 = t.cross(f1).squaredNorm();
+      if (n1 < 1e-12 || n2 < 1e-12) continue;
+      const double w_sampson = 0.125 * (1.0 / n1 + 1.0 / n2);
+
+      // r = f1^T [t]_x R f2, with R <- R * exp(d_r), t <- t + B * d_t
+      const double r = f1.dot(t.cross(v));
+
+      const double w =
+          w_sampson / (1.0 + w_sampson * r * r / (ROBUST_SCALE * threshold));
+
+      const Eigen::Vector3d u = Rm.transpose() * f1.cross(t);
+      const Eigen::Vector3d v_f1 = v.cross(f1);
+
+      Eigen::Matrix<double, 1, 5> J;
+      J.head<3>() = -u.cross(f2).transpose();
+      J[3] = v_f1.dot(b1);
+      J[4] = v_f1.dot(b2);
+
+      H += w * J.transpose() * J;
+      g += w * J.transpose() * r;
+    }
+
+    const Eigen::Matrix<double, 5, 1> inc = -H.ldlt().solve(g);
+    if (!inc.allFinite()) return;
+
+    R = R * Sophus::SO3d::exp(inc.head<3>());
+    t = (t + b1 * inc[3] + b2 * inc[4]).normalized();
+
+    if (inc.norm() < 1e-10) return;
+  }
+}
+
+// Iteration count of the PROSAC growth function
+constexpr double PROSAC_T_N = 200000;
+
+// Confidence for the adaptive termination
+constexpr double RANSAC_CONFIDENCE = 0.99;
+
+}  // namespace
+
+int fivePointEssential(const Eigen::Matrix<double, 3, 5>& f1,
+                       const Eigen::Matrix<double, 3, 5>& f2,
+                       std::array<Eigen::Matrix3d, 10>& E) {
+  // Epipolar constraints f1^T E f2 = 0 on the row-major entries of E
+  Eigen::Matrix<double, 9, 5> Qt;
+  for (int i = 0; i < 5; i++) {
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        Qt(3 * r + c, i) = f1(r, i) * f2(c, i);
+      }
+    }
+  }
+
+  // The last 4 columns of the full Q factor span the null space
+  Eigen::HouseholderQR<Eigen::Matrix<double, 9, 5>> qr(Qt);
+  const Eigen::Matrix<double, 9, 9> Q = qr.householderQ();
+  const Eigen::Matrix<double, 9, 4> null_space = Q.rightCols<4>();
+
+  Poly Ep[3][3];
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) {
+      Ep[r][c].setZero();
+      Ep[r][c].tail<4>() = null_space.row(3 * r + c).transpose();
+    }
+  }
+
+  Eigen::Matrix<double, 10, 20> M;
+
+  // det(E) = 0
+  const Poly det =
+      multiplyQuadraticLinear(multiplyLinear(Ep[1][1], Ep[2][2]) -
+                                  multiplyLinear(Ep[1][2], Ep[2][1]),
+                              Ep[0][0]) -
+      multiplyQuadraticLinear(multiplyLinear(Ep[1][0], Ep[2][2]) -
+                                  multiplyLinear(Ep[1][2], Ep[2][0]),
+                              Ep[0][1]) +
+      multiplyQuadraticLinear(multiplyLinear(Ep[1][0], Ep[2][1]) -
+                                  multiplyLinear(Ep[1][1], Ep[2][0]),
+                              Ep[0][2]);
+  M.row(0) = det.transpose();
+
+  // 2 E E^T E - trace(E E^T) E = 0
+  Poly EEt[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = i; j < 3; j++) {
+      EEt[i][j] = multiplyLinear(Ep[i][0], Ep[j][0]) +
+                  multiplyLinear(Ep[i][1], Ep[j][1]) +
+                  multiplyLinear(Ep[i][2], Ep[j][2]);
+      EEt[j][i] = EEt[i][j];
+    }
+  }
+  const Poly trace = EEt[0][0] + EEt[1][1] + EEt[2][2];
+
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      Poly c = -multiplyQuadraticLinear(trace, Ep[i][j]);
+      for (int k = 0; k < 3; k++) {
+        c += 2 * multiplyQuadraticLinear(EEt[i][k], Ep[k][j]);
+      }
+      M.row(1 + 3 * i + j) = c.transpose();
+    }
+  }
+
+  // Express the cubic monomials in the basis
+  // x^2, xy, xz, y^2, yz, z^2, x, y, z, 1
+  const Eigen::Matrix<double, 10, 10> G =
+      -M.leftCols<10>().partialPivLu().solve(M.rightCols<10>());
+  if (!G.allFinite()) return 0;
+
+  // Action matrix of the multiplication with x on the basis. Its
+  // eigenvectors are the basis monomials evaluated at the solutions.
+  Eigen::Matrix<double, 10, 10> A;
+  A.setZero();
+  A.topRows<6>() = G.topRows<6>();  // x^3, x^2y, x^2z, xy^2, xyz, xz^2
+  A(6, 0) = 1;                      // x^2
+  A(7, 1) = 1;                      // xy
+  A(8, 2) = 1;                      // xz
+  A(9, 6) = 1;                      // x
+
+  Eigen::EigenSolver<Eigen::Matrix<double, 10, 10>> es(A);
+  if (es.info() != Eigen::Success) return 0;
+
+  int num_solutions = 0;
+  for (int k = 0; k < 10; k++) {
+    const std::complex<double> lambda = es.eigenvalues()[k];
+    if (std::abs(lambda.imag()) > 1e-8 * std::max(1.0, std::abs(lambda.real())))
+      continue;
+
+    const auto v = es.eigenvectors().col(k);
+    if (std::abs(v[9]) < 1e-12 * v.norm()) continue;
+
+    const Eigen::Vector4d xyz1((v[6] / v[9]).real(), (v[7] / v[9]).real(),
+                               (v[8] / v[9]).real(), 1.0);
+    const Eigen::Matrix<double, 9, 1> e = null_space * xyz1;
+
+    Eigen::Matrix3d& Ek = E[num_solutions++];
+    Ek << e[0], e[1], e[2], e[3], e[4], e[5], e[6], e[7], e[8];
+    Ek.normalize();
+  }
+
+  return num_solutions;
+}
+
+bool findRelativePoseRansac(const Eigen::aligned_vector<Eigen::Vector3d>& f1,
+                            const Eigen::aligned_vector<Eigen::Vector3d>& f2,
+                            double threshold, int max_iterations,
+                            Sophus::SE3d& T_1_2, std::vector<int>& inliers) {
+  constexpr int m = 5;
+
+  inliers.clear();
+
+  const int num_points = f1.size();
+  if (num_points < m) return false;
+
+  thread_local RansacScratch s;
+  s.set(f1, f2);
+
+  // Fixed seed, so the result does not depend on the thread
+  std::minstd_rand rng(num_points);
+
+  // PROSAC: sample from the n best correspondences, n grows with the number
+  // of iterations
+  double T_n = PROSAC_T_N;
+  for (int i = 0; i < m; i++) T_n *= double(m - i) / double(num_points - i);
+  double T_n_prime = 1;
+  int n = m;
+
+  int best_num_inliers = 0;
+  Eigen::Matrix3d best_E;
+  double num_iterations_needed = max_iterations;
+
+  std::array<Eigen::Matrix3d, 10> Es;
+  Eigen::Matrix<double, 3, 5> sample1, sample2;
+  int sample[m];
+
+  for (int t = 1; t <= max_iterations && t <= num_iterations_needed; t++) {
+    if (t > T_n_prime && n < num_points) {
+      const double T_n_next = T_n * (n + 1) / (n + 1 - m);
+      T_n_prime += std::ceil(T_n_next - T_n);
+      T_n = T_n_next;
+      n++;
+    }
+
+    // Either m points from the first n, or the n-th point and m - 1 points
+    // from the first n - 1
+    int num_sampled = 0;
+    int pool_size = n;
+    if (T_n_prime >= t) {
+      sample[num_sampled++] = n - 1;
+      pool_size = n - 1;
+    }
+
+    while (num_sampled < m) {
+      const int idx = rng() % pool_size;
+      if (std::find(sample, sample + num_sampled, idx) == sample + num_sampled)
+        sample[num_sampled++] = idx;
+    }
+
+    for (int i = 0; i < m; i++) {
+      sample1.col(i) = f1[sample[i]];
+      sample2.col(i) = f2[sample[i]];
+    }
+
+    const int num_solutions = fivePointEssential(sample1, sample2, Es);
+
+    for (int k = 0; k < num_solutions; k++) {
+      const int num_inliers = computeResiduals(Es[k], s, threshold);
+      if (num_inliers <= best_num_inliers) continue;
+
+      best_num_inliers = num_inliers;
+      best_E = Es[k];
+
+      // Iterations to draw an outlier free sample with the given confidence
+      const double p_good =
+          std::pow(double(num_inliers) / double(num_points), m);
+      if (p_good >= 1) {
+        num_iterations_needed = 0;
+      } else if (p_good > 0) {
+        num_iterations_needed =
+            std::log(1 - RANSAC_CONFIDENCE) / std::log(1 - p_good);
+      }
+    }
+  }
+
+  if (best_num_inliers < m) return false;
+
+  computeResiduals(best_E, s, threshold);
+  for (int i = 0; i < num_points; i++) {
+    if (s.residuals[i] < threshold) inliers.emplace_back(i);
+  }
+
+  Sophus::SO3d R;
+  Eigen::Vector3d t;
+  decomposeEssential(best_E, s, inliers, R, t);
+
+  // Non-linear refinement and select the inliers again, rejecting points
+  // behind the cameras
+  refineRelativePose(s, inliers, threshold, R, t);
+
+  const Eigen::Matrix3d E = Sophus::SO3d::hat(t) * R.matrix();
+  computeResiduals(E, s, threshold);
+
+  const Eigen::Matrix3d Rm = R.matrix();
+  inliers.clear();
+  for (int i = 0; i < num_points; i++) {
+    if (s.residuals[i] < threshold &&
+        inFront(s.bearing1(i), Rm * s.bearing2(i), t)) {
+      inliers.emplace_back(i);
+    }
+  }
+
+  T_1_2 = Sophus::SE3d(R, t);
+
+  return true;
+}
+
+}  // namespace basalt
@@ -76,6 +76,11 @@ VioConfig::VioConfig() {
   vio_init_ba_weight = 1e1;
   vio_init_bg_weight = 1e2;
 
+  vio_reintegrate_bg_thresh = 0.002;
+  vio_reintegrate_ba_thresh = 0.02;
+
+  vio_marg_data_features = false;
+
   mapper_obs_std_dev = 0.25;
   mapper_obs_huber_thresh = 1.5;
   mapper_detection_num_points = 800;
@@ -86,6 +91,12 @@ VioConfig::VioConfig() {
   mapper_min_track_length = 5;
   mapper_max_hamming_distance = 70;
   mapper_second_best_test_ratio = 1.2;
+  mapper_guided_matching = false;
+  mapper_guided_epipolar_error = 5e-3;
+  mapper_guided_cell_size = 32;
+  mapper_guided_min_depth = 0.3;
+  mapper_guided_max_time_diff = 2.0;
+  mapper_guided_min_baseline = 0.01;
   mapper_bow_num_bits = 16;
   mapper_min_triangulation_dist = 0.07;
   mapper_no_factor_weights = false;
@@ -94,6 +105,23 @@ VioConfig::VioConfig() {
   mapper_use_lm = false;
   mapper_lm_lambda_min = 1e-32;
   mapper_lm_lambda_max = 1e2;
+  mapper_local_window = 10.0;
+  mapper_pose_graph_init = false;
+  mapper_loop_min_time_diff = 10.0;
+  mapper_loop_pos_std_dev = 0.05;
+  mapper_loop_rot_std_dev = 0.01;
+  mapper_session_align_pos_thresh = 0.5;
+  mapper_session_align_rot_thresh = 0.1;
+  mapper_session_align_min_inliers = 3;
+  mapper_partitioned = false;
+  mapper_submap_size = 30.0;
+  mapper_submap_overlap = 5.0;
+  mapper_submap_iterations = 3;
+
+  loop_exclusion_window = 10.0;
+  loop_latency_budget = 0.2;
+  loop_min_score = 0.04;
+  loop_num_candidates = 5;
 }
 
 void VioConfig::save(const std::string& filename) {
@@ -153,6 +181,11 @@ void serialize(Archive& ar, basalt::VioConfig& config) {
   ar(CEREAL_NVP(config.vio_init_ba_weight));
   ar(CEREAL_NVP(config.vio_init_bg_weight));
 
+  ar(CEREAL_NVP(config.vio_reintegrate_bg_thresh));
+  ar(CEREAL_NVP(config.vio_reintegrate_ba_thresh));
+
+  ar(CEREAL_NVP(config.vio_marg_data_features));
+
   ar(CEREAL_NVP(config.mapper_obs_std_dev));
   ar(CEREAL_NVP(config.mapper_obs_huber_thresh));
   ar(CEREAL_NVP(config.mapper_detection_num_points));
@@ -163,6 +196,12 @@ void serialize(Archive& ar, basalt::VioConfig& config) {
   ar(CEREAL_NVP(config.mapper_min_track_length));
   ar(CEREAL_NVP(config.mapper_max_hamming_distance));
   ar(CEREAL_NVP(config.mapper_second_best_test_ratio));
+  ar(CEREAL_NVP(config.mapper_guided_matching));
+  ar(CEREAL_NVP(config.mapper_guided_epipolar_error));
+  ar(CEREAL_NVP(config.mapper_guided_cell_size));
+  ar(CEREAL_NVP(config.mapper_guided_min_depth));
+  ar(CEREAL_NVP(config.mapper_guided_max_time_diff));
+  ar(CEREAL_NVP(config.mapper_guided_min_baseline));
   ar(CEREAL_NVP(config.mapper_bow_num_bits));
   ar(CEREAL_NVP(config.mapper_min_triangulation_dist));
   ar(CEREAL_NVP(config.mapper_no_factor_weights));
@@ -171,5 +210,22 @@ void serialize(Archive& ar, basalt::VioConfig& config) {
   ar(CEREAL_NVP(config.mapper_use_lm));
   ar(CEREAL_NVP(config.mapper_lm_lambda_min));
   ar(CEREAL_NVP(config.mapper_lm_lambda_max));
+  ar(CEREAL_NVP(config.mapper_local_window));
+  ar(CEREAL_NVP(config.mapper_pose_graph_init));
+  ar(CEREAL_NVP(config.mapper_loop_min_time_diff));
+  ar(CEREAL_NVP(config.mapper_loop_pos_std_dev));
+  ar(CEREAL_NVP(config.mapper_loop_rot_std_dev));
+  ar(CEREAL_NVP(config.mapper_session_align_pos_thresh));
+  ar(CEREAL_NVP(config.mapper_session_align_rot_thresh));
+  ar(CEREAL_NVP(config.mapper_session_align_min_inliers));
+  ar(CEREAL_NVP(config.mapper_partitioned));
+  ar(CEREAL_NVP(config.mapper_submap_size));
+  ar(CEREAL_NVP(config.mapper_submap_overlap));
+  ar(CEREAL_NVP(config.mapper_submap_iterations));
+
+  ar(CEREAL_NVP(config.loop_exclusion_window));
+  ar(CEREAL_NVP(config.loop_latency_budget));
+  ar(CEREAL_NVP(config.loop_min_score));
+  ar(CEREAL_NVP(config.loop_num_candidates));
 }
 }  // namespace cereal
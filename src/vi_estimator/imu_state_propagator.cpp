@@ -0,0 +1,134 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <basalt/vi_estimator/imu_state_propagator.h>
+
+namespace basalt {
+
+ImuStatePropagator::ImuStatePropagator(const Eigen::Vector3d& g,
+                                       const basalt::Calibration<double>& calib)
+    : g(g), calib(calib), anchored(false), state_pool(1024) {
+  imu_data_queue.set_capacity(300);
+  state_queue.set_capacity(16);
+
+  processing_thread.reset(
+      new std::thread(&ImuStatePropagator::processingLoop, this));
+}
+
+void ImuStatePropagator::processingLoop() {
+  ImuData<double>::Ptr data;
+  PoseVelBiasState<double>::Ptr state;
+
+  while (true) {
+    imu_data_queue.pop(data);
+
+    if (!data.get()) {
+      if (out_imu_queue) out_imu_queue->push(nullptr);
+      if (out_state_queue) out_state_queue->push(nullptr);
+      break;
+    }
+
+    // The estimator calibrates samples in place, so keep a copy before
+    // handing the sample over.
+    ImuData<double> sample = *data;
+    if (out_imu_queue) out_imu_queue->push(data);
+
+    sample.accel = calib.calib_accel_bias.getCalibrated(sample.accel);
+    sample.gyro = calib.calib_gyro_bias.getCalibrated(sample.gyro);
+
+    // Only the most recent optimized state matters.
+    PoseVelBiasState<double>::Ptr latest_state;
+    while (state_queue.try_pop(state)) {
+      if (state.get()) latest_state = state;
+    }
+
+    if (!anchored || sample.t_ns > curr_state.t_ns) {
+      imu_buffer.emplace_back(sample);
+      if (imu_buffer.size() > MAX_BUFFERED_SAMPLES) imu_buffer.pop_front();
+    }
+
+    const bool new_anchor =
+        latest_state.get() &&
+        (!anchored || latest_state->t_ns != anchor_state.t_ns);
+
+    if (new_anchor) {
+      reanchor(*latest_state);
+    } else if (anchored && sample.t_ns > curr_state.t_ns) {
+      propagate(sample);
+    } else {
+      continue;
+    }
+
+    if (out_state_queue && curr_state.t_ns > anchor_state.t_ns) {
+      PoseVelBiasState<double>::Ptr res = state_pool.get();
+      *res = PoseVelBiasState<double>(
+          curr_state.t_ns, curr_state.T_w_i, curr_state.vel_w_i,
+          anchor_state.bias_gyro, anchor_state.bias_accel);
+
+      // Never stall the IMU path because of a slow consumer.
+      out_state_queue->try_push(std::move(res));
+    }
+  }
+}
+
+void ImuStatePropagator::propagate(const ImuData<double>& data) {
+  ImuData<double> data_corrected = data;
+  data_corrected.accel -= anchor_state.bias_accel;
+  data_corrected.gyro -= anchor_state.bias_gyro;
+
+  PoseVelState<double> next_state;
+  IntegratedImuMeasurement<double>::propagateState(curr_state, data_corrected,
+                                                   next_state);
+
+  // propagateState integrates without gravity.
+  const double dt = (data.t_ns - curr_state.t_ns) * 1e-9;
+  next_state.vel_w_i += g * dt;
+  next_state.T_w_i.translation() += 0.5 * g * dt * dt;
+
+  curr_state = next_state;
+}
+
+void ImuStatePropagator::reanchor(const PoseVelBiasState<double>& anchor) {
+  anchored = true;
+  anchor_state = anchor;
+  curr_state = PoseVelState<double>(anchor.t_ns, anchor.T_w_i, anchor.vel_w_i);
+
+  while (!imu_buffer.empty() && imu_buffer.front().t_ns <= anchor.t_ns)
+    imu_buffer.pop_front();
+
+  for (const auto& d : imu_buffer) propagate(d);
+}
+
+}  // namespace basalt
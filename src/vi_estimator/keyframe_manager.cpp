@@ -0,0 +1,174 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <basalt/vi_estimator/keyframe_manager.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <limits>
+
+namespace basalt {
+
+void KeyframeManager::setPosition(int64_t kf_id, const Eigen::Vector3d& pos) {
+  auto it = slots.find(kf_id);
+
+  if (it == slots.end()) {
+    size_t slot;
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      slot = positions.size();
+      positions.emplace_back();
+      changed.emplace_back(0);
+
+      inv_dist.conservativeResize(slot + 1, slot + 1);
+      inv_dist.row(slot).setZero();
+      inv_dist.col(slot).setZero();
+      row_sum.conservativeResize(slot + 1);
+      row_sum[slot] = 0;
+    }
+
+    slots.emplace(kf_id, slot);
+    positions[slot] = pos;
+    changed[slot] = 1;
+  } else if (positions[it->second] != pos) {
+    positions[it->second] = pos;
+    changed[it->second] = 1;
+  }
+}
+
+void KeyframeManager::erase(int64_t kf_id) {
+  auto it = slots.find(kf_id);
+  if (it == slots.end()) return;
+
+  const size_t slot = it->second;
+  slots.erase(it);
+  free_slots.emplace_back(slot);
+  changed[slot] = 0;
+
+  if (!sums_dirty) row_sum -= inv_dist.col(slot);
+
+  inv_dist.row(slot).setZero();
+  inv_dist.col(slot).setZero();
+  row_sum[slot] = 0;
+}
+
+void KeyframeManager::retain(const std::set<int64_t>& kf_ids) {
+  std::vector<int64_t> to_erase;
+  for (const auto& kv : slots) {
+    if (kf_ids.count(kv.first) == 0) to_erase.emplace_back(kv.first);
+  }
+
+  for (int64_t id : to_erase) erase(id);
+}
+
+void KeyframeManager::updateDistances() {
+  std::vector<size_t> active, changed_slots;
+  active.reserve(slots.size());
+  for (const auto& kv : slots) {
+    active.emplace_back(kv.second);
+    if (changed[kv.second]) changed_slots.emplace_back(kv.second);
+  }
+
+  if (changed_slots.empty()) return;
+
+  // Every task only writes the row of its own slot, the symmetric entries
+  // are written by the task of the other slot.
+  tbb::parallel_for(
+      tbb::blocked_range<size_t>(0, active.size(), 16),
+      [&](const tbb::blocked_range<size_t>& range) {
+        for (size_t r = range.begin(); r != range.end(); ++r) {
+          const size_t i = active[r];
+
+          if (changed[i]) {
+            for (size_t j : active) {
+              inv_dist(i, j) =
+                  1 / ((positions[i] - positions[j]).norm() + DIST_EPS);
+            }
+          } else {
+            for (size_t j : changed_slots) {
+              inv_dist(i, j) =
+                  1 / ((positions[i] - positions[j]).norm() + DIST_EPS);
+            }
+          }
+        }
+      });
+
+  for (size_t i : changed_slots) changed[i] = 0;
+  sums_dirty = true;
+}
+
+int64_t KeyframeManager::selectKeyframeToMarg() {
+  if (slots.size() < 3) return -1;
+
+  updateDistances();
+
+  if (sums_dirty) {
+    row_sum = inv_dist.rowwise().sum();
+    sums_dirty = false;
+  }
+
+  // The two newest keyframes are neither candidates nor part of the sums.
+  auto last_it = slots.crbegin();
+  const size_t last = last_it->second;
+  last_it++;
+  const size_t second_last = last_it->second;
+
+  const Eigen::Vector3d& last_pos = positions[last];
+
+  double min_score = std::numeric_limits<double>::max();
+  int64_t min_score_id = -1;
+
+  const size_t num_candidates = slots.size() - 2;
+  auto it = slots.cbegin();
+  for (size_t k = 0; k < num_candidates; k++, it++) {
+    const size_t i = it->second;
+
+    const double denom =
+        row_sum[i] - inv_dist(i, last) - inv_dist(i, second_last);
+    const double score = std::sqrt((positions[i] - last_pos).norm()) * denom;
+
+    if (score < min_score) {
+      min_score_id = it->first;
+      min_score = score;
+    }
+  }
+
+  return min_score_id;
+}
+
+}  // namespace basalt
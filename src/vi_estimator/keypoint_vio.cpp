@@ -119,6 +119,8 @@ void KeypointVioEstimator::initialize(const Eigen::Vector3d& bg,
     const Eigen::Vector3d gyro_cov =
         calib.dicrete_time_gyro_noise_std().array().square();
 
+    Eigen::aligned_vector<ImuData<double>> imu_batch;
+
     ImuData<double>::Ptr data;
     imu_data_queue.pop(data);
     data->accel = calib.calib_accel_bias.getCalibrated(data->accel);
@@ -188,21 +190,29 @@ void KeypointVioEstimator::initialize(const Eigen::Vector3d& bg,
           data->gyro = calib.calib_gyro_bias.getCalibrated(data->gyro);
         }
 
+        // Collect the samples of this frame and integrate them in one batch.
+        imu_batch.clear();
+
         while (data->t_ns <= curr_frame->t_ns) {
-          meas->integrate(*data, accel_cov, gyro_cov);
+          imu_batch.emplace_back(*data);
           imu_data_queue.pop(data);
           if (!data.get()) break;
           data->accel = calib.calib_accel_bias.getCalibrated(data->accel);
           data->gyro = calib.calib_gyro_bias.getCalibrated(data->gyro);
         }
 
-        if (meas->get_start_t_ns() + meas->get_dt_ns() < curr_frame->t_ns) {
+        const int64_t last_t_ns = imu_batch.empty()
+                                      ? meas->get_start_t_ns()
+                                      : imu_batch.back().t_ns;
+
+        if (last_t_ns < curr_frame->t_ns) {
           if (!data.get()) break;
-          int64_t tmp = data->t_ns;
-          data->t_ns = curr_frame->t_ns;
-          meas->integrate(*data, accel_cov, gyro_cov);
-          data->t_ns = tmp;
+          imu_batch.emplace_back(*data);
+          imu_batch.back().t_ns = curr_frame->t_ns;
         }
+
+        meas->integrate(imu_batch, accel_cov, gyro_cov);
+        imu_meas_data[meas->get_start_t_ns()].swap(imu_batch);
       }
 
       measure(curr_frame, meas);
@@ -432,12 +442,15 @@ bool KeypointVioEstimator::measure(
   // 进行边缘化的操作
   marginalize(num_points_connected);
 
-  if (out_state_queue) {
+  if (out_state_queue || out_imu_propagator_queue) {
     PoseVelBiasStateWithLin p = frame_states.at(last_state_t_ns);
 
-    PoseVelBiasState<double>::Ptr data(new PoseVelBiasState(p.getState()));
+    PoseVelBiasState<double>::Ptr data = out_state_pool.get();
+    *data = p.getState();
 
-    out_state_queue->push(data);
+    // The propagator only needs the latest state, so never wait for it.
+    if (out_imu_propagator_queue) out_imu_propagator_queue->try_push(data);
+    if (out_state_queue) out_state_queue->push(std::move(data));
   }
 
   if (out_vis_queue) {
@@ -547,6 +560,18 @@ void KeypointVioEstimator::marginalize(
     auto kf_ids_all = kf_ids;
     std::set<int64_t> kfs_to_marg;
 
+    // 更新keyframe位置, 只有位置变化的keyframe的打分项会被重新计算
+    kf_manager.retain(kf_ids);
+    for (int64_t id : kf_ids) {
+      auto it = frame_poses.find(id);
+      if (it != frame_poses.end()) {
+        kf_manager.setPosition(id, it->second.getPose().translation());
+      } else {
+        kf_manager.setPosition(
+            id, frame_states.at(id).getState().T_w_i.translation());
+      }
+    }
+
     // 必须满足一下两个条件才进行marg:
     // 1. 有 states 是kf 需要被marg 掉 vel 和bias
     // 2. kf_ids 的数量大于max_kfs
@@ -572,41 +597,10 @@ void KeypointVioEstimator::marginalize(
       }
 
       if (id_to_marg < 0) {
-        std::vector<int64_t> ids;
-        for (int64_t id : kf_ids) {
-          ids.push_back(id);
-        }
-
-        int64_t last_kf = *kf_ids.crbegin();
-        double min_score = std::numeric_limits<double>::max();
-        int64_t min_score_id = -1;
-
         // ? 这个类似于DSO的判断条件有点迷
         // 第一部分因该是保证前后不会太大
         // 第二部分应该是保证和最新的state 位移没有太大
-        for (size_t i = 0; i < ids.size() - 2; i++) {
-          double denom = 0;
-          for (size_t j = 0; j < ids.size() - 2; j++) {
-            denom += 1 / ((frame_poses.at(ids[i]).getPose().translation() -
-                           frame_poses.at(ids[j]).getPose().translation())
-                              .norm() +
-                          1e-5);
-          }
-
-          double score =
-              std::sqrt(
-                  (frame_poses.at(ids[i]).getPose().translation() -
-                   frame_states.at(last_kf).getState().T_w_i.translation())
-                      .norm()) *
-              denom;
-
-          if (score < min_score) {
-            min_score_id = ids[i];
-            min_score = score;
-          }
-        }
-
-        id_to_marg = min_score_id;
+        id_to_marg = kf_manager.selectKeyframeToMarg();
       }
 
       // 添加需要marg 的id
@@ -615,6 +609,7 @@ void KeypointVioEstimator::marginalize(
       poses_to_marg.emplace(id_to_marg);
 
       kf_ids.erase(id_to_marg);
+      kf_manager.erase(id_to_marg);
     }
 
     //    std::cout << "marg order" << std::endl;
@@ -777,6 +772,7 @@ void KeypointVioEstimator::marginalize(
     for (const int64_t id : states_to_marg_all) {
       frame_states.erase(id);
       imu_meas.erase(id);
+      imu_meas_data.erase(id);
       prev_opt_flow_res.erase(id);
     }
 
@@ -788,6 +784,7 @@ void KeypointVioEstimator::marginalize(
       frame_poses[id] = pose;
       frame_states.erase(id);
       imu_meas.erase(id);
+      imu_meas_data.erase(id);
     }
 
     // 去除掉旧的frame_poses
@@ -845,11 +842,68 @@ void KeypointVioEstimator::marginalize(
   }
 }
 
+void KeypointVioEstimator::reintegrateImuMeasurements() {
+  const Eigen::Vector3d accel_cov =
+      calib.dicrete_time_accel_noise_std().array().square();
+  const Eigen::Vector3d gyro_cov =
+      calib.dicrete_time_gyro_noise_std().array().square();
+
+  const int num_reintegrated = reintegrateImuMeasurements(
+      frame_states, imu_meas, imu_meas_data, accel_cov, gyro_cov,
+      config.vio_reintegrate_bg_thresh, config.vio_reintegrate_ba_thresh);
+
+  if (config.vio_debug && num_reintegrated > 0) {
+    std::cout << "Re-integrated " << num_reintegrated << " IMU measurements"
+              << std::endl;
+  }
+}
+
+int KeypointVioEstimator::reintegrateImuMeasurements(
+    const Eigen::aligned_map<int64_t, PoseVelBiasStateWithLin<double>>& states,
+    Eigen::aligned_map<int64_t, IntegratedImuMeasurement<double>>& imu_meas,
+    const Eigen::aligned_map<int64_t, Eigen::aligned_vector<ImuData<double>>>&
+        imu_meas_data,
+    const Eigen::Vector3d& accel_cov, const Eigen::Vector3d& gyro_cov,
+    double bg_thresh, double ba_thresh) {
+  // Small bias changes are handled by the first-order correction with
+  // d_state_d_bg and d_state_d_ba in the residual. Only re-integrate when
+  // the change is too large for the linearization to hold.
+  int num_reintegrated = 0;
+
+  for (auto& kv : imu_meas) {
+    auto data_it = imu_meas_data.find(kv.first);
+    auto state_it = states.find(kv.first);
+    if (data_it == imu_meas_data.end() || data_it->second.empty() ||
+        state_it == states.end())
+      continue;
+
+    const PoseVelBiasState<double>& state = state_it->second.getState();
+
+    const double bg_drift =
+        (state.bias_gyro - kv.second.get_bias_gyro_lin()).norm();
+    const double ba_drift =
+        (state.bias_accel - kv.second.get_bias_accel_lin()).norm();
+
+    if (bg_drift < bg_thresh && ba_drift < ba_thresh) continue;
+
+    IntegratedImuMeasurement<double> meas(kv.first, state.bias_gyro,
+                                          state.bias_accel);
+    meas.integrate(data_it->second, accel_cov, gyro_cov);
+    kv.second = meas;
+
+    num_reintegrated++;
+  }
+
+  return num_reintegrated;
+}
+
 void KeypointVioEstimator::optimize() {
   if (config.vio_debug) {
     std::cout << "=================================" << std::endl;
   }
 
+  reintegrateImuMeasurements();
+
   // 如果 frame_state >4 就开始进行优化 
   if (opt_started || frame_states.size() > 4) {
     // Optimize
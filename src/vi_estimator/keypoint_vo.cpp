@@ -323,11 +323,13 @@ bool KeypointVoEstimator::measure(const OpticalFlowResult::Ptr& opt_flow_meas,
   if (out_state_queue) {
     const PoseStateWithLin<double>& p = frame_poses.at(last_state_t_ns);
 
-    PoseVelBiasState<double>::Ptr data(new PoseVelBiasState<double>(
-        p.getT_ns(), p.getPose(), Eigen::Vector3d::Zero(),
-        Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero()));
+    PoseVelBiasState<double>::Ptr data = out_state_pool.get();
+    *data = PoseVelBiasState<double>(p.getT_ns(), p.getPose(),
+                                     Eigen::Vector3d::Zero(),
+                                     Eigen::Vector3d::Zero(),
+                                     Eigen::Vector3d::Zero());
 
-    out_state_queue->push(data);
+    out_state_queue->push(std::move(data));
   }
 
   if (out_vis_queue) {
@@ -395,6 +397,11 @@ void KeypointVoEstimator::marginalize(
 
     auto kf_ids_all = kf_ids;
     std::set<int64_t> kfs_to_marg;
+
+    kf_manager.retain(kf_ids);
+    for (int64_t id : kf_ids) {
+      kf_manager.setPosition(id, frame_poses.at(id).getPose().translation());
+    }
     while (kf_ids.size() > max_kfs) {
       int64_t id_to_marg = -1;
 
@@ -415,43 +422,14 @@ void KeypointVoEstimator::marginalize(
       }
 
       if (id_to_marg < 0) {
-        std::vector<int64_t> ids;
-        for (int64_t id : kf_ids) {
-          ids.push_back(id);
-        }
-
-        int64_t last_kf = *kf_ids.crbegin();
-        double min_score = std::numeric_limits<double>::max();
-        int64_t min_score_id = -1;
-
-        for (size_t i = 0; i < ids.size() - 2; i++) {
-          double denom = 0;
-          for (size_t j = 0; j < ids.size() - 2; j++) {
-            denom += 1 / ((frame_poses.at(ids[i]).getPose().translation() -
-                           frame_poses.at(ids[j]).getPose().translation())
-                              .norm() +
-                          1e-5);
-          }
-
-          double score =
-              std::sqrt((frame_poses.at(ids[i]).getPose().translation() -
-                         frame_poses.at(last_kf).getPose().translation())
-                            .norm()) *
-              denom;
-
-          if (score < min_score) {
-            min_score_id = ids[i];
-            min_score = score;
-          }
-        }
-
-        id_to_marg = min_score_id;
+        id_to_marg = kf_manager.selectKeyframeToMarg();
       }
 
       kfs_to_marg.emplace(id_to_marg);
       non_kf_poses.emplace(id_to_marg);
 
       kf_ids.erase(id_to_marg);
+      kf_manager.erase(id_to_marg);
     }
 
     //    std::cout << "marg order" << std::endl;
@@ -41,6 +41,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <basalt/hash_bow/hash_bow.h>
 
+#include <unordered_set>
+
 namespace basalt {
 
 NfrMapper::NfrMapper(const Calibration<double>& calib, const VioConfig& config)
@@ -62,7 +64,7 @@ void NfrMapper::addMargData(MargData::Ptr& data) {
 
   if (valid) {
     for (const auto& kv : data->frame_poses) {
-      PoseStateWithLin<double> p(kv.second.getT_ns(), kv.second.getPose());
+      PoseStateWithLin<double> p(kv.first, kv.second.getPose());
 
       frame_poses[kv.first] = p;
     }
@@ -70,14 +72,225 @@ void NfrMapper::addMargData(MargData::Ptr& data) {
     for (const auto& kv : data->frame_states) {
       if (data->kfs_all.count(kv.first) > 0) {
         auto state = kv.second;
-        PoseStateWithLin<double> p(state.getState().t_ns,
-                                   state.getState().T_w_i);
+        PoseStateWithLin<double> p(kv.first, state.getState().T_w_i);
         frame_poses[kv.first] = p;
       }
     }
   }
 }
 
+size_t NfrMapper::addSession(int64_t start_t_ns) {
+  // Leaves room for negative offsets in the last session
+  BASALT_ASSERT(session_start_t_ns.size() < 127);
+
+  session_start_t_ns.emplace_back(start_t_ns);
+  session_aligned.emplace_back(session_aligned.empty());
+  return session_start_t_ns.size() - 1;
+}
+
+int64_t NfrMapper::sessionFrameId(size_t session, int64_t t_ns) const {
+  return (int64_t(session) << SESSION_ID_SHIFT) +
+         (t_ns - session_start_t_ns.at(session));
+}
+
+std::pair<size_t, int64_t> NfrMapper::splitFrameId(int64_t frame_id) const {
+  if (session_start_t_ns.empty()) return std::make_pair(0, frame_id);
+
+  // Rounded, since frames before the start of a session (e.g. ground truth)
+  // have negative offsets
+  const int64_t half = int64_t(1) << (SESSION_ID_SHIFT - 1);
+  const size_t session = (frame_id + half) >> SESSION_ID_SHIFT;
+
+  return std::make_pair(session, frame_id -
+                                     (int64_t(session) << SESSION_ID_SHIFT) +
+                                     session_start_t_ns.at(session));
+}
+
+void NfrMapper::toSessionFrameIds(MargData& m, size_t session) const {
+  AbsOrderMap aom;
+  aom.items = m.aom.items;
+  aom.total_size = m.aom.total_size;
+  for (const auto& kv : m.aom.abs_order_map) {
+    aom.abs_order_map.emplace(sessionFrameId(session, kv.first), kv.second);
+  }
+  m.aom = aom;
+
+  Eigen::aligned_map<int64_t, PoseVelBiasStateWithLin<double>> frame_states;
+  for (const auto& kv : m.frame_states) {
+    frame_states.emplace(sessionFrameId(session, kv.first), kv.second);
+  }
+  m.frame_states.swap(frame_states);
+
+  Eigen::aligned_map<int64_t, PoseStateWithLin<double>> frame_poses;
+  for (const auto& kv : m.frame_poses) {
+    frame_poses.emplace(sessionFrameId(session, kv.first), kv.second);
+  }
+  m.frame_poses.swap(frame_poses);
+
+  std::set<int64_t> kfs_all, kfs_to_marg;
+  for (int64_t t_ns : m.kfs_all) {
+    kfs_all.emplace(sessionFrameId(session, t_ns));
+  }
+  for (int64_t t_ns : m.kfs_to_marg) {
+    kfs_to_marg.emplace(sessionFrameId(session, t_ns));
+  }
+  m.kfs_all.swap(kfs_all);
+  m.kfs_to_marg.swap(kfs_to_marg);
+
+  for (auto& res : m.opt_flow_res) {
+    // Results are shared between the marg. data of a session, copy instead
+    // of changing them in place
+    auto res_session = std::make_shared<OpticalFlowResult>(*res);
+    res_session->t_ns = sessionFrameId(session, res->t_ns);
+    res = res_session;
+  }
+}
+
+void NfrMapper::alignSessions() {
+  if (session_start_t_ns.size() < 2) return;
+
+  const bool yaw_only = !roll_pitch_factors.empty();
+
+  // Pose of a loop closure frame in its own session and in the world frame
+  // of the aligned session it is connected to
+  struct SessionLink {
+    Sophus::SE3d T_w_source;
+    Sophus::SE3d T_a_target;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Rotation with the same yaw as R
+  auto yaw_rotation = [](const Sophus::SO3d& R) {
+    const Eigen::Vector3d x = R * Eigen::Vector3d::UnitX();
+    return Sophus::SO3d::rotZ(std::atan2(x.y(), x.x()));
+  };
+
+  auto is_inlier = [&](const Sophus::SE3d& T_a_w, const SessionLink& l) {
+    const Sophus::SE3d T_err = (T_a_w * l.T_w_source).inverse() * l.T_a_target;
+    return T_err.translation().norm() <
+               config.mapper_session_align_pos_thresh &&
+           T_err.so3().log().norm() < config.mapper_session_align_rot_thresh;
+  };
+
+  // Sessions connected to an aligned session become aligned, until no loop
+  // closure adds another session
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    std::map<size_t, Eigen::aligned_vector<SessionLink>> links;
+
+    for (const RelPoseFactor& lc : loop_closure_factors) {
+      const size_t session_i = splitFrameId(lc.t_i_ns).first;
+      const size_t session_j = splitFrameId(lc.t_j_ns).first;
+      if (session_aligned[session_i] == session_aligned[session_j]) continue;
+
+      const Sophus::SE3d& T_w_i = frame_poses.at(lc.t_i_ns).getPose();
+      const Sophus::SE3d& T_w_j = frame_poses.at(lc.t_j_ns).getPose();
+
+      SessionLink l;
+      if (session_aligned[session_i]) {
+        l.T_w_source = T_w_j;
+        l.T_a_target = T_w_i * lc.T_i_j;
+        links[session_j].emplace_back(l);
+      } else {
+        l.T_w_source = T_w_i;
+        l.T_a_target = T_w_j * lc.T_i_j.inverse();
+        links[session_i].emplace_back(l);
+      }
+    }
+
+    // Align the session with the largest consensus first, it is the most
+    // reliable anchor for the sessions that follow
+    size_t best_session = 0;
+    Sophus::SE3d best_T_a_w;
+    std::vector<size_t> best_inliers;
+
+    for (const auto& kv : links) {
+      const Eigen::aligned_vector<SessionLink>& session_links = kv.second;
+
+      for (const SessionLink& hyp : session_links) {
+        // Transformation from the world frame of the session to the aligned
+        // world frame that moves the source pose onto the target
+        Sophus::SE3d T_a_w = hyp.T_a_target * hyp.T_w_source.inverse();
+        if (yaw_only) {
+          T_a_w.so3() = yaw_rotation(T_a_w.so3());
+          T_a_w.translation() = hyp.T_a_target.translation() -
+                                T_a_w.so3() * hyp.T_w_source.translation();
+        }
+
+        std::vector<size_t> inliers;
+        for (size_t k = 0; k < session_links.size(); k++) {
+          if (is_inlier(T_a_w, session_links[k])) inliers.emplace_back(k);
+        }
+
+        if (inliers.size() > best_inliers.size()) {
+          best_session = kv.first;
+          best_T_a_w = T_a_w;
+          best_inliers = inliers;
+        }
+      }
+    }
+
+    // Too few closures agree yet, a single false match must not place a
+    // session. It is aligned by a later call once more closures arrive.
+    if (best_inliers.empty() ||
+        int(best_inliers.size()) < config.mapper_session_align_min_inliers) {
+      break;
+    }
+
+    // Least squares over the inliers: mean rotation in the tangent space of
+    // the best hypothesis, then the translation that fits it best
+    const Eigen::aligned_vector<SessionLink>& session_links =
+        links.at(best_session);
+
+    Eigen::Vector3d mean_log = Eigen::Vector3d::Zero();
+    for (size_t k : best_inliers) {
+      const SessionLink& l = session_links[k];
+      const Sophus::SO3d R_k =
+          l.T_a_target.so3() * l.T_w_source.so3().inverse();
+      mean_log += (best_T_a_w.so3().inverse() * R_k).log();
+    }
+    mean_log /= best_inliers.size();
+
+    Sophus::SE3d T_a_w;
+    T_a_w.so3() = best_T_a_w.so3() * Sophus::SO3d::exp(mean_log);
+    if (yaw_only) T_a_w.so3() = yaw_rotation(T_a_w.so3());
+
+    Eigen::Vector3d mean_t = Eigen::Vector3d::Zero();
+    for (size_t k : best_inliers) {
+      const SessionLink& l = session_links[k];
+      mean_t += l.T_a_target.translation() -
+                T_a_w.so3() * l.T_w_source.translation();
+    }
+    T_a_w.translation() = mean_t / best_inliers.size();
+
+    for (auto& kv : frame_poses) {
+      if (splitFrameId(kv.first).first == best_session) {
+        kv.second =
+            PoseStateWithLin<double>(kv.first, T_a_w * kv.second.getPose());
+      }
+    }
+
+    std::cout << "Aligned session " << best_session << " with "
+              << best_inliers.size() << " of " << session_links.size()
+              << " loop closures." << std::endl;
+
+    session_aligned[best_session] = true;
+    changed = true;
+  }
+
+  for (size_t i = 0; i < session_aligned.size(); i++) {
+    if (!session_aligned[i]) {
+      std::cout << "Session " << i << " is not aligned, fewer than "
+                << config.mapper_session_align_min_inliers
+                << " consistent loop closures to the other sessions."
+                << std::endl;
+    }
+  }
+}
+
 void NfrMapper::processMargData(MargData& m) {
   BASALT_ASSERT(m.aom.total_size == size_t(m.abs_H.cols()));
 
@@ -240,20 +453,93 @@ bool NfrMapper::extractNonlinearFactors(MargData& m) {
   return true;
 }
 
-void NfrMapper::optimize(int num_iterations) {
-  AbsOrderMap aom;
+void NfrMapper::setupLocalProblem(const std::set<int64_t>& active_frames,
+                                  LocalProblem& lp) const {
+  // Only the landmarks observed in an active frame are linearized. Other
+  // frames observing them are part of the problem but kept fixed.
+  for (const auto& kv : lmdb.getObservations()) {
+    const bool host_active = active_frames.count(kv.first.frame_id) > 0;
+    for (const auto& obs_kv : kv.second) {
+      if (host_active || active_frames.count(obs_kv.first.frame_id) > 0) {
+        for (const auto& ko : obs_kv.second) {
+          lp.landmarks.emplace(ko.kpt_id);
+        }
+      }
+    }
+  }
 
-  for (const auto& kv : frame_poses) {
-    aom.abs_order_map[kv.first] = std::make_pair(aom.total_size, POSE_SIZE);
-    aom.total_size += POSE_SIZE;
+  for (int64_t t_ns : active_frames) {
+    if (frame_poses.count(t_ns) > 0) {
+      lp.active_frames.emplace(t_ns);
+      lp.frames.emplace(t_ns);
+    }
   }
 
+  for (const auto& kv : lmdb.getObservations()) {
+    for (const auto& obs_kv : kv.second) {
+      for (const auto& ko : obs_kv.second) {
+        if (lp.landmarks.count(ko.kpt_id) > 0) {
+          lp.obs[kv.first][obs_kv.first].emplace_back(ko);
+          lp.frames.emplace(kv.first.frame_id);
+          lp.frames.emplace(obs_kv.first.frame_id);
+        }
+      }
+    }
+  }
+
+  // Relative pose factors of the active frames constrain them also where
+  // they cross the boundary of the problem, the other pose is kept fixed
+  for (const RelPoseFactor& rpf : rel_pose_factors) {
+    if (lp.active_frames.count(rpf.t_i_ns) > 0 ||
+        lp.active_frames.count(rpf.t_j_ns) > 0) {
+      lp.rel_pose_factors.emplace_back(rpf);
+      lp.frames.emplace(rpf.t_i_ns);
+      lp.frames.emplace(rpf.t_j_ns);
+    }
+  }
+
+  for (int64_t t_ns : lp.frames) {
+    if (lp.active_frames.count(t_ns) == 0) {
+      lp.fixed_idx.emplace_back(lp.aom.total_size);
+    }
+    lp.aom.abs_order_map[t_ns] = std::make_pair(lp.aom.total_size, POSE_SIZE);
+    lp.aom.total_size += POSE_SIZE;
+  }
+
+  for (const RollPitchFactor& rpf : roll_pitch_factors) {
+    if (lp.frames.count(rpf.t_ns) > 0) {
+      lp.roll_pitch_factors.emplace_back(rpf);
+    }
+  }
+}
+
+void NfrMapper::optimize(int num_iterations,
+                         const std::set<int64_t>* active_frames) {
+  LocalProblem lp;
+  AbsOrderMap& aom = lp.aom;
+  const std::vector<int>& fixed_idx = lp.fixed_idx;
+
+  if (active_frames) {
+    setupLocalProblem(*active_frames, lp);
+  } else {
+    for (const auto& kv : frame_poses) {
+      aom.abs_order_map[kv.first] = std::make_pair(aom.total_size, POSE_SIZE);
+      aom.total_size += POSE_SIZE;
+    }
+  }
+
+  const auto& obs_to_lin = active_frames ? lp.obs : lmdb.getObservations();
+  const auto& opt_roll_pitch_factors =
+      active_frames ? lp.roll_pitch_factors : roll_pitch_factors;
+  const auto& opt_rel_pose_factors =
+      active_frames ? lp.rel_pose_factors : rel_pose_factors;
+
   for (int iter = 0; iter < num_iterations; iter++) {
     auto t1 = std::chrono::high_resolution_clock::now();
 
     double rld_error;
     Eigen::aligned_vector<RelLinData> rld_vec;
-    linearizeHelper(rld_vec, lmdb.getObservations(), rld_error);
+    linearizeHelper(rld_vec, obs_to_lin, rld_error);
 
     //      SparseHashAccumulator<double> accum;
     //      accum.reset(aom.total_size);
@@ -273,9 +559,9 @@ void NfrMapper::optimize(int num_iterations) {
     tbb::blocked_range<Eigen::aligned_vector<RelLinData>::iterator> range(
         rld_vec.begin(), rld_vec.end());
     tbb::blocked_range<Eigen::aligned_vector<RollPitchFactor>::const_iterator>
-        range1(roll_pitch_factors.begin(), roll_pitch_factors.end());
+        range1(opt_roll_pitch_factors.begin(), opt_roll_pitch_factors.end());
     tbb::blocked_range<Eigen::aligned_vector<RelPoseFactor>::const_iterator>
-        range2(rel_pose_factors.begin(), rel_pose_factors.end());
+        range2(opt_rel_pose_factors.begin(), opt_rel_pose_factors.end());
 
     tbb::parallel_reduce(range, lopt);
 
@@ -292,6 +578,19 @@ void NfrMapper::optimize(int num_iterations) {
               << " roll_pitch_error: " << lopt.roll_pitch_error
               << " total: " << error_total << std::endl;
 
+    // The errors after an update are computed for the whole map. Residuals
+    // outside the local problem do not change, so compare with the error of
+    // the whole map.
+    if (active_frames && config.mapper_use_lm) {
+      double vision_error = 0, rel_error = 0, roll_pitch_error = 0;
+      computeError(vision_error);
+      if (config.mapper_use_factors) {
+        computeRelPose(rel_error);
+        computeRollPitch(roll_pitch_error);
+      }
+      error_total = vision_error + rel_error + roll_pitch_error;
+    }
+
     lopt.accum.iterative_solver = true;
     lopt.accum.print_info = true;
 
@@ -308,18 +607,21 @@ void NfrMapper::optimize(int num_iterations) {
         Eigen::VectorXd Hdiag_lambda = Hdiag * lambda;
         for (int i = 0; i < Hdiag_lambda.size(); i++)
           Hdiag_lambda[i] = std::max(Hdiag_lambda[i], min_lambda);
+        for (int idx : fixed_idx)
+          Hdiag_lambda.segment<POSE_SIZE>(idx).setConstant(FIXED_POSE_DAMPING);
 
-        const Eigen::VectorXd inc = lopt.accum.solve(&Hdiag_lambda);
+        Eigen::VectorXd inc = lopt.accum.solve(&Hdiag_lambda);
+        for (int idx : fixed_idx) inc.segment<POSE_SIZE>(idx).setZero();
         double max_inc = inc.array().abs().maxCoeff();
         if (max_inc < 1e-5) converged = true;
 
         backup();
 
         // apply increment to poses
-        for (auto& kv : frame_poses) {
-          int idx = aom.abs_order_map.at(kv.first).first;
-          BASALT_ASSERT(!kv.second.isLinearized());
-          kv.second.applyInc(-inc.segment<POSE_SIZE>(idx));
+        for (const auto& kv : aom.abs_order_map) {
+          auto& pose = frame_poses.at(kv.first);
+          BASALT_ASSERT(!pose.isLinearized());
+          pose.applyInc(-inc.segment<POSE_SIZE>(kv.second.first));
         }
 
         // Update points
@@ -382,16 +684,19 @@ void NfrMapper::optimize(int num_iterations) {
       Eigen::VectorXd Hdiag_lambda = Hdiag * min_lambda;
       for (int i = 0; i < Hdiag_lambda.size(); i++)
         Hdiag_lambda[i] = std::max(Hdiag_lambda[i], min_lambda);
+      for (int idx : fixed_idx)
+        Hdiag_lambda.segment<POSE_SIZE>(idx).setConstant(FIXED_POSE_DAMPING);
 
-      const Eigen::VectorXd inc = lopt.accum.solve(&Hdiag_lambda);
+      Eigen::VectorXd inc = lopt.accum.solve(&Hdiag_lambda);
+      for (int idx : fixed_idx) inc.segment<POSE_SIZE>(idx).setZero();
       double max_inc = inc.array().abs().maxCoeff();
       if (max_inc < 1e-5) converged = true;
 
       // apply increment to poses
-      for (auto& kv : frame_poses) {
-        int idx = aom.abs_order_map.at(kv.first).first;
-        BASALT_ASSERT(!kv.second.isLinearized());
-        kv.second.applyInc(-inc.segment<POSE_SIZE>(idx));
+      for (const auto& kv : aom.abs_order_map) {
+        auto& pose = frame_poses.at(kv.first);
+        BASALT_ASSERT(!pose.isLinearized());
+        pose.applyInc(-inc.segment<POSE_SIZE>(kv.second.first));
       }
 
       // Update points
@@ -421,6 +726,389 @@ void NfrMapper::optimize(int num_iterations) {
   }
 }
 
+void NfrMapper::optimizePoseGraph(int num_iterations) {
+  if (frame_poses.empty()) return;
+
+  AbsOrderMap aom;
+  for (const auto& kv : frame_poses) {
+    aom.abs_order_map[kv.first] = std::make_pair(aom.total_size, POSE_SIZE);
+    aom.total_size += POSE_SIZE;
+  }
+
+  auto compute_error = [&]() {
+    double rel_error = 0, roll_pitch_error = 0, loop_error = 0;
+    computeRelPose(rel_error);
+    computeRollPitch(roll_pitch_error);
+    computeLoopClosure(loop_error);
+    return rel_error + roll_pitch_error + loop_error;
+  };
+
+  for (int iter = 0; iter < num_iterations; iter++) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+
+    MapperLinearizeAbsReduce<SparseHashAccumulator<double>> lopt(aom,
+                                                                 &frame_poses);
+    tbb::blocked_range<Eigen::aligned_vector<RollPitchFactor>::const_iterator>
+        range1(roll_pitch_factors.begin(), roll_pitch_factors.end());
+    tbb::blocked_range<Eigen::aligned_vector<RelPoseFactor>::const_iterator>
+        range2(rel_pose_factors.begin(), rel_pose_factors.end());
+    tbb::blocked_range<Eigen::aligned_vector<RelPoseFactor>::const_iterator>
+        range3(loop_closure_factors.begin(), loop_closure_factors.end());
+
+    tbb::parallel_reduce(range1, lopt);
+    tbb::parallel_reduce(range2, lopt);
+    tbb::parallel_reduce(range3, lopt);
+
+    // rel_error includes the loop closures
+    const double error_total = lopt.rel_error + lopt.roll_pitch_error;
+
+    std::cout << "[POSE GRAPH] iter " << iter
+              << " before_update_error: rel_error: " << lopt.rel_error
+              << " roll_pitch_error: " << lopt.roll_pitch_error
+              << " total: " << error_total << std::endl;
+
+    // Direct sparse solver, the pose graph is small compared to the full
+    // problem
+    lopt.accum.iterative_solver = false;
+    lopt.accum.setup_solver();
+    const Eigen::VectorXd Hdiag = lopt.accum.Hdiagonal();
+
+    bool converged = false;
+    bool step = false;
+    int max_iter = 10;
+
+    while (!step && max_iter > 0 && !converged) {
+      Eigen::VectorXd Hdiag_lambda = Hdiag * lambda;
+      for (int i = 0; i < Hdiag_lambda.size(); i++)
+        Hdiag_lambda[i] = std::max(Hdiag_lambda[i], min_lambda);
+
+      // Position and yaw are not observable, the first pose is kept fixed
+      Hdiag_lambda.head<POSE_SIZE>().setConstant(FIXED_POSE_DAMPING);
+
+      Eigen::VectorXd inc = lopt.accum.solve(&Hdiag_lambda);
+      inc.head<POSE_SIZE>().setZero();
+      double max_inc = inc.array().abs().maxCoeff();
+      if (max_inc < 1e-5) converged = true;
+
+      backup();
+
+      for (const auto& kv : aom.abs_order_map) {
+        auto& pose = frame_poses.at(kv.first);
+        BASALT_ASSERT(!pose.isLinearized());
+        pose.applyInc(-inc.segment<POSE_SIZE>(kv.second.first));
+      }
+
+      const double after_error_total = compute_error();
+      const double f_diff = error_total - after_error_total;
+
+      if (f_diff < 0) {
+        std::cout << "\t[REJECTED] lambda:" << lambda << " f_diff: " << f_diff
+                  << " max_inc: " << max_inc << " total: " << after_error_total
+                  << std::endl;
+        lambda = std::min(max_lambda, lambda_vee * lambda);
+        lambda_vee *= 2;
+
+        restore();
+      } else {
+        std::cout << "\t[ACCEPTED] lambda:" << lambda << " f_diff: " << f_diff
+                  << " max_inc: " << max_inc << " total: " << after_error_total
+                  << std::endl;
+
+        lambda = std::max(min_lambda, lambda / 3);
+        lambda_vee = 2;
+
+        step = true;
+      }
+
+      max_iter--;
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    auto elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+
+    std::cout << "iter " << iter << " time : " << elapsed.count()
+              << "(us),  num_poses " << frame_poses.size()
+              << " num_loop_closures " << loop_closure_factors.size()
+              << std::endl;
+
+    if (converged || !step) break;
+  }
+}
+
+void NfrMapper::optimizeLocalProblem(LocalProblem& lp, int num_iterations) {
+  // Problems are optimized in parallel, so every problem has its own damping
+  // and backs up only the states it changes
+  double lp_lambda = min_lambda;
+  double lp_lambda_vee = 2;
+
+  // Error of the residuals of the problem, all other residuals do not change.
+  // The vision residuals are linearized at the same time.
+  auto linearize_error = [&](Eigen::aligned_vector<RelLinData>& rld_vec) {
+    double error;
+    linearizeHelper(rld_vec, lp.obs, error);
+
+    if (config.mapper_use_factors) {
+      for (const RelPoseFactor& rpf : lp.rel_pose_factors) {
+        const Sophus::Vector6d res =
+            relPoseError(rpf.T_i_j, frame_poses.at(rpf.t_i_ns).getPose(),
+                         frame_poses.at(rpf.t_j_ns).getPose());
+        error += res.transpose() * rpf.cov_inv * res;
+      }
+
+      for (const RollPitchFactor& rpf : lp.roll_pitch_factors) {
+        const Sophus::Vector2d res =
+            rollPitchError(frame_poses.at(rpf.t_ns).getPose(), rpf.R_w_i_meas);
+        error += res.transpose() * rpf.cov_inv * res;
+      }
+    }
+
+    return error;
+  };
+
+  auto backup_problem = [&]() {
+    for (int64_t t_ns : lp.active_frames) frame_poses.at(t_ns).backup();
+    for (int lm_id : lp.landmarks) lmdb.getLandmark(lm_id).backup();
+  };
+
+  auto restore_problem = [&]() {
+    for (int64_t t_ns : lp.active_frames) frame_poses.at(t_ns).restore();
+    for (int lm_id : lp.landmarks) lmdb.getLandmark(lm_id).restore();
+  };
+
+  Eigen::aligned_vector<RelLinData> rld_vec;
+  double error_total = linearize_error(rld_vec);
+
+  for (int iter = 0; iter < num_iterations; iter++) {
+    MapperLinearizeAbsReduce<SparseHashAccumulator<double>> lopt(lp.aom,
+                                                                 &frame_poses);
+    tbb::blocked_range<Eigen::aligned_vector<RelLinData>::iterator> range(
+        rld_vec.begin(), rld_vec.end());
+    tbb::blocked_range<Eigen::aligned_vector<RollPitchFactor>::const_iterator>
+        range1(lp.roll_pitch_factors.begin(), lp.roll_pitch_factors.end());
+    tbb::blocked_range<Eigen::aligned_vector<RelPoseFactor>::const_iterator>
+        range2(lp.rel_pose_factors.begin(), lp.rel_pose_factors.end());
+
+    tbb::parallel_reduce(range, lopt);
+
+    if (config.mapper_use_factors) {
+      tbb::parallel_reduce(range1, lopt);
+      tbb::parallel_reduce(range2, lopt);
+    }
+
+    lopt.accum.iterative_solver = true;
+    lopt.accum.setup_solver();
+    const Eigen::VectorXd Hdiag = lopt.accum.Hdiagonal();
+
+    // Levenberg-Marquardt as in optimize()
+    bool converged = false;
+    bool step = false;
+    int max_iter = 10;
+
+    while (!step && max_iter > 0 && !converged) {
+      Eigen::VectorXd Hdiag_lambda = Hdiag * lp_lambda;
+      for (int i = 0; i < Hdiag_lambda.size(); i++)
+        Hdiag_lambda[i] = std::max(Hdiag_lambda[i], min_lambda);
+      for (int idx : lp.fixed_idx)
+        Hdiag_lambda.segment<POSE_SIZE>(idx).setConstant(FIXED_POSE_DAMPING);
+
+      Eigen::VectorXd inc = lopt.accum.solve(&Hdiag_lambda);
+      for (int idx : lp.fixed_idx) inc.segment<POSE_SIZE>(idx).setZero();
+      const double max_inc = inc.array().abs().maxCoeff();
+      if (max_inc < 1e-5) converged = true;
+
+      backup_problem();
+
+      // Fixed poses can be shared with other problems, never write them
+      for (int64_t t_ns : lp.active_frames) {
+        auto& pose = frame_poses.at(t_ns);
+        BASALT_ASSERT(!pose.isLinearized());
+        const int idx = lp.aom.abs_order_map.at(t_ns).first;
+        pose.applyInc(-inc.segment<POSE_SIZE>(idx));
+      }
+
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, rld_vec.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+                          for (size_t i = r.begin(); i != r.end(); ++i) {
+                            updatePoints(lp.aom, rld_vec[i], inc);
+                          }
+                        });
+
+      Eigen::aligned_vector<RelLinData> after_rld_vec;
+      const double after_error_total = linearize_error(after_rld_vec);
+
+      if (after_error_total > error_total) {
+        lp_lambda = std::min(max_lambda, lp_lambda_vee * lp_lambda);
+        lp_lambda_vee *= 2;
+
+        restore_problem();
+      } else {
+        lp_lambda = std::max(min_lambda, lp_lambda / 3);
+        lp_lambda_vee = 2;
+
+        // The next iteration starts from this linearization
+        rld_vec.swap(after_rld_vec);
+        error_total = after_error_total;
+        step = true;
+      }
+
+      max_iter--;
+    }
+
+    if (converged || !step) break;
+  }
+}
+
+void NfrMapper::optimizePartitioned(int num_sweeps) {
+  if (frame_poses.empty()) return;
+
+  const int64_t size_ns = int64_t(config.mapper_submap_size * 1e9);
+  const int64_t overlap_ns = int64_t(config.mapper_submap_overlap * 1e9);
+
+  if (size_ns <= 0) {
+    std::cerr << "config.mapper_submap_size " << config.mapper_submap_size
+              << " has to be positive." << std::endl;
+    std::abort();
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  // Consecutive submaps along the trajectory. The first frame of every
+  // submap after the first one is a boundary.
+  std::vector<std::set<int64_t>> submap_frames;
+  std::vector<int64_t> boundaries;
+  std::unordered_map<int64_t, size_t> frame_submap;
+
+  const int64_t last_t_ns = frame_poses.rbegin()->first;
+  for (int64_t start_t_ns = frame_poses.begin()->first;
+       start_t_ns <= last_t_ns; start_t_ns += size_ns) {
+    // Skip gaps without frames, e.g. between sessions
+    const int64_t next_t_ns = frame_poses.lower_bound(start_t_ns)->first;
+    if (next_t_ns >= start_t_ns + size_ns) start_t_ns = next_t_ns;
+
+    std::set<int64_t> frames;
+    for (auto it = frame_poses.lower_bound(start_t_ns);
+         it != frame_poses.end() && it->first < start_t_ns + size_ns; ++it) {
+      frames.emplace(it->first);
+      frame_submap[it->first] = submap_frames.size();
+    }
+
+    if (!frames.empty()) {
+      if (!submap_frames.empty()) boundaries.emplace_back(*frames.begin());
+      submap_frames.emplace_back(std::move(frames));
+    }
+  }
+
+  // Two submaps conflict if they share a landmark or if one of them writes a
+  // pose that the other one uses. Both happen only through a landmark that
+  // is observed in both submaps or a relative pose factor between them.
+  // Submaps of the same color do not conflict and are optimized in parallel.
+  // Every other submap has the same color if tracks are shorter than a
+  // submap.
+  std::unordered_map<int, std::set<size_t>> landmark_submaps;
+  for (const auto& kv : lmdb.getObservations()) {
+    const size_t submap_h = frame_submap.at(kv.first.frame_id);
+    for (const auto& obs_kv : kv.second) {
+      const size_t submap_t = frame_submap.at(obs_kv.first.frame_id);
+      for (const auto& ko : obs_kv.second) {
+        std::set<size_t>& s = landmark_submaps[ko.kpt_id];
+        s.emplace(submap_h);
+        s.emplace(submap_t);
+      }
+    }
+  }
+
+  std::vector<std::set<size_t>> conflicts(submap_frames.size());
+  auto add_conflicts = [&](const std::set<size_t>& ids) {
+    for (size_t i : ids) {
+      for (size_t j : ids) {
+        if (i != j) conflicts[i].emplace(j);
+      }
+    }
+  };
+
+  for (const auto& kv : landmark_submaps) add_conflicts(kv.second);
+  for (const RelPoseFactor& rpf : rel_pose_factors) {
+    add_conflicts({frame_submap.at(rpf.t_i_ns), frame_submap.at(rpf.t_j_ns)});
+  }
+  landmark_submaps.clear();
+
+  // Greedy coloring in time order
+  std::vector<int> color(submap_frames.size(), -1);
+  std::vector<std::vector<size_t>> color_groups;
+  for (size_t i = 0; i < submap_frames.size(); i++) {
+    std::set<int> used;
+    for (size_t j : conflicts[i]) {
+      if (color[j] >= 0) used.emplace(color[j]);
+    }
+
+    int c = 0;
+    while (used.count(c) > 0) c++;
+    color[i] = c;
+
+    if (c >= int(color_groups.size())) color_groups.resize(c + 1);
+    color_groups[c].emplace_back(i);
+  }
+
+  // Separators are the frames closer than mapper_submap_overlap to a
+  // boundary. They connect the submaps and are optimized together in a
+  // separate solve after each sweep.
+  std::set<int64_t> separator_frames;
+  for (int64_t boundary_t_ns : boundaries) {
+    for (auto it = frame_poses.lower_bound(boundary_t_ns - overlap_ns);
+         it != frame_poses.end() && it->first < boundary_t_ns + overlap_ns;
+         ++it) {
+      separator_frames.emplace(it->first);
+    }
+  }
+
+  std::cout << "Partitioned the map into " << submap_frames.size()
+            << " submaps with " << color_groups.size() << " colors and "
+            << separator_frames.size() << " separator frames." << std::endl;
+
+  // Local problems hold a copy of their observations. They are built when
+  // they are optimized and freed right after, so at most one problem per
+  // thread is in memory.
+  auto optimize_frames = [&](const std::set<int64_t>& frames) {
+    LocalProblem lp;
+    setupLocalProblem(frames, lp);
+    optimizeLocalProblem(lp, config.mapper_submap_iterations);
+  };
+
+  for (int sweep = 0; sweep < num_sweeps; sweep++) {
+    for (const auto& group : color_groups) {
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, group.size()),
+                        [&](const tbb::blocked_range<size_t>& r) {
+                          for (size_t i = r.begin(); i != r.end(); ++i) {
+                            optimize_frames(submap_frames[group[i]]);
+                          }
+                        });
+    }
+
+    if (!separator_frames.empty()) optimize_frames(separator_frames);
+
+    double vision_error = 0, rel_error = 0, roll_pitch_error = 0;
+    computeError(vision_error);
+    if (config.mapper_use_factors) {
+      computeRelPose(rel_error);
+      computeRollPitch(roll_pitch_error);
+    }
+
+    std::cout << "[PARTITIONED] sweep " << sweep
+              << " vision_error: " << vision_error
+              << " rel_error: " << rel_error
+              << " roll_pitch_error: " << roll_pitch_error
+              << " total: " << vision_error + rel_error + roll_pitch_error
+              << std::endl;
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+
+  std::cout << "Partitioned optimization time: " << elapsed.count() << "(us)"
+            << std::endl;
+}
+
 Eigen::aligned_map<int64_t, PoseStateWithLin<double>>&
 NfrMapper::getFramePoses() {
   return frame_poses;
@@ -451,6 +1139,19 @@ void NfrMapper::computeRollPitch(double& roll_pitch_error) {
   }
 }
 
+void NfrMapper::computeLoopClosure(double& loop_error) {
+  loop_error = 0;
+
+  for (const RelPoseFactor& rpf : loop_closure_factors) {
+    const Sophus::SE3d& pose_i = frame_poses.at(rpf.t_i_ns).getPose();
+    const Sophus::SE3d& pose_j = frame_poses.at(rpf.t_j_ns).getPose();
+
+    Sophus::Vector6d res = relPoseError(rpf.T_i_j, pose_i, pose_j);
+
+    loop_error += res.transpose() * rpf.cov_inv * res;
+  }
+}
+
 void NfrMapper::detect_keypoints() {
   std::vector<int64_t> keys;
   for (const auto& kv : img_data) {
@@ -459,6 +1160,10 @@ void NfrMapper::detect_keypoints() {
     }
   }
 
+  detect_keypoints(keys);
+}
+
+void NfrMapper::detect_keypoints(const std::vector<int64_t>& keys) {
   auto t1 = std::chrono::high_resolution_clock::now();
 
   tbb::parallel_for(
@@ -471,23 +1176,29 @@ void NfrMapper::detect_keypoints() {
               TimeCamId tcid(kv->first, i);
               KeypointsData& kd = feature_corners[tcid];
 
-              if (!kv->second->img_data[i].img.get()) continue;
+              if (i < kv->second->keypoints.size()) {
+                // Computed by the MargDataSaver, config.vio_marg_data_features
+                kd = kv->second->keypoints[i];
+                if (kd.corners.empty()) continue;
+              } else {
+                if (!kv->second->img_data[i].img.get()) continue;
+
+                const Image<const uint16_t> img =
+                    kv->second->img_data[i].img->Reinterpret<const uint16_t>();
 
-              const Image<const uint16_t> img =
-                  kv->second->img_data[i].img->Reinterpret<const uint16_t>();
+                detectKeypointsMapping(img, kd,
+                                       config.mapper_detection_num_points);
+                computeAngles(img, kd, true);
+                computeDescriptors(img, kd);
 
-              detectKeypointsMapping(img, kd,
-                                     config.mapper_detection_num_points);
-              computeAngles(img, kd, true);
-              computeDescriptors(img, kd);
+                hash_bow_database->compute_bow(kd.corner_descriptors,
+                                               kd.hashes, kd.bow_vector);
+              }
 
               std::vector<bool> success;
               calib.intrinsics[tcid.cam_id].unproject(kd.corners, kd.corners_3d,
                                                       success);
 
-              hash_bow_database->compute_bow(kd.corner_descriptors, kd.hashes,
-                                             kd.bow_vector);
-
               hash_bow_database->add_to_database(tcid, kd.bow_vector);
 
               // std::cout << "bow " << kd.bow_vector.size() << " desc "
@@ -497,6 +1208,17 @@ void NfrMapper::detect_keypoints() {
         }
       });
 
+  // Merge the dynamic part once it grows relative to the compact index, so
+  // the amortized cost of freeze() stays constant per frame.
+  num_dynamic_frames += keys.size();
+  if (num_dynamic_frames >= num_frozen_frames / 4) {
+    hash_bow_database->freeze();
+    num_frozen_frames += num_dynamic_frames;
+    num_dynamic_frames = 0;
+  }
+
+  processed_frames.insert(keys.begin(), keys.end());
+
   auto t2 = std::chrono::high_resolution_clock::now();
 
   auto elapsed1 =
@@ -510,48 +1232,122 @@ void NfrMapper::detect_keypoints() {
 }
 
 void NfrMapper::match_stereo() {
-  // Pose of camera 1 (right) w.r.t camera 0 (left)
-  const Sophus::SE3d T_0_1 = calib.T_i_c[0].inverse() * calib.T_i_c[1];
+  std::vector<int64_t> frame_ids;
+  frame_ids.reserve(img_data.size());
+  for (const auto& kv : img_data) frame_ids.emplace_back(kv.first);
 
-  // Essential matrix
-  Eigen::Matrix4d E;
-  computeEssential(T_0_1, E);
+  match_stereo(frame_ids);
+}
 
-  std::cout << "Matching " << img_data.size() << " stereo pairs..."
-            << std::endl;
+void NfrMapper::match_stereo(const std::vector<int64_t>& unsorted_frame_ids) {
+  // Sorted frame ids, so the merged result does not depend on scheduling
+  std::vector<int64_t> frame_ids = unsorted_frame_ids;
+  std::sort(frame_ids.begin(), frame_ids.end());
 
-  int num_matches = 0;
-  int num_inliers = 0;
+  // All camera pairs (cam1 < cam2) of the rig with the pose of cam2 w.r.t.
+  // cam1 and the essential matrix
+  struct StereoPair {
+    size_t cam1, cam2;
+    Sophus::SE3d T_1_2;
+    Eigen::Matrix4d E;
 
-  for (const auto& kv : img_data) {
-    const TimeCamId tcid1(kv.first, 0), tcid2(kv.first, 1);
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  Eigen::aligned_vector<StereoPair> stereo_pairs;
+  for (size_t i = 0; i < calib.T_i_c.size(); i++) {
+    for (size_t j = i + 1; j < calib.T_i_c.size(); j++) {
+      StereoPair sp;
+      sp.cam1 = i;
+      sp.cam2 = j;
+      sp.T_1_2 = calib.T_i_c[i].inverse() * calib.T_i_c[j];
+      computeEssential(sp.T_1_2, sp.E);
+      stereo_pairs.emplace_back(sp);
+    }
+  }
+
+  const size_t num_pairs = stereo_pairs.size();
+
+  std::cout << "Matching " << frame_ids.size() * num_pairs
+            << " stereo pairs..." << std::endl;
+
+  // One slot per (frame, camera pair), written only by the task that owns
+  // the frame
+  Eigen::aligned_vector<MatchData> results(frame_ids.size() * num_pairs);
+
+  tbb::blocked_range<size_t> range(0, frame_ids.size());
+  auto match_func = [&](const tbb::blocked_range<size_t>& r) {
+    for (size_t f = r.begin(); f != r.end(); ++f) {
+      for (size_t p = 0; p < num_pairs; p++) {
+        const StereoPair& sp = stereo_pairs[p];
+        const TimeCamId tcid1(frame_ids[f], sp.cam1),
+            tcid2(frame_ids[f], sp.cam2);
+
+        auto it1 = feature_corners.find(tcid1);
+        auto it2 = feature_corners.find(tcid2);
+        if (it1 == feature_corners.end() || it2 == feature_corners.end()) {
+          continue;
+        }
+
+        const KeypointsData& kd1 = it1->second;
+        const KeypointsData& kd2 = it2->second;
+
+        MatchData& md = results[f * num_pairs + p];
+        md.T_i_j = sp.T_1_2;
+
+        if (config.mapper_guided_matching) {
+          matchDescriptorsGuided(kd1, kd2, calib.intrinsics[sp.cam2], sp.T_1_2,
+                                 md.matches, config.mapper_max_hamming_distance,
+                                 config.mapper_second_best_test_ratio,
+                                 config.mapper_guided_epipolar_error,
+                                 config.mapper_guided_cell_size,
+                                 config.mapper_guided_min_depth,
+                                 config.mapper_guided_min_baseline);
+        } else {
+          matchDescriptors(kd1.corner_descriptors, kd2.corner_descriptors,
+                           md.matches, config.mapper_max_hamming_distance,
+                           config.mapper_second_best_test_ratio);
+        }
+
+        findInliersEssential(kd1, kd2, sp.E, 1e-3, md);
+      }
+    }
+  };
 
-    MatchData md;
-    md.T_i_j = T_0_1;
+  tbb::parallel_for(range, match_func);
 
-    const KeypointsData& kd1 = feature_corners[tcid1];
-    const KeypointsData& kd2 = feature_corners[tcid2];
+  int num_matches = 0;
+  int num_inliers = 0;
 
-    matchDescriptors(kd1.corner_descriptors, kd2.corner_descriptors, md.matches,
-                     config.mapper_max_hamming_distance,
-                     config.mapper_second_best_test_ratio);
+  for (size_t f = 0; f < frame_ids.size(); f++) {
+    for (size_t p = 0; p < num_pairs; p++) {
+      MatchData& md = results[f * num_pairs + p];
 
-    num_matches += md.matches.size();
+      num_matches += md.matches.size();
 
-    findInliersEssential(kd1, kd2, E, 1e-3, md);
+      if (md.inliers.size() > 16) {
+        num_inliers += md.inliers.size();
 
-    if (md.inliers.size() > 16) {
-      num_inliers += md.inliers.size();
-      feature_matches[std::make_pair(tcid1, tcid2)] = md;
+        const TimeCamId tcid1(frame_ids[f], stereo_pairs[p].cam1),
+            tcid2(frame_ids[f], stereo_pairs[p].cam2);
+        feature_matches[std::make_pair(tcid1, tcid2)] = std::move(md);
+      }
     }
   }
 
-  std::cout << "Matched " << img_data.size() << " stereo pairs with "
-            << num_inliers << " inlier matches (" << num_matches << " total)."
-            << std::endl;
+  std::cout << "Matched " << frame_ids.size() * num_pairs
+            << " stereo pairs with " << num_inliers << " inlier matches ("
+            << num_matches << " total)." << std::endl;
 }
 
 void NfrMapper::match_all() {
+  std::vector<TimeCamId> query_ids;
+  for (const auto& kv : feature_corners) query_ids.emplace_back(kv.first);
+
+  match_all(query_ids);
+}
+
+void NfrMapper::match_all(const std::vector<TimeCamId>& query_ids) {
   std::vector<TimeCamId> keys;
   std::unordered_map<TimeCamId, size_t> id_to_key_idx;
 
@@ -570,10 +1366,11 @@ void NfrMapper::match_all() {
 
   tbb::concurrent_vector<match_pair> ids_to_match;
 
-  tbb::blocked_range<size_t> keys_range(0, keys.size());
+  tbb::blocked_range<size_t> keys_range(0, query_ids.size());
   auto compute_pairs = [&](const tbb::blocked_range<size_t>& r) {
-    for (size_t i = r.begin(); i != r.end(); ++i) {
-      const TimeCamId& tcid = keys[i];
+    for (size_t q = r.begin(); q != r.end(); ++q) {
+      const TimeCamId& tcid = query_ids[q];
+      const size_t i = id_to_key_idx.at(tcid);
       const KeypointsData& kd = feature_corners.at(tcid);
 
       std::vector<std::pair<TimeCamId, double>> results;
@@ -623,8 +1420,30 @@ void NfrMapper::match_all() {
 
       MatchData md;
 
-      matchDescriptors(f1.corner_descriptors, f2.corner_descriptors, md.matches,
-                       70, 1.2);
+      // Frames close in time have accurate relative poses from VIO, search
+      // only along the epipolar curves.
+      auto it1 = frame_poses.find(id1.frame_id);
+      auto it2 = frame_poses.find(id2.frame_id);
+
+      if (config.mapper_guided_matching && it1 != frame_poses.end() &&
+          it2 != frame_poses.end() &&
+          std::abs(id1.frame_id - id2.frame_id) * 1e-9 <
+              config.mapper_guided_max_time_diff) {
+        const Sophus::SE3d T_w_c1 =
+            it1->second.getPose() * calib.T_i_c[id1.cam_id];
+        const Sophus::SE3d T_w_c2 =
+            it2->second.getPose() * calib.T_i_c[id2.cam_id];
+
+        matchDescriptorsGuided(f1, f2, calib.intrinsics[id2.cam_id],
+                               T_w_c1.inverse() * T_w_c2, md.matches, 70, 1.2,
+                               config.mapper_guided_epipolar_error,
+                               config.mapper_guided_cell_size,
+                               config.mapper_guided_min_depth,
+                               config.mapper_guided_min_baseline);
+      } else {
+        matchDescriptors(f1.corner_descriptors, f2.corner_descriptors,
+                         md.matches, 70, 1.2);
+      }
 
       if (int(md.matches.size()) > config.mapper_min_matches) {
         matched++;
@@ -667,14 +1486,155 @@ void NfrMapper::match_all() {
             << std::endl;
 }
 
+void NfrMapper::compute_loop_closure_factors() {
+  std::vector<int64_t> frame_ids;
+  for (const auto& kv : frame_poses) frame_ids.emplace_back(kv.first);
+
+  compute_loop_closure_factors(frame_ids);
+}
+
+void NfrMapper::compute_loop_closure_factors(
+    const std::vector<int64_t>& frame_ids) {
+  const std::unordered_set<int64_t> frames(frame_ids.begin(),
+                                           frame_ids.end());
+
+  auto involved = [&](int64_t t_i_ns, int64_t t_j_ns) {
+    return frames.count(t_i_ns) > 0 || frames.count(t_j_ns) > 0;
+  };
+
+  loop_closure_factors.erase(
+      std::remove_if(loop_closure_factors.begin(), loop_closure_factors.end(),
+                     [&](const RelPoseFactor& lc) {
+                       return involved(lc.t_i_ns, lc.t_j_ns);
+                     }),
+      loop_closure_factors.end());
+
+  // The metric scale comes from the stereo pair
+  if (calib.intrinsics.size() < 2) return;
+
+  std::vector<const Matches::value_type*> loop_matches;
+  for (const auto& kv : feature_matches) {
+    const int64_t t_i_ns = kv.first.first.frame_id;
+    const int64_t t_j_ns = kv.first.second.frame_id;
+
+    if (involved(t_i_ns, t_j_ns) &&
+        std::abs(t_i_ns - t_j_ns) * 1e-9 >= config.mapper_loop_min_time_diff &&
+        kv.second.inliers.size() >= config.mapper_min_matches &&
+        frame_poses.count(t_i_ns) > 0 && frame_poses.count(t_j_ns) > 0) {
+      loop_matches.emplace_back(&kv);
+    }
+  }
+
+  Sophus::Matrix6d cov_inv;
+  cov_inv.setZero();
+  cov_inv.diagonal().head<3>().setConstant(
+      1.0 / std::pow(config.mapper_loop_pos_std_dev, 2));
+  cov_inv.diagonal().tail<3>().setConstant(
+      1.0 / std::pow(config.mapper_loop_rot_std_dev, 2));
+
+  Eigen::aligned_vector<RelPoseFactor> factors(loop_matches.size());
+  std::vector<size_t> num_inliers(loop_matches.size(), 0);
+
+  tbb::blocked_range<size_t> range(0, loop_matches.size());
+  auto compute_func = [&](const tbb::blocked_range<size_t>& r) {
+    for (size_t k = r.begin(); k != r.end(); ++k) {
+      const TimeCamId& tcid_i = loop_matches[k]->first.first;
+      const TimeCamId& tcid_j = loop_matches[k]->first.second;
+
+      // Stereo pair of the camera of tcid_i with camera 0, or with camera 1
+      // for camera 0. Stereo matches are stored with the lower camera id
+      // first.
+      const size_t cam_o = tcid_i.cam_id == 0 ? 1 : 0;
+      const TimeCamId tcid_a(tcid_i.frame_id, std::min(tcid_i.cam_id, cam_o));
+      const TimeCamId tcid_b(tcid_i.frame_id, std::max(tcid_i.cam_id, cam_o));
+      const bool i_is_a = tcid_a.cam_id == tcid_i.cam_id;
+
+      auto stereo_it = feature_matches.find(std::make_pair(tcid_a, tcid_b));
+      if (stereo_it == feature_matches.end()) continue;
+
+      const KeypointsData& kd_a = feature_corners.at(tcid_a);
+      const KeypointsData& kd_b = feature_corners.at(tcid_b);
+      const KeypointsData& kd_j = feature_corners.at(tcid_j);
+
+      const Sophus::SE3d T_a_b =
+          calib.T_i_c[tcid_a.cam_id].inverse() * calib.T_i_c[tcid_b.cam_id];
+
+      // Triangulated points in the body frame of i by feature id in tcid_i
+      std::unordered_map<FeatureId, Eigen::Vector3d> points_i;
+      for (const auto& m : stereo_it->second.inliers) {
+        const Eigen::Vector4d p =
+            triangulate(kd_a.corners_3d[m.first].head<3>(),
+                        kd_b.corners_3d[m.second].head<3>(), T_a_b);
+        if (p[3] <= 0) continue;
+
+        const FeatureId feat_id = i_is_a ? m.first : m.second;
+        points_i[feat_id] = calib.T_i_c[tcid_a.cam_id] *
+                            Eigen::Vector3d(p.head<3>() / p[3]);
+      }
+
+      Eigen::aligned_vector<Eigen::Vector3d> points, bearings;
+      for (const auto& m : loop_matches[k]->second.inliers) {
+        auto it = points_i.find(m.first);
+        if (it != points_i.end()) {
+          points.emplace_back(it->second);
+          bearings.emplace_back(kd_j.corners_3d[m.second].head<3>());
+        }
+      }
+
+      if (points.size() < config.mapper_min_matches) continue;
+
+      Sophus::SE3d T_i_cj;
+      std::vector<size_t> inliers;
+      findAbsolutePoseRansac(points, bearings, config.mapper_ransac_threshold,
+                             T_i_cj, inliers);
+
+      if (inliers.size() < config.mapper_min_matches) continue;
+
+      RelPoseFactor& rpf = factors[k];
+      rpf.t_i_ns = tcid_i.frame_id;
+      rpf.t_j_ns = tcid_j.frame_id;
+      rpf.T_i_j = T_i_cj * calib.T_i_c[tcid_j.cam_id].inverse();
+      rpf.cov_inv = cov_inv;
+
+      num_inliers[k] = inliers.size();
+    }
+  };
+
+  tbb::parallel_for(range, compute_func);
+
+  // Keep the estimate with most inliers for every pair of frames
+  std::map<std::pair<int64_t, int64_t>, size_t> best_factor;
+  for (size_t k = 0; k < factors.size(); k++) {
+    if (num_inliers[k] == 0) continue;
+
+    const std::pair<int64_t, int64_t> key =
+        std::minmax(factors[k].t_i_ns, factors[k].t_j_ns);
+    auto it = best_factor.find(key);
+    if (it == best_factor.end()) {
+      best_factor.emplace(key, k);
+    } else if (num_inliers[k] > num_inliers[it->second]) {
+      it->second = k;
+    }
+  }
+
+  for (const auto& kv : best_factor) {
+    loop_closure_factors.emplace_back(factors[kv.second]);
+  }
+
+  std::cout << "Found " << best_factor.size() << " loop closures in "
+            << loop_matches.size()
+            << " matched image pairs." << std::endl;
+}
+
 void NfrMapper::build_tracks() {
-  TrackBuilder trackBuilder;
+  track_builder.reset(new TrackBuilder);
   // Build: Efficient fusion of correspondences
-  trackBuilder.Build(feature_matches);
-  // Filter: Remove tracks that have conflict
-  trackBuilder.Filter(config.mapper_min_track_length);
+  track_builder->Build(feature_matches);
+  // Filter: Remove tracks that have conflict. They are only marked, so
+  // update() can extend them.
+  track_builder->Filter(config.mapper_min_track_length);
   // Export tree to usable data structure
-  trackBuilder.Export(feature_tracks);
+  track_builder->Export(feature_tracks);
 
   // info
   size_t inlier_match_count = 0;
@@ -694,64 +1654,194 @@ void NfrMapper::build_tracks() {
 }
 
 void NfrMapper::setup_opt() {
+  for (const auto& kv : feature_tracks) {
+    add_track_landmark(kv.first, kv.second);
+  }
+}
+
+void NfrMapper::update(int num_iterations) {
+  std::vector<int64_t> new_frames;
+  for (const auto& kv : img_data) {
+    if (frame_poses.count(kv.first) > 0 &&
+        processed_frames.count(kv.first) == 0) {
+      new_frames.emplace_back(kv.first);
+    }
+  }
+
+  if (new_frames.empty()) return;
+
+  std::sort(new_frames.begin(), new_frames.end());
+  const std::set<int64_t> new_frames_set(new_frames.begin(), new_frames.end());
+
+  std::cout << "Updating map with " << new_frames.size() << " new frames."
+            << std::endl;
+
+  // Detection and matching only for the new frames. New images are queried
+  // against all older images, as in the batch run.
+  detect_keypoints(new_frames);
+
+  std::vector<TimeCamId> new_tcids;
+  for (int64_t t_ns : new_frames) {
+    for (size_t i = 0; i < calib.intrinsics.size(); i++) {
+      const TimeCamId tcid(t_ns, i);
+      if (feature_corners.count(tcid) > 0) new_tcids.emplace_back(tcid);
+    }
+  }
+
+  match_stereo(new_frames);
+  match_all(new_tcids);
+
+  // A new session has to be in the common world frame before its landmarks
+  // are triangulated
+  if (session_start_t_ns.size() > 1) {
+    compute_loop_closure_factors(new_frames);
+    alignSessions();
+  }
+
+  // Every new match involves a new frame
+  Matches new_matches;
+  for (const auto& kv : feature_matches) {
+    if (new_frames_set.count(kv.first.first.frame_id) > 0 ||
+        new_frames_set.count(kv.first.second.frame_id) > 0) {
+      new_matches.emplace(kv);
+    }
+  }
+
+  if (!track_builder) track_builder.reset(new TrackBuilder);
+  track_builder->Build(new_matches);
+
+  // Only the tracks touched by the new matches changed, and all of them
+  // have an observation in a new frame
+  const std::vector<TrackBuilder::NodeIndex>& changed_tracks =
+      track_builder->changed_tracks;
+  track_builder->Filter(changed_tracks, config.mapper_min_track_length);
+
+  // Tracks merged into another one disappear, the changed ones are
+  // triangulated again
+  for (TrackId track_id : track_builder->merged_tracks) {
+    feature_tracks.erase(track_id);
+    if (lmdb.landmarkExists(track_id)) lmdb.removeLandmark(track_id);
+  }
+
+  Eigen::aligned_unordered_map<TrackId, KeypointPosition> warm_start;
+  for (TrackId track_id : changed_tracks) {
+    if (lmdb.landmarkExists(track_id)) {
+      warm_start[track_id] = lmdb.getLandmark(track_id);
+      lmdb.removeLandmark(track_id);
+    }
+  }
+
+  track_builder->Export(changed_tracks, feature_tracks);
+
+  std::set<int64_t> active_frames = new_frames_set;
+  int64_t min_matched_t_ns = new_frames.front();
+
+  size_t num_changed_tracks = 0;
+  for (TrackId track_id : changed_tracks) {
+    if (feature_tracks.count(track_id) == 0) continue;
+    num_changed_tracks++;
+
+    auto it = warm_start.find(track_id);
+    const bool added =
+        add_track_landmark(track_id, feature_tracks.at(track_id),
+                           it != warm_start.end() ? &it->second : nullptr);
+    if (!added) continue;
+
+    for (const auto& obs : feature_tracks.at(track_id)) {
+      active_frames.emplace(obs.first.frame_id);
+      min_matched_t_ns = std::min(min_matched_t_ns, obs.first.frame_id);
+    }
+  }
+
+  // Local window before the new frames. A loop closure to older frames
+  // also activates everything in between, so the correction is distributed
+  // over the loop.
+  const int64_t window_start_t_ns = std::min(
+      new_frames.front() - int64_t(config.mapper_local_window * 1e9),
+      min_matched_t_ns);
+
+  for (const auto& kv : frame_poses) {
+    if (kv.first >= window_start_t_ns) active_frames.emplace(kv.first);
+  }
+
+  std::cout << "Optimizing " << active_frames.size() << " of "
+            << frame_poses.size() << " frames, " << num_changed_tracks
+            << " tracks changed." << std::endl;
+
+  optimize(num_iterations, &active_frames);
+}
+
+bool NfrMapper::add_track_landmark(TrackId track_id,
+                                   const FeatureTrack& track,
+                                   const KeypointPosition* warm_start) {
+  if (track.size() < 2) return false;
+
   const double min_triang_distance2 = config.mapper_min_triangulation_dist *
                                       config.mapper_min_triangulation_dist;
 
-  for (const auto& kv : feature_tracks) {
-    if (kv.second.size() < 2) continue;
+  // Take first observation as host
+  auto it = track.begin();
+  TimeCamId tcid_h = it->first;
 
-    // Take first observation as host
-    auto it = kv.second.begin();
-    TimeCamId tcid_h = it->first;
+  auto add_observations = [&](const KeypointPosition& pos) {
+    lmdb.addLandmark(track_id, pos);
 
-    FeatureId feat_id_h = it->second;
-    Eigen::Vector2d pos_2d_h = feature_corners.at(tcid_h).corners[feat_id_h];
-    Eigen::Vector4d pos_3d_h;
-    calib.intrinsics[tcid_h.cam_id].unproject(pos_2d_h, pos_3d_h);
+    for (const auto& obs_kv : track) {
+      KeypointObservation ko;
+      ko.kpt_id = track_id;
+      ko.pos = feature_corners.at(obs_kv.first).corners[obs_kv.second];
+
+      lmdb.addObservation(obs_kv.first, ko);
+      // obs[tcid_h][obs_kv.first].emplace_back(ko);
+    }
+  };
 
-    it++;
+  // The previous estimate is still valid if the host did not change
+  if (warm_start && warm_start->kf_id == tcid_h) {
+    add_observations(*warm_start);
+    return true;
+  }
 
-    for (; it != kv.second.end(); it++) {
-      TimeCamId tcid_o = it->first;
+  FeatureId feat_id_h = it->second;
+  Eigen::Vector2d pos_2d_h = feature_corners.at(tcid_h).corners[feat_id_h];
+  Eigen::Vector4d pos_3d_h;
+  calib.intrinsics[tcid_h.cam_id].unproject(pos_2d_h, pos_3d_h);
 
-      FeatureId feat_id_o = it->second;
-      Eigen::Vector2d pos_2d_o = feature_corners.at(tcid_o).corners[feat_id_o];
-      Eigen::Vector4d pos_3d_o;
-      calib.intrinsics[tcid_o.cam_id].unproject(pos_2d_o, pos_3d_o);
+  it++;
 
-      Sophus::SE3d T_w_h = frame_poses.at(tcid_h.frame_id).getPose() *
-                           calib.T_i_c[tcid_h.cam_id];
-      Sophus::SE3d T_w_o = frame_poses.at(tcid_o.frame_id).getPose() *
-                           calib.T_i_c[tcid_o.cam_id];
+  for (; it != track.end(); it++) {
+    TimeCamId tcid_o = it->first;
 
-      Sophus::SE3d T_h_o = T_w_h.inverse() * T_w_o;
+    FeatureId feat_id_o = it->second;
+    Eigen::Vector2d pos_2d_o = feature_corners.at(tcid_o).corners[feat_id_o];
+    Eigen::Vector4d pos_3d_o;
+    calib.intrinsics[tcid_o.cam_id].unproject(pos_2d_o, pos_3d_o);
 
-      if (T_h_o.translation().squaredNorm() < min_triang_distance2) continue;
+    Sophus::SE3d T_w_h = frame_poses.at(tcid_h.frame_id).getPose() *
+                         calib.T_i_c[tcid_h.cam_id];
+    Sophus::SE3d T_w_o = frame_poses.at(tcid_o.frame_id).getPose() *
+                         calib.T_i_c[tcid_o.cam_id];
 
-      Eigen::Vector4d pos_3d =
-          triangulate(pos_3d_h.head<3>(), pos_3d_o.head<3>(), T_h_o);
+    Sophus::SE3d T_h_o = T_w_h.inverse() * T_w_o;
 
-      if (!pos_3d.array().isFinite().all() || pos_3d[3] <= 0 || pos_3d[3] > 2.0)
-        continue;
+    if (T_h_o.translation().squaredNorm() < min_triang_distance2) continue;
 
-      KeypointPosition pos;
-      pos.kf_id = tcid_h;
-      pos.dir = StereographicParam<double>::project(pos_3d);
-      pos.id = pos_3d[3];
+    Eigen::Vector4d pos_3d =
+        triangulate(pos_3d_h.head<3>(), pos_3d_o.head<3>(), T_h_o);
 
-      lmdb.addLandmark(kv.first, pos);
+    if (!pos_3d.array().isFinite().all() || pos_3d[3] <= 0 || pos_3d[3] > 2.0)
+      continue;
 
-      for (const auto& obs_kv : kv.second) {
-        KeypointObservation ko;
-        ko.kpt_id = kv.first;
-        ko.pos = feature_corners.at(obs_kv.first).corners[obs_kv.second];
+    KeypointPosition pos;
+    pos.kf_id = tcid_h;
+    pos.dir = StereographicParam<double>::project(pos_3d);
+    pos.id = pos_3d[3];
 
-        lmdb.addObservation(obs_kv.first, ko);
-        // obs[tcid_h][obs_kv.first].emplace_back(ko);
-      }
-      break;
-    }
+    add_observations(pos);
+    return true;
   }
+
+  return false;
 }
 
 }  // namespace basalt
@@ -0,0 +1,203 @@
+/**
+BSD 3-Clause License
+
+This file is part of the Basalt project.
+https://gitlab.com/VladyslavUsenko/basalt.git
+
+Copyright (c) 2019, Vladyslav Usenko and Nikolaus Demmel.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <basalt/vi_estimator/place_recognizer.h>
+
+#include <basalt/hash_bow/hash_bow.h>
+#include <basalt/utils/keypoints.h>
+
+#include <iostream>
+
+namespace basalt {
+
+PlaceRecognizer::PlaceRecognizer(const VioConfig& config)
+    : config(config),
+      num_frozen_keyframes(0),
+      num_dynamic_keyframes(0),
+      num_processed_keyframes(0),
+      num_dropped_keyframes(0),
+      max_latency_s(0) {
+  hash_bow_database.reset(new HashBow<256>(config.mapper_bow_num_bits));
+
+  in_marg_queue.set_capacity(1000);
+  job_queue.set_capacity(100);
+
+  forward_thread.reset(new std::thread(&PlaceRecognizer::forwardLoop, this));
+  processing_thread.reset(
+      new std::thread(&PlaceRecognizer::processingLoop, this));
+}
+
+PlaceRecognizer::~PlaceRecognizer() {
+  forward_thread->join();
+  processing_thread->join();
+}
+
+void PlaceRecognizer::forwardLoop() {
+  MargData::Ptr data;
+
+  while (true) {
+    in_marg_queue.pop(data);
+
+    if (!data.get()) {
+      if (out_marg_queue) out_marg_queue->push(nullptr);
+      job_queue.push(nullptr);
+      break;
+    }
+
+    const auto received = std::chrono::steady_clock::now();
+
+    // Only marginalized keyframes are final, every keyframe is
+    // marginalized exactly once.
+    for (const auto& res : data->opt_flow_res) {
+      if (data->kfs_to_marg.count(res->t_ns) == 0) continue;
+
+      std::shared_ptr<KeyframeJob> job(new KeyframeJob);
+      job->t_ns = res->t_ns;
+      job->opt_flow_res = res;
+      job->received = received;
+
+      if (!job_queue.try_push(job)) num_dropped_keyframes++;
+    }
+
+    if (out_marg_queue) out_marg_queue->push(data);
+  }
+}
+
+void PlaceRecognizer::processingLoop() {
+  std::shared_ptr<KeyframeJob> job;
+
+  while (true) {
+    job_queue.pop(job);
+
+    if (!job.get()) {
+      if (out_loop_queue) out_loop_queue->push(nullptr);
+      break;
+    }
+
+    const double wait_s =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                      job->received)
+            .count();
+
+    // A late keyframe skips only the query. It is still added to the
+    // database, so later revisits of the place can match it.
+    const bool query = wait_s <= config.loop_latency_budget;
+
+    processKeyframe(*job, query);
+
+    if (!query) {
+      num_dropped_keyframes++;
+      continue;
+    }
+
+    num_processed_keyframes++;
+
+    const double latency_s =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                      job->received)
+            .count();
+    if (latency_s > max_latency_s) max_latency_s = latency_s;
+  }
+
+  std::cout << "Finished PlaceRecognizer: processed "
+            << num_processed_keyframes << " keyframes, dropped "
+            << num_dropped_keyframes << ", max latency " << max_latency_s
+            << "s." << std::endl;
+}
+
+void PlaceRecognizer::processKeyframe(const KeyframeJob& job, bool query) {
+  const OpticalFlowInput::Ptr& input = job.opt_flow_res->input_images;
+  if (!input.get()) return;
+
+  const int64_t max_t_ns =
+      job.t_ns - int64_t(config.loop_exclusion_window * 1e9);
+
+  std::vector<std::pair<TimeCamId, HashBowVector>> bows;
+
+  for (size_t i = 0; i < input->img_data.size(); i++) {
+    if (!input->img_data[i].img.get()) continue;
+
+    const TimeCamId tcid(job.t_ns, i);
+
+    const Image<const uint16_t> img =
+        input->img_data[i].img->Reinterpret<const uint16_t>();
+
+    KeypointsData kd;
+    detectKeypointsMapping(img, kd, config.mapper_detection_num_points);
+    computeAngles(img, kd, true);
+    computeDescriptors(img, kd);
+
+    hash_bow_database->compute_bow(kd.corner_descriptors, kd.hashes,
+                                   kd.bow_vector);
+
+    std::vector<std::pair<TimeCamId, double>> results;
+    if (query) {
+      hash_bow_database->querry_database(kd.bow_vector,
+                                         config.loop_num_candidates, results,
+                                         &max_t_ns);
+    }
+
+    for (const auto& otcid_score : results) {
+      if (otcid_score.second > config.loop_min_score) {
+        LoopClosureCandidate::Ptr c(new LoopClosureCandidate);
+        c->query = tcid;
+        c->match = otcid_score.first;
+        c->score = otcid_score.second;
+
+        if (out_loop_queue) out_loop_queue->push(c);
+      }
+    }
+
+    bows.emplace_back(tcid, std::move(kd.bow_vector));
+  }
+
+  // Add after querying, so images of the same keyframe do not match each
+  // other
+  for (const auto& tcid_bow : bows) {
+    hash_bow_database->add_to_database(tcid_bow.first, tcid_bow.second);
+  }
+  num_dynamic_keyframes++;
+
+  // Merge the dynamic part once it grows relative to the compact index, so
+  // the amortized cost of freeze() stays constant per keyframe.
+  if (num_dynamic_keyframes >=
+      std::max(MIN_KEYFRAMES_TO_FREEZE, num_frozen_keyframes / 4)) {
+    hash_bow_database->freeze();
+    num_frozen_keyframes += num_dynamic_keyframes;
+    num_dynamic_keyframes = 0;
+  }
+}
+
+}  // namespace basalt
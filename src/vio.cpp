@@ -54,8 +54,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <CLI/CLI.hpp>
 
 #include <basalt/io/dataset_io.h>
+#include <basalt/io/dataset_io_prefetch.h>
+#include <basalt/io/dataset_replay.h>
 #include <basalt/io/marg_data_io.h>
 #include <basalt/spline/se3_spline.h>
+#include <basalt/vi_estimator/imu_state_propagator.h>
+#include <basalt/vi_estimator/place_recognizer.h>
 #include <basalt/vi_estimator/vio_estimator.h>
 #include <basalt/calibration/calibration.hpp>
 
@@ -118,8 +122,9 @@ pangolin::OpenGlRenderState camera;
 std::unordered_map<int64_t, basalt::VioVisualizationData::Ptr> vis_map;
 
 tbb::concurrent_bounded_queue<basalt::VioVisualizationData::Ptr> out_vis_queue;
-tbb::concurrent_bounded_queue<basalt::PoseVelBiasState<double>::Ptr>
-    out_state_queue;
+basalt::SpscQueue<basalt::PoseVelBiasState<double>::Ptr> out_state_queue;
+basalt::SpscQueue<basalt::PoseVelBiasState<double>::Ptr> out_imu_state_queue;
+tbb::concurrent_bounded_queue<basalt::LoopClosureCandidate::Ptr> out_loop_queue;
 
 std::vector<int64_t> vio_t_ns;
 Eigen::aligned_vector<Eigen::Vector3d> vio_t_w_i;
@@ -144,25 +149,29 @@ basalt::VioDatasetPtr vio_dataset;
 basalt::VioConfig vio_config;
 basalt::OpticalFlowBase::Ptr opt_flow_ptr;
 basalt::VioEstimatorBase::Ptr vio;
+basalt::ImuStatePropagator::Ptr imu_propagator;
+basalt::PlaceRecognizer::Ptr place_recognizer;
 
 // Feed functions
 void feed_images() {
   std::cout << "Started input_data thread " << std::endl;
 
+  basalt::ObjectPool<basalt::OpticalFlowInput> input_pool(32);
+
   for (size_t i = 0; i < vio_dataset->get_image_timestamps().size(); i++) {
     if (step_by_step) {
       std::unique_lock<std::mutex> lk(m);
       cv.wait(lk);
     }
 
-    basalt::OpticalFlowInput::Ptr data(new basalt::OpticalFlowInput);
+    basalt::OpticalFlowInput::Ptr data = input_pool.get();
 
     data->t_ns = vio_dataset->get_image_timestamps()[i];
     data->img_data = vio_dataset->get_image_data(data->t_ns);
 
     timestamp_to_id[data->t_ns] = i;
 
-    opt_flow_ptr->input_queue.push(data);
+    opt_flow_ptr->input_queue.push(std::move(data));
   }
 
   // Indicate the end of the sequence
@@ -172,16 +181,27 @@ void feed_images() {
 }
 
 void feed_imu() {
+  basalt::ObjectPool<basalt::ImuData<double>> imu_pool(1024);
+
   for (size_t i = 0; i < vio_dataset->get_gyro_data().size(); i++) {
-    basalt::ImuData<double>::Ptr data(new basalt::ImuData<double>);
+    basalt::ImuData<double>::Ptr data = imu_pool.get();
     data->t_ns = vio_dataset->get_gyro_data()[i].timestamp_ns;
 
     data->accel = vio_dataset->get_accel_data()[i].data;
     data->gyro = vio_dataset->get_gyro_data()[i].data;
 
-    vio->imu_data_queue.push(data);
+    if (imu_propagator) {
+      imu_propagator->imu_data_queue.push(std::move(data));
+    } else {
+      vio->imu_data_queue.push(std::move(data));
+    }
+  }
+
+  if (imu_propagator) {
+    imu_propagator->imu_data_queue.push(nullptr);
+  } else {
+    vio->imu_data_queue.push(nullptr);
   }
-  vio->imu_data_queue.push(nullptr);
 }
 
 int main(int argc, char** argv) {
@@ -196,6 +216,12 @@ int main(int argc, char** argv) {
   std::string trajectory_fmt;
   int num_threads = 0;
   bool use_imu = true;
+  bool imu_propagation = false;
+  bool place_recognition = false;
+  int prefetch_window = 16;
+  int prefetch_threads = 2;
+  double replay_speed = 0;
+  std::string replay_latency_path;
 
   CLI::App app{"App description"};
 
@@ -222,6 +248,22 @@ int main(int argc, char** argv) {
   app.add_option("--save-trajectory", trajectory_fmt,
                  "Save trajectory. Supported formats <tum, euroc, kitti>");
   app.add_option("--use-imu", use_imu, "Use IMU.");
+  app.add_option("--imu-propagation", imu_propagation,
+                 "Publish IMU-rate states propagated from the latest "
+                 "optimized state.");
+  app.add_option("--place-recognition", place_recognition,
+                 "Detect loop closure candidates online.");
+  app.add_option("--prefetch-window", prefetch_window,
+                 "Number of frames decoded ahead of the optical flow, 0 "
+                 "disables prefetching.");
+  app.add_option("--prefetch-threads", prefetch_threads,
+                 "Number of threads decoding the prefetched images.");
+  app.add_option("--replay-speed", replay_speed,
+                 "Replay the dataset at the recorded timestamps scaled by "
+                 "this factor instead of as fast as possible, 0 disables.");
+  app.add_option("--replay-latency-path", replay_latency_path,
+                 "Path to CSV file where the per-frame latencies of the "
+                 "replay will be written.");
 
   try {
     app.parse(argc, argv);
@@ -239,14 +281,15 @@ int main(int argc, char** argv) {
   if (!config_path.empty()) {
     vio_config.load(config_path);
 
-    if (vio_config.vio_enforce_realtime) {
+    if (vio_config.vio_enforce_realtime && replay_speed <= 0) {
       vio_config.vio_enforce_realtime = false;
       std::cout
           << "The option vio_config.vio_enforce_realtime was enabled, "
              "but it should only be used with the live executables (supply "
              "images at a constant framerate). This executable runs on the "
              "datasets and processes images as fast as it can, so the option "
-             "will be disabled. "
+             "will be disabled. Use --replay-speed to supply the images at "
+             "the recorded framerate."
           << std::endl;
     }
   }
@@ -261,6 +304,16 @@ int main(int argc, char** argv) {
 
     vio_dataset = dataset_io->get_data();
 
+    // The images are decoded into buffers with room for the optical flow
+    // pyramid, so the pyramid does not copy them.
+    if (prefetch_window > 0 && prefetch_threads > 0) {
+      vio_dataset = std::make_shared<basalt::PrefetchVioDataset>(
+          vio_dataset, prefetch_window, prefetch_threads, true);
+    } else {
+      vio_dataset->set_image_pool(std::make_shared<basalt::ImagePool<uint16_t>>(
+          32 * vio_dataset->get_num_cams(), true));
+    }
+
     show_frame.Meta().range[1] = vio_dataset->get_image_timestamps().size() - 1;
     show_frame.Meta().gui_changed = true;
 
@@ -282,13 +335,33 @@ int main(int argc, char** argv) {
     opt_flow_ptr->output_queue = &vio->vision_data_queue;
     if (show_gui) vio->out_vis_queue = &out_vis_queue;
     vio->out_state_queue = &out_state_queue;
+
+    if (imu_propagation && use_imu) {
+      imu_propagator.reset(
+          new basalt::ImuStatePropagator(basalt::constants::g, calib));
+      imu_propagator->out_imu_queue = &vio->imu_data_queue;
+      imu_propagator->out_state_queue = &out_imu_state_queue;
+      out_imu_state_queue.set_capacity(1000);
+      vio->out_imu_propagator_queue = &imu_propagator->state_queue;
+    }
   }
 
   basalt::MargDataSaver::Ptr marg_data_saver;
 
+  if (place_recognition) {
+    place_recognizer.reset(new basalt::PlaceRecognizer(vio_config));
+    place_recognizer->out_loop_queue = &out_loop_queue;
+    vio->out_marg_queue = &place_recognizer->in_marg_queue;
+  }
+
   if (!marg_data_path.empty()) {
-    marg_data_saver.reset(new basalt::MargDataSaver(marg_data_path));
-    vio->out_marg_queue = &marg_data_saver->in_marg_queue;
+    marg_data_saver.reset(
+        new basalt::MargDataSaver(marg_data_path, vio_config));
+    if (place_recognizer) {
+      place_recognizer->out_marg_queue = &marg_data_saver->in_marg_queue;
+    } else {
+      vio->out_marg_queue = &marg_data_saver->in_marg_queue;
+    }
 
     // Save gt.
     {
@@ -306,8 +379,25 @@ int main(int argc, char** argv) {
 
   vio_data_log.Clear();
 
-  std::thread t1(&feed_images);
-  std::thread t2(&feed_imu);
+  basalt::VioDatasetReplay::Ptr replay;
+  std::shared_ptr<std::thread> t1, t2;
+
+  if (replay_speed > 0) {
+    replay.reset(new basalt::VioDatasetReplay(vio_dataset, replay_speed));
+    replay->out_image_queue = &opt_flow_ptr->input_queue;
+    replay->out_imu_queue = imu_propagator ? &imu_propagator->imu_data_queue
+                                           : &vio->imu_data_queue;
+
+    const auto& image_t_ns = vio_dataset->get_image_timestamps();
+    for (size_t i = 0; i < image_t_ns.size(); i++) {
+      timestamp_to_id[image_t_ns[i]] = i;
+    }
+
+    replay->start();
+  } else {
+    t1.reset(new std::thread(&feed_images));
+    t2.reset(new std::thread(&feed_imu));
+  }
 
   std::shared_ptr<std::thread> t3;
 
@@ -338,6 +428,8 @@ int main(int argc, char** argv) {
 
       int64_t t_ns = data->t_ns;
 
+      if (replay) replay->record_output(t_ns);
+
       // std::cerr << "t_ns " << t_ns << std::endl;
       Sophus::SE3d T_w_i = data->T_w_i;
       Eigen::Vector3d vel_w_i = data->vel_w_i;
@@ -361,9 +453,48 @@ int main(int argc, char** argv) {
       }
     }
 
+    // The estimator has finished, nothing consumes the replayed data anymore
+    if (replay) replay->cancel();
+
     std::cout << "Finished t4" << std::endl;
   });
 
+  std::shared_ptr<std::thread> t6;
+  size_t num_imu_states = 0;
+
+  if (imu_propagator)
+    t6.reset(new std::thread([&]() {
+      basalt::PoseVelBiasState<double>::Ptr data;
+
+      while (true) {
+        out_imu_state_queue.pop(data);
+
+        if (!data.get()) break;
+
+        num_imu_states++;
+      }
+
+      std::cout << "Finished t6" << std::endl;
+    }));
+
+  std::shared_ptr<std::thread> t7;
+  size_t num_loop_candidates = 0;
+
+  if (place_recognizer)
+    t7.reset(new std::thread([&]() {
+      basalt::LoopClosureCandidate::Ptr data;
+
+      while (true) {
+        out_loop_queue.pop(data);
+
+        if (!data.get()) break;
+
+        num_loop_candidates++;
+      }
+
+      std::cout << "Finished t7" << std::endl;
+    }));
+
   std::shared_ptr<std::thread> t5;
 
   if (print_queue) {
@@ -373,7 +504,12 @@ int main(int argc, char** argv) {
                   << opt_flow_ptr->input_queue.size()
                   << " opt_flow_ptr->output_queue "
                   << opt_flow_ptr->output_queue->size() << " out_state_queue "
-                  << out_state_queue.size() << std::endl;
+                  << out_state_queue.size() << " (max "
+                  << opt_flow_ptr->input_queue.max_size() << " "
+                  << opt_flow_ptr->output_queue->max_size() << " "
+                  << out_state_queue.max_size() << ") imu_data_queue "
+                  << vio->imu_data_queue.size() << " (max "
+                  << vio->imu_data_queue.max_size() << ")" << std::endl;
         std::this_thread::sleep_for(std::chrono::seconds(1));
       }
     }));
@@ -533,15 +669,37 @@ int main(int argc, char** argv) {
         }
       }
     }
+
+    // The window was closed, end the playback early
+    if (replay) replay->stop();
   }
 
   terminate = true;
 
-  t1.join();
-  t2.join();
+  if (t1.get()) t1->join();
+  if (t2.get()) t2->join();
   if (t3.get()) t3->join();
   t4.join();
   if (t5.get()) t5->join();
+  if (t6.get()) t6->join();
+  if (t7.get()) t7->join();
+
+  if (imu_propagator) {
+    std::cout << "Published " << num_imu_states << " IMU-rate states"
+              << std::endl;
+  }
+
+  if (place_recognizer) {
+    std::cout << "Detected " << num_loop_candidates
+              << " loop closure candidates" << std::endl;
+  }
+
+  if (replay) {
+    replay->print_stats();
+    if (!replay_latency_path.empty()) {
+      replay->save_latencies(replay_latency_path);
+    }
+  }
 
   auto time_end = std::chrono::high_resolution_clock::now();
 
@@ -1,9 +1,22 @@
 
 
+#include <basalt/hash_bow/hash_bow.h>
 #include <basalt/spline/se3_spline.h>
+#include <basalt/utils/keypoints.h>
 #include <basalt/utils/nfr.h>
+#include <basalt/utils/relative_pose.h>
+#include <basalt/utils/tracks.h>
+#include <basalt/vi_estimator/nfr_mapper.h>
+#include <basalt/vi_estimator/place_recognizer.h>
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <set>
+#include <thread>
 
 #include "gtest/gtest.h"
 #include "test_utils.h"
@@ -135,3 +148,1379 @@ TEST(PreIntegrationTestSuite, RollPitchTest) {
         x0);
   }
 }
+
+TEST(KeypointsTestSuite, MatchDescriptorsTest) {
+  const int threshold = 70;
+  const double dist_2_best = 1.2;
+
+  std::mt19937 rng(0);
+
+  std::vector<std::bitset<256>> desc_1(700), desc_2(600);
+  for (auto& d : desc_1) {
+    for (int k = 0; k < 256; k++) d[k] = rng() & 1;
+  }
+
+  // Half of the descriptors are noisy copies of descriptors in desc_1
+  for (size_t j = 0; j < desc_2.size(); j++) {
+    if (j % 2 == 0) {
+      desc_2[j] = desc_1[rng() % desc_1.size()];
+      for (int k = 0; k < 20; k++) desc_2[j].flip(rng() % 256);
+    } else {
+      for (int k = 0; k < 256; k++) desc_2[j][k] = rng() & 1;
+    }
+  }
+
+  // Brute force reference
+  auto best_match = [&](const std::vector<std::bitset<256>>& d1,
+                        const std::vector<std::bitset<256>>& d2, size_t i) {
+    int best_idx = -1, best_dist = 500, best2_dist = 500;
+    for (size_t j = 0; j < d2.size(); j++) {
+      int dist = (d1[i] ^ d2[j]).count();
+      if (dist <= best_dist) {
+        best2_dist = best_dist;
+        best_dist = dist;
+        best_idx = j;
+      } else if (dist < best2_dist) {
+        best2_dist = dist;
+      }
+    }
+    bool valid =
+        best_dist < threshold && best_dist * dist_2_best <= best2_dist;
+    return valid ? best_idx : -1;
+  };
+
+  std::vector<std::pair<int, int>> matches_ref;
+  for (size_t i = 0; i < desc_1.size(); i++) {
+    int j = best_match(desc_1, desc_2, i);
+    if (j >= 0 && best_match(desc_2, desc_1, j) == int(i)) {
+      matches_ref.emplace_back(i, j);
+    }
+  }
+
+  std::vector<std::pair<int, int>> matches;
+  basalt::matchDescriptors(desc_1, desc_2, matches, threshold, dist_2_best);
+  std::sort(matches.begin(), matches.end());
+
+  EXPECT_GT(matches_ref.size(), 100u);
+  EXPECT_EQ(matches_ref, matches);
+}
+
+TEST(KeypointsTestSuite, MatchDescriptorsGuidedTest) {
+  const int threshold = 70;
+  const double dist_2_best = 1.2;
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+
+  Eigen::Vector4d params(380, 380, 376, 240);
+  basalt::GenericCamera<double> cam;
+  cam.variant = basalt::PinholeCamera<double>(params);
+
+  const Sophus::SE3d T_1_2(Sophus::SO3d::exp(Eigen::Vector3d(0, 0.05, 0)),
+                           Eigen::Vector3d(0.11, 0, 0));
+
+  basalt::KeypointsData kd1, kd2;
+  std::vector<int> gt_match_2;  // Index in kd2 for every corner of kd1
+
+  auto add_corner = [&](basalt::KeypointsData& kd, const Eigen::Vector3d& p,
+                        const std::bitset<256>& desc) {
+    Eigen::Vector2d proj;
+    if (!cam.project(Eigen::Vector4d(p[0], p[1], p[2], 1), proj) ||
+        proj[0] < 0 || proj[1] < 0 || proj[0] > 752 || proj[1] > 480) {
+      return false;
+    }
+
+    Eigen::Vector4d p_3d;
+    cam.unproject(proj, p_3d);
+
+    kd.corners.emplace_back(proj);
+    kd.corners_3d.emplace_back(p_3d);
+    kd.corner_descriptors.emplace_back(desc);
+    return true;
+  };
+
+  // Every third point has no correspondence in the second image. Instead,
+  // the second image contains a corner with the same descriptor away from
+  // the epipolar line.
+  int num_decoys = 0;
+  while (kd1.corners.size() < 300) {
+    const Eigen::Vector3d p1(3 * uniform(rng), 2 * uniform(rng),
+                             5 + 3 * uniform(rng));
+
+    std::bitset<256> desc;
+    for (int k = 0; k < 256; k++) desc[k] = rng() & 1;
+
+    const bool decoy = kd1.corners.size() % 3 == 2;
+    const Eigen::Vector3d p2 =
+        decoy ? T_1_2.inverse() * p1 + Eigen::Vector3d(0, 0.3, 0)
+              : T_1_2.inverse() * p1;
+
+    if (!add_corner(kd1, p1, desc)) continue;
+
+    std::bitset<256> desc2 = desc;
+    for (int k = 0; k < 10; k++) desc2.flip(rng() % 256);
+
+    if (add_corner(kd2, p2, desc2)) {
+      gt_match_2.emplace_back(decoy ? -1 : int(kd2.corners.size()) - 1);
+      if (decoy) num_decoys++;
+    } else {
+      gt_match_2.emplace_back(-1);
+    }
+  }
+
+  std::vector<std::pair<int, int>> matches;
+  basalt::matchDescriptors(kd1.corner_descriptors, kd2.corner_descriptors,
+                           matches, threshold, dist_2_best);
+
+  // Without the pose the decoys are matched
+  int num_wrong = 0;
+  for (const auto& m : matches) {
+    if (gt_match_2[m.first] != m.second) num_wrong++;
+  }
+  EXPECT_GT(num_decoys, 50);
+  EXPECT_GT(num_wrong, 50);
+
+  basalt::matchDescriptorsGuided(kd1, kd2, cam, T_1_2, matches, threshold,
+                                 dist_2_best, 1e-3, 20);
+
+  std::set<std::pair<int, int>> guided(matches.begin(), matches.end());
+  for (size_t i = 0; i < gt_match_2.size(); i++) {
+    if (gt_match_2[i] >= 0) {
+      EXPECT_TRUE(guided.count(std::make_pair(int(i), gt_match_2[i])));
+    }
+  }
+  for (const auto& m : matches) {
+    EXPECT_EQ(gt_match_2[m.first], m.second);
+  }
+
+  // Without baseline the epipolar constraint is degenerate, all corners are
+  // matched like without the pose
+  std::vector<std::pair<int, int>> unguided;
+  basalt::matchDescriptors(kd1.corner_descriptors, kd2.corner_descriptors,
+                           unguided, threshold, dist_2_best);
+
+  for (double baseline : {0.0, 1e-4}) {
+    const Sophus::SE3d T_1_2_rot(T_1_2.so3(),
+                                 Eigen::Vector3d(baseline, 0, 0));
+    basalt::matchDescriptorsGuided(kd1, kd2, cam, T_1_2_rot, matches,
+                                   threshold, dist_2_best, 1e-3, 20);
+    EXPECT_EQ(unguided, matches) << "baseline " << baseline;
+  }
+}
+
+TEST(RelativePoseTestSuite, FivePointRansacTest) {
+  std::mt19937 rng(0);
+  std::normal_distribution<double> normal(0, 1);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+
+  auto random_vec = [&]() {
+    return Eigen::Vector3d(normal(rng), normal(rng), normal(rng));
+  };
+
+  for (int trial = 0; trial < 20; trial++) {
+    const Sophus::SE3d T_1_2(Sophus::SO3d::exp(random_vec() * 0.2),
+                             random_vec().normalized());
+
+    // Minimal solver with noise free points
+    Eigen::Matrix<double, 3, 5> m1, m2;
+    for (int i = 0; i < 5; i++) {
+      const Eigen::Vector3d p1(uniform(rng), uniform(rng), 4 + uniform(rng));
+      m1.col(i) = p1.normalized();
+      m2.col(i) = (T_1_2.inverse() * p1).normalized();
+    }
+
+    Eigen::Matrix3d E_gt =
+        Sophus::SO3d::hat(T_1_2.translation()) * T_1_2.so3().matrix();
+    E_gt.normalize();
+
+    std::array<Eigen::Matrix3d, 10> Es;
+    const int num_solutions = basalt::fivePointEssential(m1, m2, Es);
+
+    double min_error = std::numeric_limits<double>::max();
+    for (int k = 0; k < num_solutions; k++) {
+      min_error = std::min(
+          min_error, std::min((Es[k] - E_gt).norm(), (Es[k] + E_gt).norm()));
+    }
+    EXPECT_LT(min_error, 1e-6);
+
+    // RANSAC with noise and 20% outliers at the end of the list
+    Eigen::aligned_vector<Eigen::Vector3d> f1, f2;
+    const int num_points = 200;
+    const int num_outliers = 40;
+    for (int i = 0; i < num_points; i++) {
+      const Eigen::Vector3d p1(3 * uniform(rng), 3 * uniform(rng),
+                               6 + 3 * uniform(rng));
+      f1.emplace_back((p1.normalized() + random_vec() * 1e-4).normalized());
+      if (i < num_points - num_outliers) {
+        const Eigen::Vector3d p2 = T_1_2.inverse() * p1;
+        f2.emplace_back((p2.normalized() + random_vec() * 1e-4).normalized());
+      } else {
+        f2.emplace_back(Eigen::Vector3d(uniform(rng), uniform(rng), 1));
+        f2.back().normalize();
+      }
+    }
+
+    Sophus::SE3d T_1_2_est;
+    std::vector<int> inliers;
+    ASSERT_TRUE(basalt::findRelativePoseRansac(f1, f2, 5e-5, 100, T_1_2_est,
+                                               inliers));
+
+    const double rot_error =
+        (T_1_2_est.so3().inverse() * T_1_2.so3()).log().norm();
+    const double trans_error = std::acos(std::min(
+        1.0, T_1_2_est.translation().dot(T_1_2.translation().normalized())));
+
+    EXPECT_LT(rot_error, 0.01);
+    EXPECT_LT(trans_error, 0.05);
+    EXPECT_TRUE(std::is_sorted(inliers.begin(), inliers.end()));
+    EXPECT_GE(inliers.size(), size_t(0.95 * (num_points - num_outliers)));
+  }
+}
+
+TEST(TracksTestSuite, TrackBuilderTest) {
+  using basalt::TimeCamId;
+
+  auto add_match = [](basalt::Matches& matches, const TimeCamId& i,
+                      const TimeCamId& j, basalt::FeatureId fi,
+                      basalt::FeatureId fj) {
+    matches[std::make_pair(i, j)].inliers.emplace_back(fi, fj);
+  };
+
+  basalt::Matches matches;
+
+  // Valid track over 4 images
+  add_match(matches, TimeCamId(0, 0), TimeCamId(1, 0), 0, 0);
+  add_match(matches, TimeCamId(1, 0), TimeCamId(2, 0), 0, 1);
+  add_match(matches, TimeCamId(2, 0), TimeCamId(3, 0), 1, 2);
+
+  // Image (0, 0) is observed twice
+  add_match(matches, TimeCamId(0, 0), TimeCamId(1, 0), 5, 5);
+  add_match(matches, TimeCamId(1, 0), TimeCamId(2, 0), 5, 5);
+  add_match(matches, TimeCamId(2, 0), TimeCamId(0, 0), 5, 6);
+
+  // Too short
+  add_match(matches, TimeCamId(2, 0), TimeCamId(3, 0), 7, 7);
+
+  basalt::TrackBuilder track_builder;
+  track_builder.Build(matches);
+
+  basalt::FeatureTracks tracks;
+  track_builder.Filter(3);
+  track_builder.Export(tracks);
+  EXPECT_EQ(1u, track_builder.TrackCount());
+
+  ASSERT_EQ(1u, tracks.size());
+  const basalt::TrackId track_id = tracks.begin()->first;
+  const basalt::FeatureTrack expected = {{TimeCamId(0, 0), 0},
+                                         {TimeCamId(1, 0), 0},
+                                         {TimeCamId(2, 0), 1},
+                                         {TimeCamId(3, 0), 2}};
+  EXPECT_EQ(expected, tracks.begin()->second);
+
+  // Extending the builder keeps the existing track ids. The track that was
+  // too short is long enough now.
+  basalt::Matches new_matches;
+  add_match(new_matches, TimeCamId(4, 0), TimeCamId(3, 0), 3, 2);
+  add_match(new_matches, TimeCamId(4, 0), TimeCamId(3, 0), 7, 7);
+  track_builder.Build(new_matches);
+
+  EXPECT_EQ(2u, track_builder.changed_tracks.size());
+  EXPECT_TRUE(track_builder.merged_tracks.empty());
+
+  // Only the changed tracks are filtered and exported
+  track_builder.Filter(track_builder.changed_tracks, 3);
+  track_builder.Export(track_builder.changed_tracks, tracks);
+
+  ASSERT_EQ(2u, tracks.size());
+  ASSERT_EQ(1u, tracks.count(track_id));
+  EXPECT_EQ(5u, tracks.at(track_id).size());
+  EXPECT_EQ(3, tracks.at(track_id).at(TimeCamId(4, 0)));
+
+  basalt::FeatureTracks all_tracks;
+  track_builder.Filter(3);
+  track_builder.Export(all_tracks);
+  EXPECT_EQ(all_tracks, tracks);
+
+  // A new feature matched to both tracks merges them into one track with a
+  // conflict in image (4, 0)
+  basalt::Matches merge_matches;
+  add_match(merge_matches, TimeCamId(5, 0), TimeCamId(4, 0), 0, 3);
+  add_match(merge_matches, TimeCamId(5, 0), TimeCamId(4, 0), 0, 7);
+  track_builder.Build(merge_matches);
+
+  ASSERT_EQ(1u, track_builder.changed_tracks.size());
+  ASSERT_EQ(1u, track_builder.merged_tracks.size());
+  EXPECT_EQ(track_id, track_builder.changed_tracks[0]);
+  EXPECT_EQ(1u, tracks.count(track_builder.merged_tracks[0]));
+
+  track_builder.Filter(track_builder.changed_tracks, 3);
+  for (auto id : track_builder.merged_tracks) tracks.erase(id);
+  track_builder.Export(track_builder.changed_tracks, tracks);
+
+  EXPECT_TRUE(tracks.empty());
+  EXPECT_EQ(0u, track_builder.TrackCount());
+}
+
+TEST(TracksTestSuite, TrackPartitionTest) {
+  using basalt::ImageFeaturePair;
+  using basalt::TimeCamId;
+
+  // Points observed in 2 to 6 consecutive images, matched in chains, plus
+  // some wrong matches that merge tracks and cause conflicts
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> image_dist(0, 19);
+  std::uniform_int_distribution<int> length_dist(2, 6);
+  std::uniform_int_distribution<int> point_dist(0, 299);
+
+  std::vector<basalt::Matches> batches(2);
+  for (int p = 0; p < 300; p++) {
+    const int first = image_dist(rng);
+    const int length = length_dist(rng);
+    for (int i = first; i + 1 < first + length; i++) {
+      batches[p % 2][std::make_pair(TimeCamId(i, 0), TimeCamId(i + 1, 0))]
+          .inliers.emplace_back(p, p);
+    }
+  }
+  for (int k = 0; k < 40; k++) {
+    const int i = image_dist(rng);
+    batches[k % 2][std::make_pair(TimeCamId(i, 0), TimeCamId(i + 2, 0))]
+        .inliers.emplace_back(point_dist(rng), point_dist(rng));
+  }
+
+  // Serial reference: plain union-find over all matched features
+  std::map<ImageFeaturePair, ImageFeaturePair> parent;
+  std::function<ImageFeaturePair(const ImageFeaturePair&)> find =
+      [&](const ImageFeaturePair& x) {
+        auto it = parent.emplace(x, x).first;
+        if (it->second == x) return x;
+        return it->second = find(it->second);
+      };
+
+  for (const auto& batch : batches) {
+    for (const auto& kv : batch) {
+      for (const auto& m : kv.second.inliers) {
+        const ImageFeaturePair a = find({kv.first.first, m.first});
+        const ImageFeaturePair b = find({kv.first.second, m.second});
+        if (a != b) parent[a] = b;
+      }
+    }
+  }
+
+  const size_t min_length = 3;
+
+  std::map<ImageFeaturePair, std::vector<ImageFeaturePair>> sets;
+  for (const auto& kv : parent) sets[find(kv.first)].emplace_back(kv.first);
+
+  std::set<basalt::FeatureTrack> expected;
+  for (const auto& kv : sets) {
+    basalt::FeatureTrack track;
+    bool valid = kv.second.size() >= min_length;
+    for (const auto& node : kv.second) {
+      valid = valid && track.emplace(node.first, node.second).second;
+    }
+    if (valid) expected.emplace(track);
+  }
+  ASSERT_GT(expected.size(), 100u);
+
+  // The track ids are not compared, only the partition into tracks. It has
+  // to be the same for every thread schedule and when the matches arrive in
+  // several batches.
+  for (int run = 0; run < 5; run++) {
+    basalt::TrackBuilder track_builder;
+    if (run % 2 == 0) {
+      basalt::Matches all = batches[0];
+      for (const auto& kv : batches[1]) {
+        auto& inliers = all[kv.first].inliers;
+        inliers.insert(inliers.end(), kv.second.inliers.begin(),
+                       kv.second.inliers.end());
+      }
+      track_builder.Build(all);
+    } else {
+      for (const auto& batch : batches) track_builder.Build(batch);
+    }
+
+    track_builder.Filter(min_length);
+
+    basalt::FeatureTracks tracks;
+    track_builder.Export(tracks);
+    EXPECT_EQ(tracks.size(), track_builder.TrackCount());
+
+    std::set<basalt::FeatureTrack> partition;
+    for (const auto& kv : tracks) partition.emplace(kv.second);
+
+    EXPECT_EQ(tracks.size(), partition.size());
+    EXPECT_TRUE(expected == partition) << "run " << run;
+  }
+}
+
+TEST(HashBowTestSuite, FreezeTest) {
+  std::mt19937 rng(0);
+
+  basalt::HashBow<256> dynamic_bow(10), frozen_bow(10);
+
+  auto compute_bow = [&](const std::vector<std::bitset<256>>& descriptors) {
+    std::vector<basalt::FeatureHash> hashes;
+    basalt::HashBowVector bow_vector;
+    dynamic_bow.compute_bow(descriptors, hashes, bow_vector);
+    return bow_vector;
+  };
+
+  // Frames share descriptors with their neighbours, so queries have
+  // several candidates with distinct scores
+  std::vector<std::bitset<256>> pool(2000);
+  for (auto& d : pool) {
+    for (int k = 0; k < 256; k++) d[k] = rng() & 1;
+  }
+
+  std::vector<basalt::HashBowVector> frame_bows;
+  std::vector<basalt::TimeCamId> frame_tcids;
+  for (int i = 0; i < 120; i++) {
+    std::vector<std::bitset<256>> descriptors;
+    for (int k = 0; k < 150; k++) {
+      descriptors.emplace_back(pool[(i * 15 + rng() % 300) % pool.size()]);
+    }
+
+    frame_bows.emplace_back(compute_bow(descriptors));
+    frame_tcids.emplace_back(int64_t(1000 + 10 * (i / 2)), i % 2);
+  }
+
+  // Maximum score difference from the 16 bit weights, every word of the
+  // query changes the score by at most one quantization step
+  auto tolerance = [](const basalt::HashBowVector& bow_vector) {
+    return bow_vector.size() / 65535.0;
+  };
+
+  auto expect_same_ranking =
+      [&](const basalt::HashBow<256>& frozen,
+          const basalt::HashBowVector& query, size_t num_results,
+          const int64_t* max_t_ns) {
+        std::vector<std::pair<basalt::TimeCamId, double>> res_dynamic,
+            res_frozen, res_all;
+        dynamic_bow.querry_database(query, num_results, res_dynamic,
+                                    max_t_ns);
+        frozen.querry_database(query, num_results, res_frozen, max_t_ns);
+        dynamic_bow.querry_database(query, frame_bows.size(), res_all,
+                                    max_t_ns);
+
+        std::sort(res_dynamic.begin(), res_dynamic.end(),
+                  [](const auto& a, const auto& b) {
+                    return a.second > b.second;
+                  });
+        std::sort(res_frozen.begin(), res_frozen.end(),
+                  [](const auto& a, const auto& b) {
+                    return a.second > b.second;
+                  });
+
+        std::map<basalt::TimeCamId, double> all_scores;
+        for (const auto& kv : res_all) all_scores[kv.first] = kv.second;
+
+        const double tol = tolerance(query);
+
+        if (!max_t_ns) EXPECT_EQ(num_results, res_frozen.size());
+        ASSERT_EQ(res_dynamic.size(), res_frozen.size());
+        for (size_t i = 0; i < res_frozen.size(); i++) {
+          if (max_t_ns) EXPECT_LT(res_frozen[i].first.frame_id, *max_t_ns);
+
+          // Ranks can only swap between candidates whose scores are closer
+          // than the quantization error
+          EXPECT_NEAR(res_dynamic[i].second, res_frozen[i].second, tol);
+          ASSERT_TRUE(all_scores.count(res_frozen[i].first));
+          EXPECT_NEAR(all_scores.at(res_frozen[i].first), res_frozen[i].second,
+                      tol);
+          if (res_dynamic[i].first != res_frozen[i].first) {
+            EXPECT_NEAR(all_scores.at(res_frozen[i].first),
+                        res_dynamic[i].second, 2 * tol);
+          }
+        }
+      };
+
+  // Half of the frames in the compact index, the rest added after freeze()
+  for (size_t i = 0; i < frame_bows.size(); i++) {
+    if (i == frame_bows.size() / 2) frozen_bow.freeze();
+
+    dynamic_bow.add_to_database(frame_tcids[i], frame_bows[i]);
+    frozen_bow.add_to_database(frame_tcids[i], frame_bows[i]);
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < frame_bows.size(); i += 7) {
+      expect_same_ranking(frozen_bow, frame_bows[i], 10, nullptr);
+
+      // Only frames before the query frame, as for loop closures
+      const int64_t max_t_ns = frame_tcids[i].frame_id;
+      expect_same_ranking(frozen_bow, frame_bows[i], 10, &max_t_ns);
+    }
+
+    // Everything in the compact index for the second pass
+    frozen_bow.freeze();
+  }
+
+  // Frames added in random order and frozen in several parts, so new frames
+  // fall between the frames of the compact index when they are merged
+  basalt::HashBow<256> merged_bow(10);
+  std::vector<size_t> order(frame_bows.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), rng);
+  for (size_t k = 0; k < order.size(); k++) {
+    if (k % 17 == 0) merged_bow.freeze();
+    merged_bow.add_to_database(frame_tcids[order[k]], frame_bows[order[k]]);
+  }
+  merged_bow.freeze();
+
+  for (size_t i = 0; i < frame_bows.size(); i += 7) {
+    expect_same_ranking(merged_bow, frame_bows[i], 10, nullptr);
+
+    const int64_t max_t_ns = frame_tcids[i].frame_id;
+    expect_same_ranking(merged_bow, frame_bows[i], 10, &max_t_ns);
+  }
+
+  // The time filter excludes everything
+  const int64_t min_t_ns = frame_tcids.front().frame_id;
+  std::vector<std::pair<basalt::TimeCamId, double>> results;
+  frozen_bow.querry_database(frame_bows.front(), 10, results, &min_t_ns);
+  EXPECT_TRUE(results.empty());
+}
+
+namespace {
+
+basalt::ManagedImage<uint16_t>::Ptr make_textured_image(std::mt19937& rng) {
+  basalt::ManagedImage<uint16_t>::Ptr img(
+      new basalt::ManagedImage<uint16_t>(320, 240));
+
+  // Blocks of random intensity give plenty of corners
+  const size_t block_size = 8;
+  for (size_t y = 0; y < img->h; y += block_size) {
+    for (size_t x = 0; x < img->w; x += block_size) {
+      const uint16_t val = rng() % 65536;
+      for (size_t yy = y; yy < y + block_size && yy < img->h; yy++) {
+        for (size_t xx = x; xx < x + block_size && xx < img->w; xx++) {
+          (*img)(xx, yy) = val;
+        }
+      }
+    }
+  }
+
+  return img;
+}
+
+// One keyframe that is marginalized and one frame that is not
+basalt::MargData::Ptr make_marg_data(
+    int64_t t_ns, const basalt::ManagedImage<uint16_t>::Ptr& img) {
+  basalt::MargData::Ptr data(new basalt::MargData);
+  data->use_imu = true;
+
+  for (int64_t frame_t_ns : {t_ns, t_ns + 1}) {
+    basalt::OpticalFlowResult::Ptr res(new basalt::OpticalFlowResult);
+    res->t_ns = frame_t_ns;
+    res->input_images.reset(new basalt::OpticalFlowInput);
+    res->input_images->t_ns = frame_t_ns;
+    res->input_images->img_data.resize(1);
+    res->input_images->img_data[0].img = img;
+
+    data->kfs_all.emplace(frame_t_ns);
+    data->opt_flow_res.emplace_back(res);
+  }
+
+  data->kfs_to_marg.emplace(t_ns);
+
+  return data;
+}
+
+}  // namespace
+
+TEST(PlaceRecognizerTestSuite, ExclusionWindowTest) {
+  std::mt19937 rng(0);
+
+  basalt::VioConfig config;
+  config.loop_exclusion_window = 10.0;
+  // Large enough that no keyframe is dropped on a slow machine
+  config.loop_latency_budget = 1000.0;
+
+  basalt::PlaceRecognizer::Ptr recognizer(new basalt::PlaceRecognizer(config));
+
+  tbb::concurrent_bounded_queue<basalt::MargData::Ptr> out_marg_queue;
+  tbb::concurrent_bounded_queue<basalt::LoopClosureCandidate::Ptr>
+      out_loop_queue;
+  out_loop_queue.set_capacity(10000);
+
+  recognizer->out_marg_queue = &out_marg_queue;
+  recognizer->out_loop_queue = &out_loop_queue;
+
+  // All keyframes show the same place
+  basalt::ManagedImage<uint16_t>::Ptr img = make_textured_image(rng);
+
+  // The first 10 keyframes are within the exclusion window of each other,
+  // the last one is more than 10 s after the first ones
+  std::vector<int64_t> kf_t_ns;
+  for (int i = 0; i < 10; i++) kf_t_ns.emplace_back(int64_t(i * 1e9));
+  kf_t_ns.emplace_back(int64_t(15e9));
+
+  std::vector<basalt::MargData::Ptr> sent;
+  for (int64_t t_ns : kf_t_ns) {
+    sent.emplace_back(make_marg_data(t_ns, img));
+    recognizer->in_marg_queue.push(sent.back());
+  }
+  recognizer->in_marg_queue.push(nullptr);
+
+  // Joins the threads, everything is in the output queues afterwards
+  recognizer.reset();
+
+  // MargData is forwarded unchanged and in order
+  for (const basalt::MargData::Ptr& data : sent) {
+    basalt::MargData::Ptr out;
+    ASSERT_TRUE(out_marg_queue.try_pop(out));
+    ASSERT_EQ(data, out);
+    EXPECT_EQ(2u, out->opt_flow_res.size());
+    EXPECT_EQ(1u, out->kfs_to_marg.size());
+    EXPECT_EQ(2u, out->kfs_all.size());
+  }
+  basalt::MargData::Ptr marg_end;
+  ASSERT_TRUE(out_marg_queue.try_pop(marg_end));
+  EXPECT_FALSE(marg_end);
+
+  std::set<int64_t> queries;
+  basalt::LoopClosureCandidate::Ptr c;
+  while (out_loop_queue.try_pop(c) && c) {
+    queries.emplace(c->query.frame_id);
+
+    EXPECT_LT(c->match.frame_id,
+              c->query.frame_id - int64_t(config.loop_exclusion_window * 1e9));
+    EXPECT_GT(c->score, config.loop_min_score);
+  }
+
+  // Only the last keyframe has older keyframes outside the window
+  EXPECT_EQ(std::set<int64_t>{kf_t_ns.back()}, queries);
+}
+
+TEST(PlaceRecognizerTestSuite, LatencyBudgetTest) {
+  std::mt19937 rng(0);
+
+  basalt::VioConfig config;
+  config.loop_exclusion_window = 1.0;
+  // Every keyframe waits longer than this
+  config.loop_latency_budget = -1.0;
+
+  basalt::PlaceRecognizer::Ptr recognizer(new basalt::PlaceRecognizer(config));
+
+  tbb::concurrent_bounded_queue<basalt::MargData::Ptr> out_marg_queue;
+  tbb::concurrent_bounded_queue<basalt::LoopClosureCandidate::Ptr>
+      out_loop_queue;
+
+  recognizer->out_marg_queue = &out_marg_queue;
+  recognizer->out_loop_queue = &out_loop_queue;
+
+  basalt::ManagedImage<uint16_t>::Ptr img = make_textured_image(rng);
+
+  const size_t num_keyframes = 20;
+  for (size_t i = 0; i < num_keyframes; i++) {
+    recognizer->in_marg_queue.push(make_marg_data(int64_t(i * 5e9), img));
+  }
+  recognizer->in_marg_queue.push(nullptr);
+
+  basalt::PlaceRecognizer* r = recognizer.get();
+  while (r->num_dropped() + r->num_processed() < num_keyframes) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  EXPECT_EQ(num_keyframes, r->num_dropped());
+  EXPECT_EQ(0u, r->num_processed());
+
+  recognizer.reset();
+
+  // Dropped keyframes are still forwarded
+  EXPECT_EQ(int(num_keyframes + 1), out_marg_queue.size());
+
+  // Only the end marker, no candidates
+  basalt::LoopClosureCandidate::Ptr c;
+  ASSERT_TRUE(out_loop_queue.try_pop(c));
+  EXPECT_FALSE(c);
+  EXPECT_FALSE(out_loop_queue.try_pop(c));
+}
+
+TEST(PlaceRecognizerTestSuite, DroppedKeyframeRevisitTest) {
+  std::mt19937 rng(0);
+
+  basalt::VioConfig config;
+  config.loop_exclusion_window = 1.0;
+  config.loop_latency_budget = 0.5;
+
+  basalt::PlaceRecognizer::Ptr recognizer(new basalt::PlaceRecognizer(config));
+
+  tbb::concurrent_bounded_queue<basalt::MargData::Ptr> out_marg_queue;
+  tbb::concurrent_bounded_queue<basalt::LoopClosureCandidate::Ptr>
+      out_loop_queue;
+
+  // A full candidate queue blocks the processing thread
+  out_loop_queue.set_capacity(1);
+  out_loop_queue.push(
+      basalt::LoopClosureCandidate::Ptr(new basalt::LoopClosureCandidate));
+
+  recognizer->out_marg_queue = &out_marg_queue;
+  recognizer->out_loop_queue = &out_loop_queue;
+
+  basalt::ManagedImage<uint16_t>::Ptr place_a = make_textured_image(rng);
+  basalt::ManagedImage<uint16_t>::Ptr place_b = make_textured_image(rng);
+
+  // The revisit of place a blocks on publishing its candidate, so the first
+  // visit of place b waits longer than the latency budget and is dropped
+  recognizer->in_marg_queue.push(make_marg_data(0, place_a));
+  recognizer->in_marg_queue.push(make_marg_data(int64_t(20e9), place_a));
+  recognizer->in_marg_queue.push(make_marg_data(int64_t(40e9), place_b));
+
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+
+  basalt::LoopClosureCandidate::Ptr c;
+  out_loop_queue.pop(c);
+
+  basalt::PlaceRecognizer* r = recognizer.get();
+  while (r->num_dropped() < 1) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(1u, r->num_dropped());
+
+  // Revisit of place b
+  recognizer->in_marg_queue.push(make_marg_data(int64_t(60e9), place_b));
+  recognizer->in_marg_queue.push(nullptr);
+
+  std::map<int64_t, std::set<int64_t>> matches;
+  while (true) {
+    out_loop_queue.pop(c);
+    if (!c) break;
+    matches[c->query.frame_id].emplace(c->match.frame_id);
+  }
+
+  EXPECT_EQ(3u, r->num_processed());
+  recognizer.reset();
+
+  EXPECT_EQ(1u, matches[int64_t(20e9)].count(0));
+  EXPECT_EQ(0u, matches.count(int64_t(40e9)));
+
+  // The dropped keyframe was not queried, but is matched by the revisit
+  EXPECT_EQ(1u, matches[int64_t(60e9)].count(int64_t(40e9)));
+}
+
+TEST(NfrMapperTestSuite, AlignSessionsTest) {
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<> uniform(-1.0, 1.0);
+
+  basalt::VioConfig config;
+  basalt::Calibration<double> calib;
+  basalt::NfrMapper mapper(calib, config);
+
+  mapper.addSession(0);
+  mapper.addSession(0);
+
+  // Session 1 starts in a world frame that is rotated around gravity and
+  // shifted with respect to session 0
+  const Sophus::SE3d T_w0_w1(Sophus::SO3d::rotZ(1.2),
+                             Eigen::Vector3d(3.0, -2.0, 0.5));
+
+  // Both sessions walk along the same path
+  const size_t num_frames = 20;
+  Eigen::aligned_map<int64_t, Sophus::SE3d> gt_poses;
+  for (size_t session = 0; session < 2; session++) {
+    for (size_t i = 0; i < num_frames; i++) {
+      const int64_t t_ns = int64_t(i * 1e9);
+      const int64_t frame_id = mapper.sessionFrameId(session, t_ns);
+
+      Sophus::SE3d T_w0_i(
+          Sophus::SO3d::exp(Eigen::Vector3d(0.1 * uniform(rng),
+                                            0.1 * uniform(rng), 0.2 * i)),
+          Eigen::Vector3d(std::cos(0.2 * i), std::sin(0.2 * i), 0.1 * i));
+      gt_poses[frame_id] = T_w0_i;
+
+      const Sophus::SE3d T_w_i =
+          session == 0 ? T_w0_i : T_w0_w1.inverse() * T_w0_i;
+      mapper.getFramePoses()[frame_id] =
+          basalt::PoseStateWithLin<double>(frame_id, T_w_i);
+
+      // Only its presence switches to yaw-only alignment
+      basalt::RollPitchFactor rpf;
+      rpf.t_ns = frame_id;
+      rpf.R_w_i_meas = T_w_i.so3();
+      rpf.cov_inv.setIdentity();
+      mapper.roll_pitch_factors.emplace_back(rpf);
+    }
+  }
+
+  auto session_1_unchanged = [&]() {
+    for (const auto& kv : gt_poses) {
+      if (mapper.splitFrameId(kv.first).first != 1) continue;
+      const Sophus::SE3d T_w_i = T_w0_w1.inverse() * kv.second;
+      if (!T_w_i.matrix().isApprox(
+              mapper.getFramePoses().at(kv.first).getPose().matrix())) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // A wrong match that disagrees with all others arrives first. It must not
+  // place the session on its own.
+  {
+    basalt::RelPoseFactor lc;
+    lc.cov_inv.setIdentity();
+    lc.t_i_ns = mapper.sessionFrameId(0, 0);
+    lc.t_j_ns = mapper.sessionFrameId(1, int64_t(10e9));
+    lc.T_i_j =
+        Sophus::SE3d(Sophus::SO3d::rotZ(2.0), Eigen::Vector3d(5.0, 1.0, 0.0));
+    mapper.loop_closure_factors.emplace_back(lc);
+  }
+
+  mapper.alignSessions();
+  EXPECT_TRUE(session_1_unchanged());
+
+  // Loop closures between the same place in both sessions, with a little
+  // noise, in both directions
+  ASSERT_EQ(3, config.mapper_session_align_min_inliers);
+  for (size_t i = 0; i < num_frames; i += 2) {
+    const int64_t id0 = mapper.sessionFrameId(0, int64_t(i * 1e9));
+    const int64_t id1 = mapper.sessionFrameId(1, int64_t((i + 1) * 1e9));
+
+    basalt::RelPoseFactor lc;
+    lc.cov_inv.setIdentity();
+    if (i % 4 == 0) {
+      lc.t_i_ns = id0;
+      lc.t_j_ns = id1;
+    } else {
+      lc.t_i_ns = id1;
+      lc.t_j_ns = id0;
+    }
+    lc.T_i_j = gt_poses.at(lc.t_i_ns).inverse() * gt_poses.at(lc.t_j_ns) *
+               Sophus::se3_expd(Sophus::Vector6d::Random() / 1000);
+    mapper.loop_closure_factors.emplace_back(lc);
+
+    // Two consistent closures are still below the threshold
+    if (i == 2) {
+      mapper.alignSessions();
+      EXPECT_TRUE(session_1_unchanged());
+    }
+  }
+
+  mapper.alignSessions();
+
+  for (const auto& kv : gt_poses) {
+    const Sophus::SE3d T_err =
+        kv.second.inverse() * mapper.getFramePoses().at(kv.first).getPose();
+    EXPECT_LT(T_err.translation().norm(), 1e-2);
+    EXPECT_LT(T_err.so3().log().norm(), 1e-2);
+  }
+
+  // Aligned sessions are not moved again
+  const int64_t frame_id = mapper.sessionFrameId(1, 0);
+  const Sophus::SE3d T_w_i = mapper.getFramePoses().at(frame_id).getPose();
+  mapper.alignSessions();
+  EXPECT_TRUE(T_w_i.matrix().isApprox(
+      mapper.getFramePoses().at(frame_id).getPose().matrix()));
+}
+
+namespace {
+
+// Stereo rig that moves along a wall of points with unique descriptors. The
+// keypoints are stored in the OpticalFlowInput as with
+// config.vio_marg_data_features, so no images are needed.
+struct SyntheticMap {
+  basalt::Calibration<double> calib;
+
+  Eigen::aligned_map<int64_t, Sophus::SE3d> gt_poses;
+  // Ground truth with noise, as estimated by VIO
+  Eigen::aligned_map<int64_t, Sophus::SE3d> init_poses;
+  std::map<int64_t, basalt::OpticalFlowInput::Ptr> frames;
+
+  Eigen::aligned_vector<basalt::RelPoseFactor> rel_pose_factors;
+  Eigen::aligned_vector<basalt::RollPitchFactor> roll_pitch_factors;
+
+  Eigen::aligned_vector<Eigen::Vector3d> points;
+  std::vector<std::bitset<256>> descriptors;
+};
+
+// Adds a frame at T_w_i that observes the points of the map
+void add_synthetic_frame(SyntheticMap& sm, int64_t t_ns,
+                         const Sophus::SE3d& T_w_i,
+                         const basalt::VioConfig& config, std::mt19937& rng) {
+  std::uniform_real_distribution<> uniform(-1.0, 1.0);
+  std::normal_distribution<> pixel_noise(0.0, 0.3);
+
+  basalt::HashBow<256> hash_bow(config.mapper_bow_num_bits);
+
+  sm.gt_poses[t_ns] = T_w_i;
+  const Eigen::Vector3d rot_noise(uniform(rng), uniform(rng), uniform(rng));
+  const Eigen::Vector3d pos_noise(uniform(rng), uniform(rng), uniform(rng));
+  sm.init_poses[t_ns] =
+      T_w_i * Sophus::SE3d(Sophus::SO3d::exp(rot_noise / 100), pos_noise / 50);
+
+  basalt::OpticalFlowInput::Ptr frame(new basalt::OpticalFlowInput);
+  frame->t_ns = t_ns;
+  frame->img_data.resize(sm.calib.intrinsics.size());
+  frame->keypoints.resize(sm.calib.intrinsics.size());
+
+  for (size_t cam_id = 0; cam_id < sm.calib.intrinsics.size(); cam_id++) {
+    const Sophus::SE3d T_c_w = (T_w_i * sm.calib.T_i_c[cam_id]).inverse();
+    basalt::KeypointsData& kd = frame->keypoints[cam_id];
+
+    for (size_t p = 0; p < sm.points.size(); p++) {
+      const Eigen::Vector3d p_c = T_c_w * sm.points[p];
+
+      Eigen::Vector2d proj;
+      if (!sm.calib.intrinsics[cam_id].project(p_c.homogeneous(), proj) ||
+          proj.x() < 0 || proj.y() < 0 || proj.x() >= 640 || proj.y() >= 480) {
+        continue;
+      }
+
+      kd.corners.emplace_back(
+          proj + Eigen::Vector2d(pixel_noise(rng), pixel_noise(rng)));
+      kd.corner_angles.emplace_back(0);
+      kd.corner_descriptors.emplace_back(sm.descriptors[p]);
+    }
+
+    hash_bow.compute_bow(kd.corner_descriptors, kd.hashes, kd.bow_vector);
+  }
+
+  sm.frames[t_ns] = frame;
+}
+
+SyntheticMap make_synthetic_map(size_t num_frames,
+                                const basalt::VioConfig& config,
+                                std::mt19937& rng) {
+  SyntheticMap sm;
+
+  basalt::GenericCamera<double> cam;
+  cam.variant = basalt::PinholeCamera<double>(
+      Eigen::Vector4d(1600.0, 1600.0, 320.0, 240.0));
+  for (double baseline : {0.0, 0.11}) {
+    sm.calib.intrinsics.emplace_back(cam);
+    sm.calib.T_i_c.emplace_back(Sophus::SO3d(),
+                                Eigen::Vector3d(baseline, 0, 0));
+    sm.calib.resolution.emplace_back(640, 480);
+  }
+
+  std::uniform_real_distribution<> uniform(-1.0, 1.0);
+
+  // The rig moves 0.3 m between frames along the x axis, the wall is 4-6 m
+  // in front of it. Points are visible in about 8 frames.
+  const double length = 0.3 * num_frames;
+  const size_t num_points = 40 * num_frames;
+
+  for (size_t i = 0; i < num_points; i++) {
+    sm.points.emplace_back(-3.0 + (length + 6.0) * (uniform(rng) + 1) / 2,
+                           2.0 * uniform(rng), 5.0 + uniform(rng));
+
+    std::bitset<256> d;
+    for (size_t b = 0; b < 256; b++) d[b] = rng() % 2;
+    sm.descriptors.emplace_back(d);
+  }
+
+  for (size_t i = 0; i < num_frames; i++) {
+    const int64_t t_ns = int64_t(i * 5e8);
+
+    const Sophus::SE3d T_w_i(
+        Sophus::SO3d::exp(Eigen::Vector3d(0.02 * uniform(rng),
+                                          0.02 * uniform(rng),
+                                          0.05 * uniform(rng))),
+        Eigen::Vector3d(0.3 * i, 0.1 * uniform(rng), 0.1 * uniform(rng)));
+
+    add_synthetic_frame(sm, t_ns, T_w_i, config, rng);
+
+    basalt::RollPitchFactor rpf;
+    rpf.t_ns = t_ns;
+    rpf.R_w_i_meas = T_w_i.so3();
+    rpf.cov_inv = Eigen::Matrix2d::Identity() * 1e4;
+    sm.roll_pitch_factors.emplace_back(rpf);
+
+    if (i > 0) {
+      const int64_t t_prev_ns = int64_t((i - 1) * 5e8);
+
+      basalt::RelPoseFactor rel;
+      rel.t_i_ns = t_prev_ns;
+      rel.t_j_ns = t_ns;
+      rel.T_i_j = sm.gt_poses.at(t_prev_ns).inverse() * T_w_i;
+      rel.cov_inv = Sophus::Matrix6d::Identity() * 1e4;
+      sm.rel_pose_factors.emplace_back(rel);
+    }
+  }
+
+  return sm;
+}
+
+// Adds the frames in [begin_t_ns, end_t_ns) and their factors, as
+// addMargData does
+void add_frames(const SyntheticMap& sm, int64_t begin_t_ns, int64_t end_t_ns,
+                basalt::NfrMapper& mapper) {
+  auto in_range = [&](int64_t t_ns) {
+    return t_ns >= begin_t_ns && t_ns < end_t_ns;
+  };
+
+  for (const auto& kv : sm.frames) {
+    if (!in_range(kv.first)) continue;
+
+    mapper.getFramePoses()[kv.first] = basalt::PoseStateWithLin<double>(
+        kv.first, sm.init_poses.at(kv.first));
+    mapper.img_data[kv.first] = kv.second;
+  }
+
+  for (const basalt::RollPitchFactor& rpf : sm.roll_pitch_factors) {
+    if (in_range(rpf.t_ns)) mapper.roll_pitch_factors.emplace_back(rpf);
+  }
+
+  // Factors to older frames belong to the newer frame
+  for (const basalt::RelPoseFactor& rel : sm.rel_pose_factors) {
+    if (in_range(rel.t_j_ns)) mapper.rel_pose_factors.emplace_back(rel);
+  }
+}
+
+// Features, matches and landmarks of all frames, as in the mapper
+void setup_batch(basalt::NfrMapper& mapper) {
+  mapper.detect_keypoints();
+  mapper.match_stereo();
+  mapper.match_all();
+  mapper.build_tracks();
+  mapper.setup_opt();
+}
+
+// Error of the poses relative to the first frame, so the choice of the world
+// frame does not matter
+void expect_relative_poses_near(
+    const Eigen::aligned_map<int64_t, Sophus::SE3d>& expected,
+    basalt::NfrMapper& mapper, double pos_thresh, double rot_thresh) {
+  const int64_t t0_ns = expected.begin()->first;
+  const Sophus::SE3d T_w_0 = mapper.getFramePoses().at(t0_ns).getPose();
+
+  for (const auto& kv : expected) {
+    const Sophus::SE3d T_0_i_expected =
+        expected.at(t0_ns).inverse() * kv.second;
+    const Sophus::SE3d T_0_i =
+        T_w_0.inverse() * mapper.getFramePoses().at(kv.first).getPose();
+    const Sophus::SE3d T_err = T_0_i_expected.inverse() * T_0_i;
+
+    EXPECT_LT(T_err.translation().norm(), pos_thresh) << kv.first;
+    EXPECT_LT(T_err.so3().log().norm(), rot_thresh) << kv.first;
+  }
+}
+
+// Tracks as sets of observations, their ids are arbitrary
+std::set<basalt::FeatureTrack> track_set(const basalt::FeatureTracks& tracks) {
+  std::set<basalt::FeatureTrack> res;
+  for (const auto& kv : tracks) res.emplace(kv.second);
+  return res;
+}
+
+}  // namespace
+
+TEST(NfrMapperTestSuite, IncrementalUpdateTest) {
+  std::mt19937 rng(0);
+
+  basalt::VioConfig config;
+  config.mapper_local_window = 2.0;
+
+  const size_t num_frames = 30;
+  const SyntheticMap sm = make_synthetic_map(num_frames, config, rng);
+
+  // Everything at once
+  basalt::NfrMapper batch(sm.calib, config);
+  add_frames(sm, 0, std::numeric_limits<int64_t>::max(), batch);
+
+  setup_batch(batch);
+  batch.optimize(10);
+
+  // The same frames in three parts. Tracks of the last part do not reach
+  // the first one, so only a part of the map is optimized.
+  basalt::NfrMapper incremental(sm.calib, config);
+  const int64_t part_t_ns = int64_t(num_frames / 3 * 5e8);
+  for (int64_t begin_t_ns = 0; begin_t_ns < int64_t(num_frames * 5e8);
+       begin_t_ns += part_t_ns) {
+    add_frames(sm, begin_t_ns, begin_t_ns + part_t_ns, incremental);
+    incremental.update(10);
+
+    // Only the changed tracks were exported, the others are unchanged
+    basalt::TrackBuilder track_builder;
+    track_builder.Build(incremental.feature_matches);
+    track_builder.Filter(config.mapper_min_track_length);
+    basalt::FeatureTracks tracks;
+    track_builder.Export(tracks);
+    EXPECT_EQ(track_set(tracks), track_set(incremental.feature_tracks));
+  }
+
+  // The tracks and landmarks are the same as in the batch run
+  ASSERT_FALSE(batch.feature_tracks.empty());
+  EXPECT_EQ(track_set(batch.feature_tracks),
+            track_set(incremental.feature_tracks));
+  EXPECT_EQ(batch.lmdb.numLandmarks(), incremental.lmdb.numLandmarks());
+
+  // Only the poses differ, the frames of the first parts were optimized
+  // before the later frames constrained them. Both estimates agree with the
+  // ground truth.
+  expect_relative_poses_near(sm.gt_poses, batch, 0.02, 0.005);
+  expect_relative_poses_near(sm.gt_poses, incremental, 0.02, 0.005);
+
+  // Optimizing all frames converges to the batch result
+  incremental.optimize(10);
+
+  Eigen::aligned_map<int64_t, Sophus::SE3d> batch_poses;
+  for (const auto& kv : batch.getFramePoses()) {
+    batch_poses[kv.first] = kv.second.getPose();
+  }
+  expect_relative_poses_near(batch_poses, incremental, 1e-6, 1e-6);
+}
+
+TEST(NfrMapperTestSuite, PartitionedOptimizationTest) {
+  std::mt19937 rng(0);
+
+  basalt::VioConfig config;
+  config.mapper_submap_size = 4.0;
+  config.mapper_submap_overlap = 1.0;
+  config.mapper_submap_iterations = 5;
+
+  const size_t num_frames = 40;
+  const SyntheticMap sm = make_synthetic_map(num_frames, config, rng);
+
+  basalt::NfrMapper monolithic(sm.calib, config);
+  add_frames(sm, 0, std::numeric_limits<int64_t>::max(), monolithic);
+  setup_batch(monolithic);
+
+  basalt::NfrMapper partitioned(sm.calib, config);
+  add_frames(sm, 0, std::numeric_limits<int64_t>::max(), partitioned);
+  setup_batch(partitioned);
+
+  auto total_error = [](basalt::NfrMapper& mapper) {
+    double vision_error, rel_error, roll_pitch_error;
+    mapper.computeError(vision_error);
+    mapper.computeRelPose(rel_error);
+    mapper.computeRollPitch(roll_pitch_error);
+    return vision_error + rel_error + roll_pitch_error;
+  };
+
+  monolithic.optimize(10);
+  const double monolithic_error = total_error(monolithic);
+
+  // Every local problem keeps only steps that reduce its error, so no sweep
+  // increases the error of the map
+  const double init_error = total_error(partitioned);
+  double partitioned_error = init_error;
+  for (int sweep = 0; sweep < 20; sweep++) {
+    partitioned.optimizePartitioned(1);
+
+    const double error = total_error(partitioned);
+    EXPECT_LE(error, partitioned_error) << sweep;
+    partitioned_error = error;
+  }
+
+  // Block Gauss-Seidel converges slower than the monolithic solve, but to
+  // the same minimum
+  EXPECT_LT(partitioned_error - monolithic_error,
+            0.01 * (init_error - monolithic_error));
+  EXPECT_LT(partitioned_error, 1.1 * monolithic_error);
+
+  // Submaps without frames would never end the partitioning
+  config.mapper_submap_size = 0;
+  basalt::NfrMapper invalid(sm.calib, config);
+  add_frames(sm, 0, std::numeric_limits<int64_t>::max(), invalid);
+  EXPECT_DEATH(invalid.optimizePartitioned(1), "mapper_submap_size");
+}
+
+TEST(NfrMapperTestSuite, PoseGraphTest) {
+  std::mt19937 rng(0);
+  std::normal_distribution<> noise(0.0, 1.0);
+
+  basalt::VioConfig config;
+  basalt::Calibration<double> calib;
+  basalt::NfrMapper mapper(calib, config);
+
+  // A circle that is driven a little more than once, so the last frames
+  // close the loop to the first ones
+  const size_t num_frames = 40;
+  const size_t frames_per_circle = 36;
+
+  Eigen::aligned_map<int64_t, Sophus::SE3d> gt_poses;
+  for (size_t i = 0; i < num_frames; i++) {
+    const double angle = 2 * M_PI * i / frames_per_circle;
+    gt_poses[int64_t(i * 1e9)] = Sophus::SE3d(
+        Sophus::SO3d::rotZ(angle),
+        Eigen::Vector3d(3 * std::sin(angle), 3 - 3 * std::cos(angle), 0));
+  }
+
+  // Odometry with noise, integrated from the first pose
+  Sophus::SE3d T_w_i = gt_poses.begin()->second;
+  for (auto it = gt_poses.begin(); it != gt_poses.end(); ++it) {
+    if (it != gt_poses.begin()) {
+      const auto prev = std::prev(it);
+
+      const Eigen::Vector3d rot_noise(noise(rng), noise(rng), noise(rng));
+      const Eigen::Vector3d pos_noise(noise(rng), noise(rng), noise(rng));
+
+      basalt::RelPoseFactor rel;
+      rel.t_i_ns = prev->first;
+      rel.t_j_ns = it->first;
+      rel.T_i_j =
+          prev->second.inverse() * it->second *
+          Sophus::SE3d(Sophus::SO3d::exp(0.01 * rot_noise), 0.01 * pos_noise);
+      rel.cov_inv = Sophus::Matrix6d::Identity() * 1e4;
+      mapper.rel_pose_factors.emplace_back(rel);
+
+      T_w_i = T_w_i * rel.T_i_j;
+    }
+
+    mapper.getFramePoses()[it->first] =
+        basalt::PoseStateWithLin<double>(it->first, T_w_i);
+
+    basalt::RollPitchFactor rpf;
+    rpf.t_ns = it->first;
+    rpf.R_w_i_meas = it->second.so3();
+    rpf.cov_inv = Eigen::Matrix2d::Identity() * 1e4;
+    mapper.roll_pitch_factors.emplace_back(rpf);
+  }
+
+  for (size_t i = frames_per_circle; i < num_frames; i++) {
+    basalt::RelPoseFactor lc;
+    lc.t_i_ns = int64_t((i - frames_per_circle) * 1e9);
+    lc.t_j_ns = int64_t(i * 1e9);
+    lc.T_i_j = gt_poses.at(lc.t_i_ns).inverse() * gt_poses.at(lc.t_j_ns);
+    lc.cov_inv.setZero();
+    lc.cov_inv.diagonal().head<3>().setConstant(
+        1.0 / std::pow(config.mapper_loop_pos_std_dev, 2));
+    lc.cov_inv.diagonal().tail<3>().setConstant(
+        1.0 / std::pow(config.mapper_loop_rot_std_dev, 2));
+    mapper.loop_closure_factors.emplace_back(lc);
+  }
+
+  // The first pose is fixed, so the poses are in the ground truth frame
+  auto pos_error = [&](int64_t t_ns) {
+    return (mapper.getFramePoses().at(t_ns).getPose().translation() -
+            gt_poses.at(t_ns).translation())
+        .norm();
+  };
+
+  auto rmse = [&]() {
+    double error = 0;
+    for (const auto& kv : gt_poses) error += std::pow(pos_error(kv.first), 2);
+    return std::sqrt(error / gt_poses.size());
+  };
+
+  const int64_t last_t_ns = gt_poses.rbegin()->first;
+  const double init_last_error = pos_error(last_t_ns);
+  const double init_rmse = rmse();
+
+  mapper.optimizePoseGraph(20);
+
+  // The loop closures remove the drift at the end of the loop
+  EXPECT_GT(init_last_error, 0.1);
+  EXPECT_LT(pos_error(last_t_ns), 0.2 * init_last_error);
+  EXPECT_LT(rmse(), 0.5 * init_rmse);
+}
+
+TEST(NfrMapperTestSuite, LoopClosureFactorsTest) {
+  std::mt19937 rng(0);
+
+  basalt::VioConfig config;
+
+  const size_t num_frames = 30;
+  SyntheticMap sm = make_synthetic_map(num_frames, config, rng);
+
+  // Revisits of the places of frames 5 and 10, more than
+  // config.mapper_loop_min_time_diff later and with a known offset
+  const int64_t t_5_ns = int64_t(2.5e9);
+  const int64_t t_10_ns = int64_t(5e9);
+  const int64_t t_a_ns = int64_t(20e9);
+  const int64_t t_b_ns = int64_t(21e9);
+
+  const Sophus::SE3d T_5_a(
+      Sophus::SO3d::exp(Eigen::Vector3d(0.02, -0.01, 0.05)),
+      Eigen::Vector3d(0.1, -0.05, 0.2));
+  const Sophus::SE3d T_10_b(
+      Sophus::SO3d::exp(Eigen::Vector3d(-0.01, 0.03, -0.04)),
+      Eigen::Vector3d(-0.15, 0.05, -0.1));
+  add_synthetic_frame(sm, t_a_ns, sm.gt_poses.at(t_5_ns) * T_5_a, config, rng);
+  add_synthetic_frame(sm, t_b_ns, sm.gt_poses.at(t_10_ns) * T_10_b, config,
+                      rng);
+
+  basalt::NfrMapper mapper(sm.calib, config);
+  add_frames(sm, 0, std::numeric_limits<int64_t>::max(), mapper);
+
+  mapper.detect_keypoints();
+  mapper.match_stereo();
+  mapper.match_all();
+  mapper.compute_loop_closure_factors();
+
+  auto find_factor = [&](int64_t t_0_ns, int64_t t_1_ns) {
+    const basalt::RelPoseFactor* res = nullptr;
+    for (const basalt::RelPoseFactor& lc : mapper.loop_closure_factors) {
+      if (std::minmax(lc.t_i_ns, lc.t_j_ns) == std::minmax(t_0_ns, t_1_ns)) {
+        EXPECT_FALSE(res) << "Several loop closures for one pair of frames";
+        res = &lc;
+      }
+    }
+    return res;
+  };
+
+  auto pose_error = [&](const basalt::RelPoseFactor& lc,
+                        const Sophus::SE3d& T_i_j) {
+    const Sophus::SE3d T_err = T_i_j.inverse() * lc.T_i_j;
+    return std::make_pair(T_err.translation().norm(),
+                          T_err.so3().log().norm());
+  };
+
+  // Every loop closure is a revisit and has the true relative pose, up to the
+  // depth error of the short stereo baseline for frames with little overlap
+  ASSERT_TRUE(find_factor(t_5_ns, t_a_ns));
+  ASSERT_TRUE(find_factor(t_10_ns, t_b_ns));
+
+  for (const basalt::RelPoseFactor& lc : mapper.loop_closure_factors) {
+    EXPECT_TRUE(lc.t_i_ns >= t_a_ns || lc.t_j_ns >= t_a_ns);
+    find_factor(lc.t_i_ns, lc.t_j_ns);
+
+    const auto err = pose_error(lc, sm.gt_poses.at(lc.t_i_ns).inverse() *
+                                        sm.gt_poses.at(lc.t_j_ns));
+    EXPECT_LT(err.first, 0.05) << lc.t_i_ns << " " << lc.t_j_ns;
+    EXPECT_LT(err.second, 0.015) << lc.t_i_ns << " " << lc.t_j_ns;
+  }
+
+  // The bearings of camera 1 of frame 5 are rotated, so the image pairs with
+  // it give a different relative pose than those with camera 0. The pair of
+  // images with more inliers has to win.
+  const Sophus::SO3d R_err = Sophus::SO3d::exp(Eigen::Vector3d(0, 0.05, 0));
+  for (Eigen::Vector4d& c :
+       mapper.feature_corners.at(basalt::TimeCamId(t_5_ns, 1)).corners_3d) {
+    c.head<3>() = R_err * c.head<3>();
+  }
+
+  const basalt::Matches matches = mapper.feature_matches;
+
+  // Keeps only a part of the inliers of the image pairs of frame a with
+  // camera cam_id of frame 5
+  auto remove_inliers = [&](size_t cam_id) {
+    mapper.feature_matches = matches;
+
+    for (auto& kv : mapper.feature_matches) {
+      const std::pair<basalt::TimeCamId, basalt::TimeCamId> frames =
+          std::minmax(kv.first.first, kv.first.second);
+      if (frames.first == basalt::TimeCamId(t_5_ns, cam_id) &&
+          frames.second.frame_id == t_a_ns) {
+        kv.second.inliers.resize(kv.second.inliers.size() * 2 / 3);
+      }
+    }
+  };
+
+  const Sophus::SE3d T_5_a_gt =
+      sm.gt_poses.at(t_5_ns).inverse() * sm.gt_poses.at(t_a_ns);
+  const Sophus::SE3d T_i_c1 = sm.calib.T_i_c[1];
+
+  for (size_t cam_id : {0, 1}) {
+    remove_inliers(cam_id);
+    mapper.compute_loop_closure_factors();
+
+    const basalt::RelPoseFactor* lc = find_factor(t_5_ns, t_a_ns);
+    ASSERT_TRUE(lc);
+
+    // Pose of frame a with the rotated camera 1 of frame 5
+    Sophus::SE3d T_5_a = T_5_a_gt;
+    if (cam_id == 0) {
+      T_5_a = T_i_c1 * Sophus::SE3d(R_err, Eigen::Vector3d::Zero()) *
+              T_i_c1.inverse() * T_5_a;
+    }
+
+    const Sophus::SE3d T_i_j =
+        lc->t_i_ns == t_5_ns ? T_5_a : T_5_a.inverse();
+    const auto err = pose_error(*lc, T_i_j);
+    EXPECT_LT(err.first, 0.02) << cam_id;
+    EXPECT_LT(err.second, 0.005) << cam_id;
+  }
+}
@@ -1,9 +1,20 @@
 
 
+#include <basalt/io/dataset_io_prefetch.h>
+#include <basalt/io/dataset_replay.h>
+#include <basalt/image/image_pyr.h>
 #include <basalt/spline/se3_spline.h>
+#include <basalt/utils/image_pool.h>
+#include <basalt/utils/object_pool.h>
+#include <basalt/utils/spsc_queue.h>
+#include <basalt/vi_estimator/keyframe_manager.h>
 #include <basalt/vi_estimator/keypoint_vio.h>
 
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include "gtest/gtest.h"
 #include "test_utils.h"
@@ -410,3 +421,491 @@ TEST(VioTestSuite, LinearizePointsTest) {
         x0);
   }
 }
+
+TEST(VioTestSuite, ImuReintegrationTest) {
+  Eigen::Vector3d bg, ba;
+  bg = Eigen::Vector3d::Random() / 100;
+  ba = Eigen::Vector3d::Random() / 10;
+
+  basalt::Se3Spline<5> gt_spline(int64_t(10e9));
+  gt_spline.genRandomTrajectory(15);
+
+  Eigen::Vector3d accel_cov, gyro_cov;
+  accel_cov.setConstant(accel_std_dev * accel_std_dev);
+  gyro_cov.setConstant(gyro_std_dev * gyro_std_dev);
+
+  Eigen::aligned_vector<basalt::ImuData<double>> samples;
+
+  int64_t dt_ns = 1e7;
+  for (int64_t t_ns = dt_ns / 2; t_ns < int64_t(1e8); t_ns += dt_ns) {
+    Sophus::SE3d pose = gt_spline.pose(t_ns);
+
+    basalt::ImuData<double> data;
+    data.accel = pose.so3().inverse() * (gt_spline.transAccelWorld(t_ns) -
+                                         basalt::constants::g) +
+                 ba;
+    data.gyro = gt_spline.rotVelBody(t_ns) + bg;
+    data.t_ns = t_ns + dt_ns / 2;
+
+    samples.emplace_back(data);
+  }
+
+  basalt::IntegratedImuMeasurement<double> meas(0, bg, ba);
+  meas.integrate(samples, accel_cov, gyro_cov);
+
+  Eigen::aligned_map<int64_t, basalt::IntegratedImuMeasurement<double>>
+      imu_meas;
+  Eigen::aligned_map<int64_t, Eigen::aligned_vector<basalt::ImuData<double>>>
+      imu_meas_data;
+  Eigen::aligned_map<int64_t, basalt::PoseVelBiasStateWithLin<double>>
+      frame_states;
+
+  imu_meas[0] = meas;
+  imu_meas_data[0] = samples;
+
+  basalt::PoseVelBiasState<double> state0;
+  state0.t_ns = 0;
+  state0.T_w_i = gt_spline.pose(int64_t(0));
+  state0.vel_w_i = gt_spline.transVelWorld(int64_t(0));
+
+  const double bg_thresh = 0.002;
+  const double ba_thresh = 0.02;
+
+  // Drift below both thresholds keeps the first-order correction
+  state0.bias_gyro = bg + Eigen::Vector3d(0.5 * bg_thresh, 0, 0);
+  state0.bias_accel = ba + Eigen::Vector3d(0, 0.5 * ba_thresh, 0);
+  frame_states[0] = state0;
+
+  EXPECT_EQ(0, basalt::KeypointVioEstimator::reintegrateImuMeasurements(
+                   frame_states, imu_meas, imu_meas_data, accel_cov, gyro_cov,
+                   bg_thresh, ba_thresh));
+  EXPECT_TRUE(imu_meas.at(0).get_bias_gyro_lin().isApprox(bg));
+  EXPECT_TRUE(imu_meas.at(0).get_bias_accel_lin().isApprox(ba));
+
+  // Gyroscope drift past the threshold re-integrates with the current bias
+  state0.bias_gyro = bg + Eigen::Vector3d(0, 0, 2 * bg_thresh);
+  state0.bias_accel = ba + Eigen::Vector3d(0, 0, 2 * ba_thresh);
+  frame_states[0] = state0;
+
+  EXPECT_EQ(1, basalt::KeypointVioEstimator::reintegrateImuMeasurements(
+                   frame_states, imu_meas, imu_meas_data, accel_cov, gyro_cov,
+                   bg_thresh, ba_thresh));
+
+  basalt::IntegratedImuMeasurement<double> fresh(0, state0.bias_gyro,
+                                                 state0.bias_accel);
+  fresh.integrate(samples, accel_cov, gyro_cov);
+
+  const basalt::IntegratedImuMeasurement<double>& reintegrated = imu_meas.at(0);
+
+  EXPECT_EQ(fresh.get_dt_ns(), reintegrated.get_dt_ns());
+  EXPECT_TRUE(reintegrated.get_bias_gyro_lin().isApprox(state0.bias_gyro));
+  EXPECT_TRUE(reintegrated.get_bias_accel_lin().isApprox(state0.bias_accel));
+  EXPECT_TRUE(reintegrated.get_cov().isApprox(fresh.get_cov()));
+  EXPECT_TRUE(reintegrated.get_d_state_d_bg().isApprox(fresh.get_d_state_d_bg()));
+  EXPECT_TRUE(reintegrated.get_d_state_d_ba().isApprox(fresh.get_d_state_d_ba()));
+
+  basalt::PoseVelState<double> pred_fresh, pred_reintegrated;
+  fresh.predictState(state0, basalt::constants::g, pred_fresh);
+  reintegrated.predictState(state0, basalt::constants::g, pred_reintegrated);
+
+  EXPECT_TRUE(pred_fresh.T_w_i.matrix().isApprox(
+      pred_reintegrated.T_w_i.matrix()));
+  EXPECT_TRUE(pred_fresh.vel_w_i.isApprox(pred_reintegrated.vel_w_i));
+
+  // The bias now matches the integration point, a second call is a no-op
+  EXPECT_EQ(0, basalt::KeypointVioEstimator::reintegrateImuMeasurements(
+                   frame_states, imu_meas, imu_meas_data, accel_cov, gyro_cov,
+                   bg_thresh, ba_thresh));
+}
+
+TEST(VioTestSuite, KeyframeManagerTest) {
+  // Score loop that KeyframeManager replaces in KeypointVioEstimator and
+  // KeypointVoEstimator::marginalize
+  auto select_reference =
+      [](const Eigen::aligned_map<int64_t, Eigen::Vector3d>& kf_pos) {
+        std::vector<int64_t> ids;
+        for (const auto& kv : kf_pos) ids.push_back(kv.first);
+
+        const Eigen::Vector3d& last_pos = kf_pos.at(ids.back());
+
+        double min_score = std::numeric_limits<double>::max();
+        int64_t min_score_id = -1;
+
+        for (size_t i = 0; i < ids.size() - 2; i++) {
+          double denom = 0;
+          for (size_t j = 0; j < ids.size() - 2; j++) {
+            denom +=
+                1 / ((kf_pos.at(ids[i]) - kf_pos.at(ids[j])).norm() + 1e-5);
+          }
+
+          double score =
+              std::sqrt((kf_pos.at(ids[i]) - last_pos).norm()) * denom;
+
+          if (score < min_score) {
+            min_score_id = ids[i];
+            min_score = score;
+          }
+        }
+
+        return min_score_id;
+      };
+
+  basalt::KeyframeManager kf_manager;
+  Eigen::aligned_map<int64_t, Eigen::Vector3d> kf_pos;
+
+  int64_t next_id = 0;
+  for (; next_id < 2; next_id++) {
+    kf_pos[next_id] = Eigen::Vector3d::Random();
+    kf_manager.setPosition(next_id, kf_pos[next_id]);
+  }
+  EXPECT_EQ(-1, kf_manager.selectKeyframeToMarg());
+
+  for (int iter = 0; iter < 200; iter++) {
+    // Add keyframes until the window is full
+    while (kf_pos.size() < 12) {
+      kf_pos[next_id] = Eigen::Vector3d::Random() * 5;
+      kf_manager.setPosition(next_id, kf_pos[next_id]);
+      next_id++;
+    }
+
+    // Pose updates by the optimization move a random subset of keyframes
+    for (auto& kv : kf_pos) {
+      if (std::rand() % 3 == 0) {
+        kv.second += Eigen::Vector3d::Random() * 0.1;
+        kf_manager.setPosition(kv.first, kv.second);
+      }
+    }
+
+    // Several keyframes are marginalized in a row without pose updates
+    for (int k = 0; k < 1 + iter % 3; k++) {
+      const int64_t expected = select_reference(kf_pos);
+      const int64_t id_to_marg = kf_manager.selectKeyframeToMarg();
+
+      ASSERT_EQ(expected, id_to_marg) << "iter " << iter << " k " << k;
+
+      kf_pos.erase(id_to_marg);
+      kf_manager.erase(id_to_marg);
+    }
+
+    EXPECT_EQ(kf_pos.size(), kf_manager.size());
+  }
+}
+
+TEST(VioTestSuite, SpscQueueTest) {
+  // Capacity below the ring size, indices wrap around many times
+  basalt::SpscQueue<int> queue(3);
+
+  int value;
+  EXPECT_TRUE(queue.empty());
+  EXPECT_FALSE(queue.try_pop(value));
+
+  int next_push = 0, next_pop = 0;
+  for (int round = 0; round < 100; round++) {
+    while (queue.try_push(next_push)) next_push++;
+    EXPECT_EQ(3u, queue.size());
+    EXPECT_FALSE(queue.try_push(-1));
+
+    // Leave one element, so the next round starts at a different offset
+    for (int i = 0; i < 2; i++) {
+      ASSERT_TRUE(queue.try_pop(value));
+      EXPECT_EQ(next_pop++, value);
+    }
+  }
+
+  while (queue.try_pop(value)) EXPECT_EQ(next_pop++, value);
+  EXPECT_EQ(next_push, next_pop);
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(3u, queue.max_size());
+  EXPECT_EQ(size_t(next_push), queue.total_pushed());
+
+  // Blocking push and pop between two threads, terminated by a nullptr
+  basalt::SpscQueue<std::shared_ptr<int>> ptr_queue(4);
+  const int num_values = 100000;
+
+  std::thread producer([&]() {
+    for (int i = 0; i < num_values; i++) {
+      ptr_queue.push(std::make_shared<int>(i));
+    }
+    ptr_queue.push(nullptr);
+  });
+
+  int num_popped = 0;
+  while (true) {
+    std::shared_ptr<int> ptr;
+    ptr_queue.pop(ptr);
+    if (!ptr) break;
+    EXPECT_EQ(num_popped++, *ptr);
+  }
+
+  producer.join();
+  EXPECT_EQ(num_values, num_popped);
+  EXPECT_LE(ptr_queue.max_size(), 4u);
+}
+
+TEST(VioTestSuite, ObjectPoolTest) {
+  basalt::ObjectPool<Eigen::Vector3d> pool(2);
+
+  basalt::ObjectPool<Eigen::Vector3d>::Ptr a = pool.get();
+  basalt::ObjectPool<Eigen::Vector3d>::Ptr b = pool.get();
+  EXPECT_NE(a.get(), b.get());
+
+  const Eigen::Vector3d* a_ptr = a.get();
+  const Eigen::Vector3d* b_ptr = b.get();
+
+  // Released objects are reused in order
+  a.reset();
+  b.reset();
+  EXPECT_EQ(a_ptr, pool.get().get());
+  EXPECT_EQ(b_ptr, pool.get().get());
+
+  // Objects that are still in use are replaced
+  basalt::ObjectPool<Eigen::Vector3d>::Ptr c = pool.get();
+  EXPECT_EQ(a_ptr, c.get());
+  basalt::ObjectPool<Eigen::Vector3d>::Ptr d = pool.get();
+  EXPECT_EQ(b_ptr, d.get());
+
+  // The pool forgets the object in use, it is freed with its last owner
+  basalt::ObjectPool<Eigen::Vector3d>::Ptr e = pool.get();
+  EXPECT_NE(a_ptr, e.get());
+  EXPECT_EQ(1, c.use_count());
+}
+
+namespace {
+
+// Dataset with timestamps only, the images are empty
+class TimestampDataset : public basalt::VioDataset {
+ public:
+  TimestampDataset(size_t num_frames, size_t num_imu, int64_t dt_ns) {
+    for (size_t i = 0; i < num_frames; i++) {
+      image_timestamps.push_back(i * dt_ns);
+    }
+    for (size_t i = 0; i < num_imu; i++) {
+      basalt::AccelData accel;
+      accel.timestamp_ns = i * dt_ns / 10;
+      accel.data.setZero();
+      accel_data.push_back(accel);
+
+      basalt::GyroData gyro;
+      gyro.timestamp_ns = accel.timestamp_ns;
+      gyro.data.setZero();
+      gyro_data.push_back(gyro);
+    }
+  }
+
+  size_t get_num_cams() const override { return 2; }
+  std::vector<int64_t> &get_image_timestamps() override {
+    return image_timestamps;
+  }
+  const Eigen::aligned_vector<basalt::AccelData> &get_accel_data()
+      const override {
+    return accel_data;
+  }
+  const Eigen::aligned_vector<basalt::GyroData> &get_gyro_data()
+      const override {
+    return gyro_data;
+  }
+  const std::vector<int64_t> &get_gt_timestamps() const override {
+    return gt_timestamps;
+  }
+  const Eigen::aligned_vector<Sophus::SE3d> &get_gt_pose_data()
+      const override {
+    return gt_pose_data;
+  }
+  int64_t get_mocap_to_imu_offset_ns() const override { return 0; }
+  std::vector<basalt::ImageData> get_image_data(int64_t) override {
+    return std::vector<basalt::ImageData>(get_num_cams());
+  }
+
+ private:
+  std::vector<int64_t> image_timestamps;
+  Eigen::aligned_vector<basalt::AccelData> accel_data;
+  Eigen::aligned_vector<basalt::GyroData> gyro_data;
+  std::vector<int64_t> gt_timestamps;
+  Eigen::aligned_vector<Sophus::SE3d> gt_pose_data;
+};
+
+// Counts the decoded frames of the wrapped dataset
+class CountingDataset : public TimestampDataset {
+ public:
+  using TimestampDataset::TimestampDataset;
+
+  std::vector<basalt::ImageData> get_image_data(int64_t t_ns) override {
+    std::lock_guard<std::mutex> lock(m);
+    num_decoded[t_ns]++;
+    return TimestampDataset::get_image_data(t_ns);
+  }
+
+  std::mutex m;
+  std::map<int64_t, int> num_decoded;
+};
+
+// Records the number of allocated and freed elements
+template <class T>
+struct CountingAllocator : std::allocator<T> {
+  template <class U>
+  struct rebind {
+    using other = CountingAllocator<U>;
+  };
+
+  T *allocate(size_t n) {
+    num_allocated += n;
+    return std::allocator<T>::allocate(n);
+  }
+
+  void deallocate(T *p, size_t n) {
+    num_deallocated += n;
+    std::allocator<T>::deallocate(p, n);
+  }
+
+  static inline size_t num_allocated = 0;
+  static inline size_t num_deallocated = 0;
+};
+
+}  // namespace
+
+TEST(VioTestSuite, DatasetReplayStopTest) {
+  basalt::VioDatasetPtr dataset(new TimestampDataset(1000, 10000, 1e6));
+
+  basalt::SpscQueue<basalt::OpticalFlowInput::Ptr> image_queue(2);
+  basalt::SpscQueue<basalt::ImuData<double>::Ptr> imu_queue(2);
+
+  basalt::VioDatasetReplay replay(dataset, 1.0);
+  replay.out_image_queue = &image_queue;
+  replay.out_imu_queue = &imu_queue;
+  replay.start();
+
+  // Nobody reads until both queues are full
+  while (image_queue.size() < 2 || imu_queue.size() < 2) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  replay.stop();
+
+  // Give both threads time to give up on the full queues
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  // The consumers still receive the end of both streams. They poll with a
+  // deadline, so a lost end marker fails instead of hanging the test.
+  auto drain = [](auto &queue, auto data, size_t &num_received) {
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (!queue.try_pop(data)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      } else if (!data) {
+        return true;
+      } else {
+        num_received++;
+      }
+    }
+    return false;
+  };
+
+  size_t num_images = 0, num_imu = 0;
+  bool image_end = false, imu_end = false;
+  std::thread image_consumer([&]() {
+    image_end = drain(image_queue, basalt::OpticalFlowInput::Ptr(), num_images);
+  });
+  std::thread imu_consumer([&]() {
+    imu_end = drain(imu_queue, basalt::ImuData<double>::Ptr(), num_imu);
+  });
+
+  image_consumer.join();
+  imu_consumer.join();
+
+  EXPECT_TRUE(image_end);
+  EXPECT_TRUE(imu_end);
+  EXPECT_GE(num_images, 2u);
+  EXPECT_LT(num_images, 1000u);
+  EXPECT_GE(num_imu, 2u);
+  EXPECT_LT(num_imu, 10000u);
+}
+
+TEST(VioTestSuite, PrefetchLaggingReaderTest) {
+  const size_t num_frames = 200;
+  const size_t lag = 3;
+
+  std::shared_ptr<CountingDataset> dataset(
+      new CountingDataset(num_frames, 0, 1e6));
+  const std::vector<int64_t> timestamps = dataset->get_image_timestamps();
+
+  basalt::PrefetchVioDataset prefetch(dataset, 8, 2);
+
+  // In-order reader like the feeder thread, interleaved with a reader that
+  // lags behind like the GUI in continue_fast mode
+  for (size_t i = 0; i < num_frames; i++) {
+    prefetch.get_image_data(timestamps[i]);
+    if (i >= lag) prefetch.get_image_data(timestamps[i - lag]);
+  }
+
+  // Every frame is decoded once by the window and once more for every
+  // lagging read. Moving the window would discard decoded slots and decode
+  // frames again.
+  std::lock_guard<std::mutex> lock(dataset->m);
+  for (size_t i = 0; i < num_frames; i++) {
+    const int expected = i + lag < num_frames ? 2 : 1;
+    EXPECT_EQ(expected, dataset->num_decoded[timestamps[i]]) << "frame " << i;
+  }
+}
+
+TEST(VioTestSuite, ImagePyrSharedLevelTest) {
+  const size_t num_levels = 3;
+
+  for (size_t w : {100, 101}) {
+    const size_t h = 60;
+
+    // Padded rows with room for the mipmap
+    auto pool = std::make_shared<basalt::ImagePool<uint16_t>>(2, true);
+    basalt::ManagedImage<uint16_t>::Ptr img = pool->get(w, h);
+    ASSERT_EQ((w + w / 2) * sizeof(uint16_t), img->pitch);
+
+    basalt::ManagedImage<uint16_t> ref(w, h);
+    for (size_t y = 0; y < h; y++) {
+      for (size_t x = 0; x < w; x++) {
+        (*img)(x, y) = ref(x, y) = (x * 7919 + y * 104729) % 65536;
+      }
+    }
+
+    basalt::ManagedImagePyr<uint16_t> shared_pyr, copied_pyr;
+    shared_pyr.setFromImage(img, num_levels);
+    copied_pyr.setFromImage(ref, num_levels);
+
+    // Level 0 aliases the input, which stays unchanged
+    EXPECT_EQ(img->ptr, shared_pyr.lvl(0).ptr);
+    EXPECT_EQ(img->pitch, shared_pyr.lvl(0).pitch);
+
+    for (size_t l = 0; l <= num_levels; l++) {
+      const basalt::Image<const uint16_t> a = shared_pyr.lvl(l);
+      const basalt::Image<const uint16_t> b = copied_pyr.lvl(l);
+      ASSERT_EQ(b.w, a.w);
+      ASSERT_EQ(b.h, a.h);
+
+      size_t num_diff = 0;
+      for (size_t y = 0; y < a.h; y++) {
+        for (size_t x = 0; x < a.w; x++) {
+          if (a(x, y) != b(x, y)) num_diff++;
+          if (l == 0 && a(x, y) != ref(x, y)) num_diff++;
+        }
+      }
+      EXPECT_EQ(0u, num_diff) << "w " << w << " level " << l;
+    }
+
+    // Images without room for the mipmap are copied
+    auto contiguous_pool = std::make_shared<basalt::ImagePool<uint16_t>>(2);
+    basalt::ManagedImage<uint16_t>::Ptr contiguous = contiguous_pool->get(w, h);
+    basalt::ManagedImagePyr<uint16_t> contiguous_pyr;
+    contiguous_pyr.setFromImage(contiguous, num_levels);
+    EXPECT_NE(contiguous->ptr, contiguous_pyr.lvl(0).ptr);
+  }
+
+  // A pitch that is not a multiple of the pixel size frees the same number
+  // of elements as it allocates
+  {
+    basalt::ManagedImage<uint16_t, CountingAllocator<uint16_t>> odd(5, 3, 11);
+    EXPECT_GE(CountingAllocator<uint16_t>::num_allocated * sizeof(uint16_t),
+              3u * 11u);
+  }
+  EXPECT_EQ(CountingAllocator<uint16_t>::num_allocated,
+            CountingAllocator<uint16_t>::num_deallocated);
+}
@@ -501,7 +501,7 @@ class ManagedImage : public Image<T> {
       : Image<T>(Allocator().allocate(w * h), w, h, w * sizeof(T)) {}
 
   inline ManagedImage(size_t w, size_t h, size_t pitch_bytes)
-      : Image<T>(Allocator().allocate((h * pitch_bytes) / sizeof(T) + 1), w, h,
+      : Image<T>(Allocator().allocate(NumElements(h, pitch_bytes)), w, h,
                  pitch_bytes) {}
 
   // Not copy constructable
@@ -564,7 +564,7 @@ class ManagedImage : public Image<T> {
   inline void Deallocate() {
     if (Image<T>::ptr) {
       Allocator().deallocate(Image<T>::ptr,
-                             (Image<T>::h * Image<T>::pitch) / sizeof(T));
+                             NumElements(Image<T>::h, Image<T>::pitch));
       Image<T>::ptr = nullptr;
     }
   }
@@ -602,6 +602,12 @@ class ManagedImage : public Image<T> {
       }
     }
   }
+
+ private:
+  /// Number of allocated elements, the same for allocation and deallocation
+  static inline size_t NumElements(size_t h, size_t pitch_bytes) {
+    return (h * pitch_bytes + sizeof(T) - 1) / sizeof(T);
+  }
 };
 
 }  // namespace basalt
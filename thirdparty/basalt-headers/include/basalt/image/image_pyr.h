@@ -38,6 +38,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #pragma once
 
+#include <algorithm>
+#include <memory>
+
 #include <basalt/image/image.h>
 
 namespace basalt {
@@ -70,10 +73,48 @@ class ManagedImagePyr {
   /// @param num_level number of levels for the pyramid
   inline void setFromImage(const ManagedImage<T>& other, size_t num_levels) {
     orig_w = other.w;
+    shared_image.reset();
     image.Reinitialise(other.w + other.w / 2, other.h);
     image.Fill(0);
+    buffer = image;
     lvl_internal(0).CopyFrom(other);
 
+    computeLevels(num_levels);
+  }
+
+  /// @brief Set image pyramid from other image without copying level 0.
+  ///
+  /// If the rows of the image have room for the mipmap, i.e. the pitch is at
+  /// least (w + w / 2) * sizeof(T), the image is used as level 0 and the
+  /// pyramid keeps a reference to it. Only the pixels right of level 0 are
+  /// written, so the image can be read concurrently. Otherwise the image is
+  /// copied.
+  ///
+  /// @param other image to use for the pyramid level 0
+  /// @param num_level number of levels for the pyramid
+  inline void setFromImage(const std::shared_ptr<ManagedImage<T>>& other,
+                           size_t num_levels) {
+    const size_t mipmap_w = other->w + other->w / 2;
+    if (other->pitch < mipmap_w * sizeof(T)) {
+      setFromImage(*other, num_levels);
+      return;
+    }
+
+    orig_w = other->w;
+    shared_image = other;
+    image.Deallocate();
+    buffer = Image<T>(other->ptr, mipmap_w, other->h, other->pitch);
+
+    for (size_t y = 0; y < buffer.h; y++) {
+      T* row = buffer.RowPtr(y);
+      std::fill(row + orig_w, row + mipmap_w, T(0));
+    }
+
+    computeLevels(num_levels);
+  }
+
+  /// @brief Compute the levels 1 to num_levels from level 0.
+  inline void computeLevels(size_t num_levels) {
     for (size_t i = 0; i < num_levels; i++) {
       const Image<const T> l = lvl(i);
       Image<T> lp1 = lvl_internal(i + 1);
@@ -152,11 +193,11 @@ class ManagedImagePyr {
   /// @return const image of with the pyramid level
   inline const Image<const T> lvl(size_t lvl) const {
     size_t x = (lvl == 0) ? 0 : orig_w;
-    size_t y = (lvl <= 1) ? 0 : (image.h - (image.h >> (lvl - 1)));
+    size_t y = (lvl <= 1) ? 0 : (buffer.h - (buffer.h >> (lvl - 1)));
     size_t width = (orig_w >> lvl);
-    size_t height = (image.h >> lvl);
+    size_t height = (buffer.h >> lvl);
 
-    return image.SubImage(x, y, width, height);
+    return buffer.SubImage(x, y, width, height);
   }
 
   /// @brief Return const image of underlying mipmap
@@ -164,7 +205,7 @@ class ManagedImagePyr {
   /// @return const image of of the underlying mipmap representation which can
   /// be for example used for visualization
   inline const Image<const T> mipmap() const {
-    return image.SubImage(0, 0, image.w, image.h);
+    return buffer.SubImage(0, 0, buffer.w, buffer.h);
   }
 
   /// @brief Return coordinate offset of the image in the mipmap image.
@@ -174,7 +215,7 @@ class ManagedImagePyr {
   template <typename S>
   inline Eigen::Matrix<S, 2, 1> lvl_offset(size_t lvl) {
     size_t x = (lvl == 0) ? 0 : orig_w;
-    size_t y = (lvl <= 1) ? 0 : (image.h - (image.h >> (lvl - 1)));
+    size_t y = (lvl <= 1) ? 0 : (buffer.h - (buffer.h >> (lvl - 1)));
 
     return Eigen::Matrix<S, 2, 1>(x, y);
   }
@@ -186,15 +227,17 @@ class ManagedImagePyr {
   /// @return image of with the pyramid level
   inline Image<T> lvl_internal(size_t lvl) {
     size_t x = (lvl == 0) ? 0 : orig_w;
-    size_t y = (lvl <= 1) ? 0 : (image.h - (image.h >> (lvl - 1)));
+    size_t y = (lvl <= 1) ? 0 : (buffer.h - (buffer.h >> (lvl - 1)));
     size_t width = (orig_w >> lvl);
-    size_t height = (image.h >> lvl);
+    size_t height = (buffer.h >> lvl);
 
-    return image.SubImage(x, y, width, height);
+    return buffer.SubImage(x, y, width, height);
   }
 
   size_t orig_w;          ///< Width of the original image (level 0)
   ManagedImage<T> image;  ///< Pyramid image stored as a mipmap
+  std::shared_ptr<ManagedImage<T>> shared_image;  ///< Level 0 if not copied
+  Image<T> buffer;  ///< Mipmap, either image or the buffer of shared_image
 };
 
 }  // namespace basalt
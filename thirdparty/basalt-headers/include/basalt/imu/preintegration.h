@@ -178,6 +178,129 @@ class IntegratedImuMeasurement {
     d_state_d_bg = -G + F * d_state_d_bg;
   }
 
+  /// @brief Integrate a batch of IMU data
+  ///
+  /// Gives the same result as calling \ref integrate for every sample, but
+  /// propagates the covariance and the bias Jacobians blockwise using the
+  /// sparsity of the state transition matrix and only computes the upper
+  /// triangle of the symmetric covariance.
+  /// @param[in] data pointer to the first sample
+  /// @param[in] num_samples number of samples
+  /// @param[in] accel_cov diagonal of accelerometer noise covariance matrix
+  /// @param[in] gyro_cov diagonal of gyroscope noise covariance matrix
+  void integrate(const ImuData* data, size_t num_samples, const Vec3& accel_cov,
+                 const Vec3& gyro_cov) {
+    using Mat3 = Eigen::Matrix3d;
+    using Mat39 = Eigen::Matrix<double, 3, POSE_VEL_SIZE>;
+
+    for (size_t i = 0; i < num_samples; i++) {
+      const int64_t t_ns = data[i].t_ns - start_t_ns;
+
+      BASALT_ASSERT_STREAM(t_ns > delta_state.t_ns,
+                           "data.t_ns " << t_ns << " delta_state.t_ns "
+                                        << delta_state.t_ns);
+
+      const double dt = (t_ns - delta_state.t_ns) * 1e-9;
+      const Vec3 accel = data[i].accel - bias_accel_lin;
+      const Vec3 gyro = data[i].gyro - bias_gyro_lin;
+
+      // State propagation, same as in propagateState
+      const Sophus::SO3d R_w_i_new_2 =
+          delta_state.T_w_i.so3() * Sophus::SO3d::exp(0.5 * dt * gyro);
+      const Mat3 RR_w_i_new_2 = R_w_i_new_2.matrix();
+      const Vec3 accel_world = RR_w_i_new_2 * accel;
+
+      delta_state.t_ns = t_ns;
+      delta_state.T_w_i.translation() += delta_state.vel_w_i * dt +
+                                         0.5 * accel_world * dt * dt;
+      delta_state.vel_w_i += accel_world * dt;
+      delta_state.T_w_i.so3() =
+          delta_state.T_w_i.so3() * Sophus::SO3d::exp(dt * gyro);
+
+      // Non-trivial blocks of F = d_next_d_curr. The remaining blocks are
+      // identity, zero or dt * identity (translation w.r.t. velocity).
+      const Mat3 F_vr = Sophus::SO3d::hat(-accel_world * dt);
+      const Mat3 F_pr = F_vr * dt * 0.5;
+
+      // Non-zero blocks of A = d_next_d_accel and G = d_next_d_gyro.
+      const Mat3 A_p = 0.5 * RR_w_i_new_2 * dt * dt;
+      const Mat3 A_v = RR_w_i_new_2 * dt;
+
+      Mat3 Jr, Jr2;
+      Sophus::rightJacobianSO3(dt * gyro, Jr);
+      Sophus::rightJacobianSO3(0.5 * dt * gyro, Jr2);
+
+      const Mat3 G_r = delta_state.T_w_i.so3().matrix() * Jr * dt;
+      const Mat3 G_v = F_vr * RR_w_i_new_2 * Jr2 * 0.5 * dt;
+      const Mat3 G_p = 0.5 * dt * G_v;
+
+      // cov = F * cov * F^T + A * accel_cov * A^T + G * gyro_cov * G^T
+      const Mat39 M_p = cov.middleRows<3>(0) + F_pr * cov.middleRows<3>(3) +
+                        dt * cov.middleRows<3>(6);
+      const Mat39 M_r = cov.middleRows<3>(3);
+      const Mat39 M_v = cov.middleRows<3>(6) + F_vr * cov.middleRows<3>(3);
+
+      const Mat3 As_p = A_p * accel_cov.asDiagonal();
+      const Mat3 As_v = A_v * accel_cov.asDiagonal();
+      const Mat3 Gs_p = G_p * gyro_cov.asDiagonal();
+      const Mat3 Gs_r = G_r * gyro_cov.asDiagonal();
+      const Mat3 Gs_v = G_v * gyro_cov.asDiagonal();
+
+      const Mat3 cov_pp = M_p.block<3, 3>(0, 0) +
+                          M_p.block<3, 3>(0, 3) * F_pr.transpose() +
+                          dt * M_p.block<3, 3>(0, 6) +
+                          As_p * A_p.transpose() + Gs_p * G_p.transpose();
+      const Mat3 cov_pr = M_p.block<3, 3>(0, 3) + Gs_p * G_r.transpose();
+      const Mat3 cov_pv = M_p.block<3, 3>(0, 6) +
+                          M_p.block<3, 3>(0, 3) * F_vr.transpose() +
+                          As_p * A_v.transpose() + Gs_p * G_v.transpose();
+      const Mat3 cov_rr = M_r.block<3, 3>(0, 3) + Gs_r * G_r.transpose();
+      const Mat3 cov_rv = M_r.block<3, 3>(0, 6) +
+                          M_r.block<3, 3>(0, 3) * F_vr.transpose() +
+                          Gs_r * G_v.transpose();
+      const Mat3 cov_vv = M_v.block<3, 3>(0, 6) +
+                          M_v.block<3, 3>(0, 3) * F_vr.transpose() +
+                          As_v * A_v.transpose() + Gs_v * G_v.transpose();
+
+      cov.block<3, 3>(0, 0) = cov_pp;
+      cov.block<3, 3>(0, 3) = cov_pr;
+      cov.block<3, 3>(0, 6) = cov_pv;
+      cov.block<3, 3>(3, 3) = cov_rr;
+      cov.block<3, 3>(3, 6) = cov_rv;
+      cov.block<3, 3>(6, 6) = cov_vv;
+      cov.block<3, 3>(3, 0) = cov_pr.transpose();
+      cov.block<3, 3>(6, 0) = cov_pv.transpose();
+      cov.block<3, 3>(6, 3) = cov_rv.transpose();
+
+      // d_state_d_ba = -A + F * d_state_d_ba
+      d_state_d_ba.middleRows<3>(0) +=
+          F_pr * d_state_d_ba.middleRows<3>(3) +
+          dt * d_state_d_ba.middleRows<3>(6) - A_p;
+      d_state_d_ba.middleRows<3>(6) +=
+          F_vr * d_state_d_ba.middleRows<3>(3) - A_v;
+
+      // d_state_d_bg = -G + F * d_state_d_bg
+      d_state_d_bg.middleRows<3>(0) +=
+          F_pr * d_state_d_bg.middleRows<3>(3) +
+          dt * d_state_d_bg.middleRows<3>(6) - G_p;
+      d_state_d_bg.middleRows<3>(6) +=
+          F_vr * d_state_d_bg.middleRows<3>(3) - G_v;
+      d_state_d_bg.middleRows<3>(3) -= G_r;
+    }
+
+    cov_inv_computed = false;
+  }
+
+  /// @brief Integrate a batch of IMU data
+  ///
+  /// @param[in] data IMU data
+  /// @param[in] accel_cov diagonal of accelerometer noise covariance matrix
+  /// @param[in] gyro_cov diagonal of gyroscope noise covariance matrix
+  void integrate(const Eigen::aligned_vector<ImuData>& data,
+                 const Vec3& accel_cov, const Vec3& gyro_cov) {
+    integrate(data.data(), data.size(), accel_cov, gyro_cov);
+  }
+
   /// @brief Predict state given this pseudo-measurement
   ///
   /// @param[in] state0 current state
@@ -313,6 +436,12 @@ class IntegratedImuMeasurement {
   /// @brief Jacobian of delta state with respect to gyroscope bias
   const MatN3& get_d_state_d_bg() const { return d_state_d_bg; }
 
+  /// @brief Gyroscope bias used for the integration
+  const Eigen::Vector3d& get_bias_gyro_lin() const { return bias_gyro_lin; }
+
+  /// @brief Accelerometer bias used for the integration
+  const Eigen::Vector3d& get_bias_accel_lin() const { return bias_accel_lin; }
+
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
  private:
   int64_t start_t_ns;  ///< Integration start time in nanoseconds
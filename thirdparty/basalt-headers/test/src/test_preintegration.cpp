@@ -633,6 +633,72 @@ TEST(ImuPreintegrationTestCase, CovarianceTest) {
   EXPECT_LE(std::abs(std::sqrt(var) - accel_std_dev), 0.03);
 }
 
+TEST(ImuPreintegrationTestCase, BatchIntegrateTest) {
+  int num_knots = 15;
+
+  Eigen::Vector3d bg, ba;
+  bg = Eigen::Vector3d::Random() / 100;
+  ba = Eigen::Vector3d::Random() / 10;
+
+  basalt::Se3Spline<5> gt_spline(int64_t(10e9));
+  gt_spline.genRandomTrajectory(num_knots);
+
+  Eigen::aligned_vector<basalt::ImuData> data_vec;
+
+  int64_t dt_ns = 1e7;
+  for (int64_t t_ns = dt_ns / 2;
+       t_ns < int64_t(1e9);  //  gt_spline.maxTimeNs() - int64_t(1e9);
+       t_ns += dt_ns) {
+    Sophus::SE3d pose = gt_spline.pose(t_ns);
+    Eigen::Vector3d accel_body =
+        pose.so3().inverse() *
+        (gt_spline.transAccelWorld(t_ns) - basalt::constants::g);
+    Eigen::Vector3d rot_vel_body = gt_spline.rotVelBody(t_ns);
+
+    basalt::ImuData data;
+    data.accel = accel_body + ba;
+    data.gyro = rot_vel_body + bg;
+    data.t_ns = t_ns + dt_ns / 2;
+
+    // Non-constant sample interval
+    if (data_vec.size() % 7 == 3) data.t_ns -= dt_ns / 3;
+
+    data_vec.emplace_back(data);
+  }
+
+  Eigen::Vector3d accel_cov, gyro_cov;
+  accel_cov << 0.3, 0.2, 0.1;
+  gyro_cov << 0.003, 0.002, 0.001;
+
+  basalt::IntegratedImuMeasurement imu_meas(0, bg, ba);
+  for (const auto& data : data_vec) {
+    imu_meas.integrate(data, accel_cov, gyro_cov);
+  }
+
+  // Integrate in two batches to also check continuing an integration.
+  const size_t split = data_vec.size() / 3;
+
+  basalt::IntegratedImuMeasurement imu_meas_batch(0, bg, ba);
+  imu_meas_batch.integrate(data_vec.data(), split, accel_cov, gyro_cov);
+  imu_meas_batch.integrate(data_vec.data() + split, data_vec.size() - split,
+                           accel_cov, gyro_cov);
+
+  EXPECT_EQ(imu_meas.get_dt_ns(), imu_meas_batch.get_dt_ns());
+
+  basalt::PoseVelState::VecN diff =
+      imu_meas.getDeltaState().diff(imu_meas_batch.getDeltaState());
+  EXPECT_LE(diff.norm(), 1e-10);
+
+  EXPECT_TRUE(imu_meas.get_cov().isApprox(imu_meas_batch.get_cov(), 1e-10));
+  EXPECT_TRUE(imu_meas_batch.get_cov().isApprox(
+      imu_meas_batch.get_cov().transpose(), 1e-12));
+
+  EXPECT_TRUE(imu_meas.get_d_state_d_ba().isApprox(
+      imu_meas_batch.get_d_state_d_ba(), 1e-10));
+  EXPECT_TRUE(imu_meas.get_d_state_d_bg().isApprox(
+      imu_meas_batch.get_d_state_d_bg(), 1e-10));
+}
+
 TEST(ImuPreintegrationTestCase, RandomWalkTest) {
   double dt = 0.005;
 